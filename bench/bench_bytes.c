@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kernels.h"
+
+// Searches, counts and hashes runs of bytes of several sizes, comparing the byte at a time loops
+// with the fastest kernels the processor supports, which back the BYTES_ instructions. The byte
+// and needle searched for only appear at the very end, so every search reads the whole run.
+
+#define TOTAL_BYTES (512 * 1024 * 1024)
+
+static const int sizes[] = { 64, 1024, 64 * 1024, 1024 * 1024 };
+
+static uint32_t state = 2463534242u;
+
+static uint32_t nextRandom(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    const ByteKernels* kernels[] = { &mochiScalarByteKernels, mochiByteKernels() };
+    const uint8_t needle[] = "NEEDLE";
+    int needleCount = (int)sizeof(needle) - 1;
+    int64_t checksum = 0;
+
+    printf("fastest kernels: %s\n", kernels[1]->name);
+    printf("%10s %8s %14s %14s %12s\n", "bytes", "op", "loop ns/op", "fast ns/op", "fast GB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int size = sizes[s];
+        int ops = TOTAL_BYTES / size;
+        uint8_t* text = malloc(size);
+        for (int i = 0; i < size; i++) {
+            text[i] = (uint8_t)('a' + nextRandom() % 26);
+        }
+        memcpy(text + size - needleCount - 1, needle, needleCount);
+        text[size - 1] = '!';
+
+        double ns[4][2];
+        for (int k = 0; k < 2; k++) {
+            const ByteKernels* kernel = kernels[k];
+            clock_t start = clock();
+            for (int i = 0; i < ops; i++) {
+                checksum += kernel->find(text, size, '!');
+            }
+            ns[0][k] = elapsedNs(start, ops);
+
+            start = clock();
+            for (int i = 0; i < ops; i++) {
+                checksum += kernel->search(text, size, needle, needleCount);
+            }
+            ns[1][k] = elapsedNs(start, ops);
+
+            start = clock();
+            for (int i = 0; i < ops; i++) {
+                checksum += kernel->count(text, size, 'e');
+            }
+            ns[2][k] = elapsedNs(start, ops);
+
+            start = clock();
+            for (int i = 0; i < ops; i++) {
+                checksum += (int64_t)(kernel->hash(text, size) & 0xFF);
+            }
+            ns[3][k] = elapsedNs(start, ops);
+        }
+
+        const char* names[] = { "find", "search", "count", "hash" };
+        for (int op = 0; op < 4; op++) {
+            printf("%10d %8s %14.1f %14.1f %12.2f\n", size, names[op], ns[op][0], ns[op][1], size / ns[op][1]);
+        }
+        free(text);
+    }
+
+    printf("checksum %lld\n", (long long)checksum);
+    return 0;
+}
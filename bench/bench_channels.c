@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "vm.h"
+
+// Passes messages between fibers. Two fibers hand a count back and forth, first through a ref that
+// each polls and yields on, the only way to do it before channels, and then through a pair of
+// channels holding one value each. Then several fibers send into one bounded channel that the main
+// fiber drains, and one fiber fills an unbounded channel and empties it again. The worker count is
+// the first argument, one by default.
+
+#define ROUND_TRIPS 100000
+#define PRODUCERS   4
+#define MESSAGES    400000
+#define FAN_IN_SIZE 64
+
+static int workerCount = 1;
+
+static void writeI32(MochiVM* vm, int32_t n) {
+    mochiWriteCodeByte(vm, CODE_I32, 1);
+    mochiWriteCodeI32(vm, n, 1);
+}
+
+static void writeBytes(MochiVM* vm, int count, const uint8_t* bytes) {
+    for (int i = 0; i < count; i++) {
+        mochiWriteCodeByte(vm, bytes[i], 1);
+    }
+}
+
+static void writeJump(MochiVM* vm, uint8_t code, uint8_t type, int target) {
+    mochiWriteCodeByte(vm, code, 1);
+    mochiWriteCodeByte(vm, type, 1);
+    mochiWriteCodeU32(vm, target, 1);
+}
+
+static void writeJumpBack(MochiVM* vm, int target) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    mochiWriteCodeI32(vm, target - vm->code.count - 4, 1);
+}
+
+// Writes an OFFSET over the fiber that follows, returning where to patch it.
+static int writeSkip(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    int skip = vm->code.count;
+    mochiWriteCodeI32(vm, 0, 1);
+    return skip;
+}
+
+static void patchSkip(MochiVM* vm, int skip) {
+    for (int i = 0; i < 4; i++) {
+        vm->code.data[skip + i] = (uint8_t)((vm->code.count - skip - 4) >> (24 - 8 * i));
+    }
+}
+
+// With the value a fiber expects to find in the ref in constant [ref] on the stack, yields until
+// the ref holds it, then puts the next value in the ref for the other fiber and expects the one
+// after, until it has made its half of the round trips.
+static void writeRefTurns(MochiVM* vm, int ref) {
+    int wait = vm->code.count;
+    mochiWriteCodeByte(vm, CODE_CONSTANT, 1);
+    mochiWriteCodeU16(vm, ref, 1);
+    mochiWriteCodeByte(vm, CODE_GETREF, 1);
+    writeBytes(vm, 4, (uint8_t[]){ CODE_SHUFFLE, 0, 1, 1 });
+    int ready = vm->code.count;
+    writeJump(vm, CODE_JUMP_INT_EQ, VAL_I32, 0);
+    mochiWriteCodeByte(vm, CODE_THREAD_YIELD, 1);
+    writeJumpBack(vm, wait);
+    for (int i = 0; i < 4; i++) {
+        vm->code.data[ready + 2 + i] = (uint8_t)(vm->code.count >> (24 - 8 * i));
+    }
+    mochiWriteCodeByte(vm, CODE_CONSTANT, 1);
+    mochiWriteCodeU16(vm, ref, 1);
+    writeBytes(vm, 4, (uint8_t[]){ CODE_SHUFFLE, 0, 1, 1 });
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_INC, VAL_I32 });
+    mochiWriteCodeByte(vm, CODE_PUTREF, 1);
+    writeI32(vm, 2);
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_ADD, VAL_I32 });
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, ROUND_TRIPS * 2);
+    writeJump(vm, CODE_JUMP_INT_GREATER, VAL_I32, wait);
+}
+
+static void writeRefPingPong(MochiVM* vm) {
+    int ref = mochiWriteObjConst(vm, (Obj*)mochiNewRef(vm, I32_VAL(vm, 0)));
+    int skip = writeSkip(vm);
+    int other = vm->code.count;
+    writeRefTurns(vm, ref);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    patchSkip(vm, skip);
+
+    writeI32(vm, 1);
+    mochiWriteCodeByte(vm, CODE_THREAD_SPAWN_WITH, 1);
+    mochiWriteCodeU32(vm, other, 1);
+    mochiWriteCodeU32(vm, 1, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeI32(vm, 0);
+    writeRefTurns(vm, ref);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_THREAD_JOIN, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+// The other fiber receives from the first channel and sends one more down the second until the
+// first is closed, while the main fiber sends and waits for the answer.
+static void writeChannelPingPong(MochiVM* vm) {
+    int skip = writeSkip(vm);
+    int pong = vm->code.count;
+    writeBytes(vm, 5, (uint8_t[]){ CODE_SHUFFLE, 0, 1, 1, CODE_CHANNEL_RECV });
+    int done = vm->code.count;
+    mochiWriteCodeByte(vm, CODE_JUMP_FALSE, 1);
+    mochiWriteCodeI32(vm, 0, 1);
+    writeI32(vm, 1);
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_ADD, VAL_I32 });
+    writeBytes(vm, 8, (uint8_t[]){ CODE_SHUFFLE, 0, 2, 1, 1, CODE_CHANNEL_SEND, CODE_ZAP, CODE_ZAP });
+    writeJumpBack(vm, pong);
+    for (int i = 0; i < 4; i++) {
+        vm->code.data[done + 1 + i] = (uint8_t)(vm->code.count >> (24 - 8 * i));
+    }
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    patchSkip(vm, skip);
+
+    for (int i = 0; i < 2; i++) {
+        mochiWriteCodeByte(vm, CODE_U32, 1);
+        mochiWriteCodeU32(vm, 1, 1);
+        mochiWriteCodeByte(vm, CODE_CHANNEL_NEW, 1);
+    }
+    writeBytes(vm, 5, (uint8_t[]){ CODE_SHUFFLE, 0, 2, 1, 1 });
+    mochiWriteCodeByte(vm, CODE_THREAD_SPAWN_WITH, 1);
+    mochiWriteCodeU32(vm, pong, 1);
+    mochiWriteCodeU32(vm, 2, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeBytes(vm, 6, (uint8_t[]){ CODE_SHUFFLE, 3, 3, 0, 3, 3 });
+    writeI32(vm, 0);
+    int ping = vm->code.count;
+    writeBytes(vm, 8, (uint8_t[]){ CODE_SHUFFLE, 0, 2, 2, 1, CODE_CHANNEL_SEND, CODE_ZAP, CODE_ZAP });
+    writeBytes(vm, 3, (uint8_t[]){ CODE_DUP, CODE_CHANNEL_RECV, CODE_ZAP });
+    writeI32(vm, 1);
+    writeBytes(vm, 3, (uint8_t[]){ CODE_INT_ADD, VAL_I32, CODE_DUP });
+    writeI32(vm, ROUND_TRIPS * 2);
+    writeJump(vm, CODE_JUMP_INT_GREATER, VAL_I32, ping);
+    writeBytes(vm, 8, (uint8_t[]){ CODE_SWAP, CODE_ZAP, CODE_SWAP, CODE_CHANNEL_CLOSE, CODE_ZAP, CODE_THREAD_JOIN,
+                                   CODE_ZAP, CODE_ZAP });
+}
+
+// Counts the integer on top of the stack down to zero, with the code written since [loop] run
+// each time around.
+static void writeCountdownTo(MochiVM* vm, int loop) {
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, 0);
+    writeJump(vm, CODE_JUMP_INT_LESS, VAL_I32, loop);
+}
+
+// Each producer is given the channel and sends its share of the messages, all ones, while the main
+// fiber receives and adds them all up.
+static void writeFanIn(MochiVM* vm) {
+    int skip = writeSkip(vm);
+    int producer = vm->code.count;
+    writeI32(vm, MESSAGES / PRODUCERS);
+    int send = vm->code.count;
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_DEC, VAL_I32 });
+    writeBytes(vm, 4, (uint8_t[]){ CODE_SHUFFLE, 0, 1, 1 });
+    writeI32(vm, 1);
+    writeBytes(vm, 2, (uint8_t[]){ CODE_CHANNEL_SEND, CODE_ZAP });
+    writeCountdownTo(vm, send);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    patchSkip(vm, skip);
+
+    mochiWriteCodeByte(vm, CODE_U32, 1);
+    mochiWriteCodeU32(vm, FAN_IN_SIZE, 1);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_NEW, 1);
+    for (int i = 0; i < PRODUCERS; i++) {
+        mochiWriteCodeByte(vm, CODE_DUP, 1);
+        mochiWriteCodeByte(vm, CODE_THREAD_SPAWN_WITH, 1);
+        mochiWriteCodeU32(vm, producer, 1);
+        mochiWriteCodeU32(vm, 1, 1);
+        writeBytes(vm, 2, (uint8_t[]){ CODE_ZAP, CODE_ZAP });
+    }
+    writeI32(vm, 0);
+    writeI32(vm, MESSAGES);
+    int receive = vm->code.count;
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_DEC, VAL_I32 });
+    writeBytes(vm, 6, (uint8_t[]){ CODE_SHUFFLE, 0, 1, 2, CODE_CHANNEL_RECV, CODE_ZAP });
+    writeBytes(vm, 9, (uint8_t[]){ CODE_SHUFFLE, 3, 3, 1, 3, 2, CODE_INT_ADD, VAL_I32, CODE_SWAP });
+    writeCountdownTo(vm, receive);
+    writeBytes(vm, 3, (uint8_t[]){ CODE_ZAP, CODE_ZAP, CODE_ZAP });
+}
+
+static void writeBurst(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_U32, 1);
+    mochiWriteCodeU32(vm, 0, 1);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_NEW, 1);
+    writeI32(vm, MESSAGES);
+    int send = vm->code.count;
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_DEC, VAL_I32 });
+    writeBytes(vm, 7, (uint8_t[]){ CODE_SHUFFLE, 0, 2, 1, 1, CODE_CHANNEL_SEND, CODE_ZAP });
+    writeCountdownTo(vm, send);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeI32(vm, MESSAGES);
+    int receive = vm->code.count;
+    writeBytes(vm, 2, (uint8_t[]){ CODE_INT_DEC, VAL_I32 });
+    writeBytes(vm, 7, (uint8_t[]){ CODE_SHUFFLE, 0, 1, 1, CODE_CHANNEL_RECV, CODE_ZAP, CODE_ZAP });
+    writeCountdownTo(vm, receive);
+    writeBytes(vm, 2, (uint8_t[]){ CODE_ZAP, CODE_ZAP });
+}
+
+static double run(void (*write)(MochiVM* vm), int ops, int* result) {
+    MochiVMConfiguration config;
+    mochiInitConfiguration(&config);
+    config.workerCount = workerCount;
+    MochiVM* vm = mochiNewVM(&config);
+    write(vm);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+    *result = mochiRun(vm, 0, NULL);
+    timespec_get(&end, TIME_UTC);
+    mochiFreeVM(vm);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc > 1) {
+        workerCount = atoi(argv[1]);
+    }
+    int result;
+    printf("%d workers\n", workerCount);
+    printf("%24s %10s %10s\n", "case", "result", "ns/op");
+
+    double ns = run(writeRefPingPong, ROUND_TRIPS, &result);
+    printf("%24s %10d %10.1f\n", "ref ping-pong", result, ns);
+    ns = run(writeChannelPingPong, ROUND_TRIPS, &result);
+    printf("%24s %10d %10.1f\n", "channel ping-pong", result, ns);
+    ns = run(writeFanIn, MESSAGES, &result);
+    printf("%24s %10d %10.1f\n", "fan-in", result, ns);
+    ns = run(writeBurst, MESSAGES, &result);
+    printf("%24s %10d %10.1f\n", "unbounded send, recv", result, ns);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "object.h"
+#include "vm.h"
+
+// Concatenates strings of several sizes up to a few megabytes, comparing a byte at a time copy
+// through mochiByteArraySnoc with the presized bulk copy used by STRING_CONCAT.
+
+#define TOTAL_BYTES (64 * 1024 * 1024)
+// Collect after about this many bytes of results, which both copies pay for alike.
+#define COLLECT_BYTES (16 * 1024 * 1024)
+
+static const int sizes[] = { 64, 1024, 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+
+static ObjByteArray* makeString(MochiVM* vm, int size) {
+    ObjByteArray* str = mochiByteArrayNil(vm);
+    mochiByteArrayFill(vm, size - 1, 'x', str);
+    mochiByteArraySnoc(vm, '\0', str);
+    return str;
+}
+
+static ObjByteArray* snocConcat(MochiVM* vm, ObjByteArray* a, ObjByteArray* b) {
+    ObjByteArray* cat = mochiByteArrayNil(vm);
+    for (int i = 0; i < a->elems.count - 1; i++) {
+        mochiByteArraySnoc(vm, a->elems.data[i], cat);
+    }
+    for (int i = 0; i < b->elems.count; i++) {
+        mochiByteArraySnoc(vm, b->elems.data[i], cat);
+    }
+    return cat;
+}
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    MochiVM* vm = mochiNewVM(NULL);
+    // The inputs are kept in constants, which the collector treats as roots.
+    int rootA = mochiWriteObjConst(vm, (Obj*)mochiByteArrayNil(vm));
+    int rootB = mochiWriteObjConst(vm, (Obj*)mochiByteArrayNil(vm));
+    int64_t checksum = 0;
+
+    printf("%10s %14s %14s %12s\n", "bytes", "snoc ns/op", "bulk ns/op", "bulk GB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int size = sizes[s];
+        int ops = TOTAL_BYTES / size / 2;
+        int collectEvery = COLLECT_BYTES / size / 2 > 0 ? COLLECT_BYTES / size / 2 : 1;
+        ObjByteArray* a = makeString(vm, size);
+        vm->constants.data[rootA] = OBJ_VAL(a);
+        ObjByteArray* b = makeString(vm, size);
+        vm->constants.data[rootB] = OBJ_VAL(b);
+
+        clock_t start = clock();
+        for (int i = 0; i < ops; i++) {
+            ObjByteArray* cat = snocConcat(vm, a, b);
+            checksum += cat->elems.count;
+            if (i % collectEvery == 0) {
+                mochiCollectGarbage(vm);
+            }
+        }
+        double snocNs = elapsedNs(start, ops);
+
+        start = clock();
+        for (int i = 0; i < ops; i++) {
+            ObjByteArray* cat = mochiStringConcat(vm, a, b);
+            checksum += cat->elems.count;
+            if (i % collectEvery == 0) {
+                mochiCollectGarbage(vm);
+            }
+        }
+        double bulkNs = elapsedNs(start, ops);
+
+        printf("%10d %14.1f %14.1f %12.2f\n", size * 2, snocNs, bulkNs, size * 2 / bulkNs);
+    }
+
+    printf("checksum %lld\n", (long long)checksum);
+    mochiFreeVM(vm);
+    return 0;
+}
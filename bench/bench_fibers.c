@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "vm.h"
+
+// Spawns fibers that finish straight away and joins each of them, first one at a time and then in
+// batches that are all spawned before any is joined, and times a fiber that yields to another over
+// and over. The spawns and joins are then run again with [PARKED] other fibers alive, waiting on a
+// channel. Build it against the tree before and after a change to fibers to compare the two; with
+// one OS thread per fiber, a smaller FIBERS keeps the batches within the thread limit.
+
+#define FIBERS 10000
+#define BATCH  100
+#define YIELDS 1000000
+#define PARKED 1000
+
+static void writeI32(MochiVM* vm, int32_t n) {
+    mochiWriteCodeByte(vm, CODE_I32, 1);
+    mochiWriteCodeI32(vm, n, 1);
+}
+
+// Counts the integer on top of the stack down to zero, running the code written by [body] each
+// time around with the count below it, and leaves the zero on the stack.
+static void writeCountdown(MochiVM* vm, void (*body)(MochiVM* vm, int arg), int arg) {
+    int loop = vm->code.count;
+    body(vm, arg);
+    mochiWriteCodeByte(vm, CODE_INT_DEC, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_JUMP_INT_LESS, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeU32(vm, loop, 1);
+}
+
+// Writes a fiber that aborts with zero, behind an offset that skips it, and returns where it starts.
+static int writeEmptyFiber(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    mochiWriteCodeI32(vm, 6, 1);
+    int start = vm->code.count;
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    return start;
+}
+
+static void writeSpawnJoin(MochiVM* vm, int fiber) {
+    mochiWriteCodeByte(vm, CODE_THREAD_SPAWN, 1);
+    mochiWriteCodeI32(vm, fiber, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_THREAD_JOIN, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+// Spawns [BATCH] fibers, keeping them on the stack below the count, and then joins them all.
+static void writeSpawnBatch(MochiVM* vm, int fiber) {
+    for (int i = 0; i < BATCH; i++) {
+        mochiWriteCodeByte(vm, CODE_THREAD_SPAWN, 1);
+        mochiWriteCodeI32(vm, fiber, 1);
+        mochiWriteCodeByte(vm, CODE_ZAP, 1);
+        mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    }
+    for (int i = 0; i < BATCH; i++) {
+        mochiWriteCodeByte(vm, CODE_SWAP, 1);
+        mochiWriteCodeByte(vm, CODE_THREAD_JOIN, 1);
+        mochiWriteCodeByte(vm, CODE_ZAP, 1);
+        mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    }
+}
+
+static void writeYield(MochiVM* vm, int arg) {
+    mochiWriteCodeByte(vm, CODE_THREAD_YIELD, 1);
+}
+
+// Two fibers yield to each other, the main fiber and one it spawns and joins at the end.
+static void writeYields(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    int skip = vm->code.count;
+    mochiWriteCodeI32(vm, 0, 1);
+    int other = vm->code.count;
+    writeI32(vm, YIELDS / 2);
+    writeCountdown(vm, writeYield, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    int main = vm->code.count;
+    for (int i = 0; i < 4; i++) {
+        vm->code.data[skip + i] = (uint8_t)((main - skip - 4) >> (24 - 8 * i));
+    }
+
+    mochiWriteCodeByte(vm, CODE_THREAD_SPAWN, 1);
+    mochiWriteCodeI32(vm, other, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeI32(vm, YIELDS / 2);
+    writeCountdown(vm, writeYield, 0);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_THREAD_JOIN, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+static void writeSpawnParked(MochiVM* vm, int fiber) {
+    mochiWriteCodeByte(vm, CODE_SHUFFLE, 1);
+    mochiWriteCodeByte(vm, 0, 1);
+    mochiWriteCodeByte(vm, 1, 1);
+    mochiWriteCodeByte(vm, 1, 1);
+    mochiWriteCodeByte(vm, CODE_THREAD_SPAWN_WITH, 1);
+    mochiWriteCodeI32(vm, fiber, 1);
+    mochiWriteCodeI32(vm, 1, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+// Spawns [PARKED] fibers that receive from a channel nothing is sent to, and leaves the channel
+// on the stack for the caller to close once it is done.
+static void writeParked(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    mochiWriteCodeI32(vm, 9, 1);
+    int receiver = vm->code.count;
+    mochiWriteCodeByte(vm, CODE_CHANNEL_RECV, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+
+    mochiWriteCodeByte(vm, CODE_U32, 1);
+    mochiWriteCodeU32(vm, 0, 1);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_NEW, 1);
+    writeI32(vm, PARKED);
+    writeCountdown(vm, writeSpawnParked, receiver);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+static MochiVM* newVM(void) {
+    MochiVMConfiguration config;
+    mochiInitConfiguration(&config);
+    config.workerCount = 1;
+    return mochiNewVM(&config);
+}
+
+static double run(MochiVM* vm, int ops, int* result) {
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    clock_t start = clock();
+    *result = mochiRun(vm, 0, NULL);
+    double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+    mochiFreeVM(vm);
+    return ns;
+}
+
+int main(int argc, const char* argv[]) {
+    int result;
+    printf("%20s %10s %10s\n", "case", "result", "ns/op");
+
+    MochiVM* vm = newVM();
+    int fiber = writeEmptyFiber(vm);
+    writeI32(vm, FIBERS);
+    writeCountdown(vm, writeSpawnJoin, fiber);
+    double ns = run(vm, FIBERS, &result);
+    printf("%20s %10d %10.1f\n", "spawn and join", result, ns);
+
+    vm = newVM();
+    fiber = writeEmptyFiber(vm);
+    writeI32(vm, FIBERS / BATCH);
+    writeCountdown(vm, writeSpawnBatch, fiber);
+    ns = run(vm, FIBERS, &result);
+    printf("%20s %10d %10.1f\n", "spawn batch, join", result, ns);
+
+    vm = newVM();
+    writeYields(vm);
+    ns = run(vm, YIELDS, &result);
+    printf("%20s %10d %10.1f\n", "yield", result, ns);
+
+    // Parking the fibers is timed on its own first, and taken off the time with the spawns.
+    vm = newVM();
+    writeParked(vm);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_CLOSE, 1);
+    writeI32(vm, 0);
+    double parking = run(vm, 1, &result);
+    vm = newVM();
+    fiber = writeEmptyFiber(vm);
+    writeParked(vm);
+    writeI32(vm, FIBERS);
+    writeCountdown(vm, writeSpawnJoin, fiber);
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_CLOSE, 1);
+    ns = (run(vm, 1, &result) - parking) / FIBERS;
+    printf("%20s %10d %10.1f\n", "spawn, join, parked", result, ns);
+    return 0;
+}
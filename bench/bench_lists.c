@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "object.h"
+#include "vm.h"
+
+// Builds lists of several lengths by consing, then walks and measures them, reporting the time
+// per element of each, the allocations made per element and the bytes per element the collector
+// finds live once the list is built.
+
+#define TOTAL_ELEMS 4000000
+// Measure the length of each list at least this many times.
+#define MIN_LENGTHS 1000
+
+static const int lengths[] = { 4, 64, 1024, 65536, 1048576 };
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    MochiVM* vm = mochiNewVM(NULL);
+    // The list being measured is kept in a constant, which the collector treats as a root.
+    int root = mochiWriteObjConst(vm, NULL);
+    int64_t checksum = 0;
+
+    printf("%10s %12s %12s %12s %12s %12s\n", "length", "cons ns", "allocs", "live bytes", "walk ns",
+           "length ns");
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        int length = lengths[l];
+        int repeats = TOTAL_ELEMS / length;
+
+        vm->constants.data[root] = OBJ_VAL(NULL);
+        mochiCollectGarbage(vm);
+        size_t emptyBytes = vm->bytesAllocated;
+        uint64_t allocations = vm->allocations;
+
+        ObjList* list = NULL;
+        clock_t start = clock();
+        for (int r = 0; r < repeats; r++) {
+            list = NULL;
+            for (int i = 0; i < length; i++) {
+                list = mochiListCons(vm, I32_VAL(vm, i), list);
+            }
+            vm->constants.data[root] = OBJ_VAL(list);
+        }
+        double consNs = elapsedNs(start, repeats * length);
+        double allocs = (double)(vm->allocations - allocations) / ((double)repeats * length);
+
+        mochiCollectGarbage(vm);
+        double liveBytes = (double)(vm->bytesAllocated - emptyBytes) / length;
+
+        start = clock();
+        for (int r = 0; r < repeats; r++) {
+            for (ObjList* cell = list; cell != NULL; cell = mochiListTail(cell)) {
+                checksum += AS_I32(mochiListHead(cell));
+            }
+        }
+        double walkNs = elapsedNs(start, repeats * length);
+
+        int lengthOps = repeats > MIN_LENGTHS ? repeats : MIN_LENGTHS;
+        start = clock();
+        for (int i = 0; i < lengthOps; i++) {
+            checksum += mochiListLength(list);
+        }
+        double lengthNs = elapsedNs(start, lengthOps);
+
+        printf("%10d %12.1f %12.3f %12.1f %12.2f %12.1f\n", length, consNs, allocs, liveBytes, walkNs, lengthNs);
+    }
+
+    printf("checksum %lld\n", (long long)checksum);
+    mochiFreeVM(vm);
+    return 0;
+}
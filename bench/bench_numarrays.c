@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "kernels.h"
+#include "mochivm.h"
+#include "object.h"
+#include "vm.h"
+
+// Takes the dot product of arrays of doubles and the sum of arrays of 32-bit integers at several
+// sizes, comparing a loop over the boxed Values of an ObjArray with the scalar kernels and the
+// fastest kernels the processor supports, which back the NUM_ARRAY_ instructions.
+
+#define TOTAL_ELEMS (256 * 1024 * 1024)
+
+static const int sizes[] = { 64, 1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024 };
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+static double boxedDot(ObjArray* a, ObjArray* b) {
+    double result = 0;
+    for (int i = 0; i < a->elems.count; i++) {
+        result += AS_DOUBLE(a->elems.data[i]) * AS_DOUBLE(b->elems.data[i]);
+    }
+    return result;
+}
+
+static int32_t boxedSum(ObjArray* a) {
+    uint32_t result = 0;
+    for (int i = 0; i < a->elems.count; i++) {
+        result += (uint32_t)AS_I32(a->elems.data[i]);
+    }
+    return (int32_t)result;
+}
+
+int main(int argc, const char* argv[]) {
+    MochiVM* vm = mochiNewVM(NULL);
+    const NumKernels* fast = mochiNumKernels();
+    // The inputs are kept in constants, which the collector treats as roots.
+    int rootBoxedA = mochiWriteObjConst(vm, (Obj*)mochiArrayNil(vm));
+    int rootBoxedB = mochiWriteObjConst(vm, (Obj*)mochiArrayNil(vm));
+    int rootA = mochiWriteObjConst(vm, (Obj*)mochiNewNumArray(vm, VAL_DOUBLE, 0));
+    int rootB = mochiWriteObjConst(vm, (Obj*)mochiNewNumArray(vm, VAL_DOUBLE, 0));
+    double checksum = 0;
+
+    printf("fastest kernels: %s\n", fast->name);
+    printf("%10s %6s %14s %14s %14s %12s\n", "elements", "op", "boxed ns/op", "scalar ns/op", "fast ns/op",
+           "fast GB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int size = sizes[s];
+        int ops = TOTAL_ELEMS / size;
+        // Set up the boxed arrays in place, since every allocation may collect.
+        ObjArray* boxedA = mochiArrayNil(vm);
+        vm->constants.data[rootBoxedA] = OBJ_VAL(boxedA);
+        ObjArray* boxedB = mochiArrayNil(vm);
+        vm->constants.data[rootBoxedB] = OBJ_VAL(boxedB);
+        ObjNumArray* a = mochiNewNumArray(vm, VAL_DOUBLE, size);
+        vm->constants.data[rootA] = OBJ_VAL(a);
+        ObjNumArray* b = mochiNewNumArray(vm, VAL_DOUBLE, size);
+        vm->constants.data[rootB] = OBJ_VAL(b);
+        for (int i = 0; i < size; i++) {
+            double x = (double)(i % 100);
+            double y = (double)(i % 7);
+            mochiArraySnoc(vm, DOUBLE_VAL(vm, x), boxedA);
+            mochiArraySnoc(vm, DOUBLE_VAL(vm, y), boxedB);
+            ((double*)a->data)[i] = x;
+            ((double*)b->data)[i] = y;
+        }
+
+        clock_t start = clock();
+        for (int i = 0; i < ops; i++) {
+            checksum += boxedDot(boxedA, boxedB);
+        }
+        double boxedNs = elapsedNs(start, ops);
+
+        double result;
+        start = clock();
+        for (int i = 0; i < ops; i++) {
+            mochiScalarKernels.dot[VAL_DOUBLE](&result, a->data, b->data, size);
+            checksum += result;
+        }
+        double scalarNs = elapsedNs(start, ops);
+
+        start = clock();
+        for (int i = 0; i < ops; i++) {
+            fast->dot[VAL_DOUBLE](&result, a->data, b->data, size);
+            checksum += result;
+        }
+        double fastNs = elapsedNs(start, ops);
+        printf("%10d %6s %14.1f %14.1f %14.1f %12.2f\n", size, "dot", boxedNs, scalarNs, fastNs,
+               size * 2 * sizeof(double) / fastNs);
+
+        boxedA = mochiArrayNil(vm);
+        vm->constants.data[rootBoxedA] = OBJ_VAL(boxedA);
+        a = mochiNewNumArray(vm, VAL_I32, size);
+        vm->constants.data[rootA] = OBJ_VAL(a);
+        for (int i = 0; i < size; i++) {
+            int32_t x = i % 1000 - 500;
+            mochiArraySnoc(vm, I32_VAL(vm, x), boxedA);
+            ((int32_t*)a->data)[i] = x;
+        }
+
+        start = clock();
+        for (int i = 0; i < ops; i++) {
+            checksum += boxedSum(boxedA);
+        }
+        boxedNs = elapsedNs(start, ops);
+
+        int32_t sum;
+        start = clock();
+        for (int i = 0; i < ops; i++) {
+            mochiScalarKernels.sum[VAL_I32](&sum, a->data, size);
+            checksum += sum;
+        }
+        scalarNs = elapsedNs(start, ops);
+
+        start = clock();
+        for (int i = 0; i < ops; i++) {
+            fast->sum[VAL_I32](&sum, a->data, size);
+            checksum += sum;
+        }
+        fastNs = elapsedNs(start, ops);
+        printf("%10d %6s %14.1f %14.1f %14.1f %12.2f\n", size, "sum", boxedNs, scalarNs, fastNs,
+               size * sizeof(int32_t) / fastNs);
+    }
+
+    printf("checksum %.0f\n", checksum);
+    mochiFreeVM(vm);
+    return 0;
+}
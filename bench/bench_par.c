@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "vm.h"
+
+// Maps a closure that counts up [WORK] times over an array of [ELEMENTS] integers in parallel, and
+// then adds up the results in parallel, with one worker and then twice as many each time up to the
+// worker count given as the first argument, four by default. The time per element is wall clock
+// time, so it only goes down with more workers when there are as many cores to run them on.
+
+#define ELEMENTS 20000
+#define WORK     1000
+
+static void writeI32(MochiVM* vm, int32_t n) {
+    mochiWriteCodeByte(vm, CODE_I32, 1);
+    mochiWriteCodeI32(vm, n, 1);
+}
+
+static void writeFind(MochiVM* vm, uint16_t frame, uint16_t slot) {
+    mochiWriteCodeByte(vm, CODE_FIND, 1);
+    mochiWriteCodeU16(vm, frame, 1);
+    mochiWriteCodeU16(vm, slot, 1);
+}
+
+static void writeClosure(MochiVM* vm, int body, uint8_t paramCount) {
+    mochiWriteCodeByte(vm, CODE_CLOSURE, 1);
+    mochiWriteCodeU32(vm, body, 1);
+    mochiWriteCodeByte(vm, paramCount, 1);
+    mochiWriteCodeU16(vm, 0, 1);
+}
+
+// Writes the closure bodies behind an offset that skips them, returning where the mapped one
+// starts; the added one starts at [add].
+static int writeBodies(MochiVM* vm, int* add) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    int skip = vm->code.count;
+    mochiWriteCodeI32(vm, 0, 1);
+
+    int work = vm->code.count;
+    writeFind(vm, 0, 0);
+    writeI32(vm, WORK);
+    int loop = vm->code.count;
+    mochiWriteCodeByte(vm, CODE_INT_DEC, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    mochiWriteCodeByte(vm, CODE_INT_INC, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_JUMP_INT_LESS, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeU32(vm, loop, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_RETURN, 1);
+
+    *add = vm->code.count;
+    writeFind(vm, 0, 1);
+    writeFind(vm, 0, 0);
+    mochiWriteCodeByte(vm, CODE_INT_ADD, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_RETURN, 1);
+
+    int target = vm->code.count;
+    for (int i = 0; i < 4; i++) {
+        vm->code.data[skip + i] = (uint8_t)((target - skip - 4) >> (24 - 8 * i));
+    }
+    return work;
+}
+
+static void writeMapReduce(MochiVM* vm) {
+    ObjArray* elements = mochiArrayNil(vm);
+    int index = mochiWriteObjConst(vm, (Obj*)elements);
+    for (int i = 0; i < ELEMENTS; i++) {
+        mochiArraySnoc(vm, I32_VAL(vm, i), elements);
+    }
+
+    int add;
+    int work = writeBodies(vm, &add);
+    mochiWriteCodeByte(vm, CODE_CONSTANT, 1);
+    mochiWriteCodeU16(vm, index, 1);
+    writeClosure(vm, work, 1);
+    mochiWriteCodeByte(vm, CODE_ARRAY_PAR_MAP, 1);
+    writeI32(vm, 0);
+    writeClosure(vm, add, 2);
+    mochiWriteCodeByte(vm, CODE_ARRAY_PAR_REDUCE, 1);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+}
+
+static double run(int workerCount, int* result) {
+    MochiVMConfiguration config;
+    mochiInitConfiguration(&config);
+    config.workerCount = workerCount;
+    MochiVM* vm = mochiNewVM(&config);
+    writeMapReduce(vm);
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+    *result = mochiRun(vm, 0, NULL);
+    timespec_get(&end, TIME_UTC);
+    mochiFreeVM(vm);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ELEMENTS;
+}
+
+int main(int argc, const char* argv[]) {
+    int maxWorkers = argc > 1 ? atoi(argv[1]) : 4;
+    printf("%10s %12s %12s\n", "workers", "result", "ns/element");
+    for (int workers = 1; workers <= maxWorkers; workers *= 2) {
+        int result;
+        double ns = run(workers, &result);
+        printf("%10d %12d %12.1f\n", workers, result, ns);
+    }
+    return 0;
+}
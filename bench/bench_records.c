@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "object.h"
+#include "vm.h"
+
+// Builds records of several widths one field at a time, then updates and selects random fields of
+// each, reporting the average time of each operation. Widths on either side of
+// MOCHIVM_RECORD_TRIE_THRESHOLD show the cost of flat records against records stored in tries.
+
+#define UPDATES 200000
+#define SELECTS 1000000
+// Collect this often, so the benchmark also pays for marking what it keeps alive.
+#define COLLECT_EVERY 4096
+
+static const int widths[] = { 8, 16, 32, 33, 64, 256, 1024, 4096 };
+
+static uint32_t state = 2463534242u;
+
+static uint32_t nextRandom(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    MochiVM* vm = mochiNewVM(NULL);
+    // The record being worked on is kept in a constant, which the collector treats as a root.
+    int root = mochiWriteObjConst(vm, (Obj*)mochiNewRecord(vm));
+    int32_t checksum = 0;
+
+    printf("%8s %14s %14s %14s\n", "width", "extend ns/op", "update ns/op", "select ns/op");
+    for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        int width = widths[w];
+
+        clock_t start = clock();
+        ObjRecord* rec = mochiNewRecord(vm);
+        for (int i = 0; i < width; i++) {
+            rec = mochiRecordExtend(vm, i * 3, I32_VAL(vm, i), rec);
+            vm->constants.data[root] = OBJ_VAL(rec);
+            if (i % COLLECT_EVERY == 0) {
+                mochiCollectGarbage(vm);
+            }
+        }
+        double extendNs = elapsedNs(start, width);
+
+        start = clock();
+        for (int i = 0; i < UPDATES; i++) {
+            rec = mochiRecordUpdate(vm, (nextRandom() % width) * 3, I32_VAL(vm, i), rec);
+            vm->constants.data[root] = OBJ_VAL(rec);
+            if (i % COLLECT_EVERY == 0) {
+                mochiCollectGarbage(vm);
+            }
+        }
+        double updateNs = elapsedNs(start, UPDATES);
+
+        start = clock();
+        for (int i = 0; i < SELECTS; i++) {
+            checksum += AS_I32(mochiRecordSelect((nextRandom() % width) * 3, rec));
+        }
+        double selectNs = elapsedNs(start, SELECTS);
+
+        printf("%8d %14.1f %14.1f %14.1f\n", width, extendNs, updateNs, selectNs);
+    }
+
+    printf("checksum %d\n", checksum);
+    mochiFreeVM(vm);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "vm.h"
+
+// Runs ref heavy loops: a counter kept in a ref that is read, incremented and written back, first
+// alone and then alongside many other live refs, and refs that are created and dropped straight
+// away so that each one is collected. Each step of a loop works on the ref [UNROLL] times, so the
+// loop itself is a small part of the time reported per ref operation. Build it against the tree
+// before and after a change to refs to compare the two.
+
+#define STEPS  1000000
+#define UNROLL 8
+#define LIVE   100000
+
+static void writeI32(MochiVM* vm, int32_t n) {
+    mochiWriteCodeByte(vm, CODE_I32, 1);
+    mochiWriteCodeI32(vm, n, 1);
+}
+
+// Counts the integer on top of the stack down to zero, running the code written by [body] each
+// time around with the count below it, and leaves the zero on the stack.
+static void writeCountdown(MochiVM* vm, void (*body)(MochiVM* vm)) {
+    int loop = vm->code.count;
+    body(vm);
+    mochiWriteCodeByte(vm, CODE_INT_DEC, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_JUMP_INT_LESS, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeU32(vm, loop, 1);
+}
+
+// Adds a new ref to the array below the count.
+static void writeKeepRef(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_NEWREF, 1);
+    mochiWriteCodeByte(vm, CODE_ARRAY_SNOC, 1);
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+}
+
+static void writeDropRefs(MochiVM* vm) {
+    for (int i = 0; i < UNROLL; i++) {
+        writeI32(vm, 0);
+        mochiWriteCodeByte(vm, CODE_NEWREF, 1);
+        mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    }
+}
+
+// Increments the counter in the ref below the count.
+static void writeIncrements(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    for (int i = 0; i < UNROLL; i++) {
+        mochiWriteCodeByte(vm, CODE_DUP, 1);
+        mochiWriteCodeByte(vm, CODE_DUP, 1);
+        mochiWriteCodeByte(vm, CODE_GETREF, 1);
+        writeI32(vm, 1);
+        mochiWriteCodeByte(vm, CODE_INT_ADD, 1);
+        mochiWriteCodeByte(vm, VAL_I32, 1);
+        mochiWriteCodeByte(vm, CODE_PUTREF, 1);
+    }
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+}
+
+static void writeCounter(MochiVM* vm, int live) {
+    if (live > 0) {
+        mochiWriteCodeByte(vm, CODE_ARRAY_NIL, 1);
+        writeI32(vm, live);
+        writeCountdown(vm, writeKeepRef);
+        mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    }
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_NEWREF, 1);
+    writeI32(vm, STEPS);
+    writeCountdown(vm, writeIncrements);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_GETREF, 1);
+}
+
+static void writeChurn(MochiVM* vm) {
+    writeI32(vm, STEPS);
+    writeCountdown(vm, writeDropRefs);
+}
+
+static double run(MochiVM* vm, int* result) {
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    clock_t start = clock();
+    *result = mochiRun(vm, 0, NULL);
+    double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / STEPS / UNROLL;
+    mochiFreeVM(vm);
+    return ns;
+}
+
+int main(int argc, const char* argv[]) {
+    int result;
+    printf("%20s %10s %10s\n", "case", "result", "ns/op");
+
+    MochiVM* vm = mochiNewVM(NULL);
+    writeCounter(vm, 0);
+    double ns = run(vm, &result);
+    printf("%20s %10d %10.1f\n", "counter", result, ns);
+
+    vm = mochiNewVM(NULL);
+    writeCounter(vm, LIVE);
+    ns = run(vm, &result);
+    printf("%20s %10d %10.1f\n", "counter, live refs", result, ns);
+
+    vm = mochiNewVM(NULL);
+    writeChurn(vm);
+    ns = run(vm, &result);
+    printf("%20s %10d %10.1f\n", "new and drop", result, ns);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "vm.h"
+
+// Runs the same functional update loop with each instruction that copies its input and with its
+// _REUSE variant, reporting how many allocations and how much time each takes. The loops are
+// unrolled into straight line code, so the two runs of a case differ only in the measured
+// instruction.
+
+#define REPEATS 500
+
+typedef struct {
+    const char* name;
+    Code copying;
+    Code reusing;
+    void (*writeSetup)(MochiVM* vm);
+    void (*writeStep)(MochiVM* vm, Code op, int i);
+} Case;
+
+static void writeI32(MochiVM* vm, int32_t n) {
+    mochiWriteCodeByte(vm, CODE_I32, 1);
+    mochiWriteCodeI32(vm, n, 1);
+}
+
+static void recordSetup(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_RECORD_NIL, 1);
+    for (int i = 0; i < 8; i++) {
+        writeI32(vm, i);
+        mochiWriteCodeByte(vm, CODE_RECORD_EXTEND, 1);
+        mochiWriteCodeI32(vm, i, 1);
+    }
+}
+
+static void recordStep(MochiVM* vm, Code op, int i) {
+    writeI32(vm, i);
+    mochiWriteCodeByte(vm, op, 1);
+    mochiWriteCodeI32(vm, i % 8, 1);
+}
+
+static void variantSetup(MochiVM* vm) {
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_VARIANT, 1);
+    mochiWriteCodeI32(vm, 1, 1);
+}
+
+static void variantStep(MochiVM* vm, Code op, int i) {
+    mochiWriteCodeByte(vm, op, 1);
+    mochiWriteCodeI32(vm, i % 2, 1);
+}
+
+static void listSetup(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_LIST_NIL, 1);
+}
+
+// Appends a single element list to the end of the accumulated list.
+static void listStep(MochiVM* vm, Code op, int i) {
+    mochiWriteCodeByte(vm, CODE_LIST_NIL, 1);
+    writeI32(vm, i);
+    mochiWriteCodeByte(vm, CODE_LIST_CONS, 1);
+    mochiWriteCodeByte(vm, CODE_SWAP, 1);
+    mochiWriteCodeByte(vm, op, 1);
+}
+
+static void arraySetup(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_ARRAY_NIL, 1);
+}
+
+static void arrayStep(MochiVM* vm, Code op, int i) {
+    mochiWriteCodeByte(vm, CODE_ARRAY_NIL, 1);
+    writeI32(vm, i);
+    mochiWriteCodeByte(vm, CODE_ARRAY_SNOC, 1);
+    mochiWriteCodeByte(vm, op, 1);
+}
+
+static int piece;
+
+// String constants may not be reused, so the accumulated string starts as a fresh concatenation.
+static void stringSetup(MochiVM* vm) {
+    piece = mochiWriteStringConst(vm, "ab");
+    for (int i = 0; i < 2; i++) {
+        mochiWriteCodeByte(vm, CODE_CONSTANT, 1);
+        mochiWriteCodeU16(vm, piece, 1);
+    }
+    mochiWriteCodeByte(vm, CODE_STRING_CONCAT, 1);
+}
+
+static void stringStep(MochiVM* vm, Code op, int i) {
+    mochiWriteCodeByte(vm, CODE_CONSTANT, 1);
+    mochiWriteCodeU16(vm, piece, 1);
+    mochiWriteCodeByte(vm, op, 1);
+}
+
+static const Case cases[] = {
+    { "record update", CODE_RECORD_UPDATE, CODE_RECORD_UPDATE_REUSE, recordSetup, recordStep },
+    { "embed", CODE_EMBED, CODE_EMBED_REUSE, variantSetup, variantStep },
+    { "list append", CODE_LIST_APPEND, CODE_LIST_APPEND_REUSE, listSetup, listStep },
+    { "array concat", CODE_ARRAY_CONCAT, CODE_ARRAY_CONCAT_REUSE, arraySetup, arrayStep },
+    { "string concat", CODE_STRING_CONCAT, CODE_STRING_CONCAT_REUSE, stringSetup, stringStep },
+};
+
+static void runCase(const Case* c, Code op, uint64_t* allocations, double* ns) {
+    MochiVM* vm = mochiNewVM(NULL);
+    c->writeSetup(vm);
+    for (int i = 0; i < REPEATS; i++) {
+        c->writeStep(vm, op, i);
+    }
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+
+    uint64_t before = vm->allocations;
+    clock_t start = clock();
+    mochiRun(vm, 0, NULL);
+    *ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / REPEATS;
+    *allocations = vm->allocations - before;
+    mochiFreeVM(vm);
+}
+
+int main(int argc, const char* argv[]) {
+    printf("%14s %12s %12s %12s %12s\n", "operation", "copy allocs", "reuse allocs", "copy ns/op", "reuse ns/op");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint64_t copyAllocs, reuseAllocs;
+        double copyNs, reuseNs;
+        runCase(&cases[i], cases[i].copying, &copyAllocs, &copyNs);
+        runCase(&cases[i], cases[i].reusing, &reuseAllocs, &reuseNs);
+        printf("%14s %12llu %12llu %12.1f %12.1f\n", cases[i].name, (unsigned long long)copyAllocs,
+               (unsigned long long)reuseAllocs, copyNs, reuseNs);
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "vm.h"
+
+// Times calls through a function that recurses without tail calls, and measures the memory each
+// fiber holds while parked on a channel, in code whose stack depth the verifier cannot bound.
+// Build it against the tree before and after a change to fiber stacks to compare the two; DEPTH
+// is kept within the stack capacities fibers had before they could grow.
+
+#define DEPTH   100
+#define REPEATS 100000
+#define PARKED  10000
+
+// Every allocation is preceded by its size, so the bytes held can be counted as they are freed.
+typedef union {
+    size_t size;
+    max_align_t align;
+} Header;
+
+static size_t liveBytes = 0;
+static size_t peakBytes = 0;
+
+static void* countingReallocate(void* memory, size_t newSize, void* userData) {
+    Header* header = memory == NULL ? NULL : (Header*)memory - 1;
+    if (header != NULL) {
+        liveBytes -= header->size;
+    }
+    if (newSize == 0) {
+        free(header);
+        return NULL;
+    }
+    header = realloc(header, sizeof(Header) + newSize);
+    header->size = newSize;
+    liveBytes += newSize;
+    peakBytes = liveBytes > peakBytes ? liveBytes : peakBytes;
+    return header + 1;
+}
+
+static void writeI32(MochiVM* vm, int32_t n) {
+    mochiWriteCodeByte(vm, CODE_I32, 1);
+    mochiWriteCodeI32(vm, n, 1);
+}
+
+// Writes a function that sums the numbers from the one on top of the stack down to zero, behind an
+// offset that skips it, and returns where it starts.
+static int writeSum(MochiVM* vm) {
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    mochiWriteCodeI32(vm, 23, 1);
+    int start = vm->code.count;
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_JUMP_INT_EQ, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeU32(vm, start + 22, 1);
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    mochiWriteCodeByte(vm, CODE_INT_DEC, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_CALL, 1);
+    mochiWriteCodeU32(vm, start, 1);
+    mochiWriteCodeByte(vm, CODE_INT_ADD, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_RETURN, 1);
+    return start;
+}
+
+// Counts the integer on top of the stack down to zero, running the code written by [body] each
+// time around with the count below it, and leaves the zero on the stack.
+static void writeCountdown(MochiVM* vm, void (*body)(MochiVM* vm, int arg), int arg) {
+    int loop = vm->code.count;
+    body(vm, arg);
+    mochiWriteCodeByte(vm, CODE_INT_DEC, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeByte(vm, CODE_DUP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_JUMP_INT_LESS, 1);
+    mochiWriteCodeByte(vm, VAL_I32, 1);
+    mochiWriteCodeU32(vm, loop, 1);
+}
+
+static void writeCallSum(MochiVM* vm, int sum) {
+    writeI32(vm, DEPTH);
+    mochiWriteCodeByte(vm, CODE_CALL, 1);
+    mochiWriteCodeU32(vm, sum, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+static void writeSpawnParked(MochiVM* vm, int fiber) {
+    mochiWriteCodeByte(vm, CODE_SHUFFLE, 1);
+    mochiWriteCodeByte(vm, 0, 1);
+    mochiWriteCodeByte(vm, 1, 1);
+    mochiWriteCodeByte(vm, 1, 1);
+    mochiWriteCodeByte(vm, CODE_THREAD_SPAWN_WITH, 1);
+    mochiWriteCodeI32(vm, fiber, 1);
+    mochiWriteCodeI32(vm, 1, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+}
+
+// Calls the sum once, so the code has unbounded stack depth, then spawns [count] fibers that
+// receive from a channel nothing is sent to, and closes it once they are all parked.
+static void writeParked(MochiVM* vm, int count) {
+    int sum = writeSum(vm);
+    writeCallSum(vm, sum);
+
+    mochiWriteCodeByte(vm, CODE_OFFSET, 1);
+    mochiWriteCodeI32(vm, 9, 1);
+    int receiver = vm->code.count;
+    mochiWriteCodeByte(vm, CODE_CHANNEL_RECV, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+
+    mochiWriteCodeByte(vm, CODE_U32, 1);
+    mochiWriteCodeU32(vm, 0, 1);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_NEW, 1);
+    writeI32(vm, count);
+    writeCountdown(vm, writeSpawnParked, receiver);
+    mochiWriteCodeByte(vm, CODE_ZAP, 1);
+    mochiWriteCodeByte(vm, CODE_CHANNEL_CLOSE, 1);
+    writeI32(vm, 0);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+}
+
+static MochiVM* newVM(void) {
+    MochiVMConfiguration config;
+    mochiInitConfiguration(&config);
+    config.reallocateFn = countingReallocate;
+    config.workerCount = 1;
+    return mochiNewVM(&config);
+}
+
+// Returns the most bytes held at once while running the parked fibers.
+static size_t parkedPeak(int count) {
+    MochiVM* vm = newVM();
+    writeParked(vm, count);
+    peakBytes = liveBytes;
+    mochiRun(vm, 0, NULL);
+    size_t peak = peakBytes;
+    mochiFreeVM(vm);
+    return peak;
+}
+
+int main(int argc, const char* argv[]) {
+    printf("%20s %10s %10s\n", "case", "result", "ns/op");
+
+    MochiVM* vm = newVM();
+    int sum = writeSum(vm);
+    writeI32(vm, REPEATS);
+    writeCountdown(vm, writeCallSum, sum);
+    mochiWriteCodeByte(vm, CODE_ABORT, 1);
+    clock_t start = clock();
+    int result = mochiRun(vm, 0, NULL);
+    double ns = (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ((double)REPEATS * (DEPTH + 1));
+    mochiFreeVM(vm);
+    printf("%20s %10d %10.1f\n", "recursive call", result, ns);
+
+    size_t perFiber = (parkedPeak(PARKED + 1) - parkedPeak(1)) / PARKED;
+    printf("%20s %10s %10zu\n", "bytes per parked", "", perFiber);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "value.h"
+#include "vm.h"
+
+// Sets, gets and removes a million keys in a Table, comparing it with a copy of the linear probing
+// table it replaced, which divides by the capacity on every probe. Keys are handed out in sequence,
+// and then looked up in a shuffled order.
+
+#define KEYS 1000000
+
+// The previous table, kept here as the baseline.
+
+typedef struct {
+    uint32_t capacity;
+    uint32_t count;
+    TableEntry* entries;
+} LinearTable;
+
+static uint32_t linearHash(uint64_t hash) {
+    hash = ~hash + (hash << 18);
+    hash = hash ^ (hash >> 31);
+    hash = hash * 21;
+    hash = hash ^ (hash >> 11);
+    hash = hash + (hash << 6);
+    hash = hash ^ (hash >> 22);
+    return (uint32_t)(hash & 0x3fffffff);
+}
+
+static bool linearFind(TableEntry* entries, uint32_t capacity, TableKey key, TableEntry** result) {
+    if (capacity == 0) {
+        return false;
+    }
+    uint32_t startIndex = linearHash(key) % capacity;
+    uint32_t index = startIndex;
+    TableEntry* tombstone = NULL;
+    do {
+        TableEntry* entry = &entries[index];
+        if (entry->key < TABLE_KEY_RANGE_START) {
+            if (entry->key == TABLE_KEY_UNUSED) {
+                *result = tombstone != NULL ? tombstone : entry;
+                return false;
+            } else if (tombstone == NULL) {
+                tombstone = entry;
+            }
+        } else if (entry->key == key) {
+            *result = entry;
+            return true;
+        }
+        index = (index + 1) % capacity;
+    } while (index != startIndex);
+    *result = tombstone;
+    return false;
+}
+
+static void linearResize(LinearTable* table, uint32_t capacity) {
+    TableEntry* entries = calloc(capacity, sizeof(TableEntry));
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        TableEntry* entry = &table->entries[i];
+        if (entry->key >= TABLE_KEY_RANGE_START) {
+            TableEntry* slot;
+            linearFind(entries, capacity, entry->key, &slot);
+            *slot = *entry;
+        }
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+static void linearSet(LinearTable* table, TableKey key, Value value) {
+    if (table->count + 1 > table->capacity * 75 / 100) {
+        linearResize(table, table->capacity < 16 ? 16 : table->capacity * 2);
+    }
+    TableEntry* entry;
+    if (!linearFind(table->entries, table->capacity, key, &entry)) {
+        entry->key = key;
+        table->count++;
+    }
+    entry->value = value;
+}
+
+static bool linearGet(LinearTable* table, TableKey key, Value* out) {
+    TableEntry* entry;
+    bool found = linearFind(table->entries, table->capacity, key, &entry);
+    *out = found ? entry->value : FALSE_VAL;
+    return found;
+}
+
+static bool linearRemove(LinearTable* table, TableKey key) {
+    TableEntry* entry;
+    if (!linearFind(table->entries, table->capacity, key, &entry)) {
+        return false;
+    }
+    entry->key = TABLE_KEY_TOMBSTONE;
+    table->count--;
+    if (table->capacity > 16 && table->count < table->capacity / 2 * 75 / 100) {
+        linearResize(table, table->capacity / 2);
+    }
+    return true;
+}
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    MochiVM* vm = mochiNewVM(NULL);
+    TableKey* shuffled = malloc(sizeof(TableKey) * KEYS);
+    for (int i = 0; i < KEYS; i++) {
+        shuffled[i] = TABLE_KEY_RANGE_START + (TableKey)i;
+    }
+    uint32_t state = 2463534242u;
+    for (int i = KEYS - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int j = (int)(state % (uint32_t)(i + 1));
+        TableKey swap = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = swap;
+    }
+    int64_t checksum = 0;
+    Value found;
+
+    double ns[2][4];
+    LinearTable linear = { 0, 0, NULL };
+    clock_t start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        linearSet(&linear, TABLE_KEY_RANGE_START + (TableKey)i, U32_VAL(vm, i));
+    }
+    ns[0][0] = elapsedNs(start, KEYS);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        checksum += linearGet(&linear, shuffled[i], &found);
+    }
+    ns[0][1] = elapsedNs(start, KEYS);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        checksum += linearGet(&linear, shuffled[i] + KEYS, &found);
+    }
+    ns[0][2] = elapsedNs(start, KEYS);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        checksum += linearRemove(&linear, shuffled[i]);
+    }
+    ns[0][3] = elapsedNs(start, KEYS);
+    free(linear.entries);
+
+    Table table;
+    mochiTableInit(&table);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        mochiTableSet(vm, &table, TABLE_KEY_RANGE_START + (TableKey)i, U32_VAL(vm, i));
+    }
+    ns[1][0] = elapsedNs(start, KEYS);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        checksum += mochiTableGet(&table, shuffled[i], &found);
+    }
+    ns[1][1] = elapsedNs(start, KEYS);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        checksum += mochiTableGet(&table, shuffled[i] + KEYS, &found);
+    }
+    ns[1][2] = elapsedNs(start, KEYS);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) {
+        checksum += mochiTableTryRemove(vm, &table, shuffled[i]);
+    }
+    ns[1][3] = elapsedNs(start, KEYS);
+    mochiTableClear(vm, &table);
+
+    const char* names[] = { "set", "get hit", "get miss", "remove" };
+    printf("%10s %16s %16s\n", "op", "linear ns/op", "table ns/op");
+    for (int op = 0; op < 4; op++) {
+        printf("%10s %16.1f %16.1f\n", names[op], ns[0][op], ns[1][op]);
+    }
+
+    printf("checksum %lld\n", (long long)checksum);
+    free(shuffled);
+    mochiFreeVM(vm);
+    return 0;
+}
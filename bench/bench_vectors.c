@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "mochivm.h"
+#include "object.h"
+#include "vm.h"
+
+// Updates random elements of arrays and persistent vectors of several sizes without changing the
+// original, as a functional program would: an array is copied and then set, a vector is path
+// copied by mochiVectorSetAt. Also reports the average time to read an element of each.
+
+#define UPDATES 20000
+#define READS 1000000
+// Collect about this many updates apart, so the benchmark also pays for marking what it keeps alive.
+#define COLLECT_EVERY 256
+
+static const int sizes[] = { 16, 256, 4096, 65536, 1048576 };
+
+static uint32_t state = 2463534242u;
+
+static uint32_t nextRandom(void) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+static double elapsedNs(clock_t start, int ops) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC * 1e9 / ops;
+}
+
+int main(int argc, const char* argv[]) {
+    MochiVM* vm = mochiNewVM(NULL);
+    // The array and vector being updated are kept in constants, which the collector treats as roots.
+    int arrayRoot = mochiWriteObjConst(vm, (Obj*)mochiArrayNil(vm));
+    int vectorRoot = mochiWriteObjConst(vm, (Obj*)mochiNewVector(vm));
+    int64_t checksum = 0;
+
+    printf("%10s %16s %16s %14s %14s\n", "size", "array ns/update", "vector ns/update", "array ns/read",
+           "vector ns/read");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int size = sizes[s];
+        ObjArray* array = mochiArrayNil(vm);
+        mochiArrayFill(vm, size, I32_VAL(vm, 0), array);
+        vm->constants.data[arrayRoot] = OBJ_VAL(array);
+        ObjVector* vector = mochiVectorFromArray(vm, array);
+        vm->constants.data[vectorRoot] = OBJ_VAL(vector);
+        // Copying a large array for every update is slow enough that fewer updates are timed.
+        int updates = size > 65536 ? UPDATES / 100 : UPDATES;
+
+        clock_t start = clock();
+        for (int i = 0; i < updates; i++) {
+            array = mochiArrayCopy(vm, 0, size, array);
+            mochiArraySetAt(nextRandom() % size, I32_VAL(vm, i), array);
+            vm->constants.data[arrayRoot] = OBJ_VAL(array);
+            if (i % COLLECT_EVERY == 0) {
+                mochiCollectGarbage(vm);
+            }
+        }
+        double arrayUpdateNs = elapsedNs(start, updates);
+
+        start = clock();
+        for (int i = 0; i < updates; i++) {
+            vector = mochiVectorSetAt(vm, nextRandom() % size, I32_VAL(vm, i), vector);
+            vm->constants.data[vectorRoot] = OBJ_VAL(vector);
+            if (i % COLLECT_EVERY == 0) {
+                mochiCollectGarbage(vm);
+            }
+        }
+        double vectorUpdateNs = elapsedNs(start, updates);
+
+        start = clock();
+        for (int i = 0; i < READS; i++) {
+            checksum += AS_I32(mochiArrayGetAt(nextRandom() % size, array));
+        }
+        double arrayReadNs = elapsedNs(start, READS);
+
+        start = clock();
+        for (int i = 0; i < READS; i++) {
+            checksum += AS_I32(mochiVectorGetAt(nextRandom() % size, vector));
+        }
+        double vectorReadNs = elapsedNs(start, READS);
+
+        printf("%10d %16.1f %16.1f %14.1f %14.1f\n", size, arrayUpdateNs, vectorUpdateNs, arrayReadNs,
+               vectorReadNs);
+    }
+
+    printf("checksum %lld\n", (long long)checksum);
+    mochiFreeVM(vm);
+    return 0;
+}
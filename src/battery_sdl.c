@@ -14,7 +14,7 @@ void sdlmochiInit(MochiVM* vm, ObjFiber* fiber) {
 }
 
 void sdlmochiCreateWindow(MochiVM* vm, ObjFiber* fiber) {
-    const char* title = AS_CSTRING(mochiFiberPeekValue(fiber, 1));
+    const char* title = (char*)mochiFlattenString(vm, mochiFiberPeekValue(fiber, 1))->elems.data;
     int x = AS_I32(mochiFiberPeekValue(fiber, 2));
     int y = AS_I32(mochiFiberPeekValue(fiber, 3));
     int w = AS_I32(mochiFiberPeekValue(fiber, 4));
@@ -15,15 +15,16 @@ void uvmochiVersionString(MochiVM* vm, ObjFiber* fiber);
 //     a... --> a... V{ good: Timer, fail: String }
 void uvmochiNewTimer(MochiVM* vm, ObjFiber* fiber);
 // Properly releases the resources associated with the timer object on top of the stack, and pops it.
+// A promise from starting the timer that has not settled yet settles with UV_ECANCELED.
 // WARNING: if multiple references to the timer exist, calling this function on those references will
 // cause double-free problems. Accessing other references after one has been close is the same as
 // accessing freed memory.
 //     a... Timer --> a...
 void uvmochiCloseTimer(MochiVM* vm, ObjFiber* fiber);
-// Starts the timer on top of the stack with the given duration. The timer will execute the callback
-// in the fourth stack slot when the duration has elapsed. Suspends the current fiber until the duration
-// has elapsed. Places the timer reference on top of the stack for the callback.
-//     a... (a... V{ good: Timer, fail: String } --> c...) U64 Timer ~~> c...
+// Starts the timer on top of the stack with the given duration, and pushes a promise that settles
+// with zero once the duration has elapsed. The fiber keeps running, so it can start other timers
+// before it awaits any of them.
+//     a... U64 Timer --> a... Promise
 void uvmochiTimerStart(MochiVM* vm, ObjFiber* fiber);
 void uvmochiTimerStop(MochiVM* vm, ObjFiber* fiber);
 void uvmochiTimerSetRepeat(MochiVM* vm, ObjFiber* fiber);
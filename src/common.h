@@ -69,6 +69,19 @@
 #endif
 #endif
 
+// If true, the bulk numeric array instructions run over vector loops written with
+// the vector extensions of GCC and Clang. On x86 the loops are compiled twice, and
+// the AVX2 build is picked at runtime on processors that support it. Otherwise the
+// instructions fall back to plain scalar loops.
+// Defaults to true on supported compilers.
+#ifndef MOCHIVM_VECTOR_KERNELS
+#if defined(__GNUC__) || defined(__clang__)
+#define MOCHIVM_VECTOR_KERNELS 1
+#else
+#define MOCHIVM_VECTOR_KERNELS 0
+#endif
+#endif
+
 // The VM includes a number of optional 'batteries'. You can choose to include
 // these or not. By default, they are all available. To disable one, set the
 // corresponding `MOCHIVM_BATTERY_<name>` define to `0`.
@@ -110,6 +123,10 @@
 // We need buffers of a few different types. To avoid lots of casting between
 // void* and back, we'll use the preprocessor as a poor man's generics and let
 // it generate a few type-specific ones.
+//
+// Reserve grows a buffer to hold exactly [count] more elements, so a buffer whose final size is
+// known up front is allocated once. Append copies a run of elements in with memcpy, growing the
+// buffer the same way Fill does, and [data] must not point into the buffer being appended to.
 #define DECLARE_BUFFER(name, type)                                                                                     \
     typedef struct {                                                                                                   \
         type* data;                                                                                                    \
@@ -119,7 +136,9 @@
     void mochi##name##BufferInit(name##Buffer* buffer);                                                                \
     void mochi##name##BufferClear(MochiVM* vm, name##Buffer* buffer);                                                  \
     void mochi##name##BufferFill(MochiVM* vm, name##Buffer* buffer, type data, int count);                             \
-    void mochi##name##BufferWrite(MochiVM* vm, name##Buffer* buffer, type data)
+    void mochi##name##BufferWrite(MochiVM* vm, name##Buffer* buffer, type data);                                       \
+    void mochi##name##BufferReserve(MochiVM* vm, name##Buffer* buffer, int count);                                     \
+    void mochi##name##BufferAppend(MochiVM* vm, name##Buffer* buffer, const type* data, int count)
 
 // This should be used once for each type instantiation, somewhere in a .c file.
 #define DEFINE_BUFFER(name, type)                                                                                      \
@@ -149,6 +168,25 @@
                                                                                                                        \
     void mochi##name##BufferWrite(MochiVM* vm, name##Buffer* buffer, type data) {                                      \
         mochi##name##BufferFill(vm, buffer, data, 1);                                                                  \
+    }                                                                                                                  \
+                                                                                                                       \
+    void mochi##name##BufferReserve(MochiVM* vm, name##Buffer* buffer, int count) {                                    \
+        if (buffer->capacity < buffer->count + count) {                                                                \
+            int capacity = buffer->count + count;                                                                      \
+            buffer->data =                                                                                             \
+                (type*)mochiReallocate(vm, buffer->data, buffer->capacity * sizeof(type), capacity * sizeof(type));    \
+            buffer->capacity = capacity;                                                                               \
+        }                                                                                                              \
+    }                                                                                                                  \
+                                                                                                                       \
+    void mochi##name##BufferAppend(MochiVM* vm, name##Buffer* buffer, const type* data, int count) {                   \
+        if (buffer->capacity < buffer->count + count) {                                                                \
+            mochi##name##BufferReserve(vm, buffer, mochiPowerOf2Ceil(buffer->count + count) - buffer->count);          \
+        }                                                                                                              \
+        if (count > 0) {                                                                                               \
+            memcpy(buffer->data + buffer->count, data, count * sizeof(type));                                          \
+            buffer->count += count;                                                                                    \
+        }                                                                                                              \
     }
 
 #define PANIC(message)                                                                                                 \
@@ -114,6 +114,12 @@ static int twoIntArgInstruction(const char* name, MochiVM* vm, int offset) {
     return offset;
 }
 
+static int byteIntArgInstruction(const char* name, MochiVM* vm, int offset) {
+    uint8_t* code = vm->code.data;
+    printf("%-16s %-8u %d\n", name, code[offset + 1], getInt(code, offset + 2));
+    return offset + 6;
+}
+
 static int callInstruction(const char* name, MochiVM* vm, int offset) {
     uint8_t* code = vm->code.data;
     int instrIndex = getInt(code, offset + 1);
@@ -186,10 +192,11 @@ void disassembleChunk(MochiVM* vm, const char* name) {
 
 int disassembleInstruction(MochiVM* vm, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && vm->lines.data[offset] == vm->lines.data[offset - 1]) {
+    int line = mochiGetLine(vm, offset);
+    if (offset > 0 && line == mochiGetLine(vm, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", vm->lines.data[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = vm->code.data[offset];
@@ -362,6 +369,42 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return intArgInstruction("OFFSET_TRUE", vm, offset);
     case CODE_OFFSET_FALSE:
         return intArgInstruction("OFFSET_FALSE", vm, offset);
+    case CODE_JUMP_INT_EQ:
+        return byteIntArgInstruction("JUMP_INT_EQ", vm, offset);
+    case CODE_JUMP_INT_LESS:
+        return byteIntArgInstruction("JUMP_INT_LESS", vm, offset);
+    case CODE_JUMP_INT_GREATER:
+        return byteIntArgInstruction("JUMP_INT_GREATER", vm, offset);
+    case CODE_OFFSET_INT_EQ:
+        return byteIntArgInstruction("OFFSET_INT_EQ", vm, offset);
+    case CODE_OFFSET_INT_LESS:
+        return byteIntArgInstruction("OFFSET_INT_LESS", vm, offset);
+    case CODE_OFFSET_INT_GREATER:
+        return byteIntArgInstruction("OFFSET_INT_GREATER", vm, offset);
+    case CODE_JUMP_SINGLE_EQ:
+        return intArgInstruction("JUMP_SINGLE_EQ", vm, offset);
+    case CODE_JUMP_SINGLE_LESS:
+        return intArgInstruction("JUMP_SINGLE_LESS", vm, offset);
+    case CODE_JUMP_SINGLE_GREATER:
+        return intArgInstruction("JUMP_SINGLE_GREATER", vm, offset);
+    case CODE_OFFSET_SINGLE_EQ:
+        return intArgInstruction("OFFSET_SINGLE_EQ", vm, offset);
+    case CODE_OFFSET_SINGLE_LESS:
+        return intArgInstruction("OFFSET_SINGLE_LESS", vm, offset);
+    case CODE_OFFSET_SINGLE_GREATER:
+        return intArgInstruction("OFFSET_SINGLE_GREATER", vm, offset);
+    case CODE_JUMP_DOUBLE_EQ:
+        return intArgInstruction("JUMP_DOUBLE_EQ", vm, offset);
+    case CODE_JUMP_DOUBLE_LESS:
+        return intArgInstruction("JUMP_DOUBLE_LESS", vm, offset);
+    case CODE_JUMP_DOUBLE_GREATER:
+        return intArgInstruction("JUMP_DOUBLE_GREATER", vm, offset);
+    case CODE_OFFSET_DOUBLE_EQ:
+        return intArgInstruction("OFFSET_DOUBLE_EQ", vm, offset);
+    case CODE_OFFSET_DOUBLE_LESS:
+        return intArgInstruction("OFFSET_DOUBLE_LESS", vm, offset);
+    case CODE_OFFSET_DOUBLE_GREATER:
+        return intArgInstruction("OFFSET_DOUBLE_GREATER", vm, offset);
     case CODE_CLOSURE:
         return closureInstruction("CLOSURE", vm, offset);
     case CODE_RECURSIVE:
@@ -417,6 +460,20 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return simpleInstruction("THREAD_JOIN", offset);
     case CODE_THREAD_EQUAL:
         return simpleInstruction("THREAD_EQUAL", offset);
+    case CODE_CHANNEL_NEW:
+        return simpleInstruction("CHANNEL_NEW", offset);
+    case CODE_CHANNEL_SEND:
+        return simpleInstruction("CHANNEL_SEND", offset);
+    case CODE_CHANNEL_RECV:
+        return simpleInstruction("CHANNEL_RECV", offset);
+    case CODE_CHANNEL_TRY_RECV:
+        return simpleInstruction("CHANNEL_TRY_RECV", offset);
+    case CODE_CHANNEL_CLOSE:
+        return simpleInstruction("CHANNEL_CLOSE", offset);
+    case CODE_CHANNEL_SELECT:
+        return byteArgInstruction("CHANNEL_SELECT", vm, offset);
+    case CODE_AWAIT:
+        return simpleInstruction("AWAIT", offset);
     case CODE_ZAP:
         return simpleInstruction("ZAP", offset);
     case CODE_DUP:
@@ -446,6 +503,12 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return simpleInstruction("GETREF", offset);
     case CODE_PUTREF:
         return simpleInstruction("PUTREF", offset);
+    case CODE_REF_SWAP:
+        return simpleInstruction("REF_SWAP", offset);
+    case CODE_REF_CAS:
+        return byteArgInstruction("REF_CAS", vm, offset);
+    case CODE_REF_FETCH_ADD:
+        return byteArgInstruction("REF_FETCH_ADD", vm, offset);
     case CODE_CONSTRUCT: {
         uint8_t* code = vm->code.data;
         offset += 1;
@@ -475,10 +538,14 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return intArgInstruction("RECORD_RESTRICT", vm, offset);
     case CODE_RECORD_UPDATE:
         return intArgInstruction("RECORD_UPDATE", vm, offset);
+    case CODE_RECORD_UPDATE_REUSE:
+        return intArgInstruction("RECORD_UPDATE_REUSE", vm, offset);
     case CODE_VARIANT:
         return intArgInstruction("VARIANT", vm, offset);
     case CODE_EMBED:
         return intArgInstruction("EMBED", vm, offset);
+    case CODE_EMBED_REUSE:
+        return intArgInstruction("EMBED_REUSE", vm, offset);
     case CODE_IS_CASE:
         return intArgInstruction("IS_CASE", vm, offset);
     case CODE_JUMP_CASE:
@@ -497,6 +564,8 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return simpleInstruction("LIST_IS_EMPTY", offset);
     case CODE_LIST_APPEND:
         return simpleInstruction("LIST_APPEND", offset);
+    case CODE_LIST_APPEND_REUSE:
+        return simpleInstruction("LIST_APPEND_REUSE", offset);
     case CODE_ARRAY_NIL:
         return simpleInstruction("ARRAY_NIL", offset);
     case CODE_ARRAY_FILL:
@@ -513,6 +582,12 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return simpleInstruction("ARRAY_COPY", offset);
     case CODE_ARRAY_CONCAT:
         return simpleInstruction("ARRAY_CONCAT", offset);
+    case CODE_ARRAY_CONCAT_REUSE:
+        return simpleInstruction("ARRAY_CONCAT_REUSE", offset);
+    case CODE_ARRAY_PAR_MAP:
+        return simpleInstruction("ARRAY_PAR_MAP", offset);
+    case CODE_ARRAY_PAR_REDUCE:
+        return simpleInstruction("ARRAY_PAR_REDUCE", offset);
     case CODE_ARRAY_SLICE:
         return simpleInstruction("ARRAY_SLICE", offset);
     case CODE_SUBSLICE:
@@ -541,6 +616,8 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return simpleInstruction("BYTE_ARRAY_COPY", offset);
     case CODE_BYTE_ARRAY_CONCAT:
         return simpleInstruction("BYTE_ARRAY_CONCAT", offset);
+    case CODE_BYTE_ARRAY_CONCAT_REUSE:
+        return simpleInstruction("BYTE_ARRAY_CONCAT_REUSE", offset);
     case CODE_BYTE_ARRAY_SLICE:
         return simpleInstruction("BYTE_ARRAY_SLICE", offset);
     case CODE_BYTE_SUBSLICE:
@@ -553,8 +630,66 @@ int disassembleInstruction(MochiVM* vm, int offset) {
         return simpleInstruction("BYTE_SLICE_LENGTH", offset);
     case CODE_BYTE_SLICE_COPY:
         return simpleInstruction("BYTE_SLICE_COPY", offset);
+    case CODE_BYTES_INDEX_OF:
+        return simpleInstruction("BYTES_INDEX_OF", offset);
+    case CODE_BYTES_COUNT:
+        return simpleInstruction("BYTES_COUNT", offset);
+    case CODE_BYTES_COMPARE:
+        return simpleInstruction("BYTES_COMPARE", offset);
+    case CODE_BYTES_EQUAL:
+        return simpleInstruction("BYTES_EQUAL", offset);
+    case CODE_BYTES_HASH:
+        return simpleInstruction("BYTES_HASH", offset);
+    case CODE_VECTOR_NIL:
+        return simpleInstruction("VECTOR_NIL", offset);
+    case CODE_VECTOR_SNOC:
+        return simpleInstruction("VECTOR_SNOC", offset);
+    case CODE_VECTOR_GET_AT:
+        return simpleInstruction("VECTOR_GET_AT", offset);
+    case CODE_VECTOR_SET_AT:
+        return simpleInstruction("VECTOR_SET_AT", offset);
+    case CODE_VECTOR_LENGTH:
+        return simpleInstruction("VECTOR_LENGTH", offset);
+    case CODE_VECTOR_CONCAT:
+        return simpleInstruction("VECTOR_CONCAT", offset);
+    case CODE_VECTOR_SLICE:
+        return simpleInstruction("VECTOR_SLICE", offset);
+    case CODE_ARRAY_TO_VECTOR:
+        return simpleInstruction("ARRAY_TO_VECTOR", offset);
+    case CODE_VECTOR_TO_ARRAY:
+        return simpleInstruction("VECTOR_TO_ARRAY", offset);
+    case CODE_NUM_ARRAY_FILL:
+        return byteArgInstruction("NUM_ARRAY_FILL", vm, offset);
+    case CODE_NUM_ARRAY_GET_AT:
+        return simpleInstruction("NUM_ARRAY_GET_AT", offset);
+    case CODE_NUM_ARRAY_SET_AT:
+        return simpleInstruction("NUM_ARRAY_SET_AT", offset);
+    case CODE_NUM_ARRAY_LENGTH:
+        return simpleInstruction("NUM_ARRAY_LENGTH", offset);
+    case CODE_NUM_ARRAY_SLICE:
+        return simpleInstruction("NUM_ARRAY_SLICE", offset);
+    case CODE_NUM_ARRAY_ADD:
+        return simpleInstruction("NUM_ARRAY_ADD", offset);
+    case CODE_NUM_ARRAY_MUL:
+        return simpleInstruction("NUM_ARRAY_MUL", offset);
+    case CODE_NUM_ARRAY_FMA:
+        return simpleInstruction("NUM_ARRAY_FMA", offset);
+    case CODE_NUM_ARRAY_SUM:
+        return simpleInstruction("NUM_ARRAY_SUM", offset);
+    case CODE_NUM_ARRAY_MIN:
+        return simpleInstruction("NUM_ARRAY_MIN", offset);
+    case CODE_NUM_ARRAY_MAX:
+        return simpleInstruction("NUM_ARRAY_MAX", offset);
+    case CODE_NUM_ARRAY_DOT:
+        return simpleInstruction("NUM_ARRAY_DOT", offset);
+    case CODE_NUM_ARRAY_EQ:
+        return simpleInstruction("NUM_ARRAY_EQ", offset);
+    case CODE_NUM_ARRAY_LESS:
+        return simpleInstruction("NUM_ARRAY_LESS", offset);
     case CODE_STRING_CONCAT:
         return simpleInstruction("STRING_CONCAT", offset);
+    case CODE_STRING_CONCAT_REUSE:
+        return simpleInstruction("STRING_CONCAT_REUSE", offset);
     case CODE_PRINT:
         return simpleInstruction("PRINT", offset);
     default:
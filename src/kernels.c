@@ -0,0 +1,601 @@
+#include <string.h>
+
+#include "kernels.h"
+
+// Every kernel is defined once per element type by the *_TYPES macros below, which pass
+// a kernel definition macro the name of the loop, the C type of its elements and the
+// type its arithmetic is done in, which keeps small unsigned integers from being
+// promoted to int and overflowing. The vector loops are also passed the vector type
+// for the elements, an unsigned integer vector type of the same lane width used to
+// select between lanes, and the attributes the loop is compiled with.
+
+#define WRAPPING_TYPES(kernel, name, suffix, target, op)                                                               \
+    kernel(name##U8##suffix, uint8_t, uint32_t, VecU8, VecU8, target, op)                                              \
+    kernel(name##U16##suffix, uint16_t, uint32_t, VecU16, VecU16, target, op)                                          \
+    kernel(name##U32##suffix, uint32_t, uint32_t, VecU32, VecU32, target, op)                                          \
+    kernel(name##U64##suffix, uint64_t, uint64_t, VecU64, VecU64, target, op)                                          \
+    kernel(name##F32##suffix, float, float, VecF32, VecU32, target, op)                                                \
+    kernel(name##F64##suffix, double, double, VecF64, VecU64, target, op)
+
+#define SIGNED_TYPES(kernel, name, suffix, target, op)                                                                 \
+    WRAPPING_TYPES(kernel, name, suffix, target, op)                                                                   \
+    kernel(name##I8##suffix, int8_t, int32_t, VecI8, VecU8, target, op)                                                \
+    kernel(name##I16##suffix, int16_t, int32_t, VecI16, VecU16, target, op)                                            \
+    kernel(name##I32##suffix, int32_t, int64_t, VecI32, VecU32, target, op)                                            \
+    kernel(name##I64##suffix, int64_t, int64_t, VecI64, VecU64, target, op)
+
+// Rows of a kernel table. Wrapping rows use the unsigned loops for signed elements too.
+#define WRAPPING_ROW(name, suffix)                                                                                     \
+    {                                                                                                                  \
+        NULL, name##U8##suffix, name##U8##suffix, name##U16##suffix, name##U16##suffix, name##U32##suffix,             \
+            name##U32##suffix, name##U64##suffix, name##U64##suffix, name##F32##suffix, name##F64##suffix              \
+    }
+#define SIGNED_ROW(name, suffix)                                                                                       \
+    {                                                                                                                  \
+        NULL, name##I8##suffix, name##U8##suffix, name##I16##suffix, name##U16##suffix, name##I32##suffix,             \
+            name##U32##suffix, name##I64##suffix, name##U64##suffix, name##F32##suffix, name##F64##suffix              \
+    }
+
+#define DEFINE_KERNELS(define, suffix, target)                                                                         \
+    WRAPPING_TYPES(define##_MAP, add, suffix, target, +)                                                               \
+    WRAPPING_TYPES(define##_MAP, mul, suffix, target, *)                                                               \
+    WRAPPING_TYPES(define##_FMA, fma, suffix, target, +)                                                               \
+    WRAPPING_TYPES(define##_SUM, sum, suffix, target, +)                                                               \
+    SIGNED_TYPES(define##_PICK, min, suffix, target, <)                                                                \
+    SIGNED_TYPES(define##_PICK, max, suffix, target, >)                                                                \
+    WRAPPING_TYPES(define##_DOT, dot, suffix, target, +)                                                               \
+    WRAPPING_TYPES(define##_MASK, eq, suffix, target, ==)                                                              \
+    SIGNED_TYPES(define##_MASK, less, suffix, target, <)
+
+#define KERNEL_TABLE(label, suffix)                                                                                    \
+    {                                                                                                                  \
+        label, WRAPPING_ROW(add, suffix), WRAPPING_ROW(mul, suffix), WRAPPING_ROW(fma, suffix),                        \
+            WRAPPING_ROW(sum, suffix), SIGNED_ROW(min, suffix), SIGNED_ROW(max, suffix), WRAPPING_ROW(dot, suffix),    \
+            WRAPPING_ROW(eq, suffix), SIGNED_ROW(less, suffix)                                                         \
+    }
+
+#define SCALAR_MAP(name, type, wide, vec, bits, target, op)                                                            \
+    static void name(void* dest, const void* a, const void* b, int count) {                                            \
+        type* d = dest;                                                                                                \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        for (int i = 0; i < count; i++) {                                                                              \
+            d[i] = (type)((wide)x[i] op y[i]);                                                                         \
+        }                                                                                                              \
+    }
+
+#define SCALAR_FMA(name, type, wide, vec, bits, target, op)                                                            \
+    static void name(void* dest, const void* a, const void* b, const void* c, int count) {                             \
+        type* d = dest;                                                                                                \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        const type* z = c;                                                                                             \
+        for (int i = 0; i < count; i++) {                                                                              \
+            d[i] = (type)((wide)x[i] * y[i] op z[i]);                                                                  \
+        }                                                                                                              \
+    }
+
+#define SCALAR_SUM(name, type, wide, vec, bits, target, op)                                                            \
+    static void name(void* result, const void* a, int count) {                                                         \
+        const type* x = a;                                                                                             \
+        wide sum = 0;                                                                                                  \
+        for (int i = 0; i < count; i++) {                                                                              \
+            sum = sum op x[i];                                                                                         \
+        }                                                                                                              \
+        *(type*)result = (type)sum;                                                                                    \
+    }
+
+#define SCALAR_PICK(name, type, wide, vec, bits, target, op)                                                           \
+    static void name(void* result, const void* a, int count) {                                                         \
+        const type* x = a;                                                                                             \
+        type best = x[0];                                                                                              \
+        for (int i = 1; i < count; i++) {                                                                              \
+            if (x[i] op best) {                                                                                        \
+                best = x[i];                                                                                           \
+            }                                                                                                          \
+        }                                                                                                              \
+        *(type*)result = best;                                                                                         \
+    }
+
+#define SCALAR_DOT(name, type, wide, vec, bits, target, op)                                                            \
+    static void name(void* result, const void* a, const void* b, int count) {                                          \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        wide sum = 0;                                                                                                  \
+        for (int i = 0; i < count; i++) {                                                                              \
+            sum = sum op (wide)x[i] * y[i];                                                                            \
+        }                                                                                                              \
+        *(type*)result = (type)sum;                                                                                    \
+    }
+
+#define SCALAR_MASK(name, type, wide, vec, bits, target, op)                                                           \
+    static void name(uint8_t* dest, const void* a, const void* b, int count) {                                         \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        for (int i = 0; i < count; i++) {                                                                              \
+            dest[i] = x[i] op y[i];                                                                                    \
+        }                                                                                                              \
+    }
+
+DEFINE_KERNELS(SCALAR, Scalar, )
+
+const NumKernels mochiScalarKernels = KERNEL_TABLE("scalar", Scalar);
+
+// The byte hash runs sixteen 32-bit lanes over each 64 byte block, with the round of xxHash32,
+// then folds the lanes and any bytes left over into a 64-bit hash. Inputs shorter than a block
+// skip the lanes entirely.
+
+#define HASH_LANES      16
+#define HASH_BLOCK      (HASH_LANES * 4)
+#define HASH_PRIME32_1  0x9E3779B1u
+#define HASH_PRIME32_2  0x85EBCA77u
+#define HASH_PRIME64_1  0x9E3779B97F4A7C15ull
+#define HASH_PRIME64_2  0xC2B2AE3D27D4EB4Full
+#define ROTL32(x, bits) (((x) << (bits)) | ((x) >> (32 - (bits))))
+#define ROTL64(x, bits) (((x) << (bits)) | ((x) >> (64 - (bits))))
+
+static void seedHashLanes(uint32_t* lanes) {
+    for (int lane = 0; lane < HASH_LANES; lane++) {
+        lanes[lane] = HASH_PRIME32_1 + (uint32_t)lane * HASH_PRIME32_2;
+    }
+}
+
+// Finishes a hash of the [count] bytes at [a], of which the lanes have taken in the first [i].
+static uint64_t finishHash(const uint8_t* a, int count, const uint32_t* lanes, int i) {
+    uint64_t hash = (uint64_t)count * HASH_PRIME64_1;
+    if (i > 0) {
+        for (int lane = 0; lane < HASH_LANES; lane++) {
+            hash = ROTL64(hash ^ lanes[lane] * HASH_PRIME64_2, 31) * HASH_PRIME64_1;
+        }
+    }
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, a + i, 8);
+        hash = ROTL64(hash ^ word * HASH_PRIME64_2, 31) * HASH_PRIME64_1;
+    }
+    for (; i < count; i++) {
+        hash = ROTL64(hash ^ a[i] * HASH_PRIME64_1, 11) * HASH_PRIME64_2;
+    }
+    // The finalizer of MurmurHash3, so that every input bit affects every output bit.
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int findScalar(const uint8_t* a, int count, uint8_t byte) {
+    for (int i = 0; i < count; i++) {
+        if (a[i] == byte) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int searchScalar(const uint8_t* a, int count, const uint8_t* needle, int needleCount) {
+    for (int i = 0; i + needleCount <= count; i++) {
+        if (memcmp(a + i, needle, needleCount) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int countScalar(const uint8_t* a, int count, uint8_t byte) {
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += a[i] == byte;
+    }
+    return total;
+}
+
+static uint64_t hashScalar(const uint8_t* a, int count) {
+    uint32_t lanes[HASH_LANES];
+    seedHashLanes(lanes);
+    int i = 0;
+    for (; i + HASH_BLOCK <= count; i += HASH_BLOCK) {
+        for (int lane = 0; lane < HASH_LANES; lane++) {
+            uint32_t word;
+            memcpy(&word, a + i + lane * 4, 4);
+            lanes[lane] += word * HASH_PRIME32_2;
+            lanes[lane] = ROTL32(lanes[lane], 13) * HASH_PRIME32_1;
+        }
+    }
+    return finishHash(a, count, lanes, i);
+}
+
+const ByteKernels mochiScalarByteKernels = { "scalar", findScalar, searchScalar, countScalar, hashScalar };
+
+#if MOCHIVM_VECTOR_KERNELS
+
+// The vector loops work on 32 bytes at a time, which is one AVX2 register or two SSE2
+// registers. Elements are copied in and out with memcpy, so the arrays need no particular
+// alignment. The elements left over at the end of an array go through the same scalar
+// step as the reference loops.
+
+#define VECTOR_BYTES 32
+#define LANES(type)  ((int)(VECTOR_BYTES / sizeof(type)))
+
+typedef uint8_t VecU8 __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint16_t VecU16 __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint32_t VecU32 __attribute__((vector_size(VECTOR_BYTES)));
+typedef uint64_t VecU64 __attribute__((vector_size(VECTOR_BYTES)));
+typedef int8_t VecI8 __attribute__((vector_size(VECTOR_BYTES)));
+typedef int16_t VecI16 __attribute__((vector_size(VECTOR_BYTES)));
+typedef int32_t VecI32 __attribute__((vector_size(VECTOR_BYTES)));
+typedef int64_t VecI64 __attribute__((vector_size(VECTOR_BYTES)));
+typedef float VecF32 __attribute__((vector_size(VECTOR_BYTES)));
+typedef double VecF64 __attribute__((vector_size(VECTOR_BYTES)));
+
+#define LOAD(vector, from) memcpy(&(vector), (from), VECTOR_BYTES)
+#define STORE(to, vector)  memcpy((to), &(vector), VECTOR_BYTES)
+
+#define VECTOR_MAP(name, type, wide, vec, bits, target, op)                                                            \
+    target static void name(void* dest, const void* a, const void* b, int count) {                                     \
+        type* d = dest;                                                                                                \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        int i = 0;                                                                                                     \
+        for (; i + LANES(type) <= count; i += LANES(type)) {                                                           \
+            vec vx, vy;                                                                                                \
+            LOAD(vx, x + i);                                                                                           \
+            LOAD(vy, y + i);                                                                                           \
+            vx = vx op vy;                                                                                             \
+            STORE(d + i, vx);                                                                                          \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            d[i] = (type)((wide)x[i] op y[i]);                                                                         \
+        }                                                                                                              \
+    }
+
+#define VECTOR_FMA(name, type, wide, vec, bits, target, op)                                                            \
+    target static void name(void* dest, const void* a, const void* b, const void* c, int count) {                      \
+        type* d = dest;                                                                                                \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        const type* z = c;                                                                                             \
+        int i = 0;                                                                                                     \
+        for (; i + LANES(type) <= count; i += LANES(type)) {                                                           \
+            vec vx, vy, vz;                                                                                            \
+            LOAD(vx, x + i);                                                                                           \
+            LOAD(vy, y + i);                                                                                           \
+            LOAD(vz, z + i);                                                                                           \
+            vx = vx * vy op vz;                                                                                        \
+            STORE(d + i, vx);                                                                                          \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            d[i] = (type)((wide)x[i] * y[i] op z[i]);                                                                  \
+        }                                                                                                              \
+    }
+
+// Sums and dot products keep four accumulators, so consecutive additions do not wait on
+// each other.
+#define VECTOR_SUM(name, type, wide, vec, bits, target, op)                                                            \
+    target static void name(void* result, const void* a, int count) {                                                  \
+        const type* x = a;                                                                                             \
+        vec s0 = {0}, s1 = {0}, s2 = {0}, s3 = {0};                                                                    \
+        int i = 0;                                                                                                     \
+        for (; i + 4 * LANES(type) <= count; i += 4 * LANES(type)) {                                                   \
+            vec v0, v1, v2, v3;                                                                                        \
+            LOAD(v0, x + i);                                                                                           \
+            LOAD(v1, x + i + LANES(type));                                                                             \
+            LOAD(v2, x + i + 2 * LANES(type));                                                                         \
+            LOAD(v3, x + i + 3 * LANES(type));                                                                         \
+            s0 = s0 op v0;                                                                                             \
+            s1 = s1 op v1;                                                                                             \
+            s2 = s2 op v2;                                                                                             \
+            s3 = s3 op v3;                                                                                             \
+        }                                                                                                              \
+        for (; i + LANES(type) <= count; i += LANES(type)) {                                                           \
+            vec v0;                                                                                                    \
+            LOAD(v0, x + i);                                                                                           \
+            s0 = s0 op v0;                                                                                             \
+        }                                                                                                              \
+        s0 = (s0 op s1) op (s2 op s3);                                                                                 \
+        wide sum = 0;                                                                                                  \
+        for (int lane = 0; lane < LANES(type); lane++) {                                                               \
+            sum = sum op s0[lane];                                                                                     \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            sum = sum op x[i];                                                                                         \
+        }                                                                                                              \
+        *(type*)result = (type)sum;                                                                                    \
+    }
+
+// Lanes are selected with masks rather than the ?: operator, which C does not allow on
+// vectors.
+#define VECTOR_PICK(name, type, wide, vec, bits, target, op)                                                           \
+    target static void name(void* result, const void* a, int count) {                                                  \
+        const type* x = a;                                                                                             \
+        type best = x[0];                                                                                              \
+        int i = 1;                                                                                                     \
+        if (count >= LANES(type)) {                                                                                    \
+            vec lanes;                                                                                                 \
+            LOAD(lanes, x);                                                                                            \
+            for (i = LANES(type); i + LANES(type) <= count; i += LANES(type)) {                                        \
+                vec v;                                                                                                 \
+                LOAD(v, x + i);                                                                                        \
+                bits take = (bits)(v op lanes);                                                                        \
+                lanes = (vec)(((bits)v & take) | ((bits)lanes & ~take));                                               \
+            }                                                                                                          \
+            best = lanes[0];                                                                                           \
+            for (int lane = 1; lane < LANES(type); lane++) {                                                           \
+                if (lanes[lane] op best) {                                                                             \
+                    best = lanes[lane];                                                                                \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            if (x[i] op best) {                                                                                        \
+                best = x[i];                                                                                           \
+            }                                                                                                          \
+        }                                                                                                              \
+        *(type*)result = best;                                                                                         \
+    }
+
+#define VECTOR_DOT(name, type, wide, vec, bits, target, op)                                                            \
+    target static void name(void* result, const void* a, const void* b, int count) {                                   \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        vec s0 = {0}, s1 = {0}, s2 = {0}, s3 = {0};                                                                    \
+        int i = 0;                                                                                                     \
+        for (; i + 4 * LANES(type) <= count; i += 4 * LANES(type)) {                                                   \
+            vec x0, x1, x2, x3, y0, y1, y2, y3;                                                                        \
+            LOAD(x0, x + i);                                                                                           \
+            LOAD(x1, x + i + LANES(type));                                                                             \
+            LOAD(x2, x + i + 2 * LANES(type));                                                                         \
+            LOAD(x3, x + i + 3 * LANES(type));                                                                         \
+            LOAD(y0, y + i);                                                                                           \
+            LOAD(y1, y + i + LANES(type));                                                                             \
+            LOAD(y2, y + i + 2 * LANES(type));                                                                         \
+            LOAD(y3, y + i + 3 * LANES(type));                                                                         \
+            s0 = s0 op x0 * y0;                                                                                        \
+            s1 = s1 op x1 * y1;                                                                                        \
+            s2 = s2 op x2 * y2;                                                                                        \
+            s3 = s3 op x3 * y3;                                                                                        \
+        }                                                                                                              \
+        for (; i + LANES(type) <= count; i += LANES(type)) {                                                           \
+            vec x0, y0;                                                                                                \
+            LOAD(x0, x + i);                                                                                           \
+            LOAD(y0, y + i);                                                                                           \
+            s0 = s0 op x0 * y0;                                                                                        \
+        }                                                                                                              \
+        s0 = (s0 op s1) op (s2 op s3);                                                                                 \
+        wide sum = 0;                                                                                                  \
+        for (int lane = 0; lane < LANES(type); lane++) {                                                               \
+            sum = sum op s0[lane];                                                                                     \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            sum = sum op (wide)x[i] * y[i];                                                                            \
+        }                                                                                                              \
+        *(type*)result = (type)sum;                                                                                    \
+    }
+
+#define VECTOR_MASK(name, type, wide, vec, bits, target, op)                                                           \
+    target static void name(uint8_t* dest, const void* a, const void* b, int count) {                                  \
+        const type* x = a;                                                                                             \
+        const type* y = b;                                                                                             \
+        int i = 0;                                                                                                     \
+        for (; i + LANES(type) <= count; i += LANES(type)) {                                                           \
+            vec vx, vy;                                                                                                \
+            LOAD(vx, x + i);                                                                                           \
+            LOAD(vy, y + i);                                                                                           \
+            bits holds = (bits)(vx op vy);                                                                             \
+            for (int lane = 0; lane < LANES(type); lane++) {                                                           \
+                dest[i + lane] = (uint8_t)(holds[lane] & 1);                                                           \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            dest[i] = x[i] op y[i];                                                                                    \
+        }                                                                                                              \
+    }
+
+// The byte loops compare a block of bytes at a time and only look at single bytes once a
+// block holds a hit. A block is tested for hits by reading its mask as 64-bit words, and the
+// first hit is found from the lowest set byte of the first word that has one.
+#define HAS_HIT(mask) (((VecU64)(mask))[0] | ((VecU64)(mask))[1] | ((VecU64)(mask))[2] | ((VecU64)(mask))[3])
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LOWEST_BYTE(word) (__builtin_clzll(word) / 8)
+#else
+#define LOWEST_BYTE(word) (__builtin_ctzll(word) / 8)
+#endif
+
+#define RETURN_FIRST_HIT(mask, at)                                                                                     \
+    for (int word = 0; word < LANES(uint64_t); word++) {                                                               \
+        uint64_t bits = ((VecU64)(mask))[word];                                                                        \
+        if (bits != 0) {                                                                                               \
+            return (at) + word * 8 + LOWEST_BYTE(bits);                                                                \
+        }                                                                                                              \
+    }
+
+#define VECTOR_FIND(name, target)                                                                                      \
+    target static int name(const uint8_t* a, int count, uint8_t byte) {                                               \
+        int i = 0;                                                                                                     \
+        for (; i + 2 * VECTOR_BYTES <= count; i += 2 * VECTOR_BYTES) {                                                 \
+            VecU8 v0, v1;                                                                                              \
+            LOAD(v0, a + i);                                                                                           \
+            LOAD(v1, a + i + VECTOR_BYTES);                                                                            \
+            VecU8 h0 = (VecU8)(v0 == byte);                                                                            \
+            VecU8 h1 = (VecU8)(v1 == byte);                                                                            \
+            if (HAS_HIT(h0 | h1)) {                                                                                    \
+                RETURN_FIRST_HIT(h0, i);                                                                               \
+                RETURN_FIRST_HIT(h1, i + VECTOR_BYTES);                                                                \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; i + VECTOR_BYTES <= count; i += VECTOR_BYTES) {                                                         \
+            VecU8 v0;                                                                                                  \
+            LOAD(v0, a + i);                                                                                           \
+            VecU8 h0 = (VecU8)(v0 == byte);                                                                            \
+            RETURN_FIRST_HIT(h0, i);                                                                                   \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            if (a[i] == byte) {                                                                                        \
+                return i;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+        return -1;                                                                                                     \
+    }
+
+// Substring search compares the first and last byte of the needle against a block of
+// candidate positions at once, and only compares the whole needle where both match.
+#define VECTOR_SEARCH(name, target)                                                                                    \
+    target static int name(const uint8_t* a, int count, const uint8_t* needle, int needleCount) {                      \
+        if (needleCount == 0) {                                                                                        \
+            return 0;                                                                                                  \
+        }                                                                                                              \
+        uint8_t first = needle[0];                                                                                     \
+        uint8_t last = needle[needleCount - 1];                                                                        \
+        int end = count - needleCount + 1;                                                                             \
+        int i = 0;                                                                                                     \
+        for (; i + VECTOR_BYTES <= end; i += VECTOR_BYTES) {                                                           \
+            VecU8 vf, vl;                                                                                              \
+            LOAD(vf, a + i);                                                                                           \
+            LOAD(vl, a + i + needleCount - 1);                                                                         \
+            VecU8 hits = (VecU8)(vf == first) & (VecU8)(vl == last);                                                   \
+            if (!HAS_HIT(hits)) {                                                                                      \
+                continue;                                                                                              \
+            }                                                                                                          \
+            for (int lane = 0; lane < VECTOR_BYTES; lane++) {                                                          \
+                if (hits[lane] && memcmp(a + i + lane, needle, needleCount) == 0) {                                    \
+                    return i + lane;                                                                                   \
+                }                                                                                                      \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; i < end; i++) {                                                                                         \
+            if (a[i] == first && memcmp(a + i, needle, needleCount) == 0) {                                            \
+                return i;                                                                                              \
+            }                                                                                                          \
+        }                                                                                                              \
+        return -1;                                                                                                     \
+    }
+
+// Each lane of the counter subtracts the all ones mask of a hit, and is added up before it
+// can count past 255.
+#define VECTOR_COUNT(name, target)                                                                                     \
+    target static int name(const uint8_t* a, int count, uint8_t byte) {                                                \
+        int total = 0;                                                                                                 \
+        int i = 0;                                                                                                     \
+        while (i + VECTOR_BYTES <= count) {                                                                            \
+            VecU8 counts = {0};                                                                                        \
+            for (int block = 0; block < 255 && i + VECTOR_BYTES <= count; block++, i += VECTOR_BYTES) {                \
+                VecU8 v;                                                                                               \
+                LOAD(v, a + i);                                                                                        \
+                counts -= (VecU8)(v == byte);                                                                          \
+            }                                                                                                          \
+            for (int lane = 0; lane < VECTOR_BYTES; lane++) {                                                          \
+                total += counts[lane];                                                                                 \
+            }                                                                                                          \
+        }                                                                                                              \
+        for (; i < count; i++) {                                                                                       \
+            total += a[i] == byte;                                                                                     \
+        }                                                                                                              \
+        return total;                                                                                                  \
+    }
+
+#define VECTOR_HASH(name, target)                                                                                      \
+    target static uint64_t name(const uint8_t* a, int count) {                                                         \
+        uint32_t lanes[HASH_LANES];                                                                                    \
+        seedHashLanes(lanes);                                                                                          \
+        int i = 0;                                                                                                     \
+        if (count >= HASH_BLOCK) {                                                                                     \
+            VecU32 l0, l1;                                                                                             \
+            LOAD(l0, lanes);                                                                                           \
+            LOAD(l1, lanes + LANES(uint32_t));                                                                         \
+            for (; i + HASH_BLOCK <= count; i += HASH_BLOCK) {                                                         \
+                VecU32 v0, v1;                                                                                         \
+                LOAD(v0, a + i);                                                                                       \
+                LOAD(v1, a + i + VECTOR_BYTES);                                                                        \
+                l0 += v0 * HASH_PRIME32_2;                                                                             \
+                l1 += v1 * HASH_PRIME32_2;                                                                             \
+                l0 = ROTL32(l0, 13) * HASH_PRIME32_1;                                                                  \
+                l1 = ROTL32(l1, 13) * HASH_PRIME32_1;                                                                  \
+            }                                                                                                          \
+            STORE(lanes, l0);                                                                                          \
+            STORE(lanes + LANES(uint32_t), l1);                                                                        \
+        }                                                                                                              \
+        return finishHash(a, count, lanes, i);                                                                         \
+    }
+
+#define DEFINE_BYTE_KERNELS(define, suffix, target)                                                                    \
+    define##_FIND(find##suffix, target)                                                                                \
+    define##_SEARCH(search##suffix, target)                                                                            \
+    define##_COUNT(count##suffix, target)                                                                              \
+    define##_HASH(hash##suffix, target)
+
+#define BYTE_KERNEL_TABLE(label, suffix)                                                                               \
+    { label, find##suffix, search##suffix, count##suffix, hash##suffix }
+
+DEFINE_KERNELS(VECTOR, Vector, )
+DEFINE_BYTE_KERNELS(VECTOR, Vector, )
+
+#if defined(__x86_64__)
+static const NumKernels vectorKernels = KERNEL_TABLE("sse2", Vector);
+static const ByteKernels vectorByteKernels = BYTE_KERNEL_TABLE("sse2", Vector);
+#else
+static const NumKernels vectorKernels = KERNEL_TABLE("vector", Vector);
+static const ByteKernels vectorByteKernels = BYTE_KERNEL_TABLE("vector", Vector);
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOCHIVM_AVX2_KERNELS 1
+
+DEFINE_KERNELS(VECTOR, Avx2, __attribute__((target("avx2,fma"))))
+DEFINE_BYTE_KERNELS(VECTOR, Avx2, __attribute__((target("avx2"))))
+
+static const NumKernels avx2Kernels = KERNEL_TABLE("avx2", Avx2);
+static const ByteKernels avx2ByteKernels = BYTE_KERNEL_TABLE("avx2", Avx2);
+#endif
+
+#endif
+
+const NumKernels* mochiNumKernels(void) {
+#if MOCHIVM_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return &avx2Kernels;
+    }
+#endif
+#if MOCHIVM_VECTOR_KERNELS
+    return &vectorKernels;
+#else
+    return &mochiScalarKernels;
+#endif
+}
+
+const ByteKernels* mochiByteKernels(void) {
+#if MOCHIVM_AVX2_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2ByteKernels;
+    }
+#endif
+#if MOCHIVM_VECTOR_KERNELS
+    return &vectorByteKernels;
+#else
+    return &mochiScalarByteKernels;
+#endif
+}
+
+int mochiNumElemSize(ValueType type) {
+    switch (type) {
+    case VAL_I8:
+    case VAL_U8:
+        return 1;
+    case VAL_I16:
+    case VAL_U16:
+        return 2;
+    case VAL_I32:
+    case VAL_U32:
+    case VAL_SINGLE:
+        return 4;
+    case VAL_I64:
+    case VAL_U64:
+    case VAL_DOUBLE:
+        return 8;
+    case VAL_BOOL:
+        break;
+    }
+    UNREACHABLE();
+    return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef mochivm_kernels_h
+#define mochivm_kernels_h
+
+#include "common.h"
+#include "value.h"
+
+// The loops behind the bulk numeric array instructions. Each works over raw runs of
+// elements of a single numeric type, which may be unaligned, and never allocates.
+//
+// Integer sums and products wrap around, so the signed integer types share the loops
+// of the unsigned types of the same width. Sums and dot products of floating point
+// numbers are accumulated in several lanes at once by the vector loops, so they may
+// round differently than a sum taken in order. The minimum and maximum of an array
+// holding NaN are unspecified.
+
+// Writes the elementwise result of an operation on [a] and [b] to [dest].
+typedef void (*MapKernel)(void* dest, const void* a, const void* b, int count);
+// Writes [a] * [b] + [c] to [dest], fused where the processor supports it.
+typedef void (*FmaKernel)(void* dest, const void* a, const void* b, const void* c, int count);
+// Writes a single element summarizing the [count] elements of [a] to [result].
+typedef void (*ReduceKernel)(void* result, const void* a, int count);
+// Writes the sum of the elementwise products of [a] and [b] to [result].
+typedef void (*DotKernel)(void* result, const void* a, const void* b, int count);
+// Writes 1 to [dest] where an elementwise comparison of [a] and [b] holds and 0 elsewhere.
+typedef void (*MaskKernel)(uint8_t* dest, const void* a, const void* b, int count);
+
+// One build of every kernel, indexed by the ValueType of the elements. The VAL_BOOL
+// entries are NULL.
+typedef struct {
+    const char* name;
+    MapKernel add[VAL_DOUBLE + 1];
+    MapKernel mul[VAL_DOUBLE + 1];
+    FmaKernel fma[VAL_DOUBLE + 1];
+    ReduceKernel sum[VAL_DOUBLE + 1];
+    ReduceKernel min[VAL_DOUBLE + 1];
+    ReduceKernel max[VAL_DOUBLE + 1];
+    DotKernel dot[VAL_DOUBLE + 1];
+    MaskKernel eq[VAL_DOUBLE + 1];
+    MaskKernel less[VAL_DOUBLE + 1];
+} NumKernels;
+
+// The plain scalar loops, which the vector loops are tested against.
+extern const NumKernels mochiScalarKernels;
+
+// Returns the fastest kernels the running processor supports.
+const NumKernels* mochiNumKernels(void);
+
+// Returns the size in bytes of an element of the numeric [type].
+int mochiNumElemSize(ValueType type);
+
+// The loops behind the BYTES_ instructions, which search, count and hash runs of bytes.
+typedef struct {
+    const char* name;
+    // Returns the index of the first [byte] among the [count] bytes at [a], or -1.
+    int (*find)(const uint8_t* a, int count, uint8_t byte);
+    // Returns the index of the first run of the [count] bytes at [a] that matches the
+    // [needleCount] bytes at [needle], or -1. An empty needle matches at index 0.
+    int (*search)(const uint8_t* a, int count, const uint8_t* needle, int needleCount);
+    // Returns how many of the [count] bytes at [a] are [byte].
+    int (*count)(const uint8_t* a, int count, uint8_t byte);
+    // Returns a hash of the [count] bytes at [a]. Every build computes the same hash, but
+    // words are read in machine byte order, so hashes differ between machines of different
+    // endianness.
+    uint64_t (*hash)(const uint8_t* a, int count);
+} ByteKernels;
+
+// The plain byte at a time loops, which the vector loops are tested against.
+extern const ByteKernels mochiScalarByteKernels;
+
+// Returns the fastest byte kernels the running processor supports.
+const ByteKernels* mochiByteKernels(void);
+
+#endif
@@ -6,12 +6,14 @@
 static void acquireLockSignalGc(MochiVM* vm) {
     int lockRes = mtx_trylock(&vm->allocLock);
     while (lockRes != thrd_success) {
-        PANIC_IF(lockRes == thrd_error, "Failed to acquire lock in an allocation.");
-        ObjFiber* fiber = mochiThreadCurrent(vm);
-        while (vm->collecting) {
-            fiber->isPausedForGc = true;
+        PANIC_IF(lockRes != thrd_error, "Failed to acquire lock in an allocation.");
+        // The holder may be collecting, which waits for this worker to pause.
+        Worker* worker = mochiWorkerCurrent(vm);
+        if (worker != NULL && vm->collecting) {
+            mochiWorkerWaitGc(vm, worker);
+        } else {
+            thrd_yield();
         }
-        fiber->isPausedForGc = false;
         lockRes = mtx_trylock(&vm->allocLock);
     }
 }
@@ -45,16 +47,23 @@ void* mochiReallocate(MochiVM* vm, void* memory, size_t oldSize, size_t newSize)
 #endif
 
     vm->bytesAllocated = newHeapSize;
+    if (memory == NULL && newSize > 0) {
+        vm->allocations += 1;
+    }
 
 #if MOCHIVM_DEBUG_GC_STRESS
     // Since collecting calls this function to free things, make sure we don't
     // recurse.
-    bool shouldGc = newSize > 0 && mochiThreadCount(vm) > 0;
+    bool shouldGc = newSize > 0 && vm->collectionDeferrals == 0 && mochiThreadCount(vm) > 0;
 #else
-    bool shouldGc = newSize > 0 && newHeapSize > vm->nextGC && mochiThreadCount(vm) > 0;
+    bool shouldGc =
+        newSize > 0 && newHeapSize > vm->nextGC && vm->collectionDeferrals == 0 && mochiThreadCount(vm) > 0;
 #endif
     if (shouldGc) {
-        ObjFiber* current = mochiThreadCurrent(vm);
+        Worker* current = mochiWorkerCurrent(vm);
+        if (current == NULL) {
+            PANIC("Current thread is not a MochiVM thread, but tried to be accessed as one.");
+        }
         current->isPausedForGc = true;
         mochiCollectGarbage(vm);
         current->isPausedForGc = false;
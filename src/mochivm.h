@@ -26,6 +26,9 @@
 #endif
 #endif
 
+// The value a fiber finishes with when one of its stacks would grow past the configured capacity.
+#define MOCHIVM_STACK_OVERFLOW (-2)
+
 // A single virtual machine for executing MochiVM byte code.
 //
 // MochiVM has no global state, so all state stored by a running interpreter lives
@@ -77,18 +80,39 @@ typedef struct {
     // errors.
     MochiVMErrorFn errorFn;
 
-    // The maximum number of values the VM will allow in a fiber's value stack.
-    // If zero, defaults to 128.
+    // The maximum number of values the VM will allow in a fiber's value stack,
+    // used when verification cannot bound the value stack depth of the code.
+    // Fiber stacks start small and grow up to this, and a fiber that needs more
+    // reports a stack overflow and finishes with [MOCHIVM_STACK_OVERFLOW].
+    // If zero, defaults to 65536.
     int valueStackCapacity;
 
-    // The maximum number of frames the VM will allow in a fiber's frame stack.
-    // If zero, defaults to 512.
+    // The maximum number of frames the VM will allow in a fiber's frame stack,
+    // used when verification cannot bound the frame stack depth of the code.
+    // Grows the same way as the value stack.
+    // If zero, defaults to 65536.
     int frameStackCapacity;
 
-    // The maximum number of objects the VM will allow in a fiber's root stack.
+    // The maximum number of objects the VM will allow in a fiber's root stack,
+    // used when verification cannot bound the root stack depth of the code.
     // If zero, defaults to 16.
     int rootStackCapacity;
 
+    // The most sets of stacks left by finished fibers the VM keeps to give to new fibers, rather
+    // than allocating stacks for each. Stacks that grew to more than twice the size fibers start
+    // with are freed instead. If zero, no stacks are kept. Defaults to 256.
+    int fiberStackPoolSize;
+
+    // The most fiber objects freed by the collector the VM keeps to reuse for new fibers. If zero,
+    // none are kept. Defaults to 256.
+    int fiberObjectPoolSize;
+
+    // The number of OS threads that run fibers. Fibers are green threads scheduled across these
+    // workers, so any number of fibers can be spawned.
+    //
+    // If zero, defaults to one per processor.
+    int workerCount;
+
     // The number of bytes MochiVM will allocate before triggering the first garbage
     // collection.
     //
@@ -167,6 +191,8 @@ MOCHIVM_API int mochiWriteCodeDouble(MochiVM* vm, double num, int line);
 MOCHIVM_API int mochiWriteLabel(MochiVM* vm, int labelIndex, const char* label);
 // Get the label associated with the given code index. Returns NULL if no label is associated with the index.
 MOCHIVM_API const char* mochiGetLabel(MochiVM* vm, int labelCodeIndex);
+// Get the source line the byte at the given code index was written with. Returns -1 if the index is outside the code.
+MOCHIVM_API int mochiGetLine(MochiVM* vm, int byteIndex);
 
 // Writes the given constant into the constant store for the vm.
 MOCHIVM_API int mochiWriteI32Const(MochiVM* vm, int32_t val);
@@ -176,8 +202,47 @@ MOCHIVM_API int mochiWriteStringConst(MochiVM* vm, const char* val);
 MOCHIVM_API int mochiWriteObjConst(MochiVM* vm, Obj* obj);
 
 // Add a foreign C function to the list of callable foreign methods, returning
-// the index assigned to the foreign method.
+// the index assigned to the foreign method. String arguments may be ropes, so a foreign
+// function that needs the bytes of a string should get them through mochiFlattenString.
 MOCHIVM_API int mochiAddForeign(MochiVM* vm, MochiVMForeignMethodFn fn);
+// Add a foreign C function under a symbol name, which is saved with modules written by the VM and
+// used to bind the function again when a module is loaded. Returns the index assigned to the method.
+MOCHIVM_API int mochiAddNamedForeign(MochiVM* vm, const char* name, MochiVMForeignMethodFn fn);
+
+// A foreign function may push up to this many values and this many frames onto the fiber that
+// called it. Pushes are not checked, so it must make room with mochiEnsureStack to push more.
+#define MOCHIVM_FOREIGN_STACK_ROOM 8
+// Makes sure [fiber] has room for [values] more values and [frames] more frames, growing its stacks
+// if needed. Returns false if either stack would grow past its configured capacity, in which case
+// the values and frames must not be pushed.
+MOCHIVM_API bool mochiEnsureStack(MochiVM* vm, ObjFiber* fiber, int values, int frames);
+
+// Saves the code, line information, constants, labels and foreign function names of the VM to a
+// binary module file at [path]. Returns false if the file could not be written, or if the constant
+// pool holds an object constant, which has no saved form.
+MOCHIVM_API bool mochiWriteModule(MochiVM* vm, const char* path);
+// Loads a module saved by [mochiWriteModule] into a VM that has no code, constants or labels yet.
+// The file is mapped into memory and the code is executed directly from the mapping. Foreign
+// functions saved with a name are bound to the function added to [vm] under that name, and those
+// saved without one keep the function added at the same index. Returns false and reports through
+// the configured error function if the file is not a valid module, leaving the VM unchanged.
+MOCHIVM_API bool mochiLoadModule(MochiVM* vm, const char* path);
+
+// Saves everything a module holds, along with every ref that has not been collected and every
+// object reachable from the constants and those refs, to a snapshot image at [path]. Meant to be
+// called once [mochiRun] has returned from initialization code, so that other processes can start
+// from the initialized state by loading the snapshot rather than running the initialization again.
+// Returns false if a reachable object is a fiber, frame, continuation or C pointer, which have no
+// saved form.
+MOCHIVM_API bool mochiSaveSnapshot(MochiVM* vm, const char* path);
+// Loads a snapshot saved by [mochiSaveSnapshot] into a VM that has no code, constants, labels or
+// restored refs yet, and which uses the same value representation as the VM that saved it. The code
+// is mapped and foreign functions bound as for [mochiLoadModule], and the saved objects are
+// recreated with their references relocated to the new objects. Restored refs are kept alive for
+// the life of the VM, in the order they were created, since nothing else refers to them after the
+// snapshot. Returns false and reports through the configured error function if the file is not a
+// valid snapshot, leaving the VM unchanged.
+MOCHIVM_API bool mochiLoadSnapshot(MochiVM* vm, const char* path);
 
 MOCHIVM_API void mochiSpawnCall(MochiVM* vm, ObjFiber* fiber, int codeStart);
 MOCHIVM_API void mochiSpawnCallWith(MochiVM* vm, ObjFiber* fiber, int codeStart, int valueConsume);
@@ -185,12 +250,22 @@ MOCHIVM_API void mochiSpawnCopy(MochiVM* vm, ObjFiber* fiber);
 MOCHIVM_API ObjFiber* mochiThreadCurrent(MochiVM* vm);
 MOCHIVM_API size_t mochiThreadCount(MochiVM* vm);
 
+// Checks the code block for malformed instructions, invalid jump and call targets, out of range
+// operands and unbalanced stack usage, reporting the first problem found through the configured
+// error function. When every stack depth the code can reach is known statically, new fibers are
+// given stacks of exactly that size. Otherwise fibers start with small stacks that grow as they
+// are checked against the most any stretch of code between checks can push. Returns whether the
+// code is valid.
+MOCHIVM_API bool mochiVerify(MochiVM* vm);
+
 // Given a VM with completed code/constant blocks, starts a new VM fiber running with a byte code
 // pointer at the first code instruction. The string arguments are converted to Mochi string
-// values and placed on the value stack in a single Array object.
+// values and placed on the value stack in a single Array object. The code is verified first if
+// it has changed since it was last verified, and -1 is returned without running if it is invalid.
 MOCHIVM_API int mochiRun(MochiVM* vm, int argc, const char* argv[]);
 
-// Runs the VM with the specified fiber from the fiber's current state.
+// Runs the specified fiber from its current state on the calling worker, until it finishes, yields
+// or blocks. Returns the value the fiber aborted with if it finished.
 MOCHIVM_API int mochiInterpret(MochiVM* vm, ObjFiber* fiber);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1341 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "kernels.h"
+#include "memory.h"
+#include "vm.h"
+
+#if defined(_WIN32)
+#define MOCHIVM_MODULE_MMAP 0
+#else
+#define MOCHIVM_MODULE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Modules and snapshots are both images of a VM, laid out as follows, with all integers
+// stored big-endian to match the operands in the code itself:
+//
+//   magic        8 bytes, "MOCHIMOD" for modules or "MOCHISNP" for snapshots
+//   version      u32, MOCHIVM_IMAGE_VERSION
+//   values       snapshots only, a u32 value representation and u32 sizeof(Value)
+//   code         u32 byte count, then the code bytes
+//   lines        u32 run count, then a u32 start and u32 line for each run
+//   labels       u32 count, then a u32 code index and a string for each
+//   foreign      u32 count, then a string naming each foreign function
+//
+// A module follows these with its constant pool, as a u32 count and then a u8 ConstantKind
+// and the constant for each. A snapshot follows them with the heap:
+//
+//   objects      u32 count, then a u8 ObjType and the object's contents for each
+//   constants    u32 count, then a u8 ConstantKind and a value for each
+//   refs         u32 count, then the u32 object index of each ref still allocated, oldest first
+//
+// Strings are a u32 byte count followed by the bytes and a terminating zero, so they can
+// be used in place from the mapped file. Values in a snapshot are either a zero byte and
+// the raw bits of a value without an object, or a one byte and the u32 index of an object
+// in the objects section, so they can only be loaded by a VM using the same value
+// representation. The elements of numeric arrays are likewise saved in the byte order
+// of the machine. The code section is never copied out of the mapping when loading.
+//
+// The VM has no struct or record metadata of its own, struct ids and record field labels
+// are plain integers in the code, so neither needs a section.
+
+#define MOCHIVM_MODULE_MAGIC     "MOCHIMOD"
+#define MOCHIVM_SNAPSHOT_MAGIC   "MOCHISNP"
+#define MOCHIVM_IMAGE_MAGIC_SIZE 8
+#define MOCHIVM_IMAGE_VERSION    10
+
+#if MOCHIVM_NAN_TAGGING
+#define MOCHIVM_VALUE_REPRESENTATION 2
+#elif MOCHIVM_POINTER_TAGGING
+#define MOCHIVM_VALUE_REPRESENTATION 1
+#else
+#define MOCHIVM_VALUE_REPRESENTATION 0
+#endif
+
+// The object index used in a snapshot for a NULL object, such as the end of a list.
+#define NO_OBJECT UINT32_MAX
+
+// The length recorded while reading a snapshot for a numeric array that is a slice.
+#define NUM_SLICE UINT32_MAX
+
+static void reportImageError(MochiVM* vm, const char* path, const char* message) {
+    if (vm->config.errorFn != NULL) {
+        vm->config.errorFn(vm, path, -1, message);
+    }
+}
+
+// Writing -----------------------------------------------------------------------------
+
+// Images are built in buffers allocated straight from the configured allocator rather than
+// through the collector. A snapshot is usually saved after [mochiRun] has returned, while
+// the finished main fiber is still registered, and a collection started from the embedder's
+// thread at that point would not find a current fiber.
+typedef struct {
+    MochiVM* vm;
+    uint8_t* data;
+    size_t count;
+    size_t capacity;
+} ImageBuffer;
+
+static void* imageReallocate(MochiVM* vm, void* memory, size_t size) {
+    void* result = vm->config.reallocateFn(memory, size, vm->config.userData);
+    PANIC_IF(result != NULL || size == 0, "Out of memory while writing an image.");
+    return result;
+}
+
+static void imageBufferInit(MochiVM* vm, ImageBuffer* buffer) {
+    buffer->vm = vm;
+    buffer->data = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+}
+
+static void imageBufferClear(ImageBuffer* buffer) {
+    imageReallocate(buffer->vm, buffer->data, 0);
+    imageBufferInit(buffer->vm, buffer);
+}
+
+static void putBytes(ImageBuffer* out, const void* bytes, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    if (out->count + count > out->capacity) {
+        size_t capacity = out->capacity < 64 ? 64 : out->capacity;
+        while (capacity < out->count + count) {
+            capacity *= 2;
+        }
+        out->data = imageReallocate(out->vm, out->data, capacity);
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->count, bytes, count);
+    out->count += count;
+}
+
+static void putU8(ImageBuffer* out, uint8_t val) {
+    putBytes(out, &val, 1);
+}
+
+static void putU32(ImageBuffer* out, uint32_t val) {
+    uint8_t bytes[4] = { val >> 24, val >> 16, val >> 8, val };
+    putBytes(out, bytes, 4);
+}
+
+static void putU64(ImageBuffer* out, uint64_t val) {
+    putU32(out, val >> 32);
+    putU32(out, (uint32_t)val);
+}
+
+static void putString(ImageBuffer* out, const char* string) {
+    size_t length = string == NULL ? 0 : strlen(string);
+    putU32(out, (uint32_t)length);
+    putBytes(out, string == NULL ? "" : string, length + 1);
+}
+
+// Writes the header of an image up to the code bytes themselves, which are written straight
+// from the code buffer.
+static void putHeader(ImageBuffer* out, const char* magic, bool snapshot) {
+    MochiVM* vm = out->vm;
+    putBytes(out, magic, MOCHIVM_IMAGE_MAGIC_SIZE);
+    putU32(out, MOCHIVM_IMAGE_VERSION);
+    if (snapshot) {
+        putU32(out, MOCHIVM_VALUE_REPRESENTATION);
+        putU32(out, sizeof(Value));
+    }
+    putU32(out, vm->code.count);
+}
+
+// Writes the sections following the code that modules and snapshots have in common.
+static void putSections(ImageBuffer* out) {
+    MochiVM* vm = out->vm;
+    putU32(out, vm->lines.count);
+    for (int i = 0; i < vm->lines.count; i++) {
+        putU32(out, vm->lines.data[i].start);
+        putU32(out, vm->lines.data[i].line);
+    }
+
+    putU32(out, vm->labels.count);
+    for (int i = 0; i < vm->labels.count; i++) {
+        putU32(out, vm->labelIndices.data[i]);
+        putString(out, AS_CSTRING(vm->labels.data[i]));
+    }
+
+    putU32(out, vm->foreignNames.count);
+    for (int i = 0; i < vm->foreignNames.count; i++) {
+        Value name = vm->foreignNames.data[i];
+        putString(out, AS_OBJ(name) == NULL ? NULL : AS_CSTRING(name));
+    }
+}
+
+static bool writeImage(MochiVM* vm, const char* path, ImageBuffer* header, ImageBuffer* sections) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        reportImageError(vm, path, "Could not open file for writing.");
+        return false;
+    }
+
+    fwrite(header->data, 1, header->count, file);
+    if (vm->code.count > 0) {
+        fwrite(vm->code.data, 1, vm->code.count, file);
+    }
+    fwrite(sections->data, 1, sections->count, file);
+
+    bool failed = ferror(file);
+    if (fclose(file) != 0 || failed) {
+        reportImageError(vm, path, "Could not write file.");
+        return false;
+    }
+    return true;
+}
+
+bool mochiWriteModule(MochiVM* vm, const char* path) {
+    for (int i = 0; i < vm->constantKinds.count; i++) {
+        if (vm->constantKinds.data[i] == CONST_KIND_OBJ) {
+            reportImageError(vm, path, "Object constants cannot be written to a module.");
+            return false;
+        }
+    }
+
+    ImageBuffer header;
+    ImageBuffer sections;
+    imageBufferInit(vm, &header);
+    imageBufferInit(vm, &sections);
+    putHeader(&header, MOCHIVM_MODULE_MAGIC, false);
+    putSections(&sections);
+
+    putU32(&sections, vm->constants.count);
+    for (int i = 0; i < vm->constants.count; i++) {
+        Value constant = vm->constants.data[i];
+        uint8_t kind = vm->constantKinds.data[i];
+        putU8(&sections, kind);
+        switch (kind) {
+        case CONST_KIND_I32: putU32(&sections, AS_I32(constant)); break;
+        case CONST_KIND_SINGLE: {
+            float single = AS_SINGLE(constant);
+            uint32_t bits;
+            memcpy(&bits, &single, 4);
+            putU32(&sections, bits);
+            break;
+        }
+        case CONST_KIND_DOUBLE: {
+            double dub = AS_DOUBLE(constant);
+            uint64_t bits;
+            memcpy(&bits, &dub, 8);
+            putU64(&sections, bits);
+            break;
+        }
+        case CONST_KIND_STRING: putString(&sections, AS_CSTRING(constant)); break;
+        default: UNREACHABLE();
+        }
+    }
+
+    bool written = writeImage(vm, path, &header, &sections);
+    imageBufferClear(&header);
+    imageBufferClear(&sections);
+    return written;
+}
+
+// Objects are numbered in the order they are first reached from the roots of the snapshot,
+// and written in that order, which numbers the objects they refer to in turn. The numbers
+// are found again through an open addressed table keyed on the object's address.
+typedef struct {
+    MochiVM* vm;
+    const char* path;
+    bool failed;
+
+    Obj** objects;
+    uint32_t objectCount;
+    uint32_t objectCapacity;
+
+    Obj** slotObjects;
+    uint32_t* slotIndices;
+    uint32_t slotCapacity;
+} SnapshotWriter;
+
+static uint32_t findSlot(Obj** slotObjects, uint32_t slotCapacity, Obj* obj) {
+    uint32_t slot = (uint32_t)(((uintptr_t)obj >> 3) * 2654435761u) & (slotCapacity - 1);
+    while (slotObjects[slot] != NULL && slotObjects[slot] != obj) {
+        slot = (slot + 1) & (slotCapacity - 1);
+    }
+    return slot;
+}
+
+static void growSlots(SnapshotWriter* writer) {
+    uint32_t capacity = writer->slotCapacity == 0 ? 64 : writer->slotCapacity * 2;
+    Obj** slotObjects = imageReallocate(writer->vm, NULL, capacity * sizeof(Obj*));
+    uint32_t* slotIndices = imageReallocate(writer->vm, NULL, capacity * sizeof(uint32_t));
+    memset(slotObjects, 0, capacity * sizeof(Obj*));
+
+    for (uint32_t i = 0; i < writer->slotCapacity; i++) {
+        if (writer->slotObjects[i] != NULL) {
+            uint32_t slot = findSlot(slotObjects, capacity, writer->slotObjects[i]);
+            slotObjects[slot] = writer->slotObjects[i];
+            slotIndices[slot] = writer->slotIndices[i];
+        }
+    }
+
+    imageReallocate(writer->vm, writer->slotObjects, 0);
+    imageReallocate(writer->vm, writer->slotIndices, 0);
+    writer->slotObjects = slotObjects;
+    writer->slotIndices = slotIndices;
+    writer->slotCapacity = capacity;
+}
+
+static uint32_t objectIndex(SnapshotWriter* writer, Obj* obj) {
+    if (obj == NULL) {
+        return NO_OBJECT;
+    }
+
+    // Keep the table at most half full.
+    if ((writer->objectCount + 1) * 2 > writer->slotCapacity) {
+        growSlots(writer);
+    }
+    uint32_t slot = findSlot(writer->slotObjects, writer->slotCapacity, obj);
+    if (writer->slotObjects[slot] != NULL) {
+        return writer->slotIndices[slot];
+    }
+
+    if (writer->objectCount >= writer->objectCapacity) {
+        writer->objectCapacity = writer->objectCapacity == 0 ? 64 : writer->objectCapacity * 2;
+        writer->objects = imageReallocate(writer->vm, writer->objects, writer->objectCapacity * sizeof(Obj*));
+    }
+    uint32_t index = writer->objectCount++;
+    writer->objects[index] = obj;
+    writer->slotObjects[slot] = obj;
+    writer->slotIndices[slot] = index;
+    return index;
+}
+
+static void putValue(SnapshotWriter* writer, ImageBuffer* out, Value value) {
+    if (IS_OBJ(value)) {
+        putU8(out, 1);
+        putU32(out, objectIndex(writer, AS_OBJ(value)));
+    } else {
+        putU8(out, 0);
+        putBytes(out, &value, sizeof(Value));
+    }
+}
+
+static void putObject(SnapshotWriter* writer, ImageBuffer* out, Obj* obj) {
+    MochiVM* vm = writer->vm;
+    // Ropes are saved as the flat strings they stand for.
+    putU8(out, obj->type == OBJ_ROPE ? OBJ_BYTE_ARRAY : obj->type);
+    switch (obj->type) {
+    case OBJ_I64: putU64(out, ((ObjI64*)obj)->val); break;
+    case OBJ_U64: putU64(out, ((ObjU64*)obj)->val); break;
+    case OBJ_DOUBLE: {
+        uint64_t bits;
+        memcpy(&bits, &((ObjDouble*)obj)->val, 8);
+        putU64(out, bits);
+        break;
+    }
+    case OBJ_LIST: {
+        ObjList* list = (ObjList*)obj;
+        putValue(writer, out, list->elem);
+        putU32(out, objectIndex(writer, (Obj*)mochiListTail(list)));
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)obj;
+        ptrdiff_t offset = closure->funcLocation - vm->code.data;
+        if (offset < 0 || offset > vm->code.count) {
+            reportImageError(vm, writer->path, "A closure in the snapshot does not point into the code.");
+            writer->failed = true;
+            return;
+        }
+        putU32(out, (uint32_t)offset);
+        putU8(out, closure->paramCount);
+        putU32(out, closure->capturedCount);
+        putU8(out, closure->resumeLimit);
+        for (int i = 0; i < closure->capturedCount; i++) {
+            putValue(writer, out, closure->captured[i]);
+        }
+        break;
+    }
+    case OBJ_FOREIGN: {
+        ObjForeign* foreign = (ObjForeign*)obj;
+        putU32(out, foreign->dataCount);
+        putBytes(out, foreign->data, foreign->dataCount);
+        break;
+    }
+    case OBJ_ARRAY: {
+        ObjArray* array = (ObjArray*)obj;
+        putU32(out, array->elems.count);
+        for (int i = 0; i < array->elems.count; i++) {
+            putValue(writer, out, array->elems.data[i]);
+        }
+        break;
+    }
+    case OBJ_SLICE: {
+        ObjSlice* slice = (ObjSlice*)obj;
+        putU32(out, slice->start);
+        putU32(out, slice->count);
+        putU32(out, objectIndex(writer, (Obj*)slice->source));
+        break;
+    }
+    case OBJ_BYTE_ARRAY: {
+        ObjByteArray* array = (ObjByteArray*)obj;
+        putU32(out, array->elems.count);
+        putBytes(out, array->elems.data, array->elems.count);
+        break;
+    }
+    case OBJ_ROPE: {
+        ObjRope* rope = (ObjRope*)obj;
+        uint8_t* bytes = imageReallocate(vm, NULL, rope->length + 1);
+        mochiStringCopyBytes(vm, obj, bytes);
+        bytes[rope->length] = '\0';
+        putU32(out, rope->length + 1);
+        putBytes(out, bytes, rope->length + 1);
+        imageReallocate(vm, bytes, 0);
+        break;
+    }
+    case OBJ_VECTOR: {
+        // Only the elements are saved, and a loaded vector is rebuilt balanced.
+        ObjVector* vector = (ObjVector*)obj;
+        putU32(out, vector->count);
+        for (int i = 0; i < vector->count; i++) {
+            putValue(writer, out, mochiVectorGetAt(i, vector));
+        }
+        break;
+    }
+    case OBJ_BYTE_SLICE: {
+        ObjByteSlice* slice = (ObjByteSlice*)obj;
+        putU32(out, slice->start);
+        putU32(out, slice->count);
+        putU32(out, objectIndex(writer, (Obj*)slice->source));
+        break;
+    }
+    case OBJ_NUM_ARRAY: {
+        // A slice is saved as a range of the array owning its elements.
+        ObjNumArray* array = (ObjNumArray*)obj;
+        int size = mochiNumElemSize(array->elemType);
+        if (array->source != NULL) {
+            putU8(out, 1);
+            putU32(out, (uint32_t)((array->data - array->source->data) / size));
+            putU32(out, array->count);
+            putU32(out, objectIndex(writer, (Obj*)array->source));
+        } else {
+            putU8(out, 0);
+            putU8(out, array->elemType);
+            putU32(out, array->count);
+            putBytes(out, array->data, (size_t)array->count * size);
+        }
+        break;
+    }
+    case OBJ_REF: putValue(writer, out, mochiRefGet((ObjRef*)obj)); break;
+    case OBJ_STRUCT: {
+        ObjStruct* stru = (ObjStruct*)obj;
+        putU32(out, stru->id);
+        putU32(out, stru->count);
+        for (int i = 0; i < stru->count; i++) {
+            putValue(writer, out, stru->elems[i]);
+        }
+        break;
+    }
+    case OBJ_RECORD: {
+        // Records stored as tries are saved flat and loaded flat, and go back to a trie when
+        // next extended.
+        ObjRecord* rec = (ObjRecord*)obj;
+        int count = mochiRecordCount(rec);
+        TableKey* keys = imageReallocate(vm, NULL, count * sizeof(TableKey));
+        Value* values = imageReallocate(vm, NULL, count * sizeof(Value));
+        mochiRecordFields(vm, rec, keys, values);
+        putU32(out, count);
+        for (int i = 0; i < count; i++) {
+            putU64(out, keys[i]);
+        }
+        for (int i = 0; i < count; i++) {
+            putValue(writer, out, values[i]);
+        }
+        imageReallocate(vm, keys, 0);
+        imageReallocate(vm, values, 0);
+        break;
+    }
+    case OBJ_VARIANT: {
+        ObjVariant* var = (ObjVariant*)obj;
+        putU64(out, var->label);
+        putU32(out, var->nesting);
+        putValue(writer, out, var->elem);
+        break;
+    }
+    default:
+        reportImageError(vm, writer->path,
+                         "Fibers, channels, frames, continuations and C pointers cannot be saved in a snapshot.");
+        writer->failed = true;
+        break;
+    }
+}
+
+bool mochiSaveSnapshot(MochiVM* vm, const char* path) {
+    SnapshotWriter writer;
+    memset(&writer, 0, sizeof(SnapshotWriter));
+    writer.vm = vm;
+    writer.path = path;
+
+    // The roots are encoded first so that the objects they reach are numbered, but are
+    // written after the objects so those can be created before anything refers to them.
+    ImageBuffer roots;
+    imageBufferInit(vm, &roots);
+    putU32(&roots, vm->constants.count);
+    for (int i = 0; i < vm->constants.count; i++) {
+        putU8(&roots, vm->constantKinds.data[i]);
+        putValue(&writer, &roots, vm->constants.data[i]);
+    }
+
+    // Initialization code leaves its state in refs, which nothing may refer to once it returns,
+    // so every ref that has not been collected is saved. The list of objects is newest first.
+    uint32_t refCount = 0;
+    for (Obj* obj = vm->objects; obj != NULL; obj = obj->next) {
+        refCount += obj->type == OBJ_REF ? 1 : 0;
+    }
+    Obj** refs = imageReallocate(vm, NULL, refCount * sizeof(Obj*));
+    uint32_t refIndex = refCount;
+    for (Obj* obj = vm->objects; obj != NULL; obj = obj->next) {
+        if (obj->type == OBJ_REF) {
+            refs[--refIndex] = obj;
+        }
+    }
+    putU32(&roots, refCount);
+    for (uint32_t i = 0; i < refCount; i++) {
+        putU32(&roots, objectIndex(&writer, refs[i]));
+    }
+    imageReallocate(vm, refs, 0);
+
+    ImageBuffer objects;
+    imageBufferInit(vm, &objects);
+    for (uint32_t i = 0; i < writer.objectCount && !writer.failed; i++) {
+        putObject(&writer, &objects, writer.objects[i]);
+    }
+
+    bool written = false;
+    if (!writer.failed) {
+        ImageBuffer header;
+        ImageBuffer sections;
+        imageBufferInit(vm, &header);
+        imageBufferInit(vm, &sections);
+        putHeader(&header, MOCHIVM_SNAPSHOT_MAGIC, true);
+        putSections(&sections);
+        putU32(&sections, writer.objectCount);
+        putBytes(&sections, objects.data, objects.count);
+        putBytes(&sections, roots.data, roots.count);
+
+        written = writeImage(vm, path, &header, &sections);
+        imageBufferClear(&header);
+        imageBufferClear(&sections);
+    }
+
+    imageBufferClear(&objects);
+    imageBufferClear(&roots);
+    imageReallocate(vm, writer.objects, 0);
+    imageReallocate(vm, writer.slotObjects, 0);
+    imageReallocate(vm, writer.slotIndices, 0);
+    return written;
+}
+
+// Reading -----------------------------------------------------------------------------
+
+// Loading makes two passes over an image with a reader: the first only checks that every
+// section is well formed and that each foreign function can be bound, and the second,
+// made once the first has succeeded, fills in the VM.
+//
+// The objects of a snapshot are read more than once within each pass. While checking,
+// the first read records the type and length of every object and the second checks the
+// references between them. While loading, the first read allocates every object but the
+// lists and slices, the lists are then made tail first from the links recorded while
+// checking, the second read allocates the slices now that their sources exist, and the
+// third fills in the references of every object, relocating each object index to the
+// newly allocated object.
+typedef enum
+{
+    PHASE_MEASURE,
+    PHASE_CHECK,
+    PHASE_ALLOCATE,
+    PHASE_ALLOCATE_SLICES,
+    PHASE_FILL
+} ObjectPhase;
+
+typedef struct {
+    MochiVM* vm;
+    const char* path;
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    bool apply;
+    bool failed;
+
+    uint32_t codeCount;
+
+    uint32_t objectCount;
+    uint8_t* objectTypes;
+    // The length of each array, or the index of the next cell of each list. Numeric array
+    // slices have NUM_SLICE, since they cannot be the source of another slice.
+    uint32_t* objectLengths;
+    Obj** objects;
+} ImageReader;
+
+static void readerError(ImageReader* reader, const char* message) {
+    if (!reader->failed) {
+        reportImageError(reader->vm, reader->path, message);
+    }
+    reader->failed = true;
+}
+
+static const uint8_t* readBytes(ImageReader* reader, size_t count) {
+    if (reader->failed || reader->size - reader->pos < count) {
+        readerError(reader, "File is truncated.");
+        return NULL;
+    }
+    const uint8_t* bytes = reader->data + reader->pos;
+    reader->pos += count;
+    return bytes;
+}
+
+static uint8_t readU8(ImageReader* reader) {
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(ImageReader* reader) {
+    const uint8_t* bytes = readBytes(reader, 4);
+    if (bytes == NULL) {
+        return 0;
+    }
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static uint64_t readU64(ImageReader* reader) {
+    uint64_t high = readU32(reader);
+    return (high << 32) | readU32(reader);
+}
+
+static const char* readString(ImageReader* reader) {
+    uint32_t length = readU32(reader);
+    const uint8_t* bytes = readBytes(reader, (size_t)length + 1);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    if (bytes[length] != '\0' || memchr(bytes, '\0', length) != NULL) {
+        readerError(reader, "File contains a malformed string.");
+        return NULL;
+    }
+    return (const char*)bytes;
+}
+
+static int findForeign(MochiVM* vm, const char* name) {
+    for (int i = 0; i < vm->foreignNames.count; i++) {
+        Value known = vm->foreignNames.data[i];
+        if (AS_OBJ(known) != NULL && strcmp(AS_CSTRING(known), name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reads the header and the sections modules and snapshots have in common.
+static void readSections(ImageReader* reader, const char* magic, bool snapshot) {
+    MochiVM* vm = reader->vm;
+
+    const uint8_t* found = readBytes(reader, MOCHIVM_IMAGE_MAGIC_SIZE);
+    if (found == NULL || memcmp(found, magic, MOCHIVM_IMAGE_MAGIC_SIZE) != 0) {
+        readerError(reader, snapshot ? "File is not a MochiVM snapshot." : "File is not a MochiVM module.");
+        return;
+    }
+    if (readU32(reader) != MOCHIVM_IMAGE_VERSION) {
+        readerError(reader, "File was written by an unsupported version of MochiVM.");
+        return;
+    }
+    if (snapshot && (readU32(reader) != MOCHIVM_VALUE_REPRESENTATION || readU32(reader) != sizeof(Value))) {
+        readerError(reader, "Snapshot was saved by a VM with a different value representation.");
+        return;
+    }
+
+    uint32_t codeCount = readU32(reader);
+    const uint8_t* code = readBytes(reader, codeCount);
+    if (codeCount > INT32_MAX) {
+        readerError(reader, "Code section is too large.");
+    }
+    if (reader->failed) {
+        return;
+    }
+    reader->codeCount = codeCount;
+    if (reader->apply) {
+        // The interpreter only ever reads the code, so it can point straight into the mapping.
+        vm->code.data = (uint8_t*)code;
+        vm->code.count = codeCount;
+        vm->code.capacity = codeCount;
+    }
+
+    uint32_t lineCount = readU32(reader);
+    for (uint32_t i = 0; i < lineCount && !reader->failed; i++) {
+        LineRun run;
+        run.start = readU32(reader);
+        run.line = readU32(reader);
+        if (run.start < 0 || (uint32_t)run.start >= codeCount) {
+            readerError(reader, "Line information is outside the code.");
+        } else if (reader->apply) {
+            mochiLineRunBufferWrite(vm, &vm->lines, run);
+        }
+    }
+
+    uint32_t labelCount = readU32(reader);
+    for (uint32_t i = 0; i < labelCount && !reader->failed; i++) {
+        uint32_t index = readU32(reader);
+        const char* label = readString(reader);
+        if (label != NULL && index > codeCount) {
+            readerError(reader, "Label is outside the code.");
+        } else if (label != NULL && reader->apply) {
+            mochiWriteLabel(vm, index, label);
+        }
+    }
+
+    uint32_t foreignCount = readU32(reader);
+    ForeignFunctionBuffer fns;
+    ValueBuffer names;
+    mochiForeignFunctionBufferInit(&fns);
+    mochiValueBufferInit(&names);
+    for (uint32_t i = 0; i < foreignCount && !reader->failed; i++) {
+        const char* name = readString(reader);
+        if (name == NULL) {
+            break;
+        }
+
+        int bound = name[0] == '\0' ? (int)i : findForeign(vm, name);
+        if (bound < 0 || bound >= vm->foreignFns.count) {
+            char buffer[128];
+            if (name[0] == '\0') {
+                snprintf(buffer, sizeof(buffer), "Code uses unnamed foreign function %u, which was not added.", i);
+            } else {
+                snprintf(buffer, sizeof(buffer), "Code uses foreign function '%s', which was not added.", name);
+            }
+            readerError(reader, buffer);
+        } else if (reader->apply) {
+            // The name objects are still held by the VM's current table, so they stay alive
+            // across any collection triggered while building the new one.
+            mochiForeignFunctionBufferWrite(vm, &fns, vm->foreignFns.data[bound]);
+            mochiValueBufferWrite(vm, &names, name[0] == '\0' ? OBJ_VAL(NULL) : vm->foreignNames.data[bound]);
+        }
+    }
+
+    if (reader->apply) {
+        mochiForeignFunctionBufferClear(vm, &vm->foreignFns);
+        mochiValueBufferClear(vm, &vm->foreignNames);
+        vm->foreignFns = fns;
+        vm->foreignNames = names;
+    }
+}
+
+static void readModuleConstants(ImageReader* reader) {
+    MochiVM* vm = reader->vm;
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+        switch (readU8(reader)) {
+        case CONST_KIND_I32: {
+            int32_t val = (int32_t)readU32(reader);
+            if (reader->apply) {
+                mochiWriteI32Const(vm, val);
+            }
+            break;
+        }
+        case CONST_KIND_SINGLE: {
+            uint32_t bits = readU32(reader);
+            float single;
+            memcpy(&single, &bits, 4);
+            if (reader->apply) {
+                mochiWriteSingleConst(vm, single);
+            }
+            break;
+        }
+        case CONST_KIND_DOUBLE: {
+            uint64_t bits = readU64(reader);
+            double dub;
+            memcpy(&dub, &bits, 8);
+            if (reader->apply) {
+                mochiWriteDoubleConst(vm, dub);
+            }
+            break;
+        }
+        case CONST_KIND_STRING: {
+            const char* string = readString(reader);
+            if (string != NULL && reader->apply) {
+                mochiWriteStringConst(vm, string);
+            }
+            break;
+        }
+        default: readerError(reader, "Module contains a constant of unknown kind."); break;
+        }
+    }
+}
+
+static Obj* objectAt(ImageReader* reader, uint32_t index) {
+    return index == NO_OBJECT ? NULL : reader->objects[index];
+}
+
+// Reads a value into [slot], which is only written while filling in objects.
+static void readValue(ImageReader* reader, ObjectPhase phase, Value* slot) {
+    uint8_t tag = readU8(reader);
+    if (tag == 0) {
+        const uint8_t* bytes = readBytes(reader, sizeof(Value));
+        Value value;
+        if (bytes == NULL) {
+            return;
+        }
+        memcpy(&value, bytes, sizeof(Value));
+        if (IS_OBJ(value)) {
+            readerError(reader, "Snapshot contains an object pointer outside the objects section.");
+        } else if (phase == PHASE_FILL) {
+            *slot = value;
+        }
+    } else if (tag == 1) {
+        uint32_t index = readU32(reader);
+        if (index != NO_OBJECT && index >= reader->objectCount) {
+            readerError(reader, "Snapshot refers to an object that does not exist.");
+        } else if (phase == PHASE_FILL) {
+            *slot = OBJ_VAL(objectAt(reader, index));
+        }
+    } else {
+        readerError(reader, "Snapshot contains a malformed value.");
+    }
+}
+
+// Reads the index of an object that must be of [type].
+static uint32_t readObjectIndex(ImageReader* reader, ObjectPhase phase, ObjType type, bool allowNull) {
+    uint32_t index = readU32(reader);
+    if (phase == PHASE_CHECK && !reader->failed) {
+        if (index == NO_OBJECT ? !allowNull : (index >= reader->objectCount || reader->objectTypes[index] != type)) {
+            readerError(reader, "Snapshot refers to an object of the wrong type.");
+        }
+    }
+    return index;
+}
+
+static void checkSliceBounds(ImageReader* reader, ObjectPhase phase, uint32_t start, uint32_t count,
+                             uint32_t source) {
+    if (phase == PHASE_CHECK && !reader->failed && (uint64_t)start + count > reader->objectLengths[source]) {
+        readerError(reader, "Snapshot contains a slice outside its source.");
+    }
+}
+
+static void* readerAllocate(ImageReader* reader, size_t size) {
+    MochiVM* vm = reader->vm;
+    return size == 0 ? NULL : vm->config.reallocateFn(NULL, size, vm->config.userData);
+}
+
+static void readerFree(ImageReader* reader, void* memory) {
+    if (memory != NULL) {
+        reader->vm->config.reallocateFn(memory, 0, reader->vm->config.userData);
+    }
+}
+
+static void readObject(ImageReader* reader, uint32_t index, ObjectPhase phase) {
+    MochiVM* vm = reader->vm;
+    bool allocate = phase == PHASE_ALLOCATE;
+    bool fill = phase == PHASE_FILL;
+    Obj* obj = fill ? reader->objects[index] : NULL;
+
+    uint8_t type = readU8(reader);
+    if (phase == PHASE_MEASURE) {
+        reader->objectTypes[index] = type;
+        reader->objectLengths[index] = 0;
+    }
+
+    switch (type) {
+    case OBJ_I64: {
+        uint64_t val = readU64(reader);
+        if (allocate) {
+            reader->objects[index] = (Obj*)mochiNewI64(vm, (int64_t)val);
+        }
+        break;
+    }
+    case OBJ_U64: {
+        uint64_t val = readU64(reader);
+        if (allocate) {
+            reader->objects[index] = (Obj*)mochiNewU64(vm, val);
+        }
+        break;
+    }
+    case OBJ_DOUBLE: {
+        uint64_t bits = readU64(reader);
+        double val;
+        memcpy(&val, &bits, 8);
+        if (allocate) {
+            reader->objects[index] = (Obj*)mochiNewDouble(vm, val);
+        }
+        break;
+    }
+    case OBJ_LIST: {
+        readValue(reader, phase, fill ? &((ObjList*)obj)->elem : NULL);
+        uint32_t next = readObjectIndex(reader, phase, OBJ_LIST, true);
+        // A cell can only be made once its tail exists, so lists are allocated in a pass of their own.
+        if (phase == PHASE_MEASURE) {
+            reader->objectLengths[index] = next;
+        } else if (allocate) {
+            reader->objects[index] = NULL;
+        }
+        break;
+    }
+    case OBJ_CLOSURE: {
+        uint32_t offset = readU32(reader);
+        uint8_t paramCount = readU8(reader);
+        uint32_t capturedCount = readU32(reader);
+        uint8_t resumeLimit = readU8(reader);
+        if (phase == PHASE_MEASURE &&
+            (offset > reader->codeCount || capturedCount > UINT16_MAX || resumeLimit > RESUME_MANY)) {
+            readerError(reader, "Snapshot contains a malformed closure.");
+            break;
+        }
+        if (allocate) {
+            ObjClosure* closure = mochiNewClosure(vm, vm->code.data + offset, paramCount, capturedCount);
+            closure->resumeLimit = resumeLimit;
+            reader->objects[index] = (Obj*)closure;
+        }
+        for (uint32_t i = 0; i < capturedCount && !reader->failed; i++) {
+            readValue(reader, phase, fill ? &((ObjClosure*)obj)->captured[i] : NULL);
+        }
+        break;
+    }
+    case OBJ_FOREIGN: {
+        uint32_t count = readU32(reader);
+        const uint8_t* data = readBytes(reader, count);
+        if (allocate && data != NULL) {
+            ObjForeign* foreign = mochiNewForeign(vm, count);
+            memcpy(foreign->data, data, count);
+            reader->objects[index] = (Obj*)foreign;
+        }
+        break;
+    }
+    case OBJ_ARRAY: {
+        uint32_t count = readU32(reader);
+        if (phase == PHASE_MEASURE) {
+            reader->objectLengths[index] = count;
+            if (count > INT32_MAX) {
+                readerError(reader, "Snapshot contains an array that is too large.");
+                break;
+            }
+        }
+        if (allocate) {
+            ObjArray* array = mochiArrayNil(vm);
+            mochiValueBufferFill(vm, &array->elems, FALSE_VAL, count);
+            reader->objects[index] = (Obj*)array;
+        }
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            readValue(reader, phase, fill ? &((ObjArray*)obj)->elems.data[i] : NULL);
+        }
+        break;
+    }
+    case OBJ_SLICE: {
+        uint32_t start = readU32(reader);
+        uint32_t count = readU32(reader);
+        uint32_t source = readObjectIndex(reader, phase, OBJ_ARRAY, false);
+        checkSliceBounds(reader, phase, start, count, source);
+        if (phase == PHASE_ALLOCATE_SLICES) {
+            ObjArray* array = (ObjArray*)reader->objects[source];
+            reader->objects[index] = (Obj*)mochiArraySlice(vm, start, count, array);
+        }
+        break;
+    }
+    case OBJ_BYTE_ARRAY: {
+        uint32_t count = readU32(reader);
+        const uint8_t* data = readBytes(reader, count);
+        if (phase == PHASE_MEASURE) {
+            reader->objectLengths[index] = count;
+        }
+        if (allocate && data != NULL) {
+            ObjByteArray* array = mochiByteArrayNil(vm);
+            mochiByteBufferFill(vm, &array->elems, 0, count);
+            memcpy(array->elems.data, data, count);
+            reader->objects[index] = (Obj*)array;
+        }
+        break;
+    }
+    case OBJ_VECTOR: {
+        uint32_t count = readU32(reader);
+        if (phase == PHASE_MEASURE && count > INT32_MAX) {
+            readerError(reader, "Snapshot contains a vector that is too large.");
+            break;
+        }
+        if (allocate) {
+            Value* values = readerAllocate(reader, count * sizeof(Value));
+            for (uint32_t i = 0; i < count; i++) {
+                values[i] = FALSE_VAL;
+            }
+            reader->objects[index] = (Obj*)mochiVectorFromValues(vm, values, count);
+            readerFree(reader, values);
+        }
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            readValue(reader, phase, fill ? mochiVectorSlot(i, (ObjVector*)obj) : NULL);
+        }
+        break;
+    }
+    case OBJ_BYTE_SLICE: {
+        uint32_t start = readU32(reader);
+        uint32_t count = readU32(reader);
+        uint32_t source = readObjectIndex(reader, phase, OBJ_BYTE_ARRAY, false);
+        checkSliceBounds(reader, phase, start, count, source);
+        if (phase == PHASE_ALLOCATE_SLICES) {
+            ObjByteArray* array = (ObjByteArray*)reader->objects[source];
+            reader->objects[index] = (Obj*)mochiByteArraySlice(vm, start, count, array);
+        }
+        break;
+    }
+    case OBJ_NUM_ARRAY: {
+        if (readU8(reader) != 0) {
+            uint32_t start = readU32(reader);
+            uint32_t count = readU32(reader);
+            uint32_t source = readObjectIndex(reader, phase, OBJ_NUM_ARRAY, false);
+            if (phase == PHASE_MEASURE) {
+                reader->objectLengths[index] = NUM_SLICE;
+            } else if (phase == PHASE_CHECK && !reader->failed && reader->objectLengths[source] == NUM_SLICE) {
+                readerError(reader, "Snapshot contains a slice of a numeric array slice.");
+                break;
+            }
+            checkSliceBounds(reader, phase, start, count, source);
+            if (phase == PHASE_ALLOCATE_SLICES) {
+                ObjNumArray* array = (ObjNumArray*)reader->objects[source];
+                reader->objects[index] = (Obj*)mochiNumArraySlice(vm, start, count, array);
+            }
+            break;
+        }
+        uint8_t elemType = readU8(reader);
+        uint32_t count = readU32(reader);
+        if (phase == PHASE_MEASURE) {
+            if (elemType == VAL_BOOL || elemType > VAL_DOUBLE || count > INT32_MAX / sizeof(uint64_t)) {
+                readerError(reader, "Snapshot contains a malformed numeric array.");
+                break;
+            }
+            reader->objectLengths[index] = count;
+        }
+        size_t size = (size_t)count * mochiNumElemSize(elemType);
+        const uint8_t* data = readBytes(reader, size);
+        if (allocate && data != NULL) {
+            ObjNumArray* array = mochiNewNumArray(vm, elemType, count);
+            memcpy(array->data, data, size);
+            reader->objects[index] = (Obj*)array;
+        }
+        break;
+    }
+    case OBJ_REF: {
+        if (allocate) {
+            reader->objects[index] = (Obj*)mochiNewRef(vm, FALSE_VAL);
+        }
+        Value value = FALSE_VAL;
+        readValue(reader, phase, &value);
+        if (fill) {
+            mochiRefPut((ObjRef*)obj, value);
+        }
+        break;
+    }
+    case OBJ_STRUCT: {
+        uint32_t id = readU32(reader);
+        uint32_t count = readU32(reader);
+        if (phase == PHASE_MEASURE && count > INT32_MAX) {
+            readerError(reader, "Snapshot contains a struct that is too large.");
+            break;
+        }
+        if (allocate) {
+            ObjStruct* stru = mochiNewStruct(vm, id, count);
+            for (uint32_t i = 0; i < count; i++) {
+                stru->elems[i] = FALSE_VAL;
+            }
+            reader->objects[index] = (Obj*)stru;
+        }
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            readValue(reader, phase, fill ? &((ObjStruct*)obj)->elems[i] : NULL);
+        }
+        break;
+    }
+    case OBJ_RECORD: {
+        uint32_t count = readU32(reader);
+        if (phase == PHASE_MEASURE && count > INT32_MAX) {
+            readerError(reader, "Snapshot contains a record that is too large.");
+            break;
+        }
+        TableKey* keys = allocate ? readerAllocate(reader, count * sizeof(TableKey)) : NULL;
+        TableKey previous = 0;
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            TableKey key = readU64(reader);
+            if (phase == PHASE_MEASURE && key < previous) {
+                readerError(reader, "Snapshot contains a record with unsorted fields.");
+            }
+            previous = key;
+            if (allocate) {
+                keys[i] = key;
+            }
+        }
+        if (allocate) {
+            ObjRecord* rec = mochiNewRecordWithShape(vm, mochiInternShape(vm, keys, (int)count));
+            for (uint32_t i = 0; i < count; i++) {
+                rec->values[i] = FALSE_VAL;
+            }
+            reader->objects[index] = (Obj*)rec;
+            readerFree(reader, keys);
+        }
+        for (uint32_t i = 0; i < count && !reader->failed; i++) {
+            readValue(reader, phase, fill ? &((ObjRecord*)obj)->values[i] : NULL);
+        }
+        break;
+    }
+    case OBJ_VARIANT: {
+        TableKey label = readU64(reader);
+        int nesting = (int)readU32(reader);
+        if (allocate) {
+            ObjVariant* var = mochiNewVariant(vm, label, FALSE_VAL);
+            var->nesting = nesting;
+            reader->objects[index] = (Obj*)var;
+        }
+        readValue(reader, phase, fill ? &((ObjVariant*)obj)->elem : NULL);
+        break;
+    }
+    default: readerError(reader, "Snapshot contains an object of an unsupported type."); break;
+    }
+}
+
+// Lists are allocated tail first, so the cells of a list must not link back around to themselves.
+static void checkListChains(ImageReader* reader) {
+    uint8_t* states = readerAllocate(reader, reader->objectCount);
+    if (states != NULL) {
+        memset(states, 0, reader->objectCount);
+    }
+    for (uint32_t i = 0; i < reader->objectCount && !reader->failed; i++) {
+        if (reader->objectTypes[i] != OBJ_LIST || states[i] != 0) {
+            continue;
+        }
+        // Cells on the chain being walked are marked 1, and cells known to end are marked 2.
+        uint32_t cell = i;
+        while (cell != NO_OBJECT && states[cell] == 0) {
+            states[cell] = 1;
+            cell = reader->objectLengths[cell];
+        }
+        if (cell != NO_OBJECT && states[cell] == 1) {
+            readerError(reader, "Snapshot contains a list that links back to itself.");
+        }
+        for (cell = i; cell != NO_OBJECT && states[cell] == 1; cell = reader->objectLengths[cell]) {
+            states[cell] = 2;
+        }
+    }
+    readerFree(reader, states);
+}
+
+static void allocateLists(ImageReader* reader) {
+    uint32_t* pending = readerAllocate(reader, reader->objectCount * sizeof(uint32_t));
+    for (uint32_t i = 0; i < reader->objectCount; i++) {
+        uint32_t count = 0;
+        uint32_t cell = i;
+        while (cell != NO_OBJECT && reader->objectTypes[cell] == OBJ_LIST && reader->objects[cell] == NULL) {
+            pending[count++] = cell;
+            cell = reader->objectLengths[cell];
+        }
+        while (count > 0) {
+            cell = pending[--count];
+            ObjList* tail = (ObjList*)objectAt(reader, reader->objectLengths[cell]);
+            reader->objects[cell] = (Obj*)mochiListCons(reader->vm, FALSE_VAL, tail);
+        }
+    }
+    readerFree(reader, pending);
+}
+
+static void readObjectsInPhase(ImageReader* reader, size_t start, ObjectPhase phase) {
+    reader->pos = start;
+    for (uint32_t i = 0; i < reader->objectCount && !reader->failed; i++) {
+        readObject(reader, i, phase);
+    }
+}
+
+static void readObjects(ImageReader* reader) {
+    uint32_t count = readU32(reader);
+    if (reader->failed) {
+        return;
+    }
+    // Every object takes at least its type byte, which bounds the tables allocated here.
+    if (count > reader->size - reader->pos) {
+        readerError(reader, "File is truncated.");
+        return;
+    }
+
+    size_t start = reader->pos;
+    reader->objectCount = count;
+    if (!reader->apply) {
+        reader->objectTypes = readerAllocate(reader, count * sizeof(uint8_t));
+        reader->objectLengths = readerAllocate(reader, count * sizeof(uint32_t));
+        readObjectsInPhase(reader, start, PHASE_MEASURE);
+        readObjectsInPhase(reader, start, PHASE_CHECK);
+        checkListChains(reader);
+    } else {
+        reader->objects = readerAllocate(reader, count * sizeof(Obj*));
+        readObjectsInPhase(reader, start, PHASE_ALLOCATE);
+        allocateLists(reader);
+        readObjectsInPhase(reader, start, PHASE_ALLOCATE_SLICES);
+        readObjectsInPhase(reader, start, PHASE_FILL);
+    }
+}
+
+static void readSnapshotRoots(ImageReader* reader) {
+    MochiVM* vm = reader->vm;
+    ObjectPhase phase = reader->apply ? PHASE_FILL : PHASE_CHECK;
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+        uint8_t kind = readU8(reader);
+        Value value = FALSE_VAL;
+        if (kind > CONST_KIND_OBJ) {
+            readerError(reader, "Snapshot contains a constant of unknown kind.");
+        }
+        readValue(reader, phase, &value);
+        if (reader->apply) {
+            mochiByteBufferWrite(vm, &vm->constantKinds, kind);
+            mochiValueBufferWrite(vm, &vm->constants, value);
+        }
+    }
+
+    uint32_t refCount = readU32(reader);
+    for (uint32_t i = 0; i < refCount && !reader->failed; i++) {
+        uint32_t index = readObjectIndex(reader, phase, OBJ_REF, false);
+        if (reader->apply) {
+            mochiValueBufferWrite(vm, &vm->snapshotRefs, OBJ_VAL(objectAt(reader, index)));
+        }
+    }
+}
+
+static void readImage(ImageReader* reader, bool snapshot) {
+    if (snapshot) {
+        readSections(reader, MOCHIVM_SNAPSHOT_MAGIC, true);
+        readObjects(reader);
+        readSnapshotRoots(reader);
+    } else {
+        readSections(reader, MOCHIVM_MODULE_MAGIC, false);
+        readModuleConstants(reader);
+    }
+
+    if (!reader->failed && reader->pos != reader->size) {
+        readerError(reader, "File has trailing data.");
+    }
+}
+
+static void* mapImage(MochiVM* vm, const char* path, size_t* size) {
+#if MOCHIVM_MODULE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    *size = info.st_size;
+    return mapping;
+#else
+    // Without mmap, read the whole file into a single allocation instead, which is still
+    // only one copy of the code with no per-byte buffer growth.
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length <= 0) {
+        fclose(file);
+        return NULL;
+    }
+    void* mapping = vm->config.reallocateFn(NULL, length, vm->config.userData);
+    if (mapping != NULL && fread(mapping, 1, length, file) != (size_t)length) {
+        vm->config.reallocateFn(mapping, 0, vm->config.userData);
+        mapping = NULL;
+    }
+    fclose(file);
+    *size = length;
+    return mapping;
+#endif
+}
+
+static void unmapImage(MochiVM* vm, void* mapping, size_t size) {
+#if MOCHIVM_MODULE_MMAP
+    munmap(mapping, size);
+#else
+    vm->config.reallocateFn(mapping, 0, vm->config.userData);
+#endif
+}
+
+static bool loadImage(MochiVM* vm, const char* path, bool snapshot) {
+    if (vm->code.count > 0 || vm->constants.count > 0 || vm->labels.count > 0 || vm->snapshotRefs.count > 0) {
+        reportImageError(vm, path, "Modules and snapshots can only be loaded into a VM with no code.");
+        return false;
+    }
+    // Nothing read from the image is reachable by the collector until loading is complete,
+    // which is only safe while there are no fibers that could trigger a collection.
+    if (mochiThreadCount(vm) > 0) {
+        reportImageError(vm, path, "Modules and snapshots can only be loaded into a VM with no fibers.");
+        return false;
+    }
+
+    size_t size = 0;
+    void* mapping = mapImage(vm, path, &size);
+    if (mapping == NULL) {
+        reportImageError(vm, path, "Could not open file.");
+        return false;
+    }
+
+    ImageReader reader;
+    memset(&reader, 0, sizeof(ImageReader));
+    reader.vm = vm;
+    reader.path = path;
+    reader.data = mapping;
+    reader.size = size;
+    readImage(&reader, snapshot);
+
+    if (!reader.failed) {
+        mochiByteBufferClear(vm, &vm->code);
+        mochiLineRunBufferClear(vm, &vm->lines);
+        reader.pos = 0;
+        reader.apply = true;
+        readImage(&reader, snapshot);
+        ASSERT(!reader.failed, "Image changed between validating and loading.");
+    }
+
+    readerFree(&reader, reader.objectTypes);
+    readerFree(&reader, reader.objectLengths);
+    readerFree(&reader, reader.objects);
+    if (reader.failed) {
+        unmapImage(vm, mapping, size);
+        return false;
+    }
+
+    vm->moduleMapping = mapping;
+    vm->moduleMappingSize = size;
+    vm->verified = false;
+    return true;
+}
+
+bool mochiLoadModule(MochiVM* vm, const char* path) {
+    return loadImage(vm, path, false);
+}
+
+bool mochiLoadSnapshot(MochiVM* vm, const char* path) {
+    return loadImage(vm, path, true);
+}
+
+void mochiReleaseModule(MochiVM* vm, bool keepCode) {
+    ASSERT(vm->moduleMapping != NULL, "No module is mapped.");
+
+    ByteBuffer code;
+    mochiByteBufferInit(&code);
+    if (keepCode && vm->code.count > 0) {
+        mochiByteBufferFill(vm, &code, 0, vm->code.count);
+        memcpy(code.data, vm->code.data, vm->code.count);
+    }
+
+    unmapImage(vm, vm->moduleMapping, vm->moduleMappingSize);
+    vm->moduleMapping = NULL;
+    vm->moduleMappingSize = 0;
+    vm->code = code;
+}
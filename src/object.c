@@ -1,5 +1,9 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "kernels.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -71,60 +75,357 @@ ObjHandleFrame* mochinewHandleFrame(MochiVM* vm, int handleId, uint8_t paramCoun
     return frame;
 }
 
-ObjFiber* mochiNewFiber(MochiVM* vm, uint8_t* first, Value* initialStack, int initialStackCount) {
-    // Allocate the arrays before the fiber in case it triggers a GC.
-    Value* values = ALLOCATE_ARRAY(vm, Value, vm->config.valueStackCapacity);
-    ObjVarFrame** frames = ALLOCATE_ARRAY(vm, ObjVarFrame*, vm->config.frameStackCapacity);
-    Obj** roots = ALLOCATE_ARRAY(vm, Obj*, vm->config.rootStackCapacity);
-
-    ObjFiber* fiber = ALLOCATE(vm, ObjFiber);
-    initObj(vm, (Obj*)fiber, OBJ_FIBER);
-    fiber->valueStack = values;
-    fiber->valueStackTop = values;
-    fiber->frameStack = frames;
-    fiber->frameStackTop = frames;
-    fiber->rootStack = roots;
-    fiber->rootStackTop = roots;
+// Takes stacks with at least the given capacities from the fiber pool, or allocates them if the
+// pool is empty. Pooled stacks too small for the current code are freed.
+static void takeStacks(MochiVM* vm, FiberStacks* stacks, int valueCapacity, int frameCapacity) {
+    FiberPool* pool = &vm->fiberPool;
+    bool pooled = false;
+    mtx_lock(&pool->lock);
+    if (pool->stackCount > 0) {
+        *stacks = pool->stacks[--pool->stackCount];
+        pooled = true;
+    }
+    mtx_unlock(&pool->lock);
 
-    for (int i = 0; i < initialStackCount; i++) {
-        values[i] = initialStack[i];
+    if (pooled) {
+        if (stacks->valueCapacity >= valueCapacity && stacks->frameCapacity >= frameCapacity &&
+            stacks->rootCapacity >= vm->rootStackCapacity) {
+            return;
+        }
+        DEALLOCATE(vm, stacks->values);
+        DEALLOCATE(vm, stacks->frames);
+        DEALLOCATE(vm, stacks->roots);
     }
-    fiber->valueStackTop += initialStackCount;
+    stacks->values = ALLOCATE_ARRAY(vm, Value, valueCapacity);
+    stacks->frames = ALLOCATE_ARRAY(vm, ObjVarFrame*, frameCapacity);
+    stacks->roots = ALLOCATE_ARRAY(vm, Obj*, vm->rootStackCapacity);
+    stacks->valueCapacity = valueCapacity;
+    stacks->frameCapacity = frameCapacity;
+    stacks->rootCapacity = vm->rootStackCapacity;
+}
+
+// Takes a fiber object from the fiber pool, or allocates one if the pool is empty, and gives it
+// the stacks and a fresh state.
+static ObjFiber* newFiberWith(MochiVM* vm, FiberStacks* stacks, uint8_t* first) {
+    FiberPool* pool = &vm->fiberPool;
+    mtx_lock(&pool->lock);
+    Obj* object = pool->objects;
+    if (object != NULL) {
+        pool->objects = object->next;
+        pool->objectCount--;
+    }
+    mtx_unlock(&pool->lock);
+    if (object == NULL) {
+        object = (Obj*)ALLOCATE(vm, ObjFiber);
+    }
+
+    ObjFiber* fiber = (ObjFiber*)object;
+    initObj(vm, object, OBJ_FIBER);
+    fiber->valueStack = stacks->values;
+    fiber->valueStackTop = stacks->values;
+    fiber->valueStackEnd = stacks->values + stacks->valueCapacity;
+    fiber->frameStack = stacks->frames;
+    fiber->frameStackTop = stacks->frames;
+    fiber->frameStackEnd = stacks->frames + stacks->frameCapacity;
+    fiber->sharedValues = NULL;
+    fiber->sharedValueCount = 0;
+    fiber->sharedFrames = NULL;
+    fiber->sharedFrameCount = 0;
+    fiber->rootStack = stacks->roots;
+    fiber->rootStackTop = stacks->roots;
+    fiber->rootStackEnd = stacks->roots + stacks->rootCapacity;
 
     fiber->isSuspended = false;
     fiber->caller = NULL;
     fiber->ip = first;
 
-    fiber->isPausedForGc = false;
+    fiber->state = FIBER_READY;
+    fiber->result = 0;
+    fiber->wakeTime = 0;
+    fiber->joining = NULL;
+    fiber->joiners = NULL;
+    fiber->nextJoiner = NULL;
+    fiber->waitCount = 0;
+    atomic_init(&fiber->channelPark, 0);
+    fiber->registryIndex = -1;
+    fiber->isParTask = false;
+    fiber->isParWaiting = false;
+    atomic_init(&fiber->parRemaining, 0);
+    atomic_init(&fiber->parFailed, false);
+    fiber->parResult = 0;
+    return fiber;
+}
+
+ObjFiber* mochiNewFiber(MochiVM* vm, uint8_t* first, Value* initialStack, int initialStackCount) {
+    // The initial values must fit with the headroom still left above them.
+    int valueCapacity = vm->valueStackCapacity;
+    if (initialStackCount + vm->valueStackHeadroom > valueCapacity) {
+        valueCapacity = initialStackCount + vm->valueStackHeadroom;
+    }
+
+    // Take the stacks before the fiber in case allocating them triggers a GC.
+    FiberStacks stacks;
+    takeStacks(vm, &stacks, valueCapacity, vm->frameStackCapacity);
+    ObjFiber* fiber = newFiberWith(vm, &stacks, first);
+
+    for (int i = 0; i < initialStackCount; i++) {
+        stacks.values[i] = initialStack[i];
+    }
+    fiber->valueStackTop += initialStackCount;
     return fiber;
 }
 
+static ObjStackSegment* newStackSegment(MochiVM* vm, ObjStackSegment* below, int belowCount, bool holdsFrames) {
+    ObjStackSegment* segment = ALLOCATE(vm, ObjStackSegment);
+    initObj(vm, (Obj*)segment, OBJ_STACK_SEGMENT);
+    segment->below = below;
+    segment->belowCount = belowCount;
+    segment->holdsFrames = holdsFrames;
+    segment->count = 0;
+    segment->capacity = 0;
+    segment->values = NULL;
+    return segment;
+}
+
+// Moves what is on the value and frame stacks of [fiber] into new segments on top of those it
+// already shares, and gives it empty stacks to go on with. Stacks with nothing on them are left
+// alone, so copying a fiber again before it pushes anything makes no new segments.
+static void shareStacks(MochiVM* vm, ObjFiber* fiber) {
+    int valueCount = (int)(fiber->valueStackTop - fiber->valueStack);
+    if (valueCount > 0) {
+        ObjStackSegment* segment = newStackSegment(vm, fiber->sharedValues, fiber->sharedValueCount, false);
+        Value* stack = ALLOCATE_ARRAY(vm, Value, vm->valueStackCapacity);
+        segment->values = fiber->valueStack;
+        segment->count = valueCount;
+        segment->capacity = (int)(fiber->valueStackEnd - fiber->valueStack);
+        fiber->sharedValues = segment;
+        fiber->sharedValueCount += valueCount;
+        fiber->valueStack = stack;
+        fiber->valueStackTop = stack;
+        fiber->valueStackEnd = stack + vm->valueStackCapacity;
+    }
+
+    int frameCount = (int)(fiber->frameStackTop - fiber->frameStack);
+    if (frameCount > 0) {
+        ObjStackSegment* segment = newStackSegment(vm, fiber->sharedFrames, fiber->sharedFrameCount, true);
+        ObjVarFrame** stack = ALLOCATE_ARRAY(vm, ObjVarFrame*, vm->frameStackCapacity);
+        segment->frames = fiber->frameStack;
+        segment->count = frameCount;
+        segment->capacity = (int)(fiber->frameStackEnd - fiber->frameStack);
+        fiber->sharedFrames = segment;
+        fiber->sharedFrameCount += frameCount;
+        fiber->frameStack = stack;
+        fiber->frameStackTop = stack;
+        fiber->frameStackEnd = stack + vm->frameStackCapacity;
+    }
+}
+
 ObjFiber* mochiFiberClone(MochiVM* vm, ObjFiber* original) {
-    Value* values = ALLOCATE_ARRAY(vm, Value, vm->config.valueStackCapacity);
-    ObjVarFrame** frames = ALLOCATE_ARRAY(vm, ObjVarFrame*, vm->config.frameStackCapacity);
-    Obj** roots = ALLOCATE_ARRAY(vm, Obj*, vm->config.rootStackCapacity);
-
-    valueArrayCopy(values, original->valueStack, mochiFiberValueCount(original));
-    memcpy(frames, original->frameStack, mochiFiberFrameCount(original));
-    OBJ_ARRAY_COPY(roots, original->rootStack, mochiFiberRootCount(original));
-
-    ObjFiber* fiber = ALLOCATE(vm, ObjFiber);
-    initObj(vm, (Obj*)fiber, OBJ_FIBER);
-    fiber->valueStack = values;
-    fiber->valueStackTop = values;
-    fiber->frameStack = frames;
-    fiber->frameStackTop = frames;
-    fiber->rootStack = roots;
-    fiber->rootStackTop = roots;
+    int rootCount = mochiFiberRootCount(original);
+    if (vm->verified) {
+        // Nothing else holds the segments until both fibers share them.
+        vm->collectionDeferrals++;
+        shareStacks(vm, original);
+        FiberStacks stacks;
+        takeStacks(vm, &stacks, vm->valueStackCapacity, vm->frameStackCapacity);
+        OBJ_ARRAY_COPY(stacks.roots, original->rootStack, rootCount);
+        ObjFiber* fiber = newFiberWith(vm, &stacks, original->ip);
+        fiber->rootStackTop += rootCount;
+        fiber->sharedValues = original->sharedValues;
+        fiber->sharedValueCount = original->sharedValueCount;
+        fiber->sharedFrames = original->sharedFrames;
+        fiber->sharedFrameCount = original->sharedFrameCount;
+        vm->collectionDeferrals--;
+        return fiber;
+    }
 
-    fiber->isSuspended = false;
-    fiber->caller = NULL;
-    fiber->ip = original->ip;
+    // Without the stack floors of verified code nothing would copy shared values back in time, so
+    // the clone gets its own copies, with only room for what is in use and the headroom above it
+    // rather than all the original has grown to. It grows again on demand like any other fiber.
+    int valueCount = (int)(original->valueStackTop - original->valueStack);
+    int frameCount = (int)(original->frameStackTop - original->frameStack);
+    int valueCapacity = vm->valueStackCapacity;
+    if (valueCount + vm->valueStackHeadroom > valueCapacity) {
+        valueCapacity = valueCount + vm->valueStackHeadroom;
+    }
+    int frameCapacity = vm->frameStackCapacity;
+    if (frameCount + vm->frameStackHeadroom > frameCapacity) {
+        frameCapacity = frameCount + vm->frameStackHeadroom;
+    }
+    FiberStacks stacks;
+    takeStacks(vm, &stacks, valueCapacity, frameCapacity);
 
-    fiber->isPausedForGc = false;
+    valueArrayCopy(stacks.values, original->valueStack, valueCount);
+    memcpy(stacks.frames, original->frameStack, sizeof(ObjVarFrame*) * frameCount);
+    OBJ_ARRAY_COPY(stacks.roots, original->rootStack, rootCount);
+
+    ObjFiber* fiber = newFiberWith(vm, &stacks, original->ip);
+    fiber->valueStackTop += valueCount;
+    fiber->frameStackTop += frameCount;
+    fiber->rootStackTop += rootCount;
     return fiber;
 }
 
+void mochiFiberRelease(MochiVM* vm, ObjFiber* fiber) {
+    if (fiber->valueStack == NULL) {
+        return;
+    }
+    FiberStacks stacks = {
+        .values = fiber->valueStack,
+        .frames = fiber->frameStack,
+        .roots = fiber->rootStack,
+        .valueCapacity = (int)(fiber->valueStackEnd - fiber->valueStack),
+        .frameCapacity = (int)(fiber->frameStackEnd - fiber->frameStack),
+        .rootCapacity = (int)(fiber->rootStackEnd - fiber->rootStack),
+    };
+    fiber->valueStack = fiber->valueStackTop = fiber->valueStackEnd = NULL;
+    fiber->frameStack = fiber->frameStackTop = fiber->frameStackEnd = NULL;
+    fiber->rootStack = fiber->rootStackTop = fiber->rootStackEnd = NULL;
+    fiber->sharedValues = fiber->sharedFrames = NULL;
+    fiber->sharedValueCount = fiber->sharedFrameCount = 0;
+
+    // Nothing scans pooled stacks, so the values left in them keep nothing alive. Stacks that grew
+    // far past the size fibers start with are not worth holding on to.
+    FiberPool* pool = &vm->fiberPool;
+    bool kept = false;
+    if (stacks.valueCapacity <= vm->valueStackCapacity * 2 && stacks.frameCapacity <= vm->frameStackCapacity * 2) {
+        mtx_lock(&pool->lock);
+        if (pool->stackCount < vm->config.fiberStackPoolSize) {
+            pool->stacks[pool->stackCount++] = stacks;
+            kept = true;
+        }
+        mtx_unlock(&pool->lock);
+    }
+    if (!kept) {
+        DEALLOCATE(vm, stacks.values);
+        DEALLOCATE(vm, stacks.frames);
+        DEALLOCATE(vm, stacks.roots);
+    }
+}
+
+// Keeps a fiber object the collector is freeing in the fiber pool, if there is room for it.
+static bool poolFiberObject(MochiVM* vm, ObjFiber* fiber) {
+    FiberPool* pool = &vm->fiberPool;
+    bool kept = false;
+    mtx_lock(&pool->lock);
+    if (pool->objectCount < vm->config.fiberObjectPoolSize) {
+        fiber->obj.next = pool->objects;
+        pool->objects = (Obj*)fiber;
+        pool->objectCount++;
+        kept = true;
+    }
+    mtx_unlock(&pool->lock);
+    return kept;
+}
+
+// Returns the capacity to grow a stack of [capacity] to so it can hold [needed] elements, doubling
+// it to keep the cost of growing constant over many pushes, or 0 if [needed] is over [limit].
+static int grownCapacity(int capacity, int needed, int limit) {
+    if (needed > limit) {
+        return 0;
+    }
+    int grown = capacity < 1 ? 1 : capacity;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    return grown < limit ? grown : limit;
+}
+
+// Copies the top [count] elements of [size] bytes shared through [segment] under the [used]
+// elements of [stack], which must have room for them, and returns the number still shared.
+static int pullShared(ObjStackSegment** segment, int shared, void* stack, int used, int count, size_t size) {
+    uint8_t* bottom = (uint8_t*)stack;
+    memmove(bottom + count * size, bottom, used * size);
+    int left = count;
+    while (left > 0) {
+        ObjStackSegment* from = *segment;
+        int taken = shared - from->belowCount < left ? shared - from->belowCount : left;
+        shared -= taken;
+        left -= taken;
+        memcpy(bottom + left * size, (uint8_t*)from->values + (shared - from->belowCount) * size, taken * size);
+        // Segments the fiber no longer reaches into are left for the collector.
+        while (*segment != NULL && shared <= (*segment)->belowCount) {
+            *segment = shared > 0 ? (*segment)->below : NULL;
+        }
+    }
+    return shared;
+}
+
+// Grows the stacks of [fiber] as mochiFiberReserve does, first copying shared values and frames
+// onto them until there are at least [valueFloor] and [frameFloor] of them, or all it has.
+static bool reserveStacks(MochiVM* vm, ObjFiber* fiber, int valueFloor, int frameFloor, int values, int frames) {
+    int valueCount = (int)(fiber->valueStackTop - fiber->valueStack);
+    int valuePull = valueFloor - valueCount < fiber->sharedValueCount ? valueFloor - valueCount
+                                                                       : fiber->sharedValueCount;
+    valuePull = valuePull > 0 ? valuePull : 0;
+    int valueCapacity = (int)(fiber->valueStackEnd - fiber->valueStack);
+    if (valueCount + valuePull + values > valueCapacity) {
+        // Shared values still count towards the configured capacity.
+        int limit = vm->config.valueStackCapacity - (fiber->sharedValueCount - valuePull);
+        int capacity = grownCapacity(valueCapacity, valueCount + valuePull + values, limit);
+        if (capacity == 0) {
+            return false;
+        }
+        // Growing may collect first, while the fiber still holds the old stack.
+        Value* stack = (Value*)mochiReallocate(vm, fiber->valueStack, sizeof(Value) * valueCapacity,
+                                               sizeof(Value) * capacity);
+        fiber->valueStack = stack;
+        fiber->valueStackTop = stack + valueCount;
+        fiber->valueStackEnd = stack + capacity;
+    }
+
+    int frameCount = (int)(fiber->frameStackTop - fiber->frameStack);
+    int framePull = frameFloor - frameCount < fiber->sharedFrameCount ? frameFloor - frameCount
+                                                                       : fiber->sharedFrameCount;
+    framePull = framePull > 0 ? framePull : 0;
+    int frameCapacity = (int)(fiber->frameStackEnd - fiber->frameStack);
+    if (frameCount + framePull + frames > frameCapacity) {
+        int limit = vm->config.frameStackCapacity - (fiber->sharedFrameCount - framePull);
+        int capacity = grownCapacity(frameCapacity, frameCount + framePull + frames, limit);
+        if (capacity == 0) {
+            return false;
+        }
+        ObjVarFrame** stack = (ObjVarFrame**)mochiReallocate(
+            vm, fiber->frameStack, sizeof(ObjVarFrame*) * frameCapacity, sizeof(ObjVarFrame*) * capacity);
+        fiber->frameStack = stack;
+        fiber->frameStackTop = stack + frameCount;
+        fiber->frameStackEnd = stack + capacity;
+    }
+
+    // Nothing is copied until both stacks have room, so a collection while growing them sees the
+    // fiber as it was.
+    if (valuePull > 0) {
+        fiber->sharedValueCount = pullShared(&fiber->sharedValues, fiber->sharedValueCount, fiber->valueStack,
+                                             valueCount, valuePull, sizeof(Value));
+        fiber->valueStackTop += valuePull;
+    }
+    if (framePull > 0) {
+        fiber->sharedFrameCount = pullShared(&fiber->sharedFrames, fiber->sharedFrameCount, fiber->frameStack,
+                                             frameCount, framePull, sizeof(ObjVarFrame*));
+        fiber->frameStackTop += framePull;
+    }
+    return true;
+}
+
+bool mochiFiberReserve(MochiVM* vm, ObjFiber* fiber, int values, int frames) {
+    // Copying twice the floor at a time means code popping steadily into shared values only stops
+    // to copy once every floor's worth of them.
+    return reserveStacks(vm, fiber, vm->valueStackFloor * 2, vm->frameStackFloor * 2, values, frames);
+}
+
+void mochiFiberReach(MochiVM* vm, ObjFiber* fiber, int values, int frames) {
+    if (fiber->sharedValues == NULL && fiber->sharedFrames == NULL) {
+        return;
+    }
+    // The shared values and frames already count towards the capacities, so copying them cannot fail.
+    PANIC_IF(reserveStacks(vm, fiber, values, frames, 0, 0),
+             "Copying shared values and frames went past the stack capacities.");
+}
+
+void mochiFiberUnshare(MochiVM* vm, ObjFiber* fiber) {
+    mochiFiberReach(vm, fiber, INT_MAX, INT_MAX);
+}
+
 ObjClosure* mochiNewClosure(MochiVM* vm, uint8_t* body, uint8_t paramCount, uint16_t capturedCount) {
     ObjClosure* closure = ALLOCATE_FLEX(vm, ObjClosure, Value, capturedCount);
     initObj(vm, (Obj*)closure, OBJ_CLOSURE);
@@ -167,6 +468,7 @@ ObjContinuation* mochiNewContinuation(MochiVM* vm, uint8_t* resume, uint8_t para
 ObjForeign* mochiNewForeign(MochiVM* vm, size_t size) {
     ObjForeign* object = ALLOCATE_FLEX(vm, ObjForeign, uint8_t, size);
     initObj(vm, (Obj*)object, OBJ_FOREIGN);
+    object->dataCount = (int)size;
 
     // Zero out the bytes.
     memset(object->data, 0, size);
@@ -188,13 +490,511 @@ ForeignResume* mochiNewResume(MochiVM* vm, ObjFiber* fiber) {
     return res;
 }
 
-ObjRef* mochiNewRef(MochiVM* vm, TableKey ptr) {
+ObjRef* mochiNewRef(MochiVM* vm, Value value) {
     ObjRef* ref = ALLOCATE(vm, ObjRef);
+#if MOCHIVM_NAN_TAGGING || MOCHIVM_POINTER_TAGGING
+    atomic_init(&ref->value, value);
+#else
+    atomic_flag_clear(&ref->lock);
+    ref->value = value;
+#endif
     initObj(vm, (Obj*)ref, OBJ_REF);
-    ref->ptr = ptr;
     return ref;
 }
 
+// The payload of an integer of [type], zero extended, so that integers of the same type compare
+// equal exactly when their payloads do.
+static uint64_t intPayload(ValueType type, Value value) {
+    switch (type) {
+    case VAL_I8: return (uint8_t)AS_I8(value);
+    case VAL_U8: return AS_U8(value);
+    case VAL_I16: return (uint16_t)AS_I16(value);
+    case VAL_U16: return AS_U16(value);
+    case VAL_I32: return (uint32_t)AS_I32(value);
+    case VAL_U32: return AS_U32(value);
+    case VAL_I64: return (uint64_t)AS_I64(value);
+    case VAL_U64: return AS_U64(value);
+    case VAL_BOOL:
+    case VAL_SINGLE:
+    case VAL_DOUBLE: break;
+    }
+    UNREACHABLE();
+    return 0;
+}
+
+static Value intFromPayload(MochiVM* vm, ValueType type, uint64_t payload) {
+    switch (type) {
+    case VAL_I8: return I8_VAL(vm, (int8_t)payload);
+    case VAL_U8: return U8_VAL(vm, (uint8_t)payload);
+    case VAL_I16: return I16_VAL(vm, (int16_t)payload);
+    case VAL_U16: return U16_VAL(vm, (uint16_t)payload);
+    case VAL_I32: return I32_VAL(vm, (int32_t)payload);
+    case VAL_U32: return U32_VAL(vm, (uint32_t)payload);
+    case VAL_I64: return I64_VAL(vm, (int64_t)payload);
+    case VAL_U64: return U64_VAL(vm, payload);
+    case VAL_BOOL:
+    case VAL_SINGLE:
+    case VAL_DOUBLE: break;
+    }
+    UNREACHABLE();
+    return FALSE_VAL;
+}
+
+#if MOCHIVM_NAN_TAGGING || MOCHIVM_POINTER_TAGGING
+
+// A tagged value fits in a machine word, so the cell is updated with compare and swap loops.
+// The collector only runs while every fiber is paused outside of these, so an object read from the
+// cell stays alive for the whole loop unless the loop allocates.
+
+Value mochiRefGet(ObjRef* ref) {
+    return atomic_load_explicit(&ref->value, memory_order_acquire);
+}
+
+void mochiRefPut(ObjRef* ref, Value value) {
+    atomic_store_explicit(&ref->value, value, memory_order_release);
+}
+
+Value mochiRefSwap(ObjRef* ref, Value value) {
+    return atomic_exchange_explicit(&ref->value, value, memory_order_acq_rel);
+}
+
+bool mochiRefCompareSwap(ObjRef* ref, ValueType type, Value expected, Value desired) {
+    uint64_t want = intPayload(type, expected);
+    Value current = atomic_load_explicit(&ref->value, memory_order_acquire);
+    while (intPayload(type, current) == want) {
+        if (atomic_compare_exchange_weak_explicit(&ref->value, &current, desired, memory_order_acq_rel,
+                                                  memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Value mochiRefFetchAdd(MochiVM* vm, ObjRef* ref, ValueType type, Value delta, Value* root) {
+    uint64_t add = intPayload(type, delta);
+    Value current = atomic_load_explicit(&ref->value, memory_order_acquire);
+    while (true) {
+        *root = current;
+        Value next = intFromPayload(vm, type, intPayload(type, current) + add);
+        if (atomic_compare_exchange_weak_explicit(&ref->value, &current, next, memory_order_acq_rel,
+                                                  memory_order_acquire)) {
+            return current;
+        }
+    }
+}
+
+#else
+
+static void lockRef(ObjRef* ref) {
+    while (atomic_flag_test_and_set_explicit(&ref->lock, memory_order_acquire)) {
+    }
+}
+
+static void unlockRef(ObjRef* ref) {
+    atomic_flag_clear_explicit(&ref->lock, memory_order_release);
+}
+
+Value mochiRefGet(ObjRef* ref) {
+    lockRef(ref);
+    Value value = ref->value;
+    unlockRef(ref);
+    return value;
+}
+
+void mochiRefPut(ObjRef* ref, Value value) {
+    lockRef(ref);
+    ref->value = value;
+    unlockRef(ref);
+}
+
+Value mochiRefSwap(ObjRef* ref, Value value) {
+    lockRef(ref);
+    Value old = ref->value;
+    ref->value = value;
+    unlockRef(ref);
+    return old;
+}
+
+bool mochiRefCompareSwap(ObjRef* ref, ValueType type, Value expected, Value desired) {
+    lockRef(ref);
+    bool equal = intPayload(type, ref->value) == intPayload(type, expected);
+    if (equal) {
+        ref->value = desired;
+    }
+    unlockRef(ref);
+    return equal;
+}
+
+// Union values never allocate, so the old value needs no root.
+Value mochiRefFetchAdd(MochiVM* vm, ObjRef* ref, ValueType type, Value delta, Value* root) {
+    lockRef(ref);
+    Value old = ref->value;
+    ref->value = intFromPayload(vm, type, intPayload(type, old) + intPayload(type, delta));
+    unlockRef(ref);
+    return old;
+}
+
+#endif
+
+static ChannelSegment* newChannelSegment(MochiVM* vm) {
+    ChannelSegment* segment = ALLOCATE(vm, ChannelSegment);
+    atomic_init(&segment->next, NULL);
+    segment->retired = NULL;
+    atomic_init(&segment->head, 0);
+    atomic_init(&segment->tail, 0);
+    for (int i = 0; i < MOCHIVM_CHANNEL_SEGMENT_SIZE; i++) {
+        atomic_init(&segment->slots[i].sequence, 0);
+    }
+    return segment;
+}
+
+static void initWaiters(ChannelWaiters* waiters) {
+    waiters->fibers = NULL;
+    atomic_init(&waiters->count, 0);
+    waiters->capacity = 0;
+}
+
+ObjChannel* mochiNewChannel(MochiVM* vm, uint32_t capacity) {
+    ASSERT(capacity <= INT32_MAX / sizeof(ChannelSlot), "Channel capacity is too large.");
+    // Allocate the first segment before the channel in case it triggers a GC.
+    ChannelSegment* segment = capacity == 0 ? newChannelSegment(vm) : NULL;
+    ObjChannel* channel = ALLOCATE_FLEX(vm, ObjChannel, ChannelSlot, capacity);
+    channel->capacity = capacity;
+    atomic_init(&channel->closed, false);
+    atomic_flag_clear(&channel->lock);
+    initWaiters(&channel->senders);
+    initWaiters(&channel->receivers);
+    atomic_init(&channel->sendPosition, 0);
+    atomic_init(&channel->receivePosition, 0);
+    for (uint32_t i = 0; i < capacity; i++) {
+        atomic_init(&channel->slots[i].sequence, i);
+    }
+    atomic_init(&channel->head, segment);
+    atomic_init(&channel->tail, segment);
+    atomic_init(&channel->retired, NULL);
+    initObj(vm, (Obj*)channel, OBJ_CHANNEL);
+    return channel;
+}
+
+static void lockChannel(ObjChannel* channel) {
+    while (atomic_flag_test_and_set_explicit(&channel->lock, memory_order_acquire)) {
+    }
+}
+
+static void unlockChannel(ObjChannel* channel) {
+    atomic_flag_clear_explicit(&channel->lock, memory_order_release);
+}
+
+// Takes [fiber] out of the channel park with [ticket], unless someone else already has.
+static bool claimPark(ObjFiber* fiber, uint64_t ticket) {
+    if (!atomic_compare_exchange_strong(&fiber->channelPark, &ticket, ticket + 1)) {
+        return false;
+    }
+    atomic_store(&fiber->state, FIBER_READY);
+    return true;
+}
+
+// Reads the channels [fiber] parks on off its stack, returning how many there are.
+static int parkChannels(ObjFiber* fiber, bool sending, ObjChannel** channels) {
+    int count = sending ? 1 : fiber->waitCount;
+    for (int i = 0; i < count; i++) {
+        channels[i] = AS_CHANNEL(mochiFiberPeekValue(fiber, sending ? 2 : i + 1));
+    }
+    return count;
+}
+
+// Drops the entries for [fiber] from the waiters of the [count] [channels] it parked on, once it
+// has been taken out of the park and before it is queued, so that a select leaves nothing behind
+// on the channels that did not wake it. An entry its park is still adding may be missed, but it is
+// stale, and dropped by the next wake or park on that channel.
+static void unlistWaiter(ObjFiber* fiber, bool sending, ObjChannel** channels, int count) {
+    for (int i = 0; i < count; i++) {
+        ChannelWaiters* waiters = sending ? &channels[i]->senders : &channels[i]->receivers;
+        lockChannel(channels[i]);
+        int total = atomic_load_explicit(&waiters->count, memory_order_relaxed);
+        int kept = 0;
+        for (int j = 0; j < total; j++) {
+            if (waiters->fibers[j].fiber != fiber) {
+                waiters->fibers[kept++] = waiters->fibers[j];
+            }
+        }
+        atomic_store_explicit(&waiters->count, kept, memory_order_relaxed);
+        unlockChannel(channels[i]);
+    }
+}
+
+// Wakes the longest parked fiber in [waiters] that is still in the park it was listed for. Stale
+// entries, from parks the fiber has since been taken out of, are dropped along the way.
+static void wakeWaiter(MochiVM* vm, ObjChannel* channel, ChannelWaiters* waiters) {
+    ObjFiber* woken = NULL;
+    lockChannel(channel);
+    int count = atomic_load_explicit(&waiters->count, memory_order_relaxed);
+    int taken = 0;
+    while (taken < count && woken == NULL) {
+        ChannelWaiter waiter = waiters->fibers[taken++];
+        if (claimPark(waiter.fiber, waiter.ticket)) {
+            woken = waiter.fiber;
+        }
+    }
+    memmove(waiters->fibers, waiters->fibers + taken, sizeof(ChannelWaiter) * (count - taken));
+    atomic_store_explicit(&waiters->count, count - taken, memory_order_relaxed);
+    unlockChannel(channel);
+    if (woken != NULL) {
+        // The woken fiber is not queued yet, so its stack still holds the channels it parked on.
+        ObjChannel* channels[UINT8_MAX];
+        bool sending = waiters == &channel->senders;
+        unlistWaiter(woken, sending, channels, parkChannels(woken, sending, channels));
+        mochiSchedulerWake(vm, woken);
+    }
+}
+
+// Wakes a fiber parked in [waiters] after a send or receive that may let it continue. The fence
+// pairs with the one in mochiChannelPark, so either the parking fiber sees the change to the
+// channel or this sees the fiber in [waiters].
+static void wakeAfter(MochiVM* vm, ObjChannel* channel, ChannelWaiters* waiters) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&waiters->count, memory_order_relaxed) > 0) {
+        wakeWaiter(vm, channel, waiters);
+    }
+}
+
+static bool sendBounded(ObjChannel* channel, Value value) {
+    uint64_t position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+    for (;;) {
+        ChannelSlot* slot = &channel->slots[position % channel->capacity];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t difference = (int64_t)(sequence - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->sendPosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->value = value;
+                atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // The slot still holds the value sent a lap ago.
+            return false;
+        } else {
+            position = atomic_load_explicit(&channel->sendPosition, memory_order_relaxed);
+        }
+    }
+}
+
+static bool receiveBounded(ObjChannel* channel, Value* value) {
+    uint64_t position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+    for (;;) {
+        ChannelSlot* slot = &channel->slots[position % channel->capacity];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t difference = (int64_t)(sequence - (position + 1));
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->receivePosition, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *value = slot->value;
+                atomic_store_explicit(&slot->sequence, position + channel->capacity, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = atomic_load_explicit(&channel->receivePosition, memory_order_relaxed);
+        }
+    }
+}
+
+static void sendUnbounded(MochiVM* vm, ObjChannel* channel, Value value) {
+    ChannelSegment* spare = NULL;
+    for (;;) {
+        ChannelSegment* segment = atomic_load_explicit(&channel->tail, memory_order_acquire);
+        int64_t index = atomic_fetch_add_explicit(&segment->tail, 1, memory_order_relaxed);
+        if (index < MOCHIVM_CHANNEL_SEGMENT_SIZE) {
+            ChannelSlot* slot = &segment->slots[index];
+            slot->value = value;
+            atomic_store_explicit(&slot->sequence, 1, memory_order_release);
+            break;
+        }
+        ChannelSegment* next = atomic_load_explicit(&segment->next, memory_order_acquire);
+        if (next == NULL) {
+            if (spare == NULL) {
+                // Allocating may collect, which frees retired segments, so start over afterwards
+                // rather than touch [segment] again.
+                spare = newChannelSegment(vm);
+                continue;
+            }
+            if (atomic_compare_exchange_strong_explicit(&segment->next, &next, spare, memory_order_acq_rel,
+                                                        memory_order_acquire)) {
+                next = spare;
+                spare = NULL;
+            }
+        }
+        atomic_compare_exchange_strong_explicit(&channel->tail, &segment, next, memory_order_acq_rel,
+                                                memory_order_relaxed);
+    }
+    if (spare != NULL) {
+        DEALLOCATE(vm, spare);
+    }
+}
+
+static bool receiveUnbounded(ObjChannel* channel, Value* value) {
+    for (;;) {
+        ChannelSegment* segment = atomic_load_explicit(&channel->head, memory_order_acquire);
+        int64_t index = atomic_load_explicit(&segment->head, memory_order_acquire);
+        if (index >= MOCHIVM_CHANNEL_SEGMENT_SIZE) {
+            ChannelSegment* next = atomic_load_explicit(&segment->next, memory_order_acquire);
+            if (next == NULL) {
+                return false;
+            }
+            if (atomic_compare_exchange_strong_explicit(&channel->head, &segment, next, memory_order_acq_rel,
+                                                        memory_order_relaxed)) {
+                ChannelSegment* retired = atomic_load_explicit(&channel->retired, memory_order_relaxed);
+                do {
+                    segment->retired = retired;
+                } while (!atomic_compare_exchange_weak_explicit(&channel->retired, &retired, segment,
+                                                                memory_order_release, memory_order_relaxed));
+            }
+            continue;
+        }
+        ChannelSlot* slot = &segment->slots[index];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) == 0) {
+            if (atomic_load_explicit(&segment->tail, memory_order_acquire) <= index) {
+                return false;
+            }
+            // A sender has claimed the slot and is about to fill it.
+            thrd_yield();
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&segment->head, &index, index + 1, memory_order_acq_rel,
+                                                  memory_order_relaxed)) {
+            *value = slot->value;
+            return true;
+        }
+    }
+}
+
+ChannelStatus mochiChannelSend(MochiVM* vm, ObjChannel* channel, Value value) {
+    if (atomic_load_explicit(&channel->closed, memory_order_acquire)) {
+        return CHANNEL_CLOSED;
+    }
+    if (channel->capacity == 0) {
+        sendUnbounded(vm, channel, value);
+    } else if (!sendBounded(channel, value)) {
+        return CHANNEL_BLOCKED;
+    }
+    wakeAfter(vm, channel, &channel->receivers);
+    return CHANNEL_OK;
+}
+
+ChannelStatus mochiChannelReceive(MochiVM* vm, ObjChannel* channel, Value* value) {
+    // Checked first, so that everything sent before the channel was closed is received before
+    // receiving fails.
+    bool closed = atomic_load_explicit(&channel->closed, memory_order_acquire);
+    if (channel->capacity == 0 ? receiveUnbounded(channel, value) : receiveBounded(channel, value)) {
+        if (channel->capacity > 0) {
+            wakeAfter(vm, channel, &channel->senders);
+        }
+        return CHANNEL_OK;
+    }
+    return closed ? CHANNEL_CLOSED : CHANNEL_BLOCKED;
+}
+
+void mochiChannelClose(MochiVM* vm, ObjChannel* channel) {
+    atomic_store(&channel->closed, true);
+    while (atomic_load(&channel->receivers.count) > 0) {
+        wakeWaiter(vm, channel, &channel->receivers);
+    }
+    while (atomic_load(&channel->senders.count) > 0) {
+        wakeWaiter(vm, channel, &channel->senders);
+    }
+}
+
+// Whether a send or receive on [channel] might no longer block. It may be wrong in favour of
+// waking, since a woken fiber just tries again.
+static bool channelReady(ObjChannel* channel, bool sending) {
+    if (atomic_load(&channel->closed)) {
+        return true;
+    }
+    if (channel->capacity > 0) {
+        uint64_t sent = atomic_load(&channel->sendPosition);
+        uint64_t received = atomic_load(&channel->receivePosition);
+        return sending ? sent - received < channel->capacity : sent != received;
+    }
+    ChannelSegment* segment = atomic_load(&channel->head);
+    return atomic_load(&segment->head) < atomic_load(&segment->tail) || atomic_load(&segment->next) != NULL;
+}
+
+// Lists [fiber] in [waiters] for the park with [ticket], unless a select already listed it there,
+// dropping stale entries along the way.
+static void addWaiter(MochiVM* vm, ObjChannel* channel, ChannelWaiters* waiters, ObjFiber* fiber, uint64_t ticket) {
+    lockChannel(channel);
+    int count = atomic_load_explicit(&waiters->count, memory_order_relaxed);
+    int kept = 0;
+    bool listed = false;
+    for (int i = 0; i < count; i++) {
+        ChannelWaiter waiter = waiters->fibers[i];
+        listed = listed || (waiter.fiber == fiber && waiter.ticket == ticket);
+        if (atomic_load(&waiter.fiber->channelPark) == waiter.ticket) {
+            waiters->fibers[kept++] = waiter;
+        }
+    }
+    if (!listed) {
+        if (kept == waiters->capacity) {
+            // Kept outside the collected heap, since parking happens while a collection may run.
+            int capacity = waiters->capacity < 4 ? 4 : waiters->capacity * 2;
+            waiters->fibers =
+                vm->config.reallocateFn(waiters->fibers, sizeof(ChannelWaiter) * capacity, vm->config.userData);
+            PANIC_IF(waiters->fibers != NULL, "Out of memory while parking a fiber on a channel.");
+            waiters->capacity = capacity;
+        }
+        waiters->fibers[kept++] = (ChannelWaiter){fiber, ticket};
+    }
+    atomic_store_explicit(&waiters->count, kept, memory_order_relaxed);
+    unlockChannel(channel);
+}
+
+bool mochiChannelPark(MochiVM* vm, ObjFiber* fiber) {
+    // Once parked the fiber may be woken and run by another worker, so the channels are read off
+    // its stack first.
+    ObjChannel* channels[UINT8_MAX];
+    bool sending = fiber->state == FIBER_SENDING;
+    int count = parkChannels(fiber, sending, channels);
+
+    // Only this worker moves [channelPark] on while the fiber is not parked.
+    uint64_t ticket = atomic_load(&fiber->channelPark) + 1;
+    atomic_store(&fiber->state, FIBER_CHANNEL_PARKED);
+    atomic_store(&fiber->channelPark, ticket);
+    for (int i = 0; i < count; i++) {
+        addWaiter(vm, channels[i], sending ? &channels[i]->senders : &channels[i]->receivers, fiber, ticket);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    bool ready = false;
+    for (int i = 0; i < count && !ready; i++) {
+        ready = channelReady(channels[i], sending);
+    }
+    if (!ready || !claimPark(fiber, ticket)) {
+        return false;
+    }
+    unlistWaiter(fiber, sending, channels, count);
+    return true;
+}
+
+ObjPromise* mochiNewPromise(MochiVM* vm) {
+    ObjPromise* promise = ALLOCATE(vm, ObjPromise);
+    initObj(vm, (Obj*)promise, OBJ_PROMISE);
+    atomic_init(&promise->isSettled, false);
+    promise->value = FALSE_VAL;
+    promise->awaiters = NULL;
+    promise->prevPending = NULL;
+
+    Scheduler* scheduler = &vm->scheduler;
+    mtx_lock(&scheduler->lock);
+    promise->nextPending = vm->pendingPromises;
+    if (vm->pendingPromises != NULL) {
+        vm->pendingPromises->prevPending = promise;
+    }
+    vm->pendingPromises = promise;
+    mtx_unlock(&scheduler->lock);
+    return promise;
+}
+
 ObjStruct* mochiNewStruct(MochiVM* vm, StructId id, int elemCount) {
     ObjStruct* stru = ALLOCATE_FLEX(vm, ObjStruct, Value, elemCount);
     initObj(vm, (Obj*)stru, OBJ_STRUCT);
@@ -203,287 +1003,1636 @@ ObjStruct* mochiNewStruct(MochiVM* vm, StructId id, int elemCount) {
     return stru;
 }
 
-ObjList* mochiListNil(MochiVM* vm) {
-    return NULL;
+ObjList* mochiListNil(MochiVM* vm) {
+    return NULL;
+}
+
+static ObjListChunk* newListChunk(MochiVM* vm, int capacity, ObjList* next) {
+    ObjListChunk* chunk = ALLOCATE_FLEX(vm, ObjListChunk, ObjList, capacity);
+    initObj(vm, (Obj*)chunk, OBJ_LIST_CHUNK);
+    atomic_init(&chunk->used, 0);
+    chunk->capacity = capacity;
+    chunk->next = next;
+    chunk->nextLength = mochiListLength(next);
+    return chunk;
+}
+
+// Fills in the already claimed cell at [index] of [chunk].
+static ObjList* initListCell(ObjListChunk* chunk, int index, Value elem) {
+    ObjList* cell = &chunk->cells[index];
+    cell->obj.type = OBJ_LIST;
+    cell->obj.isMarked = false;
+    cell->obj.next = (Obj*)chunk;
+    cell->elem = elem;
+    return cell;
+}
+
+static int listCellIndex(ObjList* list) {
+    return (int)(list - LIST_CHUNK(list)->cells);
+}
+
+ObjList* mochiListCons(MochiVM* vm, Value elem, ObjList* tail) {
+    int capacity = 1;
+    if (tail != NULL) {
+        ObjListChunk* chunk = LIST_CHUNK(tail);
+        int above = listCellIndex(tail) + 1;
+        // Only one of the lists consing onto the same cell can claim the cell above it.
+        int claimed = above;
+        if (above < chunk->capacity && atomic_compare_exchange_strong(&chunk->used, &claimed, above + 1)) {
+            return initListCell(chunk, above, elem);
+        }
+        // A list that continues past a full chunk gets a larger one, while a list forking from
+        // the middle of a chunk starts small again.
+        if (above == chunk->capacity) {
+            capacity = chunk->capacity * 2 < MOCHIVM_LIST_CHUNK ? chunk->capacity * 2 : MOCHIVM_LIST_CHUNK;
+        }
+    }
+
+    ObjListChunk* chunk = newListChunk(vm, capacity, tail);
+    atomic_store(&chunk->used, 1);
+    return initListCell(chunk, 0, elem);
+}
+
+ObjList* mochiListTail(ObjList* list) {
+    int index = listCellIndex(list);
+    return index > 0 ? list - 1 : LIST_CHUNK(list)->next;
+}
+
+Value mochiListHead(ObjList* list) {
+    return list->elem;
+}
+
+int mochiListLength(ObjList* list) {
+    if (list == NULL) {
+        return 0;
+    }
+    return LIST_CHUNK(list)->nextLength + listCellIndex(list) + 1;
+}
+
+ObjList* mochiListAppend(MochiVM* vm, ObjList* prefix, ObjList* suffix) {
+    if (prefix == NULL) {
+        return suffix;
+    }
+    if (suffix == NULL) {
+        return prefix;
+    }
+
+    // The copy is built head first in a single walk of the prefix. Every chunk of it is full but
+    // the one holding the head, and each is linked in below the one before it.
+    vm->collectionDeferrals++;
+    int remaining = mochiListLength(prefix);
+    int suffixLength = mochiListLength(suffix);
+    ObjList* head = NULL;
+    ObjListChunk* above = NULL;
+    while (remaining > 0) {
+        int count = (remaining - 1) % MOCHIVM_LIST_CHUNK + 1;
+        ObjListChunk* chunk = newListChunk(vm, count, NULL);
+        chunk->nextLength = remaining - count + suffixLength;
+        atomic_store(&chunk->used, count);
+        for (int i = count - 1; i >= 0; i--) {
+            initListCell(chunk, i, prefix->elem);
+            prefix = mochiListTail(prefix);
+        }
+
+        if (above == NULL) {
+            head = &chunk->cells[count - 1];
+        } else {
+            above->next = &chunk->cells[count - 1];
+        }
+        above = chunk;
+        remaining -= count;
+    }
+    above->next = suffix;
+    vm->collectionDeferrals--;
+    return head;
+}
+
+ObjList* mochiListAppendInPlace(ObjList* prefix, ObjList* suffix) {
+    if (prefix == NULL) {
+        return suffix;
+    }
+
+    // Every chunk below the head grows by the length of the suffix, and the last one links to it.
+    int suffixLength = mochiListLength(suffix);
+    ObjListChunk* chunk = LIST_CHUNK(prefix);
+    while (true) {
+        chunk->nextLength += suffixLength;
+        if (chunk->next == NULL) {
+            break;
+        }
+        chunk = LIST_CHUNK(chunk->next);
+    }
+    chunk->next = suffix;
+    return prefix;
+}
+
+ObjArray* mochiArrayNil(MochiVM* vm) {
+    ObjArray* arr = ALLOCATE(vm, ObjArray);
+    initObj(vm, (Obj*)arr, OBJ_ARRAY);
+    mochiValueBufferInit(&arr->elems);
+    return arr;
+}
+
+ObjArray* mochiArrayFill(MochiVM* vm, int amount, Value elem, ObjArray* array) {
+    mochiValueBufferFill(vm, &array->elems, elem, amount);
+    return array;
+}
+
+ObjArray* mochiArraySnoc(MochiVM* vm, Value elem, ObjArray* array) {
+    mochiValueBufferWrite(vm, &array->elems, elem);
+    return array;
+}
+
+Value mochiArrayGetAt(int index, ObjArray* array) {
+    ASSERT(array->elems.count > index, "Tried to access an element beyond the bounds of the Array.");
+    return array->elems.data[index];
+}
+
+void mochiArraySetAt(int index, Value value, ObjArray* array) {
+    ASSERT(array->elems.count > index, "Tried to modify an element beyond the bounds of the Array.");
+    array->elems.data[index] = value;
+}
+
+int mochiArrayLength(ObjArray* array) {
+    return array->elems.count;
+}
+
+ObjArray* mochiArrayCopy(MochiVM* vm, int start, int length, ObjArray* array) {
+    ASSERT(start + length <= array->elems.count,
+           "Tried to copy elements beyond the length of the source Array.");
+    ValueBuffer elems;
+    mochiValueBufferInit(&elems);
+    mochiValueBufferReserve(vm, &elems, length);
+    mochiValueBufferAppend(vm, &elems, array->elems.data + start, length);
+    ObjArray* copy = mochiArrayNil(vm);
+    copy->elems = elems;
+    return copy;
+}
+
+ObjArray* mochiArrayConcat(MochiVM* vm, ObjArray* a, ObjArray* b) {
+    // The elements are copied before the new array is allocated, so that the buffer is never
+    // reachable from an unrooted object.
+    ValueBuffer elems;
+    mochiValueBufferInit(&elems);
+    mochiValueBufferReserve(vm, &elems, a->elems.count + b->elems.count);
+    mochiValueBufferAppend(vm, &elems, a->elems.data, a->elems.count);
+    mochiValueBufferAppend(vm, &elems, b->elems.data, b->elems.count);
+    ObjArray* cat = mochiArrayNil(vm);
+    cat->elems = elems;
+    return cat;
+}
+
+ObjArray* mochiArrayAppend(MochiVM* vm, ObjArray* array, ObjArray* other) {
+    mochiValueBufferAppend(vm, &array->elems, other->elems.data, other->elems.count);
+    return array;
+}
+
+ObjSlice* mochiArraySlice(MochiVM* vm, int start, int length, ObjArray* array) {
+    ASSERT(start + length <= array->elems.count,
+           "Tried to creat a Slice that accesses elements beyond the length of the source Array.");
+    ObjSlice* slice = ALLOCATE(vm, ObjSlice);
+    initObj(vm, (Obj*)slice, OBJ_SLICE);
+    slice->start = start;
+    slice->count = length;
+    slice->source = array;
+    return slice;
+}
+
+ObjSlice* mochiSubslice(MochiVM* vm, int start, int length, ObjSlice* slice) {
+    return mochiArraySlice(vm, start + slice->start, length, slice->source);
+}
+
+Value mochiSliceGetAt(int index, ObjSlice* slice) {
+    ASSERT(slice->count > index, "Tried to access an element beyond the bounds of the Slice.");
+    return slice->source->elems.data[slice->start + index];
+}
+
+void mochiSliceSetAt(int index, Value value, ObjSlice* slice) {
+    ASSERT(slice->count > index, "Tried to modify an element beyond the bounds of the Slice.");
+    slice->source->elems.data[slice->start + index] = value;
+}
+
+int mochiSliceLength(ObjSlice* slice) {
+    return slice->count;
+}
+
+ObjArray* mochiSliceCopy(MochiVM* vm, ObjSlice* slice) {
+    ValueBuffer elems;
+    mochiValueBufferInit(&elems);
+    mochiValueBufferReserve(vm, &elems, slice->count);
+    mochiValueBufferAppend(vm, &elems, slice->source->elems.data + slice->start, slice->count);
+    ObjArray* copy = mochiArrayNil(vm);
+    copy->elems = elems;
+    return copy;
+}
+
+ObjByteArray* mochiByteArrayNil(MochiVM* vm) {
+    ObjByteArray* arr = ALLOCATE(vm, ObjByteArray);
+    initObj(vm, (Obj*)arr, OBJ_BYTE_ARRAY);
+    mochiByteBufferInit(&arr->elems);
+    return arr;
+}
+
+ObjByteArray* mochiByteArrayString(MochiVM* vm, const char* string) {
+    // Keep the null terminator, so the bytes can be used as a C string.
+    int length = (int)strlen(string) + 1;
+    ByteBuffer bytes;
+    mochiByteBufferInit(&bytes);
+    mochiByteBufferReserve(vm, &bytes, length);
+    mochiByteBufferAppend(vm, &bytes, (const uint8_t*)string, length);
+    ObjByteArray* str = mochiByteArrayNil(vm);
+    str->elems = bytes;
+    return str;
+}
+
+ObjByteArray* mochiByteArrayFill(MochiVM* vm, int amount, uint8_t elem, ObjByteArray* array) {
+    mochiByteBufferFill(vm, &array->elems, elem, amount);
+    return array;
+}
+
+ObjByteArray* mochiByteArraySnoc(MochiVM* vm, uint8_t elem, ObjByteArray* array) {
+    mochiByteBufferWrite(vm, &array->elems, elem);
+    return array;
+}
+
+uint8_t mochiByteArrayGetAt(int index, ObjByteArray* array) {
+    ASSERT(array->elems.count > index, "Tried to access an element beyond the bounds of the Array.");
+    return array->elems.data[index];
+}
+
+void mochiByteArraySetAt(int index, uint8_t value, ObjByteArray* array) {
+    ASSERT(array->elems.count > index, "Tried to modify an element beyond the bounds of the Array.");
+    array->elems.data[index] = value;
+}
+
+int mochiByteArrayLength(ObjByteArray* array) {
+    return array->elems.count;
+}
+
+ObjByteArray* mochiByteArrayCopy(MochiVM* vm, int start, int length, ObjByteArray* array) {
+    ASSERT(start + length <= array->elems.count,
+           "Tried to copy elements beyond the length of the source Array.");
+    ByteBuffer elems;
+    mochiByteBufferInit(&elems);
+    mochiByteBufferReserve(vm, &elems, length);
+    mochiByteBufferAppend(vm, &elems, array->elems.data + start, length);
+    ObjByteArray* copy = mochiByteArrayNil(vm);
+    copy->elems = elems;
+    return copy;
+}
+
+// Concatenates the first [aCount] bytes of [a] with all of [b].
+static ObjByteArray* byteArrayConcat(MochiVM* vm, ObjByteArray* a, int aCount, ObjByteArray* b) {
+    ByteBuffer elems;
+    mochiByteBufferInit(&elems);
+    mochiByteBufferReserve(vm, &elems, aCount + b->elems.count);
+    mochiByteBufferAppend(vm, &elems, a->elems.data, aCount);
+    mochiByteBufferAppend(vm, &elems, b->elems.data, b->elems.count);
+    ObjByteArray* cat = mochiByteArrayNil(vm);
+    cat->elems = elems;
+    return cat;
+}
+
+ObjByteArray* mochiByteArrayConcat(MochiVM* vm, ObjByteArray* a, ObjByteArray* b) {
+    return byteArrayConcat(vm, a, a->elems.count, b);
+}
+
+ObjByteArray* mochiByteArrayAppend(MochiVM* vm, ObjByteArray* array, ObjByteArray* other) {
+    mochiByteBufferAppend(vm, &array->elems, other->elems.data, other->elems.count);
+    return array;
+}
+
+ObjByteArray* mochiStringConcat(MochiVM* vm, ObjByteArray* a, ObjByteArray* b) {
+    // Leave out the null terminator of the first string.
+    return byteArrayConcat(vm, a, a->elems.count - 1, b);
+}
+
+ObjByteArray* mochiStringAppend(MochiVM* vm, ObjByteArray* string, ObjByteArray* other) {
+    string->elems.count -= 1;
+    return mochiByteArrayAppend(vm, string, other);
+}
+
+ObjByteSlice* mochiByteArraySlice(MochiVM* vm, int start, int length, ObjByteArray* array) {
+    ASSERT(start + length <= array->elems.count,
+           "Tried to creat a Slice that accesses elements beyond the length of the source Array.");
+    ObjByteSlice* slice = ALLOCATE(vm, ObjByteSlice);
+    initObj(vm, (Obj*)slice, OBJ_BYTE_SLICE);
+    slice->start = start;
+    slice->count = length;
+    slice->source = array;
+    return slice;
+}
+
+ObjByteSlice* mochiByteSubslice(MochiVM* vm, int start, int length, ObjByteSlice* slice) {
+    return mochiByteArraySlice(vm, start + slice->start, length, slice->source);
+}
+
+uint8_t mochiByteSliceGetAt(int index, ObjByteSlice* slice) {
+    ASSERT(slice->count > index, "Tried to access an element beyond the bounds of the Slice.");
+    return slice->source->elems.data[slice->start + index];
+}
+
+void mochiByteSliceSetAt(int index, uint8_t value, ObjByteSlice* slice) {
+    ASSERT(slice->count > index, "Tried to modify an element beyond the bounds of the Slice.");
+    slice->source->elems.data[slice->start + index] = value;
+}
+
+int mochiByteSliceLength(ObjByteSlice* slice) {
+    return slice->count;
+}
+
+ObjByteArray* mochiByteSliceCopy(MochiVM* vm, ObjByteSlice* slice) {
+    ByteBuffer elems;
+    mochiByteBufferInit(&elems);
+    mochiByteBufferReserve(vm, &elems, slice->count);
+    mochiByteBufferAppend(vm, &elems, slice->source->elems.data + slice->start, slice->count);
+    ObjByteArray* copy = mochiByteArrayNil(vm);
+    copy->elems = elems;
+    return copy;
+}
+
+// Returns the bytes behind a byte array, byte slice or string, and stores how many there are in
+// [count]. Strings are byte arrays that end in a null terminator, which is left out so that a
+// string matches a slice or array of the same text. A byte array ending in zero is read alike.
+static const uint8_t* bytesOf(MochiVM* vm, Obj* bytes, int* count) {
+    if (bytes->type == OBJ_BYTE_SLICE) {
+        ObjByteSlice* slice = (ObjByteSlice*)bytes;
+        *count = slice->count;
+        return slice->source->elems.data + slice->start;
+    }
+    ObjByteArray* array = bytes->type == OBJ_ROPE ? mochiRopeFlatten(vm, (ObjRope*)bytes) : (ObjByteArray*)bytes;
+    ASSERT(array->obj.type == OBJ_BYTE_ARRAY, "Expected a byte array, byte slice or string.");
+    *count = array->elems.count;
+    if (*count > 0 && array->elems.data[*count - 1] == '\0') {
+        *count -= 1;
+    }
+    return array->elems.data;
+}
+
+int mochiBytesIndexOf(MochiVM* vm, Obj* bytes, Obj* needle) {
+    int count, needleCount;
+    const uint8_t* data = bytesOf(vm, bytes, &count);
+    const uint8_t* sought = bytesOf(vm, needle, &needleCount);
+    if (needleCount == 0) {
+        return 0;
+    }
+    if (needleCount > count) {
+        return -1;
+    }
+    if (needleCount == 1) {
+        return mochiByteKernels()->find(data, count, sought[0]);
+    }
+    return mochiByteKernels()->search(data, count, sought, needleCount);
+}
+
+int mochiBytesCount(MochiVM* vm, uint8_t byte, Obj* bytes) {
+    int count;
+    const uint8_t* data = bytesOf(vm, bytes, &count);
+    return mochiByteKernels()->count(data, count, byte);
+}
+
+// Comparisons go through memcmp, which the C library already vectorizes.
+int mochiBytesCompare(MochiVM* vm, Obj* a, Obj* b) {
+    int countA, countB;
+    const uint8_t* x = bytesOf(vm, a, &countA);
+    const uint8_t* y = bytesOf(vm, b, &countB);
+    int shorter = countA < countB ? countA : countB;
+    int order = shorter > 0 ? memcmp(x, y, shorter) : 0;
+    if (order == 0) {
+        order = countA - countB;
+    }
+    return (order > 0) - (order < 0);
+}
+
+bool mochiBytesEqual(MochiVM* vm, Obj* a, Obj* b) {
+    int countA, countB;
+    const uint8_t* x = bytesOf(vm, a, &countA);
+    const uint8_t* y = bytesOf(vm, b, &countB);
+    return countA == countB && (countA == 0 || memcmp(x, y, countA) == 0);
+}
+
+uint64_t mochiBytesHash(MochiVM* vm, Obj* bytes) {
+    int count;
+    const uint8_t* data = bytesOf(vm, bytes, &count);
+    return mochiByteKernels()->hash(data, count);
+}
+
+int mochiStringLength(Obj* string) {
+    if (string->type == OBJ_ROPE) {
+        ObjRope* rope = (ObjRope*)string;
+        // A flattened rope holds the same bytes, so its length has not changed.
+        return rope->length;
+    }
+    return ((ObjByteArray*)string)->elems.count - 1;
+}
+
+// Returns [string] as a half of a new rope. A flat string can still be changed by the byte array
+// instructions, so the rope gets a copy of it; a rope is never changed and is shared as it is.
+static Obj* ropeHalf(MochiVM* vm, Obj* string) {
+    if (string->type == OBJ_ROPE) {
+        return string;
+    }
+    ObjByteArray* array = (ObjByteArray*)string;
+    return (Obj*)mochiByteArrayCopy(vm, 0, array->elems.count, array);
+}
+
+Obj* mochiRopeConcat(MochiVM* vm, Obj* a, Obj* b) {
+    int length = mochiStringLength(a) + mochiStringLength(b);
+    if (length < MOCHIVM_ROPE_MIN_LENGTH && a->type == OBJ_BYTE_ARRAY && b->type == OBJ_BYTE_ARRAY) {
+        return (Obj*)mochiStringConcat(vm, (ObjByteArray*)a, (ObjByteArray*)b);
+    }
+
+    vm->collectionDeferrals++;
+    ObjRope* rope = ALLOCATE(vm, ObjRope);
+    initObj(vm, (Obj*)rope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = ropeHalf(vm, a);
+    rope->right = ropeHalf(vm, b);
+    atomic_init(&rope->flat, NULL);
+    vm->collectionDeferrals--;
+    return (Obj*)rope;
+}
+
+static void* ropeReallocate(MochiVM* vm, void* memory, size_t size) {
+    void* result = vm->config.reallocateFn(memory, size, vm->config.userData);
+    PANIC_IF(result != NULL || size == 0, "Out of memory while flattening a rope.");
+    return result;
+}
+
+void mochiStringCopyBytes(MochiVM* vm, Obj* string, uint8_t* dest) {
+    // Ropes built by repeated appends are deep, so the halves still to be copied are kept on a
+    // stack outside the VM heap rather than on the C stack.
+    Obj** pending = NULL;
+    int pendingCount = 0;
+    int pendingCapacity = 0;
+
+    Obj* node = string;
+    while (node != NULL) {
+        // The halves of a rope stay put until the next collection, so they can be copied from
+        // even while another thread flattens the rope.
+        ObjByteArray* flat = node->type == OBJ_ROPE
+                                 ? atomic_load_explicit(&((ObjRope*)node)->flat, memory_order_acquire)
+                                 : (ObjByteArray*)node;
+        if (flat == NULL) {
+            ObjRope* rope = (ObjRope*)node;
+            if (pendingCount == pendingCapacity) {
+                pendingCapacity = pendingCapacity == 0 ? 16 : pendingCapacity * 2;
+                pending = ropeReallocate(vm, pending, pendingCapacity * sizeof(Obj*));
+            }
+            pending[pendingCount++] = rope->right;
+            node = rope->left;
+            continue;
+        }
+
+        int length = flat->elems.count - 1;
+        if (length > 0) {
+            memcpy(dest, flat->elems.data, length);
+            dest += length;
+        }
+        node = pendingCount > 0 ? pending[--pendingCount] : NULL;
+    }
+    ropeReallocate(vm, pending, 0);
+}
+
+// Copies the bytes of [rope] and a null terminator into a new byte array.
+static ObjByteArray* ropeCopy(MochiVM* vm, ObjRope* rope) {
+    ObjByteArray* flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+    if (flat != NULL) {
+        return mochiByteArrayCopy(vm, 0, flat->elems.count, flat);
+    }
+
+    // Like the other copies, the bytes are gathered before the array holding them is allocated.
+    ByteBuffer bytes;
+    mochiByteBufferInit(&bytes);
+    mochiByteBufferReserve(vm, &bytes, rope->length + 1);
+    mochiStringCopyBytes(vm, (Obj*)rope, bytes.data);
+    bytes.data[rope->length] = '\0';
+    bytes.count = rope->length + 1;
+
+    ObjByteArray* copy = mochiByteArrayNil(vm);
+    copy->elems = bytes;
+    return copy;
+}
+
+ObjByteArray* mochiRopeFlatten(MochiVM* vm, ObjRope* rope) {
+    ObjByteArray* flat = atomic_load_explicit(&rope->flat, memory_order_acquire);
+    if (flat != NULL) {
+        return flat;
+    }
+    // Ropes are shared between threads, so two may flatten the same one at once. The first copy
+    // published is the one every thread uses, and the other is left to the collector.
+    ObjByteArray* copy = ropeCopy(vm, rope);
+    if (atomic_compare_exchange_strong_explicit(&rope->flat, &flat, copy, memory_order_release,
+                                                memory_order_acquire)) {
+        return copy;
+    }
+    return flat;
+}
+
+ObjByteArray* mochiDetachString(MochiVM* vm, Value* slot) {
+    Obj* string = AS_OBJ(*slot);
+    if (string->type != OBJ_ROPE) {
+        return (ObjByteArray*)string;
+    }
+    ObjByteArray* copy = ropeCopy(vm, (ObjRope*)string);
+    *slot = OBJ_VAL(copy);
+    return copy;
+}
+
+#define VECTOR_MASK (MOCHIVM_VECTOR_BRANCH - 1)
+
+// Allocates a node of [count] slots, with room for the cumulative sizes of its children if it is
+// [relaxed]. The slots must be filled in before the next allocation.
+static ObjVectorNode* newVectorNode(MochiVM* vm, int count, bool relaxed) {
+    size_t size = sizeof(ObjVectorNode) + sizeof(Value) * count + (relaxed ? sizeof(int) * count : 0);
+    ObjVectorNode* node = (ObjVectorNode*)mochiReallocate(vm, NULL, 0, size);
+    initObj(vm, (Obj*)node, OBJ_VECTOR_NODE);
+    node->count = count;
+    node->sizes = relaxed ? (int*)(void*)&node->slots[count] : NULL;
+    return node;
+}
+
+static ObjVectorNode* vectorChild(ObjVectorNode* node, int slot) {
+    return (ObjVectorNode*)AS_OBJ(node->slots[slot]);
+}
+
+// The number of elements under [node], whose children are found with [shift] bits of index.
+static int vectorNodeSize(ObjVectorNode* node, int shift) {
+    int size = 0;
+    while (shift > 0) {
+        if (node->sizes != NULL) {
+            return size + node->sizes[node->count - 1];
+        }
+        size += (node->count - 1) << shift;
+        node = vectorChild(node, node->count - 1);
+        shift -= MOCHIVM_VECTOR_BITS;
+    }
+    return size + node->count;
+}
+
+// Writes the number of elements under each child of [node] and all those before it to [sizes].
+static void vectorChildSizes(ObjVectorNode* node, int shift, int* sizes) {
+    if (node->sizes != NULL) {
+        memcpy(sizes, node->sizes, sizeof(int) * node->count);
+        return;
+    }
+    for (int i = 0; i < node->count - 1; i++) {
+        sizes[i] = (i + 1) << shift;
+    }
+    int last = node->count - 1;
+    sizes[last] = (last << shift) + vectorNodeSize(vectorChild(node, last), shift - MOCHIVM_VECTOR_BITS);
+}
+
+// Builds an internal node at [shift] from [count] children, given the cumulative number of elements
+// under them in [sizes]. The node is only relaxed if some child before the last is not full.
+static ObjVectorNode* newVectorBranch(MochiVM* vm, int shift, const Value* children, const int* sizes,
+                                      int count) {
+    bool relaxed = false;
+    for (int i = 0; i < count - 1; i++) {
+        if (sizes[i] != (i + 1) << shift) {
+            relaxed = true;
+            break;
+        }
+    }
+    ObjVectorNode* node = newVectorNode(vm, count, relaxed);
+    valueArrayCopy(node->slots, children, count);
+    if (relaxed) {
+        memcpy(node->sizes, sizes, sizeof(int) * count);
+    }
+    return node;
+}
+
+static ObjVectorNode* copyVectorNode(MochiVM* vm, ObjVectorNode* node) {
+    ObjVectorNode* copy = newVectorNode(vm, node->count, node->sizes != NULL);
+    valueArrayCopy(copy->slots, node->slots, node->count);
+    if (node->sizes != NULL) {
+        memcpy(copy->sizes, node->sizes, sizeof(int) * node->count);
+    }
+    return copy;
+}
+
+// Finds the child of [node] holding element [*index], and makes [*index] relative to that child.
+static int vectorFindChild(ObjVectorNode* node, int shift, int* index) {
+    int slot = *index >> shift;
+    if (node->sizes == NULL) {
+        *index -= slot << shift;
+        return slot;
+    }
+    // No child holds more than a full one, so the radix slot is never past the one we want.
+    while (node->sizes[slot] <= *index) {
+        slot++;
+    }
+    if (slot > 0) {
+        *index -= node->sizes[slot - 1];
+    }
+    return slot;
+}
+
+static ObjVector* newVector(MochiVM* vm, ObjVectorNode* root, int shift, int count) {
+    // Slicing and concatenation can leave a chain of single child nodes at the top of the tree.
+    while (shift > 0 && root->count == 1) {
+        root = vectorChild(root, 0);
+        shift -= MOCHIVM_VECTOR_BITS;
+    }
+    ObjVector* vector = ALLOCATE(vm, ObjVector);
+    initObj(vm, (Obj*)vector, OBJ_VECTOR);
+    vector->count = count;
+    vector->shift = shift;
+    vector->root = root;
+    return vector;
+}
+
+ObjVector* mochiNewVector(MochiVM* vm) {
+    ObjVector* vector = ALLOCATE(vm, ObjVector);
+    initObj(vm, (Obj*)vector, OBJ_VECTOR);
+    vector->count = 0;
+    vector->shift = 0;
+    vector->root = NULL;
+    return vector;
+}
+
+ObjVector* mochiVectorFromValues(MochiVM* vm, const Value* values, int count) {
+    if (count == 0) {
+        return mochiNewVector(vm);
+    }
+
+    // The tree is built a level at a time with every node but the last full, so it is balanced.
+    vm->collectionDeferrals++;
+    int levelCount = (count + VECTOR_MASK) >> MOCHIVM_VECTOR_BITS;
+    Value* level = ALLOCATE_ARRAY(vm, Value, levelCount);
+    for (int i = 0; i < levelCount; i++) {
+        int start = i << MOCHIVM_VECTOR_BITS;
+        int size = count - start < MOCHIVM_VECTOR_BRANCH ? count - start : MOCHIVM_VECTOR_BRANCH;
+        ObjVectorNode* leaf = newVectorNode(vm, size, false);
+        valueArrayCopy(leaf->slots, values + start, size);
+        level[i] = OBJ_VAL(leaf);
+    }
+
+    int shift = 0;
+    while (levelCount > 1) {
+        shift += MOCHIVM_VECTOR_BITS;
+        int parentCount = (levelCount + VECTOR_MASK) >> MOCHIVM_VECTOR_BITS;
+        for (int i = 0; i < parentCount; i++) {
+            int start = i << MOCHIVM_VECTOR_BITS;
+            int size = levelCount - start < MOCHIVM_VECTOR_BRANCH ? levelCount - start : MOCHIVM_VECTOR_BRANCH;
+            ObjVectorNode* node = newVectorNode(vm, size, false);
+            valueArrayCopy(node->slots, level + start, size);
+            level[i] = OBJ_VAL(node);
+        }
+        levelCount = parentCount;
+    }
+
+    ObjVector* vector = newVector(vm, (ObjVectorNode*)AS_OBJ(level[0]), shift, count);
+    DEALLOCATE(vm, level);
+    vm->collectionDeferrals--;
+    return vector;
+}
+
+ObjVector* mochiVectorFromArray(MochiVM* vm, ObjArray* array) {
+    return mochiVectorFromValues(vm, array->elems.data, array->elems.count);
+}
+
+static void vectorCopyValues(ObjVectorNode* node, int shift, Value* dest) {
+    if (shift == 0) {
+        valueArrayCopy(dest, node->slots, node->count);
+        return;
+    }
+    for (int i = 0; i < node->count; i++) {
+        ObjVectorNode* child = vectorChild(node, i);
+        vectorCopyValues(child, shift - MOCHIVM_VECTOR_BITS, dest);
+        dest += vectorNodeSize(child, shift - MOCHIVM_VECTOR_BITS);
+    }
+}
+
+ObjArray* mochiVectorToArray(MochiVM* vm, ObjVector* vector) {
+    ValueBuffer elems;
+    mochiValueBufferInit(&elems);
+    mochiValueBufferReserve(vm, &elems, vector->count);
+    if (vector->root != NULL) {
+        vectorCopyValues(vector->root, vector->shift, elems.data);
+    }
+    elems.count = vector->count;
+    ObjArray* array = mochiArrayNil(vm);
+    array->elems = elems;
+    return array;
+}
+
+Value* mochiVectorSlot(int index, ObjVector* vector) {
+    ASSERT(index >= 0 && index < vector->count, "Tried to access an element beyond the bounds of the Vector.");
+    ObjVectorNode* node = vector->root;
+    for (int shift = vector->shift; shift > 0; shift -= MOCHIVM_VECTOR_BITS) {
+        node = vectorChild(node, vectorFindChild(node, shift, &index));
+    }
+    return &node->slots[index];
+}
+
+Value mochiVectorGetAt(int index, ObjVector* vector) {
+    return *mochiVectorSlot(index, vector);
+}
+
+static ObjVectorNode* vectorSet(MochiVM* vm, ObjVectorNode* node, int shift, int index, Value value) {
+    ObjVectorNode* copy = copyVectorNode(vm, node);
+    if (shift == 0) {
+        copy->slots[index] = value;
+        return copy;
+    }
+    int slot = vectorFindChild(node, shift, &index);
+    ObjVectorNode* child = vectorSet(vm, vectorChild(node, slot), shift - MOCHIVM_VECTOR_BITS, index, value);
+    copy->slots[slot] = OBJ_VAL(child);
+    return copy;
+}
+
+ObjVector* mochiVectorSetAt(MochiVM* vm, int index, Value value, ObjVector* vector) {
+    ASSERT(index >= 0 && index < vector->count, "Tried to modify an element beyond the bounds of the Vector.");
+    vm->collectionDeferrals++;
+    ObjVectorNode* root = vectorSet(vm, vector->root, vector->shift, index, value);
+    ObjVector* updated = newVector(vm, root, vector->shift, vector->count);
+    vm->collectionDeferrals--;
+    return updated;
+}
+
+// Builds a path of single child nodes from [shift] down to a leaf holding just [elem].
+static ObjVectorNode* vectorPath(MochiVM* vm, int shift, Value elem) {
+    ObjVectorNode* node = newVectorNode(vm, 1, false);
+    node->slots[0] = elem;
+    for (int level = 0; level < shift; level += MOCHIVM_VECTOR_BITS) {
+        ObjVectorNode* parent = newVectorNode(vm, 1, false);
+        parent->slots[0] = OBJ_VAL(node);
+        node = parent;
+    }
+    return node;
+}
+
+// Appends [elem] to the rightmost path under [node], returning NULL if every node on it is full.
+static ObjVectorNode* vectorPush(MochiVM* vm, ObjVectorNode* node, int shift, Value elem) {
+    if (shift == 0) {
+        if (node->count == MOCHIVM_VECTOR_BRANCH) {
+            return NULL;
+        }
+        ObjVectorNode* leaf = newVectorNode(vm, node->count + 1, false);
+        valueArrayCopy(leaf->slots, node->slots, node->count);
+        leaf->slots[node->count] = elem;
+        return leaf;
+    }
+
+    int last = node->count - 1;
+    ObjVectorNode* child = vectorPush(vm, vectorChild(node, last), shift - MOCHIVM_VECTOR_BITS, elem);
+    if (child != NULL) {
+        ObjVectorNode* copy = copyVectorNode(vm, node);
+        copy->slots[last] = OBJ_VAL(child);
+        if (copy->sizes != NULL) {
+            copy->sizes[last]++;
+        }
+        return copy;
+    }
+    if (node->count == MOCHIVM_VECTOR_BRANCH) {
+        return NULL;
+    }
+
+    Value children[MOCHIVM_VECTOR_BRANCH];
+    int sizes[MOCHIVM_VECTOR_BRANCH];
+    valueArrayCopy(children, node->slots, node->count);
+    vectorChildSizes(node, shift, sizes);
+    children[node->count] = OBJ_VAL(vectorPath(vm, shift - MOCHIVM_VECTOR_BITS, elem));
+    sizes[node->count] = sizes[last] + 1;
+    return newVectorBranch(vm, shift, children, sizes, node->count + 1);
+}
+
+ObjVector* mochiVectorSnoc(MochiVM* vm, Value elem, ObjVector* vector) {
+    vm->collectionDeferrals++;
+    ObjVector* result;
+    if (vector->root == NULL) {
+        result = newVector(vm, vectorPath(vm, 0, elem), 0, 1);
+    } else {
+        int shift = vector->shift;
+        ObjVectorNode* root = vectorPush(vm, vector->root, shift, elem);
+        if (root == NULL) {
+            // The rightmost path is full, so the tree grows a level with the old root on the left.
+            Value children[2] = { OBJ_VAL(vector->root), OBJ_VAL(vectorPath(vm, shift, elem)) };
+            int sizes[2] = { vector->count, vector->count + 1 };
+            shift += MOCHIVM_VECTOR_BITS;
+            root = newVectorBranch(vm, shift, children, sizes, 2);
+        }
+        result = newVector(vm, root, shift, vector->count + 1);
+    }
+    vm->collectionDeferrals--;
+    return result;
+}
+
+// The values or nodes gathered at one level of the seam while concatenating two trees. There are
+// at most the children of two nodes, one of them replaced by the two nodes merged below it.
+typedef struct VectorSeam {
+    Value items[MOCHIVM_VECTOR_BRANCH * 2];
+    int count;
+} VectorSeam;
+
+static void seamAdd(VectorSeam* seam, const Value* items, int count) {
+    valueArrayCopy(seam->items + seam->count, items, count);
+    seam->count += count;
+}
+
+// Packs the items of [seam] into nodes at [shift], filling the first before starting a second so
+// that the leaves and nodes along the seam stay as dense as those either side of it.
+static VectorSeam seamPack(MochiVM* vm, VectorSeam* seam, int shift) {
+    VectorSeam packed;
+    packed.count = 0;
+    for (int start = 0; start < seam->count; start += MOCHIVM_VECTOR_BRANCH) {
+        int count = seam->count - start < MOCHIVM_VECTOR_BRANCH ? seam->count - start : MOCHIVM_VECTOR_BRANCH;
+        ObjVectorNode* node;
+        if (shift == 0) {
+            node = newVectorNode(vm, count, false);
+            valueArrayCopy(node->slots, seam->items + start, count);
+        } else {
+            int sizes[MOCHIVM_VECTOR_BRANCH];
+            int size = 0;
+            for (int i = 0; i < count; i++) {
+                size += vectorNodeSize((ObjVectorNode*)AS_OBJ(seam->items[start + i]), shift - MOCHIVM_VECTOR_BITS);
+                sizes[i] = size;
+            }
+            node = newVectorBranch(vm, shift, seam->items + start, sizes, count);
+        }
+        packed.items[packed.count++] = OBJ_VAL(node);
+    }
+    return packed;
+}
+
+// Merges the right edge of [left] with the left edge of [right], returning one or two nodes at the
+// greater of their two shifts. Only the nodes along the seam are rebuilt.
+static VectorSeam vectorMerge(MochiVM* vm, ObjVectorNode* left, int leftShift, ObjVectorNode* right,
+                              int rightShift) {
+    VectorSeam seam;
+    seam.count = 0;
+    if (leftShift == 0 && rightShift == 0) {
+        seamAdd(&seam, left->slots, left->count);
+        seamAdd(&seam, right->slots, right->count);
+        return seamPack(vm, &seam, 0);
+    }
+
+    int shift = leftShift > rightShift ? leftShift : rightShift;
+    if (leftShift >= rightShift) {
+        seamAdd(&seam, left->slots, left->count - 1);
+    }
+    ObjVectorNode* leftEdge = leftShift >= rightShift ? vectorChild(left, left->count - 1) : left;
+    ObjVectorNode* rightEdge = rightShift >= leftShift ? vectorChild(right, 0) : right;
+    VectorSeam merged =
+        vectorMerge(vm, leftEdge, leftShift >= rightShift ? leftShift - MOCHIVM_VECTOR_BITS : leftShift, rightEdge,
+                    rightShift >= leftShift ? rightShift - MOCHIVM_VECTOR_BITS : rightShift);
+    seamAdd(&seam, merged.items, merged.count);
+    if (rightShift >= leftShift) {
+        seamAdd(&seam, right->slots + 1, right->count - 1);
+    }
+    return seamPack(vm, &seam, shift);
+}
+
+ObjVector* mochiVectorConcat(MochiVM* vm, ObjVector* a, ObjVector* b) {
+    if (a->count == 0) {
+        return b;
+    }
+    if (b->count == 0) {
+        return a;
+    }
+
+    vm->collectionDeferrals++;
+    VectorSeam merged = vectorMerge(vm, a->root, a->shift, b->root, b->shift);
+    int shift = a->shift > b->shift ? a->shift : b->shift;
+    ObjVectorNode* root = (ObjVectorNode*)AS_OBJ(merged.items[0]);
+    if (merged.count == 2) {
+        int sizes[2] = { vectorNodeSize(root, shift), a->count + b->count };
+        shift += MOCHIVM_VECTOR_BITS;
+        root = newVectorBranch(vm, shift, merged.items, sizes, 2);
+    }
+    ObjVector* result = newVector(vm, root, shift, a->count + b->count);
+    vm->collectionDeferrals--;
+    return result;
+}
+
+// Builds a node at [shift] holding elements [start] up to [end] of [node], sharing every child
+// that lies wholly inside the range.
+static ObjVectorNode* vectorCut(MochiVM* vm, ObjVectorNode* node, int shift, int start, int end) {
+    if (start == 0 && end == vectorNodeSize(node, shift)) {
+        return node;
+    }
+    if (shift == 0) {
+        ObjVectorNode* leaf = newVectorNode(vm, end - start, false);
+        valueArrayCopy(leaf->slots, node->slots + start, end - start);
+        return leaf;
+    }
+
+    int sizes[MOCHIVM_VECTOR_BRANCH];
+    vectorChildSizes(node, shift, sizes);
+    int first = 0;
+    while (sizes[first] <= start) {
+        first++;
+    }
+    int last = first;
+    while (sizes[last] < end) {
+        last++;
+    }
+
+    Value children[MOCHIVM_VECTOR_BRANCH];
+    int cutSizes[MOCHIVM_VECTOR_BRANCH];
+    int count = last - first + 1;
+    for (int i = 0; i < count; i++) {
+        int slot = first + i;
+        int before = slot > 0 ? sizes[slot - 1] : 0;
+        int from = start > before ? start - before : 0;
+        int to = end < sizes[slot] ? end - before : sizes[slot] - before;
+        children[i] = OBJ_VAL(vectorCut(vm, vectorChild(node, slot), shift - MOCHIVM_VECTOR_BITS, from, to));
+        cutSizes[i] = (i > 0 ? cutSizes[i - 1] : 0) + to - from;
+    }
+    return newVectorBranch(vm, shift, children, cutSizes, count);
+}
+
+ObjVector* mochiVectorSlice(MochiVM* vm, int start, int length, ObjVector* vector) {
+    ASSERT(start >= 0 && length >= 0 && start + length <= vector->count,
+           "Tried to slice a range beyond the bounds of the Vector.");
+    if (length == 0) {
+        return mochiNewVector(vm);
+    }
+    if (length == vector->count) {
+        return vector;
+    }
+
+    vm->collectionDeferrals++;
+    ObjVectorNode* root = vectorCut(vm, vector->root, vector->shift, start, start + length);
+    ObjVector* slice = newVector(vm, root, vector->shift, length);
+    vm->collectionDeferrals--;
+    return slice;
+}
+
+int mochiVectorLength(ObjVector* vector) {
+    return vector->count;
+}
+
+// A single element of a numeric array, for moving elements between arrays and values.
+typedef union {
+    int8_t i8;
+    uint8_t u8;
+    int16_t i16;
+    uint16_t u16;
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    uint64_t u64;
+    float single;
+    double dub;
+} NumElem;
+
+static Value numElemToValue(MochiVM* vm, ValueType type, const uint8_t* data) {
+    NumElem elem;
+    memcpy(&elem, data, mochiNumElemSize(type));
+    switch (type) {
+    case VAL_I8: return I8_VAL(vm, elem.i8);
+    case VAL_U8: return U8_VAL(vm, elem.u8);
+    case VAL_I16: return I16_VAL(vm, elem.i16);
+    case VAL_U16: return U16_VAL(vm, elem.u16);
+    case VAL_I32: return I32_VAL(vm, elem.i32);
+    case VAL_U32: return U32_VAL(vm, elem.u32);
+    case VAL_I64: return I64_VAL(vm, elem.i64);
+    case VAL_U64: return U64_VAL(vm, elem.u64);
+    case VAL_SINGLE: return SINGLE_VAL(vm, elem.single);
+    case VAL_DOUBLE: return DOUBLE_VAL(vm, elem.dub);
+    case VAL_BOOL: break;
+    }
+    UNREACHABLE();
+    return FALSE_VAL;
+}
+
+static void numElemFromValue(ValueType type, Value value, uint8_t* data) {
+    NumElem elem;
+    switch (type) {
+    case VAL_I8: elem.i8 = AS_I8(value); break;
+    case VAL_U8: elem.u8 = AS_U8(value); break;
+    case VAL_I16: elem.i16 = AS_I16(value); break;
+    case VAL_U16: elem.u16 = AS_U16(value); break;
+    case VAL_I32: elem.i32 = AS_I32(value); break;
+    case VAL_U32: elem.u32 = AS_U32(value); break;
+    case VAL_I64: elem.i64 = AS_I64(value); break;
+    case VAL_U64: elem.u64 = AS_U64(value); break;
+    case VAL_SINGLE: elem.single = AS_SINGLE(value); break;
+    case VAL_DOUBLE: elem.dub = AS_DOUBLE(value); break;
+    case VAL_BOOL: UNREACHABLE(); return;
+    }
+    memcpy(data, &elem, mochiNumElemSize(type));
+}
+
+// Creates a numeric array whose elements are left for the caller to fill in.
+static ObjNumArray* newNumArray(MochiVM* vm, ValueType elemType, int count) {
+    ASSERT(elemType > VAL_BOOL && elemType <= VAL_DOUBLE, "Numeric arrays can only hold numbers.");
+    ObjNumArray* array = ALLOCATE_FLEX(vm, ObjNumArray, uint8_t, (size_t)count * mochiNumElemSize(elemType));
+    initObj(vm, (Obj*)array, OBJ_NUM_ARRAY);
+    array->elemType = elemType;
+    array->count = count;
+    array->data = (uint8_t*)array->storage;
+    array->source = NULL;
+    return array;
+}
+
+ObjNumArray* mochiNewNumArray(MochiVM* vm, ValueType elemType, int count) {
+    ObjNumArray* array = newNumArray(vm, elemType, count);
+    memset(array->data, 0, (size_t)count * mochiNumElemSize(elemType));
+    return array;
+}
+
+ObjNumArray* mochiNumArrayFill(MochiVM* vm, ValueType elemType, int count, Value elem) {
+    // Take the number out of its value first, since a boxed number is not kept alive by the array.
+    uint8_t bytes[sizeof(NumElem)];
+    numElemFromValue(elemType, elem, bytes);
+    int size = mochiNumElemSize(elemType);
+    ObjNumArray* array = newNumArray(vm, elemType, count);
+    for (int i = 0; i < count; i++) {
+        memcpy(array->data + (size_t)i * size, bytes, size);
+    }
+    return array;
+}
+
+Value mochiNumArrayGetAt(MochiVM* vm, int index, ObjNumArray* array) {
+    ASSERT(array->count > index, "Tried to access an element beyond the bounds of the Array.");
+    return numElemToValue(vm, array->elemType, array->data + (size_t)index * mochiNumElemSize(array->elemType));
+}
+
+void mochiNumArraySetAt(int index, Value value, ObjNumArray* array) {
+    ASSERT(array->count > index, "Tried to modify an element beyond the bounds of the Array.");
+    numElemFromValue(array->elemType, value, array->data + (size_t)index * mochiNumElemSize(array->elemType));
+}
+
+int mochiNumArrayLength(ObjNumArray* array) {
+    return array->count;
+}
+
+ObjNumArray* mochiNumArraySlice(MochiVM* vm, int start, int length, ObjNumArray* array) {
+    ASSERT(start + length <= array->count,
+           "Tried to creat a Slice that accesses elements beyond the length of the source Array.");
+    ObjNumArray* slice = ALLOCATE(vm, ObjNumArray);
+    initObj(vm, (Obj*)slice, OBJ_NUM_ARRAY);
+    slice->elemType = array->elemType;
+    slice->count = length;
+    slice->data = array->data + (size_t)start * mochiNumElemSize(array->elemType);
+    // A slice of a slice shares the elements of the original array directly.
+    slice->source = array->source != NULL ? array->source : array;
+    return slice;
 }
 
-ObjList* mochiListCons(MochiVM* vm, Value elem, ObjList* tail) {
-    ObjList* list = ALLOCATE(vm, ObjList);
-    initObj(vm, (Obj*)list, OBJ_LIST);
-    list->next = tail;
-    list->elem = elem;
-    return list;
+static void assertSameShape(ObjNumArray* a, ObjNumArray* b) {
+    ASSERT(a->elemType == b->elemType, "Numeric arrays must hold the same type of number.");
+    ASSERT(a->count == b->count, "Numeric arrays must have the same length.");
 }
 
-ObjList* mochiListTail(ObjList* list) {
-    return list->next;
+ObjNumArray* mochiNumArrayAdd(MochiVM* vm, ObjNumArray* a, ObjNumArray* b) {
+    assertSameShape(a, b);
+    ObjNumArray* sum = newNumArray(vm, a->elemType, a->count);
+    mochiNumKernels()->add[a->elemType](sum->data, a->data, b->data, a->count);
+    return sum;
 }
 
-Value mochiListHead(ObjList* list) {
-    return list->elem;
+ObjNumArray* mochiNumArrayMul(MochiVM* vm, ObjNumArray* a, ObjNumArray* b) {
+    assertSameShape(a, b);
+    ObjNumArray* product = newNumArray(vm, a->elemType, a->count);
+    mochiNumKernels()->mul[a->elemType](product->data, a->data, b->data, a->count);
+    return product;
 }
 
-int mochiListLength(ObjList* list) {
-    int count = 0;
-    while (list != NULL) {
-        list = list->next;
-        count++;
-    }
-    return count;
+ObjNumArray* mochiNumArrayFma(MochiVM* vm, ObjNumArray* a, ObjNumArray* b, ObjNumArray* c) {
+    assertSameShape(a, b);
+    assertSameShape(a, c);
+    ObjNumArray* result = newNumArray(vm, a->elemType, a->count);
+    mochiNumKernels()->fma[a->elemType](result->data, a->data, b->data, c->data, a->count);
+    return result;
 }
 
-ObjArray* mochiArrayNil(MochiVM* vm) {
-    ObjArray* arr = ALLOCATE(vm, ObjArray);
-    initObj(vm, (Obj*)arr, OBJ_ARRAY);
-    mochiValueBufferInit(&arr->elems);
-    return arr;
+static Value numArrayReduce(MochiVM* vm, ReduceKernel kernel, ObjNumArray* array) {
+    NumElem result;
+    kernel(&result, array->data, array->count);
+    return numElemToValue(vm, array->elemType, (uint8_t*)&result);
 }
 
-ObjArray* mochiArrayFill(MochiVM* vm, int amount, Value elem, ObjArray* array) {
-    mochiValueBufferFill(vm, &array->elems, elem, amount);
-    return array;
+Value mochiNumArraySum(MochiVM* vm, ObjNumArray* array) {
+    return numArrayReduce(vm, mochiNumKernels()->sum[array->elemType], array);
 }
 
-ObjArray* mochiArraySnoc(MochiVM* vm, Value elem, ObjArray* array) {
-    mochiValueBufferWrite(vm, &array->elems, elem);
-    return array;
+Value mochiNumArrayMin(MochiVM* vm, ObjNumArray* array) {
+    ASSERT(array->count > 0, "Tried to take the minimum of an empty Array.");
+    return numArrayReduce(vm, mochiNumKernels()->min[array->elemType], array);
 }
 
-Value mochiArrayGetAt(int index, ObjArray* array) {
-    ASSERT(array->elems.count > index, "Tried to access an element beyond the bounds of the Array.");
-    return array->elems.data[index];
+Value mochiNumArrayMax(MochiVM* vm, ObjNumArray* array) {
+    ASSERT(array->count > 0, "Tried to take the maximum of an empty Array.");
+    return numArrayReduce(vm, mochiNumKernels()->max[array->elemType], array);
 }
 
-void mochiArraySetAt(int index, Value value, ObjArray* array) {
-    ASSERT(array->elems.count > index, "Tried to modify an element beyond the bounds of the Array.");
-    array->elems.data[index] = value;
+Value mochiNumArrayDot(MochiVM* vm, ObjNumArray* a, ObjNumArray* b) {
+    assertSameShape(a, b);
+    NumElem result;
+    mochiNumKernels()->dot[a->elemType](&result, a->data, b->data, a->count);
+    return numElemToValue(vm, a->elemType, (uint8_t*)&result);
 }
 
-int mochiArrayLength(ObjArray* array) {
-    return array->elems.count;
+ObjNumArray* mochiNumArrayEq(MochiVM* vm, ObjNumArray* a, ObjNumArray* b) {
+    assertSameShape(a, b);
+    ObjNumArray* mask = newNumArray(vm, VAL_U8, a->count);
+    mochiNumKernels()->eq[a->elemType](mask->data, a->data, b->data, a->count);
+    return mask;
 }
 
-ObjArray* mochiArrayCopy(MochiVM* vm, int start, int length, ObjArray* array) {
-    ValueBuffer elems;
-    mochiValueBufferInit(&elems);
-    for (int i = 0; i < array->elems.count; i++) {
-        mochiValueBufferWrite(vm, &elems, array->elems.data[i]);
-    }
-    ObjArray* copy = mochiArrayNil(vm);
-    copy->elems = elems;
-    return copy;
+ObjNumArray* mochiNumArrayLess(MochiVM* vm, ObjNumArray* a, ObjNumArray* b) {
+    assertSameShape(a, b);
+    ObjNumArray* mask = newNumArray(vm, VAL_U8, a->count);
+    mochiNumKernels()->less[a->elemType](mask->data, a->data, b->data, a->count);
+    return mask;
 }
 
-ObjSlice* mochiArraySlice(MochiVM* vm, int start, int length, ObjArray* array) {
-    ASSERT(start + length <= array->elems.count,
-           "Tried to creat a Slice that accesses elements beyond the length of the source Array.");
-    ObjSlice* slice = ALLOCATE(vm, ObjSlice);
-    initObj(vm, (Obj*)slice, OBJ_SLICE);
-    slice->start = start;
-    slice->count = length;
-    slice->source = array;
-    return slice;
+// Shapes with at most this many fields are built on the stack before being interned.
+#define MOCHIVM_SHAPE_STACK_KEYS 64
+
+static void* shapeReallocate(MochiVM* vm, void* memory, size_t size) {
+    void* result = vm->config.reallocateFn(memory, size, vm->config.userData);
+    PANIC_IF(result != NULL || size == 0, "Out of memory while interning a record shape.");
+    return result;
 }
 
-ObjSlice* mochiSubslice(MochiVM* vm, int start, int length, ObjSlice* slice) {
-    return mochiArraySlice(vm, start + slice->start, length, slice->source);
+static uint32_t hashShapeKeys(const TableKey* keys, int count) {
+    uint64_t hash = 14695981039346656037u;
+    for (int i = 0; i < count; i++) {
+        hash = (hash ^ keys[i]) * 1099511628211u;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
 }
 
-Value mochiSliceGetAt(int index, ObjSlice* slice) {
-    ASSERT(slice->count > index, "Tried to access an element beyond the bounds of the Slice.");
-    return slice->source->elems.data[slice->start + index];
+static void growShapes(MochiVM* vm) {
+    int capacity = vm->shapeCapacity == 0 ? 64 : vm->shapeCapacity * 2;
+    RecordShape** shapes = shapeReallocate(vm, NULL, capacity * sizeof(RecordShape*));
+    memset(shapes, 0, capacity * sizeof(RecordShape*));
+    for (int i = 0; i < vm->shapeCapacity; i++) {
+        RecordShape* shape = vm->shapes[i];
+        if (shape != NULL) {
+            uint32_t slot = shape->hash & (capacity - 1);
+            while (shapes[slot] != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            shapes[slot] = shape;
+        }
+    }
+    shapeReallocate(vm, vm->shapes, 0);
+    vm->shapes = shapes;
+    vm->shapeCapacity = capacity;
 }
 
-void mochiSliceSetAt(int index, Value value, ObjSlice* slice) {
-    ASSERT(slice->count > index, "Tried to modify an element beyond the bounds of the Slice.");
-    slice->source->elems.data[slice->start + index] = value;
+// Interns the shape with the [count] sorted [keys] while holding the shape lock. Shapes are
+// allocated outside the collector, so interning never starts a collection while holding it.
+static RecordShape* internShapeLocked(MochiVM* vm, const TableKey* keys, int count) {
+    uint32_t hash = hashShapeKeys(keys, count);
+    if ((vm->shapeCount + 1) * 4 > vm->shapeCapacity * 3) {
+        growShapes(vm);
+    }
+
+    uint32_t slot = hash & (vm->shapeCapacity - 1);
+    RecordShape* shape;
+    while ((shape = vm->shapes[slot]) != NULL) {
+        if (shape->hash == hash && shape->count == count &&
+            (count == 0 || memcmp(shape->keys, keys, count * sizeof(TableKey)) == 0)) {
+            break;
+        }
+        slot = (slot + 1) & (vm->shapeCapacity - 1);
+    }
+
+    if (shape == NULL) {
+        shape = shapeReallocate(vm, NULL, sizeof(RecordShape) + count * sizeof(TableKey));
+        shape->hash = hash;
+        shape->count = count;
+        atomic_init(&shape->transitions, NULL);
+        if (count > 0) {
+            memcpy(shape->keys, keys, count * sizeof(TableKey));
+        }
+        vm->shapes[slot] = shape;
+        vm->shapeCount += 1;
+    }
+    return shape;
 }
 
-int mochiSliceLength(ObjSlice* slice) {
-    return slice->count;
+RecordShape* mochiInternShape(MochiVM* vm, const TableKey* keys, int count) {
+    mtx_lock(&vm->shapeLock);
+    RecordShape* shape = internShapeLocked(vm, keys, count);
+    mtx_unlock(&vm->shapeLock);
+    return shape;
 }
 
-ObjArray* mochiSliceCopy(MochiVM* vm, ObjSlice* slice) {
-    ValueBuffer elems;
-    mochiValueBufferInit(&elems);
-    for (int i = 0; i < slice->count; i++) {
-        mochiValueBufferWrite(vm, &elems, slice->source->elems.data[i]);
+void mochiFreeShapes(MochiVM* vm) {
+    for (int i = 0; i < vm->shapeCapacity; i++) {
+        RecordShape* shape = vm->shapes[i];
+        if (shape == NULL) {
+            continue;
+        }
+        ShapeTransition* transition = atomic_load_explicit(&shape->transitions, memory_order_relaxed);
+        while (transition != NULL) {
+            ShapeTransition* next = transition->next;
+            shapeReallocate(vm, transition, 0);
+            transition = next;
+        }
+        shapeReallocate(vm, shape, 0);
     }
-    ObjArray* copy = mochiArrayNil(vm);
-    copy->elems = elems;
-    return copy;
+    vm->shapes = shapeReallocate(vm, vm->shapes, 0);
+    vm->shapeCount = 0;
+    vm->shapeCapacity = 0;
 }
 
-ObjByteArray* mochiByteArrayNil(MochiVM* vm) {
-    ObjByteArray* arr = ALLOCATE(vm, ObjByteArray);
-    initObj(vm, (Obj*)arr, OBJ_BYTE_ARRAY);
-    mochiByteBufferInit(&arr->elems);
-    return arr;
+int mochiShapeSlot(RecordShape* shape, TableKey field) {
+    // Find the first key not less than the field, which is its most recent occurrence.
+    int low = 0;
+    int high = shape->count;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (shape->keys[mid] < field) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < shape->count && shape->keys[low] == field ? low : -1;
 }
 
-ObjByteArray* mochiByteArrayString(MochiVM* vm, const char* string) {
-    ByteBuffer bytes;
-    mochiByteBufferInit(&bytes);
-    for (int i = 0; string[i] != '\0'; i++) {
-        mochiByteBufferWrite(vm, &bytes, string[i]);
+static RecordShape* findTransition(ShapeTransition* transition, TableKey field, bool remove) {
+    for (; transition != NULL; transition = transition->next) {
+        if (transition->field == field && transition->remove == remove) {
+            return transition->shape;
+        }
     }
-    mochiByteBufferWrite(vm, &bytes, '\0');
-    ObjByteArray* str = mochiByteArrayNil(vm);
-    str->elems = bytes;
-    return str;
+    return NULL;
 }
 
-ObjByteArray* mochiByteArrayFill(MochiVM* vm, int amount, uint8_t elem, ObjByteArray* array) {
-    mochiByteBufferFill(vm, &array->elems, elem, amount);
-    return array;
+// Interns the shape of [shape] with [field] inserted at [index], or with the key at [index]
+// removed if [remove] is true. A transition taken before is found without taking the lock.
+static RecordShape* changedShape(MochiVM* vm, RecordShape* shape, int index, TableKey field, bool remove) {
+    ShapeTransition* first = atomic_load_explicit(&shape->transitions, memory_order_acquire);
+    RecordShape* cached = findTransition(first, field, remove);
+    if (cached != NULL) {
+        return cached;
+    }
+
+    int count = remove ? shape->count - 1 : shape->count + 1;
+    TableKey stackKeys[MOCHIVM_SHAPE_STACK_KEYS];
+    TableKey* keys =
+        count <= MOCHIVM_SHAPE_STACK_KEYS ? stackKeys : shapeReallocate(vm, NULL, count * sizeof(TableKey));
+
+    memcpy(keys, shape->keys, index * sizeof(TableKey));
+    if (remove) {
+        memcpy(keys + index, shape->keys + index + 1, (count - index) * sizeof(TableKey));
+    } else {
+        keys[index] = field;
+        memcpy(keys + index + 1, shape->keys + index, (shape->count - index) * sizeof(TableKey));
+    }
+
+    mtx_lock(&vm->shapeLock);
+    // another thread may have taken the same transition since it was looked for
+    ShapeTransition* latest = atomic_load_explicit(&shape->transitions, memory_order_relaxed);
+    RecordShape* changed = latest == first ? NULL : findTransition(latest, field, remove);
+    if (changed == NULL) {
+        changed = internShapeLocked(vm, keys, count);
+        ShapeTransition* transition = shapeReallocate(vm, NULL, sizeof(ShapeTransition));
+        transition->field = field;
+        transition->remove = remove;
+        transition->shape = changed;
+        transition->next = latest;
+        atomic_store_explicit(&shape->transitions, transition, memory_order_release);
+    }
+    mtx_unlock(&vm->shapeLock);
+
+    if (keys != stackKeys) {
+        shapeReallocate(vm, keys, 0);
+    }
+    return changed;
 }
 
-ObjByteArray* mochiByteArraySnoc(MochiVM* vm, uint8_t elem, ObjByteArray* array) {
-    mochiByteBufferWrite(vm, &array->elems, elem);
-    return array;
+ObjRecord* mochiNewRecordWithShape(MochiVM* vm, RecordShape* shape) {
+    ObjRecord* rec = ALLOCATE_FLEX(vm, ObjRecord, Value, shape->count);
+    initObj(vm, (Obj*)rec, OBJ_RECORD);
+    rec->shape = shape;
+    rec->trie = NULL;
+    rec->trieCount = 0;
+    return rec;
 }
 
-uint8_t mochiByteArrayGetAt(int index, ObjByteArray* array) {
-    ASSERT(array->elems.count > index, "Tried to access an element beyond the bounds of the Array.");
-    return array->elems.data[index];
+ObjRecord* mochiNewRecord(MochiVM* vm) {
+    return mochiNewRecordWithShape(vm, vm->emptyShape);
 }
 
-void mochiByteArraySetAt(int index, uint8_t value, ObjByteArray* array) {
-    ASSERT(array->elems.count > index, "Tried to modify an element beyond the bounds of the Array.");
-    array->elems.data[index] = value;
+int mochiRecordCount(ObjRecord* rec) {
+    return rec->shape != NULL ? rec->shape->count : rec->trieCount;
 }
 
-int mochiByteArrayLength(ObjByteArray* array) {
-    return array->elems.count;
+// Record tries ------------------------------------------------------------------------
+
+#define TRIE_BITS 5
+
+// A bijective mix of the label, so distinct labels always have distinct hashes and two fields
+// can always be split into separate branches within the 64 bits.
+static uint64_t hashLabel(TableKey key) {
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9u;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebu;
+    return key ^ (key >> 31);
 }
 
-ObjByteArray* mochiByteArrayCopy(MochiVM* vm, int start, int length, ObjByteArray* array) {
-    ByteBuffer elems;
-    mochiByteBufferInit(&elems);
-    for (int i = 0; i < array->elems.count; i++) {
-        mochiByteBufferWrite(vm, &elems, array->elems.data[i]);
-    }
-    ObjByteArray* copy = mochiByteArrayNil(vm);
-    copy->elems = elems;
-    return copy;
+static int popCount(uint32_t bits) {
+    bits = bits - ((bits >> 1) & 0x55555555u);
+    bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+    return (int)((((bits + (bits >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
 }
 
-ObjByteSlice* mochiByteArraySlice(MochiVM* vm, int start, int length, ObjByteArray* array) {
-    ASSERT(start + length <= array->elems.count,
-           "Tried to creat a Slice that accesses elements beyond the length of the source Array.");
-    ObjByteSlice* slice = ALLOCATE(vm, ObjByteSlice);
-    initObj(vm, (Obj*)slice, OBJ_BYTE_SLICE);
-    slice->start = start;
-    slice->count = length;
-    slice->source = array;
-    return slice;
+static uint32_t trieBit(uint64_t hash, int shift) {
+    return 1u << ((hash >> shift) & 31);
 }
 
-ObjByteSlice* mochiByteSubslice(MochiVM* vm, int start, int length, ObjByteSlice* slice) {
-    return mochiByteArraySlice(vm, start + slice->start, length, slice->source);
+static ObjRecordNode* newTrieNode(MochiVM* vm, uint32_t bitmap) {
+    int count = popCount(bitmap);
+    ObjRecordNode* node = ALLOCATE_FLEX(vm, ObjRecordNode, RecordTrieEntry, count);
+    initObj(vm, (Obj*)node, OBJ_RECORD_NODE);
+    node->bitmap = bitmap;
+    node->count = count;
+    return node;
 }
 
-uint8_t mochiByteSliceGetAt(int index, ObjByteSlice* slice) {
-    ASSERT(slice->count > index, "Tried to access an element beyond the bounds of the Slice.");
-    return slice->source->elems.data[slice->start + index];
+static RecordTrieEntry* trieFind(ObjRecordNode* node, TableKey key) {
+    uint64_t hash = hashLabel(key);
+    for (int shift = 0; node != NULL; shift += TRIE_BITS) {
+        uint32_t bit = trieBit(hash, shift);
+        if ((node->bitmap & bit) == 0) {
+            return NULL;
+        }
+        RecordTrieEntry* entry = &node->entries[popCount(node->bitmap & (bit - 1))];
+        if (entry->node == NULL) {
+            return entry->key == key ? entry : NULL;
+        }
+        node = entry->node;
+    }
+    return NULL;
 }
 
-void mochiByteSliceSetAt(int index, uint8_t value, ObjByteSlice* slice) {
-    ASSERT(slice->count > index, "Tried to modify an element beyond the bounds of the Slice.");
-    slice->source->elems.data[slice->start + index] = value;
+// Builds the subtrie holding the two fields [a] and [b], starting at [shift].
+static ObjRecordNode* trieJoin(MochiVM* vm, int shift, RecordTrieEntry a, uint64_t aHash, RecordTrieEntry b,
+                               uint64_t bHash) {
+    uint32_t aBit = trieBit(aHash, shift);
+    uint32_t bBit = trieBit(bHash, shift);
+    if (aBit == bBit) {
+        ObjRecordNode* child = trieJoin(vm, shift + TRIE_BITS, a, aHash, b, bHash);
+        ObjRecordNode* node = newTrieNode(vm, aBit);
+        node->entries[0] = (RecordTrieEntry){ .node = child };
+        return node;
+    }
+    ObjRecordNode* node = newTrieNode(vm, aBit | bBit);
+    node->entries[aBit < bBit ? 0 : 1] = a;
+    node->entries[aBit < bBit ? 1 : 0] = b;
+    return node;
 }
 
-int mochiByteSliceLength(ObjByteSlice* slice) {
-    return slice->count;
+// Copies [node] with the field [key] set to [value]. If the field exists and [shadow] is true,
+// its current value is kept as a shadowed occurrence, otherwise it is replaced.
+static ObjRecordNode* trieInsert(MochiVM* vm, ObjRecordNode* node, int shift, uint64_t hash, TableKey key,
+                                 Value value, bool shadow) {
+    uint32_t bit = trieBit(hash, shift);
+    int index = popCount(node->bitmap & (bit - 1));
+    RecordTrieEntry field = { .node = NULL, .key = key, .value = value, .shadowed = NULL };
+
+    if ((node->bitmap & bit) == 0) {
+        ObjRecordNode* copy = newTrieNode(vm, node->bitmap | bit);
+        memcpy(copy->entries, node->entries, index * sizeof(RecordTrieEntry));
+        copy->entries[index] = field;
+        memcpy(copy->entries + index + 1, node->entries + index, (node->count - index) * sizeof(RecordTrieEntry));
+        return copy;
+    }
+
+    RecordTrieEntry entry = node->entries[index];
+    if (entry.node != NULL) {
+        entry.node = trieInsert(vm, entry.node, shift + TRIE_BITS, hash, key, value, shadow);
+    } else if (entry.key == key) {
+        if (shadow) {
+            entry.shadowed = mochiListCons(vm, entry.value, entry.shadowed);
+        }
+        entry.value = value;
+    } else {
+        ObjRecordNode* child = trieJoin(vm, shift + TRIE_BITS, entry, hashLabel(entry.key), field, hash);
+        entry = (RecordTrieEntry){ .node = child };
+    }
+
+    ObjRecordNode* copy = newTrieNode(vm, node->bitmap);
+    memcpy(copy->entries, node->entries, node->count * sizeof(RecordTrieEntry));
+    copy->entries[index] = entry;
+    return copy;
 }
 
-ObjByteArray* mochiByteSliceCopy(MochiVM* vm, ObjByteSlice* slice) {
-    ByteBuffer elems;
-    mochiByteBufferInit(&elems);
-    for (int i = 0; i < slice->count; i++) {
-        mochiByteBufferWrite(vm, &elems, slice->source->elems.data[i]);
+// Copies [node] without the most recent occurrence of the field [key], which must exist.
+// Returns NULL if nothing would be left in the node.
+static ObjRecordNode* trieRemove(MochiVM* vm, ObjRecordNode* node, int shift, uint64_t hash, TableKey key) {
+    uint32_t bit = trieBit(hash, shift);
+    int index = popCount(node->bitmap & (bit - 1));
+    RecordTrieEntry entry = node->entries[index];
+    bool removed = false;
+
+    if (entry.node != NULL) {
+        ObjRecordNode* child = trieRemove(vm, entry.node, shift + TRIE_BITS, hash, key);
+        if (child == NULL) {
+            removed = true;
+        } else if (child->count == 1 && child->entries[0].node == NULL) {
+            // pull a lone field up so lookups stop at the shallowest level that tells it apart
+            entry = child->entries[0];
+        } else {
+            entry.node = child;
+        }
+    } else if (entry.shadowed != NULL) {
+        entry.value = mochiListHead(entry.shadowed);
+        entry.shadowed = mochiListTail(entry.shadowed);
+    } else {
+        removed = true;
     }
-    ObjByteArray* copy = mochiByteArrayNil(vm);
-    copy->elems = elems;
+
+    if (!removed) {
+        ObjRecordNode* copy = newTrieNode(vm, node->bitmap);
+        memcpy(copy->entries, node->entries, node->count * sizeof(RecordTrieEntry));
+        copy->entries[index] = entry;
+        return copy;
+    }
+    if (node->count == 1) {
+        return NULL;
+    }
+    ObjRecordNode* copy = newTrieNode(vm, node->bitmap & ~bit);
+    memcpy(copy->entries, node->entries, index * sizeof(RecordTrieEntry));
+    memcpy(copy->entries + index, node->entries + index + 1, (node->count - index - 1) * sizeof(RecordTrieEntry));
     return copy;
 }
 
-static ObjRecord* emptyRecord(MochiVM* vm, size_t fieldCount) {
-    ObjRecord* rec = ALLOCATE_FLEX(vm, ObjRecord, TableEntry, fieldCount);
+static ObjRecord* newTrieRecord(MochiVM* vm, ObjRecordNode* trie, int count) {
+    ObjRecord* rec = ALLOCATE_FLEX(vm, ObjRecord, Value, 0);
     initObj(vm, (Obj*)rec, OBJ_RECORD);
-    rec->count = fieldCount;
+    rec->shape = NULL;
+    rec->trie = trie;
+    rec->trieCount = count;
     return rec;
 }
 
-ObjRecord* mochiNewRecord(MochiVM* vm) {
-    return emptyRecord(vm, 0);
+static int trieCollect(ObjRecordNode* node, RecordTrieEntry** fields, int count) {
+    for (int i = 0; i < node->count; i++) {
+        if (node->entries[i].node != NULL) {
+            count = trieCollect(node->entries[i].node, fields, count);
+        } else {
+            fields[count++] = &node->entries[i];
+        }
+    }
+    return count;
+}
+
+static int compareTrieFields(const void* a, const void* b) {
+    TableKey aKey = (*(RecordTrieEntry* const*)a)->key;
+    TableKey bKey = (*(RecordTrieEntry* const*)b)->key;
+    return aKey < bKey ? -1 : (aKey > bKey ? 1 : 0);
+}
+
+void mochiRecordFields(MochiVM* vm, ObjRecord* rec, TableKey* keys, Value* values) {
+    if (rec->shape != NULL) {
+        if (rec->shape->count > 0) {
+            memcpy(keys, rec->shape->keys, rec->shape->count * sizeof(TableKey));
+            valueArrayCopy(values, rec->values, rec->shape->count);
+        }
+        return;
+    }
+
+    // Each label appears in a single field of the trie, so sorting those fields orders the labels,
+    // and the shadowed values of each follow it most recent first, as in a flat record.
+    RecordTrieEntry** fields = shapeReallocate(vm, NULL, rec->trieCount * sizeof(RecordTrieEntry*));
+    int fieldCount = trieCollect(rec->trie, fields, 0);
+    qsort(fields, fieldCount, sizeof(RecordTrieEntry*), compareTrieFields);
+
+    int count = 0;
+    for (int i = 0; i < fieldCount; i++) {
+        keys[count] = fields[i]->key;
+        values[count++] = fields[i]->value;
+        for (ObjList* shadowed = fields[i]->shadowed; shadowed != NULL; shadowed = mochiListTail(shadowed)) {
+            keys[count] = fields[i]->key;
+            values[count++] = mochiListHead(shadowed);
+        }
+    }
+    shapeReallocate(vm, fields, 0);
+}
+
+// Stores the flat record [rec] with [field] added as a trie. The fields are added oldest first, so
+// that each label added more than once ends up with its occurrences in the same order.
+static ObjRecord* flatToTrie(MochiVM* vm, TableKey field, Value value, ObjRecord* rec) {
+    RecordShape* shape = rec->shape;
+    ObjRecordNode* trie = newTrieNode(vm, 0);
+    for (int i = shape->count - 1; i >= 0; i--) {
+        trie = trieInsert(vm, trie, 0, hashLabel(shape->keys[i]), shape->keys[i], rec->values[i], true);
+    }
+    trie = trieInsert(vm, trie, 0, hashLabel(field), field, value, true);
+    return newTrieRecord(vm, trie, shape->count + 1);
 }
 
+static ObjRecord* trieToFlat(MochiVM* vm, ObjRecord* rec) {
+    TableKey keys[MOCHIVM_RECORD_TRIE_THRESHOLD];
+    Value values[MOCHIVM_RECORD_TRIE_THRESHOLD];
+    mochiRecordFields(vm, rec, keys, values);
+
+    ObjRecord* flat = mochiNewRecordWithShape(vm, mochiInternShape(vm, keys, rec->trieCount));
+    valueArrayCopy(flat->values, values, rec->trieCount);
+    return flat;
+}
+
+// Operations ------------------------------------------------------------------------------
+
 ObjRecord* mochiRecordExtend(MochiVM* vm, TableKey field, Value value, ObjRecord* rec) {
-    ObjRecord* new = emptyRecord(vm, rec->count + 1);
-    // insert while maintaining sort for better selection
-    size_t insertIndex = 0;
-    for (size_t i = 0; i < rec->count; i++) {
-        insertIndex = i;
-        if (rec->fields[i].key >= field) {
-            break;
+    RecordShape* shape = rec->shape;
+    if (shape == NULL || shape->count >= MOCHIVM_RECORD_TRIE_THRESHOLD) {
+        // None of the new nodes are reachable until the record holding them is made.
+        vm->collectionDeferrals++;
+        ObjRecord* new;
+        if (shape != NULL) {
+            new = flatToTrie(vm, field, value, rec);
+        } else {
+            ObjRecordNode* trie = trieInsert(vm, rec->trie, 0, hashLabel(field), field, value, true);
+            new = newTrieRecord(vm, trie, rec->trieCount + 1);
         }
-        new->fields[i] = rec->fields[i];
+        vm->collectionDeferrals--;
+        return new;
     }
-    new->fields[insertIndex] = (TableEntry) { .key = field, .value = value };
-    for (size_t i = insertIndex+1; i < new->count; i++) {
-        new->fields[i] = rec->fields[i-1];
+
+    // insert before any existing occurrence of the field so that it shadows them
+    int insertIndex = 0;
+    while (insertIndex < shape->count && shape->keys[insertIndex] < field) {
+        insertIndex++;
     }
+
+    ObjRecord* new = mochiNewRecordWithShape(vm, changedShape(vm, shape, insertIndex, field, false));
+    valueArrayCopy(new->values, rec->values, insertIndex);
+    new->values[insertIndex] = value;
+    valueArrayCopy(new->values + insertIndex + 1, rec->values + insertIndex, shape->count - insertIndex);
     return new;
 }
 
 ObjRecord* mochiRecordRestrict(MochiVM* vm, TableKey field, ObjRecord* rec) {
-    ASSERT(rec->count > 0, "Tried to restrict on an empty record.");
-    ObjRecord* new = emptyRecord(vm, rec->count - 1);
-    //remove while maintaining sort for better selection
-    size_t removeIndex = 0;
-    for (size_t i = 0; i < rec->count; i++) {
-        removeIndex = i;
-        if (rec->fields[i].key == field) {
-            break;
+    RecordShape* shape = rec->shape;
+    if (shape == NULL) {
+        ASSERT(trieFind(rec->trie, field) != NULL, "Tried to restrict on a record but couldn't find the key.");
+        vm->collectionDeferrals++;
+        ObjRecordNode* trie = trieRemove(vm, rec->trie, 0, hashLabel(field), field);
+        ObjRecord* new = newTrieRecord(vm, trie == NULL ? newTrieNode(vm, 0) : trie, rec->trieCount - 1);
+        if (new->trieCount <= MOCHIVM_RECORD_TRIE_THRESHOLD) {
+            new = trieToFlat(vm, new);
         }
-        new->fields[i] = rec->fields[i];
+        vm->collectionDeferrals--;
+        return new;
     }
 
-    ASSERT(removeIndex < rec->count, "Tried to restrict on a record but couldn't find the key.");
-    for (size_t i = removeIndex; i < new->count; i++) {
-        new->fields[i] = rec->fields[i+1];
-    }
+    int removeIndex = mochiShapeSlot(shape, field);
+    ASSERT(removeIndex >= 0, "Tried to restrict on a record but couldn't find the key.");
+
+    ObjRecord* new = mochiNewRecordWithShape(vm, changedShape(vm, shape, removeIndex, field, true));
+    valueArrayCopy(new->values, rec->values, removeIndex);
+    valueArrayCopy(new->values + removeIndex, rec->values + removeIndex + 1, shape->count - removeIndex - 1);
     return new;
 }
 
+ObjRecord* mochiRecordUpdateAt(MochiVM* vm, int slot, Value value, ObjRecord* rec) {
+    ObjRecord* upd = mochiNewRecordWithShape(vm, rec->shape);
+    valueArrayCopy(upd->values, rec->values, rec->shape->count);
+    upd->values[slot] = value;
+    return upd;
+}
+
 ObjRecord* mochiRecordUpdate(MochiVM* vm, TableKey field, Value value, ObjRecord* rec) {
-    ObjRecord* upd = emptyRecord(vm, rec->count);
-    size_t updateIndex = 0;
-    for (size_t i = 0; i < upd->count; i++) {
-        updateIndex = i;
-        if (rec->fields[i].key == field) {
-            break;
-        }
-        upd->fields[i] = rec->fields[i];
+    if (rec->shape == NULL) {
+        ASSERT(trieFind(rec->trie, field) != NULL, "Tried to update on a record but couldn't find the key.");
+        vm->collectionDeferrals++;
+        ObjRecordNode* trie = trieInsert(vm, rec->trie, 0, hashLabel(field), field, value, false);
+        ObjRecord* upd = newTrieRecord(vm, trie, rec->trieCount);
+        vm->collectionDeferrals--;
+        return upd;
     }
-    ASSERT(updateIndex < upd->count, "Tried to update on a record but couldn't find the key.");
-    upd->fields[updateIndex] = rec->fields[updateIndex];
-    for (size_t i = updateIndex + 1; i < upd->count; i++) {
-        upd->fields[i] = rec->fields[i];
+
+    int slot = mochiShapeSlot(rec->shape, field);
+    ASSERT(slot >= 0, "Tried to update on a record but couldn't find the key.");
+    return mochiRecordUpdateAt(vm, slot, value, rec);
+}
+
+void mochiRecordUpdateInPlace(MochiVM* vm, TableKey field, Value value, ObjRecord* rec) {
+    if (rec->shape == NULL) {
+        ASSERT(trieFind(rec->trie, field) != NULL, "Tried to update on a record but couldn't find the key.");
+        vm->collectionDeferrals++;
+        rec->trie = trieInsert(vm, rec->trie, 0, hashLabel(field), field, value, false);
+        vm->collectionDeferrals--;
+        return;
     }
-    return upd;
+
+    int slot = mochiShapeSlot(rec->shape, field);
+    ASSERT(slot >= 0, "Tried to update on a record but couldn't find the key.");
+    rec->values[slot] = value;
 }
 
 Value mochiRecordSelect(TableKey field, ObjRecord* rec) {
-    // TODO: binary search here
-    for (size_t i = 0; i < rec->count; i++) {
-        if (rec->fields[i].key == field) {
-            return rec->fields[i].value;
-        }
+    if (rec->shape == NULL) {
+        RecordTrieEntry* entry = trieFind(rec->trie, field);
+        ASSERT(entry != NULL, "Record does not contain field for selection.");
+        return entry->value;
     }
-    ASSERT(false, "Record does not contain field for selection.");
-    return FALSE_VAL;
+
+    int slot = mochiShapeSlot(rec->shape, field);
+    ASSERT(slot >= 0, "Record does not contain field for selection.");
+    return rec->values[slot];
 }
 
 ObjVariant* mochiNewVariant(MochiVM* vm, TableKey label, Value elem) {
@@ -539,9 +2688,33 @@ void mochiFreeObj(MochiVM* vm, Obj* object) {
     }
     case OBJ_FIBER: {
         ObjFiber* fiber = (ObjFiber*)object;
-        DEALLOCATE(vm, fiber->valueStack);
-        DEALLOCATE(vm, fiber->frameStack);
-        DEALLOCATE(vm, fiber->rootStack);
+        mochiFiberRelease(vm, fiber);
+        if (poolFiberObject(vm, fiber)) {
+            return;
+        }
+        break;
+    }
+    case OBJ_STACK_SEGMENT: {
+        ObjStackSegment* segment = (ObjStackSegment*)object;
+        DEALLOCATE(vm, segment->values);
+        break;
+    }
+    case OBJ_CHANNEL: {
+        ObjChannel* channel = (ObjChannel*)object;
+        ChannelSegment* segment = channel->head;
+        while (segment != NULL) {
+            ChannelSegment* next = segment->next;
+            DEALLOCATE(vm, segment);
+            segment = next;
+        }
+        segment = channel->retired;
+        while (segment != NULL) {
+            ChannelSegment* next = segment->retired;
+            DEALLOCATE(vm, segment);
+            segment = next;
+        }
+        vm->config.reallocateFn(channel->senders.fibers, 0, vm->config.userData);
+        vm->config.reallocateFn(channel->receivers.fibers, 0, vm->config.userData);
         break;
     }
     case OBJ_ARRAY: {
@@ -554,19 +2727,6 @@ void mochiFreeObj(MochiVM* vm, Obj* object) {
         mochiByteBufferClear(vm, &arr->elems);
         break;
     }
-    case OBJ_REF: {
-        ObjRef* ref = (ObjRef*)object;
-        // NOTE: this assumes garbage collection, i.e. there are
-        // no other ObjRef instances that contain the same ptr value
-        // that ref contains. If the ref can be fully copied into
-        // a new ObjRef with the same ptr value, the following is
-        // no longer valid. But note that this is not the same as
-        // having multiple pointers to ref on the value/frame stack,
-        // which is perfectly fine since the table-clearing logic will
-        // only occur when ref becomes fully unreachable.
-        mochiTableTryRemove(vm, &vm->heap, ref->ptr);
-        break;
-    }
     case OBJ_RECORD: {
         break;
     }
@@ -578,16 +2738,32 @@ void mochiFreeObj(MochiVM* vm, Obj* object) {
         break;
     case OBJ_LIST:
         break;
+    case OBJ_LIST_CHUNK:
+        break;
     case OBJ_FOREIGN_RESUME:
         break;
+    case OBJ_PROMISE:
+        break;
     case OBJ_SLICE:
         break;
     case OBJ_BYTE_SLICE:
         break;
+    case OBJ_REF:
+        break;
     case OBJ_STRUCT:
         break;
     case OBJ_VARIANT:
         break;
+    case OBJ_RECORD_NODE:
+        break;
+    case OBJ_ROPE:
+        break;
+    case OBJ_VECTOR:
+        break;
+    case OBJ_VECTOR_NODE:
+        break;
+    case OBJ_NUM_ARRAY:
+        break;
     case OBJ_I64:
         break;
     case OBJ_U64:
@@ -599,6 +2775,25 @@ void mochiFreeObj(MochiVM* vm, Obj* object) {
     DEALLOCATE(vm, object);
 }
 
+// Prints an element of a numeric array without boxing it, since printing must not allocate.
+static void printNumElem(ValueType type, const uint8_t* data) {
+    NumElem elem;
+    memcpy(&elem, data, mochiNumElemSize(type));
+    switch (type) {
+    case VAL_I8: printf("%d", elem.i8); break;
+    case VAL_U8: printf("%u", elem.u8); break;
+    case VAL_I16: printf("%d", elem.i16); break;
+    case VAL_U16: printf("%u", elem.u16); break;
+    case VAL_I32: printf("%d", elem.i32); break;
+    case VAL_U32: printf("%u", elem.u32); break;
+    case VAL_I64: printf("%jd", (intmax_t)elem.i64); break;
+    case VAL_U64: printf("%ju", (uintmax_t)elem.u64); break;
+    case VAL_SINGLE: printf("%f", elem.single); break;
+    case VAL_DOUBLE: printf("%f", elem.dub); break;
+    case VAL_BOOL: UNREACHABLE();
+    }
+}
+
 void printObject(MochiVM* vm, Value object) {
     if (AS_OBJ(object) == NULL) {
         printf("nil");
@@ -653,6 +2848,19 @@ void printObject(MochiVM* vm, Value object) {
         printf("fiber");
         break;
     }
+    case OBJ_CHANNEL: {
+        printf("channel");
+        break;
+    }
+    case OBJ_PROMISE: {
+        printf("promise");
+        break;
+    }
+    case OBJ_STACK_SEGMENT: {
+        ObjStackSegment* segment = (ObjStackSegment*)AS_OBJ(object);
+        printf("segment(%d + %d)", segment->belowCount, segment->count);
+        break;
+    }
     case OBJ_FOREIGN: {
         printf("foreign");
         break;
@@ -666,7 +2874,7 @@ void printObject(MochiVM* vm, Value object) {
         printf("cons(");
         printValue(vm, list->elem);
         printf(",");
-        printObject(vm, OBJ_VAL(list->next));
+        printObject(vm, OBJ_VAL(mochiListTail(list)));
         printf(")");
         break;
     }
@@ -707,6 +2915,40 @@ void printObject(MochiVM* vm, Value object) {
         printf("%s", AS_CSTRING(object));
         break;
     }
+    case OBJ_ROPE: {
+        // Printing must not allocate on the heap, so the rope is not flattened.
+        ObjRope* rope = AS_ROPE(object);
+        char* chars = ropeReallocate(vm, NULL, rope->length + 1);
+        mochiStringCopyBytes(vm, (Obj*)rope, (uint8_t*)chars);
+        chars[rope->length] = '\0';
+        printf("rope(%d) or %s", rope->length, chars);
+        ropeReallocate(vm, chars, 0);
+        break;
+    }
+    case OBJ_VECTOR: {
+        ObjVector* vector = AS_VECTOR(object);
+        printf("vector(");
+        for (int i = 0; i < vector->count; i++) {
+            printValue(vm, mochiVectorGetAt(i, vector));
+            if (i < vector->count - 1) {
+                printf(",");
+            }
+        }
+        printf(")");
+        break;
+    }
+    case OBJ_NUM_ARRAY: {
+        ObjNumArray* arr = AS_NUM_ARRAY(object);
+        printf("narray(");
+        for (int i = 0; i < arr->count; i++) {
+            printNumElem(arr->elemType, arr->data + (size_t)i * mochiNumElemSize(arr->elemType));
+            if (i < arr->count - 1) {
+                printf(",");
+            }
+        }
+        printf(")");
+        break;
+    }
     case OBJ_BYTE_SLICE: {
         ObjByteSlice* slice = AS_BYTE_SLICE(object);
         printf("bslice(");
@@ -725,13 +2967,7 @@ void printObject(MochiVM* vm, Value object) {
     }
     case OBJ_REF: {
         printf("ref(");
-        ObjRef* ref = AS_REF(object);
-        Value val;
-        if (mochiTableGet(&vm->heap, ref->ptr, &val)) {
-            printValue(vm, val);
-        } else {
-            printf("NOT_FOUND");
-        }
+        printValue(vm, mochiRefGet(AS_REF(object)));
         printf(")");
         break;
     }
@@ -750,13 +2986,19 @@ void printObject(MochiVM* vm, Value object) {
     case OBJ_RECORD: {
         printf("record(");
         ObjRecord* rec = AS_RECORD(object);
-        for (size_t i = 0; i < rec->count; i++) {
-            printf("%ld->", rec->fields[i].key);
-            printValue(vm, rec->fields[i].value);
-            if (i < rec->count - 1) {
+        int count = mochiRecordCount(rec);
+        TableKey* keys = shapeReallocate(vm, NULL, count * sizeof(TableKey));
+        Value* values = shapeReallocate(vm, NULL, count * sizeof(Value));
+        mochiRecordFields(vm, rec, keys, values);
+        for (int i = 0; i < count; i++) {
+            printf("%ld->", keys[i]);
+            printValue(vm, values[i]);
+            if (i < count - 1) {
                 printf(",");
             }
         }
+        shapeReallocate(vm, keys, 0);
+        shapeReallocate(vm, values, 0);
         printf(")");
         break;
     }
@@ -2,6 +2,7 @@
 #define mochivm_object_h
 
 #include "value.h"
+#include <stdatomic.h>
 #include <threads.h>
 
 #define ASSERT_OBJ_TYPE(obj, objType, message) ASSERT(((Obj*)obj)->type == objType, message)
@@ -28,9 +29,16 @@
 #define AS_BYTE_ARRAY(v)       ((ObjByteArray*)AS_OBJ(v))
 #define AS_BYTE_SLICE(v)       ((ObjByteSlice*)AS_OBJ(v))
 #define AS_REF(v)              ((ObjRef*)AS_OBJ(v))
+#define AS_CHANNEL(v)          ((ObjChannel*)AS_OBJ(v))
+#define AS_PROMISE(v)          ((ObjPromise*)AS_OBJ(v))
 #define AS_STRUCT(v)           ((ObjStruct*)AS_OBJ(v))
 #define AS_RECORD(v)           ((ObjRecord*)AS_OBJ(v))
 #define AS_VARIANT(v)          ((ObjVariant*)AS_OBJ(v))
+#define AS_ROPE(v)             ((ObjRope*)AS_OBJ(v))
+#define AS_VECTOR(v)           ((ObjVector*)AS_OBJ(v))
+#define AS_NUM_ARRAY(v)        ((ObjNumArray*)AS_OBJ(v))
+// Only valid for flat strings. A string value that may be a rope must go through
+// mochiFlattenString first.
 #define AS_CSTRING(v)          ((char*)(void*)((ObjByteArray*)AS_OBJ(v))->elems.data)
 
 // This enum provides a way for compiler writers to specify that some closures-as-handlers have
@@ -89,25 +97,108 @@ typedef struct ObjHandleFrame {
     uint8_t handlerCount;
 } ObjHandleFrame;
 
+// Where a fiber is in its life. A running fiber sets one of the stopped states before returning
+// to the scheduler, which then queues or parks it accordingly.
+typedef enum
+{
+    // Queued to run, or not yet started.
+    FIBER_READY,
+    FIBER_RUNNING,
+    // Stopped to let other fibers run, and queued again straight away.
+    FIBER_YIELDED,
+    // Parked until [wakeTime].
+    FIBER_SLEEPING,
+    // Parked until [joining] finishes, at which point the join is run again.
+    FIBER_JOINING,
+    // Parked until a foreign function that suspended it resumes it.
+    FIBER_SUSPENDED,
+    // Stopped because the channel below the top of the stack is full, or because none of the
+    // [waitCount] channels at the top of the stack have a value to receive. The scheduler parks
+    // the fiber on the channels, and it runs the send or receive again once woken.
+    FIBER_SENDING,
+    FIBER_RECEIVING,
+    // Stopped because the promise on top of the stack has not settled. The scheduler parks the
+    // fiber on the promise, and it runs the await again once woken.
+    FIBER_AWAITING,
+    // Parked on the channels it was sending or receiving on. Only sends, receives and closes on
+    // channels move it out of this state, kept apart from FIBER_PARKED so that they never wake a
+    // fiber parked for another reason, and only through an entry listed for its current
+    // [channelPark]. Whoever moves it out must unlist it from its channels and queue it.
+    FIBER_CHANNEL_PARKED,
+    // Parked on a promise, or suspended and parked by the scheduler once it stopped running.
+    // Whoever moves it out of this state must queue it.
+    FIBER_PARKED,
+    FIBER_DONE
+} FiberState;
+
+// Values or frames from the bottom of the stacks of a copied fiber, shared by the fiber and its
+// copies and never changed once made. A fiber sees the first [n] elements of a chain of segments,
+// the first [belowCount] of which are those of the segment [below].
+typedef struct ObjStackSegment {
+    Obj obj;
+    struct ObjStackSegment* below;
+    int belowCount;
+    bool holdsFrames;
+    int count;
+    int capacity;
+    union {
+        Value* values;
+        ObjVarFrame** frames;
+    };
+} ObjStackSegment;
+
 struct ObjFiber {
     Obj obj;
     uint8_t* ip;
     bool isSuspended;
 
-    thrd_t thread;
-    _Atomic(bool) isPausedForGc;
+    _Atomic(FiberState) state;
+    // The value the fiber aborted with, once it is done.
+    int result;
+    // The time in nanoseconds a sleeping fiber wakes at.
+    uint64_t wakeTime;
+    // The fiber a joining fiber waits on, and the fibers parked in a join on this one, linked
+    // through [nextJoiner], which also links the fibers awaiting a promise. Guarded by the
+    // scheduler lock.
+    struct ObjFiber* joining;
+    struct ObjFiber* joiners;
+    struct ObjFiber* nextJoiner;
+    int waitCount;
+    // Counts the fiber's parks on channels: odd while it is parked on them, and moved on to the
+    // next even number by whoever takes it out of the park.
+    _Atomic(uint64_t) channelPark;
+    // The slot the fiber holds in the fiber registry of the VM, or -1 while it is not registered.
+    int registryIndex;
+    // Set on a fiber running one part of a parallel array instruction for its [caller].
+    bool isParTask;
+    // Set on a fiber suspended in a parallel array instruction, along with the parts of it still
+    // running. If any part fails, [parResult] is the result of the first to fail.
+    bool isParWaiting;
+    atomic_int parRemaining;
+    atomic_bool parFailed;
+    int parResult;
 
     // Value stack, upon which all instructions that consume and produce data operate.
     Value* valueStack;
     Value* valueStackTop;
+    Value* valueStackEnd;
 
     // Frame stack, upon which variable, function, and continuation instructions operate.
     ObjVarFrame** frameStack;
     ObjVarFrame** frameStackTop;
+    ObjVarFrame** frameStackEnd;
+
+    // The values and frames beneath the bottom of the two stacks, shared with the fibers this one
+    // was copied from or to. They are copied onto the stacks as instructions reach them.
+    ObjStackSegment* sharedValues;
+    int sharedValueCount;
+    ObjStackSegment* sharedFrames;
+    int sharedFrameCount;
 
     // Root stack, a smaller Object stack used to temporarily store data so it doesn't get GC'ed.
     Obj** rootStack;
     Obj** rootStackTop;
+    Obj** rootStackEnd;
 
     struct ObjFiber* caller;
 };
@@ -142,12 +233,37 @@ typedef struct ForeignResume {
     ObjFiber* fiber;
 } ForeignResume;
 
+// Lists are unrolled into chunks of up to this many cells.
+#define MOCHIVM_LIST_CHUNK 16
+
+// A list is a pointer to the cell holding its head, or NULL when empty. Cells are not allocated
+// one at a time but live in an ObjListChunk, which is the object the collector tracks and frees.
+// Since cells are not in the VM's list of objects, the next pointer of a cell's header instead
+// points at its chunk.
 typedef struct ObjList {
     Obj obj;
     Value elem;
-    struct ObjList* next;
 } ObjList;
 
+// The cells of consecutive elements of a list, the first cell holding the element furthest from
+// the head. The tail of each cell is the one before it, and the tail of the first is [next].
+// A cons onto the last claimed cell of a chunk with room claims the cell after it rather than
+// allocating, so a list built by consing takes one allocation per chunk and its cells are
+// adjacent in memory. Cells are never reclaimed, so lists that fork from the middle of a chunk
+// start a chunk of their own.
+typedef struct ObjListChunk {
+    Obj obj;
+    // The number of cells claimed, which only grows. Atomic since lists are shared between threads.
+    atomic_int used;
+    int capacity;
+    struct ObjList* next;
+    // The length of [next], so that the length of any list is known without walking it.
+    int nextLength;
+    ObjList cells[];
+} ObjListChunk;
+
+#define LIST_CHUNK(list) ((ObjListChunk*)(list)->obj.next)
+
 typedef struct ObjArray {
     Obj obj;
     ValueBuffer elems;
@@ -172,11 +288,172 @@ typedef struct ObjByteSlice {
     ObjByteArray* source;
 } ObjByteSlice;
 
+// Concatenations of strings at least this long make a rope instead of copying both strings.
+#define MOCHIVM_ROPE_MIN_LENGTH 256
+
+// A string made by concatenating two others without copying them. Each half is either a null
+// terminated byte array or another rope. The bytes are copied into a single byte array the
+// first time something needs them contiguous. [flat] is set only once, by whichever thread
+// flattens the rope first, and the halves are let go by the next collection rather than by the
+// flattening, since another thread may still be copying from them.
+// A rope is never changed: flat halves are copied into arrays only the rope reaches, and the
+// byte array instructions that change a string replace a rope with a copy (mochiDetachString).
+typedef struct ObjRope {
+    Obj obj;
+    // The number of bytes in the string, not counting a null terminator.
+    int length;
+    Obj* left;
+    Obj* right;
+    _Atomic(ObjByteArray*) flat;
+} ObjRope;
+
+// Persistent vectors are relaxed radix balanced trees with this many slots in each node.
+#define MOCHIVM_VECTOR_BITS   5
+#define MOCHIVM_VECTOR_BRANCH (1 << MOCHIVM_VECTOR_BITS)
+
+// A node of a persistent vector, never changed once it is part of a vector. A leaf holds up to
+// MOCHIVM_VECTOR_BRANCH values, and an internal node as many child nodes. An internal node is
+// balanced when every child but the last is full, so a child can be found by radix alone.
+// Concatenation and slicing make relaxed nodes, which are searched using [sizes].
+typedef struct ObjVectorNode {
+    Obj obj;
+    int count;
+    // For a relaxed internal node, the number of elements under each child and all those before
+    // it. NULL for leaves and balanced nodes. Stored after the slots in the same allocation.
+    int* sizes;
+    // The values of a leaf, or object values holding the children of an internal node.
+    Value slots[];
+} ObjVectorNode;
+
+// An immutable vector whose updates share all but O(log n) nodes with the vector they came from.
+typedef struct ObjVector {
+    Obj obj;
+    int count;
+    // The height of the tree in bits of index, zero when the root is a leaf.
+    int shift;
+    // NULL when the vector is empty.
+    ObjVectorNode* root;
+} ObjVector;
+
+// A fixed length array of unboxed numbers of a single value type, stored contiguously so the
+// bulk numeric instructions can run over it with vector loops. A slice of a numeric array is
+// another numeric array sharing the elements of its source, so slices work with every numeric
+// array instruction.
+typedef struct ObjNumArray {
+    Obj obj;
+    ValueType elemType;
+    int count;
+    // The first element, in [storage] or in the storage of [source].
+    uint8_t* data;
+    // The array owning the elements of a slice, or NULL when the elements are in [storage].
+    struct ObjNumArray* source;
+    uint64_t storage[];
+} ObjNumArray;
+
+// A mutable cell holding a single value, which fibers on different threads may share. Loads
+// from the cell acquire and stores to it release, so a fiber that reads a value also sees
+// everything the writing fiber did before storing it. Running code only writes to the cell
+// through the mochiRef functions, which is where a write barrier belongs.
 typedef struct ObjRef {
     Obj obj;
-    TableKey ptr;
+#if MOCHIVM_NAN_TAGGING || MOCHIVM_POINTER_TAGGING
+    _Atomic(Value) value;
+#else
+    // A union value is too wide to update atomically on every platform, so the cell is guarded
+    // by a spin lock held only for the length of each operation.
+    atomic_flag lock;
+    Value value;
+#endif
 } ObjRef;
 
+// The number of values held by each segment of an unbounded channel.
+#define MOCHIVM_CHANNEL_SEGMENT_SIZE 32
+
+// A slot of a channel. As in Vyukov's bounded MPMC queue, [sequence] tells senders and receivers
+// whose turn it is to use the slot, so [value] itself needs no atomics.
+typedef struct {
+    _Atomic(uint64_t) sequence;
+    Value value;
+} ChannelSlot;
+
+// A run of slots in an unbounded channel, each used once. Senders claim slots in order by
+// incrementing [tail], and receivers by advancing [head]. Once every slot is claimed a sender
+// links a new segment after it, and once every slot is received the segment is retired.
+typedef struct ChannelSegment {
+    _Atomic(struct ChannelSegment*) next;
+    struct ChannelSegment* retired;
+    _Atomic(int64_t) head;
+    _Atomic(int64_t) tail;
+    ChannelSlot slots[MOCHIVM_CHANNEL_SEGMENT_SIZE];
+} ChannelSegment;
+
+// A fiber parked on a channel, along with the [ticket] of the park it was listed for. The entry is
+// stale, and can no longer wake the fiber, once the fiber's [channelPark] has moved past it.
+typedef struct {
+    ObjFiber* fiber;
+    uint64_t ticket;
+} ChannelWaiter;
+
+// The fibers parked on one end of a channel, oldest first. Guarded by the channel lock, though
+// [count] is also read without it to see whether there is anyone to wake.
+typedef struct {
+    ChannelWaiter* fibers;
+    _Atomic(int) count;
+    int capacity;
+} ChannelWaiters;
+
+// A first in, first out queue of values that any number of fibers may send to and receive from
+// at once. A bounded channel holds up to [capacity] values in a ring of [slots], and senders park
+// while it is full. An unbounded channel has a [capacity] of zero and a list of segments from
+// [head] to [tail], which grows as needed. Receivers park while the channel is empty. Sending and
+// receiving take no lock unless a fiber has to be parked or woken.
+//
+// Once [closed], sends fail, and receives fail once the values sent before the close are gone.
+typedef struct ObjChannel {
+    Obj obj;
+    uint32_t capacity;
+    _Atomic(bool) closed;
+    // Guards the waiters, held only for the length of each change to them.
+    atomic_flag lock;
+    ChannelWaiters senders;
+    ChannelWaiters receivers;
+
+    // The positions of the next slot to send to and receive from, in a bounded channel.
+    _Atomic(uint64_t) sendPosition;
+    _Atomic(uint64_t) receivePosition;
+
+    _Atomic(ChannelSegment*) head;
+    _Atomic(ChannelSegment*) tail;
+    // Segments receivers have moved past, which another receiver may still be reading. They are
+    // freed by the next collection, since no fiber is partway through a receive while it runs.
+    _Atomic(ChannelSegment*) retired;
+
+    ChannelSlot slots[];
+} ObjChannel;
+
+typedef enum
+{
+    CHANNEL_OK,
+    // The channel was full or empty, and sending or receiving again later may succeed.
+    CHANNEL_BLOCKED,
+    CHANNEL_CLOSED
+} ChannelStatus;
+
+// The result of an operation that finishes later, such as one a foreign function starts on the
+// event loop. Fibers awaiting the promise before it settles are parked on it, linked through
+// [nextJoiner], and queued once it does, while those awaiting it afterwards take [value] straight
+// away. A promise settles once. Until then it is kept alive in the VM's list of pending promises,
+// since whatever is to settle it may hold the only reference. The awaiters and the list are
+// guarded by the scheduler lock.
+typedef struct ObjPromise {
+    Obj obj;
+    _Atomic(bool) isSettled;
+    Value value;
+    ObjFiber* awaiters;
+    struct ObjPromise* prevPending;
+    struct ObjPromise* nextPending;
+} ObjPromise;
+
 typedef uint32_t StructId;
 
 typedef struct ObjStruct {
@@ -186,10 +463,68 @@ typedef struct ObjStruct {
     Value elems[];
 } ObjStruct;
 
+struct RecordShape;
+
+// The shape a record of another shape gets when [field] is added to it, or removed from it if
+// [remove] is true.
+typedef struct ShapeTransition {
+    TableKey field;
+    bool remove;
+    struct RecordShape* shape;
+    struct ShapeTransition* next;
+} ShapeTransition;
+
+// The set of field labels a record has, shared by every record with the same labels. Shapes
+// are interned by the VM, so two records have the same labels exactly when they have the same
+// shape, and live until the VM is freed. The keys are sorted, with a label that is added again
+// going before its earlier occurrences.
+typedef struct RecordShape {
+    uint32_t hash;
+    int count;
+    // The transitions records of this shape have taken so far. They are read without the shape
+    // lock, so each is filled in before it is pushed onto the front under the lock, and never
+    // removed until the VM is freed.
+    _Atomic(ShapeTransition*) transitions;
+    TableKey keys[];
+} RecordShape;
+
+// Records with more fields than this are stored in a hash trie rather than flat, so that
+// extending, updating and restricting them copies a path through the trie instead of every field.
+#define MOCHIVM_RECORD_TRIE_THRESHOLD 32
+
+struct ObjRecordNode;
+
+// A branch of a record trie node, which is either a subtrie or a single field.
+typedef struct RecordTrieEntry {
+    // The subtrie of the branch, or NULL if the branch holds a field.
+    struct ObjRecordNode* node;
+    TableKey key;
+    Value value;
+    // The values of the field's earlier occurrences when its label has been added more than
+    // once, most recent first.
+    ObjList* shadowed;
+} RecordTrieEntry;
+
+// A node of a record trie. Each level of the trie branches on the next five bits of a hash of
+// the field label, and [bitmap] marks which of the 32 branches the node has, with [entries]
+// holding just those branches in order. Nodes are never changed once built, so records share
+// every node off the path an operation copies.
+typedef struct ObjRecordNode {
+    Obj obj;
+    uint32_t bitmap;
+    int count;
+    RecordTrieEntry entries[];
+} ObjRecordNode;
+
 typedef struct ObjRecord {
     Obj obj;
-    size_t count;
-    TableEntry fields[];
+    // The shape of a record stored flat in [values], or NULL for a record stored in [trie].
+    RecordShape* shape;
+    ObjRecordNode* trie;
+    // The number of fields in [trie], counting each occurrence of a label added more than once.
+    int trieCount;
+    // The value of each field of a flat record, in the order of the keys of [shape].
+    Value values[];
 } ObjRecord;
 
 typedef struct ObjVariant {
@@ -201,17 +536,36 @@ typedef struct ObjVariant {
 
 // Creates a new fiber object with the values from the given initial stack.
 ObjFiber* mochiNewFiber(MochiVM* vm, uint8_t* first, Value* initialStack, int initialStackCount);
+// Creates a new fiber continuing from where the original is. Once the code is verified, the values
+// and frames of the original are moved into segments shared by both rather than copied, so each
+// only copies what it pops down to. Otherwise, and always for the roots, they are copied outright.
+// The frames themselves are shared between the two.
 ObjFiber* mochiFiberClone(MochiVM* vm, ObjFiber* orig);
+// Makes sure [fiber] has room for [values] more values and [frames] more frames, growing its stacks
+// if needed, after copying up shared values and frames until it holds at least the stack floors
+// the verifier found. Returns false if either stack would grow past the configured capacity.
+bool mochiFiberReserve(MochiVM* vm, ObjFiber* fiber, int values, int frames);
+// Copies all shared values and frames of [fiber] onto its stacks, for code that works on them
+// whole.
+void mochiFiberUnshare(MochiVM* vm, ObjFiber* fiber);
+// Copies shared values and frames onto the stacks of [fiber] until it holds at least [values]
+// values and [frames] frames, or all it has.
+void mochiFiberReach(MochiVM* vm, ObjFiber* fiber, int values, int frames);
+// Gives the stacks of a fiber that will not run again to the fiber pool, or frees them, leaving
+// the fiber with empty stacks.
+void mochiFiberRelease(MochiVM* vm, ObjFiber* fiber);
+// The number of values and frames the fiber has, counting those still shared.
 static inline size_t mochiFiberValueCount(ObjFiber* fiber) {
-    return fiber->valueStackTop - fiber->valueStack;
+    return (fiber->valueStackTop - fiber->valueStack) + fiber->sharedValueCount;
 }
 static inline size_t mochiFiberFrameCount(ObjFiber* fiber) {
-    return fiber->frameStackTop - fiber->frameStack;
+    return (fiber->frameStackTop - fiber->frameStack) + fiber->sharedFrameCount;
 }
 static inline size_t mochiFiberRootCount(ObjFiber* fiber) {
     return fiber->rootStackTop - fiber->rootStack;
 }
 static inline void mochiFiberPushValue(ObjFiber* fiber, Value v) {
+    ASSERT(fiber->valueStackTop < fiber->valueStackEnd, "Pushed past the end of the value stack.");
     *fiber->valueStackTop++ = v;
 }
 static inline Value mochiFiberPopValue(ObjFiber* fiber) {
@@ -224,6 +578,7 @@ static inline void mochiFiberDropValues(ObjFiber* fiber, int count) {
     fiber->valueStackTop -= count;
 }
 static inline void mochiFiberPushFrame(ObjFiber* fiber, ObjVarFrame* frame) {
+    ASSERT(fiber->frameStackTop < fiber->frameStackEnd, "Pushed past the end of the frame stack.");
     *fiber->frameStackTop++ = frame;
 }
 static inline ObjVarFrame* mochiFiberPopFrame(ObjFiber* fiber) {
@@ -239,7 +594,7 @@ static inline Obj* mochiFiberPopRoot(ObjFiber* fiber) {
     return *(--fiber->rootStackTop);
 }
 static inline bool mochiFiberEqual(ObjFiber* left, ObjFiber* right) {
-    return thrd_equal(left->thread, right->thread);
+    return left == right;
 }
 
 ObjClosure* mochiNewClosure(MochiVM* vm, uint8_t* body, uint8_t paramCount, uint16_t capturedCount);
@@ -257,7 +612,39 @@ ObjForeign* mochiNewForeign(MochiVM* vm, size_t size);
 ObjCPointer* mochiNewCPointer(MochiVM* vm, void* pointer);
 ForeignResume* mochiNewResume(MochiVM* vm, ObjFiber* fiber);
 
-ObjRef* mochiNewRef(MochiVM* vm, TableKey ptr);
+ObjRef* mochiNewRef(MochiVM* vm, Value value);
+// The collector stops every fiber before marking and never runs alongside an operation on a ref,
+// so none of these need a barrier yet; an incremental collector would gray the stored value in
+// each of them when [ref] is already black.
+Value mochiRefGet(ObjRef* ref);
+void mochiRefPut(ObjRef* ref, Value value);
+// Stores [value] in [ref] and returns the value it replaced.
+Value mochiRefSwap(ObjRef* ref, Value value);
+// Stores [desired] in [ref] if it holds an integer of [type] equal to [expected], returning
+// whether it did.
+bool mochiRefCompareSwap(ObjRef* ref, ValueType type, Value expected, Value desired);
+// Adds [delta] to the integer of [type] in [ref], wrapping on overflow, and returns the value it
+// replaced. Adding may allocate the new value, so the old one is kept in [root], which must be a
+// slot the collector scans, until it is no longer needed.
+Value mochiRefFetchAdd(MochiVM* vm, ObjRef* ref, ValueType type, Value delta, Value* root);
+
+// Creates a channel holding up to [capacity] values, or an unbounded one if [capacity] is zero.
+ObjChannel* mochiNewChannel(MochiVM* vm, uint32_t capacity);
+// Sends [value] without waiting, waking a parked receiver if there is one. Sending to an unbounded
+// channel may allocate, so [value] must be reachable by the collector.
+ChannelStatus mochiChannelSend(MochiVM* vm, ObjChannel* channel, Value value);
+// Receives a value into [value] without waiting, waking a parked sender if there is one.
+ChannelStatus mochiChannelReceive(MochiVM* vm, ObjChannel* channel, Value* value);
+// Closes [channel] and wakes every fiber parked on it.
+void mochiChannelClose(MochiVM* vm, ObjChannel* channel);
+// Parks [fiber], stopped in FIBER_SENDING or FIBER_RECEIVING, on the channels it is waiting for.
+// Returns true if one of them became ready while it was being parked, in which case the fiber is
+// no longer parked and the caller must queue it.
+bool mochiChannelPark(MochiVM* vm, ObjFiber* fiber);
+
+// Creates a promise that has not settled, which stays alive until it is settled with
+// mochiSchedulerSettle.
+ObjPromise* mochiNewPromise(MochiVM* vm);
 
 ObjStruct* mochiNewStruct(MochiVM* vm, StructId id, int elemCount);
 
@@ -266,6 +653,11 @@ ObjList* mochiListCons(MochiVM* vm, Value elem, ObjList* tail);
 ObjList* mochiListTail(ObjList* list);
 Value mochiListHead(ObjList* list);
 int mochiListLength(ObjList* list);
+// Copies [prefix] into full chunks in front of [suffix], which is shared rather than copied.
+ObjList* mochiListAppend(MochiVM* vm, ObjList* prefix, ObjList* suffix);
+// Links the end of [prefix] to [suffix] without copying, which is only safe when no cell of
+// [prefix] is shared.
+ObjList* mochiListAppendInPlace(ObjList* prefix, ObjList* suffix);
 
 ObjArray* mochiArrayNil(MochiVM* vm);
 ObjArray* mochiArrayFill(MochiVM* vm, int amount, Value elem, ObjArray* array);
@@ -274,6 +666,9 @@ Value mochiArrayGetAt(int index, ObjArray* array);
 void mochiArraySetAt(int index, Value value, ObjArray* array);
 int mochiArrayLength(ObjArray* array);
 ObjArray* mochiArrayCopy(MochiVM* vm, int start, int length, ObjArray* array);
+ObjArray* mochiArrayConcat(MochiVM* vm, ObjArray* a, ObjArray* b);
+// Appends the elements of [other] to [array] in place.
+ObjArray* mochiArrayAppend(MochiVM* vm, ObjArray* array, ObjArray* other);
 
 ObjSlice* mochiArraySlice(MochiVM* vm, int start, int length, ObjArray* array);
 ObjSlice* mochiSubslice(MochiVM* vm, int start, int length, ObjSlice* slice);
@@ -290,6 +685,31 @@ uint8_t mochiByteArrayGetAt(int index, ObjByteArray* array);
 void mochiByteArraySetAt(int index, uint8_t value, ObjByteArray* array);
 int mochiByteArrayLength(ObjByteArray* array);
 ObjByteArray* mochiByteArrayCopy(MochiVM* vm, int start, int length, ObjByteArray* array);
+ObjByteArray* mochiByteArrayConcat(MochiVM* vm, ObjByteArray* a, ObjByteArray* b);
+// Appends the elements of [other] to [array] in place.
+ObjByteArray* mochiByteArrayAppend(MochiVM* vm, ObjByteArray* array, ObjByteArray* other);
+// Like the byte array functions, but dropping the null terminator of the first string.
+ObjByteArray* mochiStringConcat(MochiVM* vm, ObjByteArray* a, ObjByteArray* b);
+ObjByteArray* mochiStringAppend(MochiVM* vm, ObjByteArray* string, ObjByteArray* other);
+
+// The number of bytes in the flat string or rope [string], not counting the null terminator.
+int mochiStringLength(Obj* string);
+// Concatenates two strings, each flat or a rope, making a rope when the result is long enough.
+Obj* mochiRopeConcat(MochiVM* vm, Obj* a, Obj* b);
+// Copies the bytes of [string] without a null terminator into [dest], which must have room for
+// [mochiStringLength] bytes. Does not allocate on the VM heap, so it is safe outside a run.
+void mochiStringCopyBytes(MochiVM* vm, Obj* string, uint8_t* dest);
+ObjByteArray* mochiRopeFlatten(MochiVM* vm, ObjRope* rope);
+// Returns the flat byte array holding the string [string], flattening it if it is a rope. The
+// string must be reachable by the collector, since flattening allocates. The array of a rope is
+// shared with every rope built from it, so it must only be read.
+static inline ObjByteArray* mochiFlattenString(MochiVM* vm, Value string) {
+    Obj* obj = AS_OBJ(string);
+    return obj->type == OBJ_ROPE ? mochiRopeFlatten(vm, (ObjRope*)obj) : (ObjByteArray*)obj;
+}
+// Returns a flat byte array holding the string in [slot] that may be changed. Ropes are never
+// changed, so a rope in [slot] is replaced with a new byte array holding a copy of its bytes.
+ObjByteArray* mochiDetachString(MochiVM* vm, Value* slot);
 
 ObjByteSlice* mochiByteArraySlice(MochiVM* vm, int start, int length, ObjByteArray* array);
 ObjByteSlice* mochiByteSubslice(MochiVM* vm, int start, int length, ObjByteSlice* slice);
@@ -298,10 +718,76 @@ void mochiByteSliceSetAt(int index, uint8_t value, ObjByteSlice* slice);
 int mochiByteSliceLength(ObjByteSlice* slice);
 ObjByteArray* mochiByteSliceCopy(MochiVM* vm, ObjByteSlice* slice);
 
+// Byte arrays, byte slices and strings are searched, compared and hashed alike by these, without
+// the null terminator of a string. Ropes are flattened first, so the arguments must be reachable
+// by the collector.
+int mochiBytesIndexOf(MochiVM* vm, Obj* bytes, Obj* needle);
+int mochiBytesCount(MochiVM* vm, uint8_t byte, Obj* bytes);
+// Orders [a] and [b] lexicographically by unsigned byte, returning -1, 0 or 1.
+int mochiBytesCompare(MochiVM* vm, Obj* a, Obj* b);
+bool mochiBytesEqual(MochiVM* vm, Obj* a, Obj* b);
+uint64_t mochiBytesHash(MochiVM* vm, Obj* bytes);
+
+ObjVector* mochiNewVector(MochiVM* vm);
+ObjVector* mochiVectorFromValues(MochiVM* vm, const Value* values, int count);
+ObjVector* mochiVectorFromArray(MochiVM* vm, ObjArray* array);
+ObjArray* mochiVectorToArray(MochiVM* vm, ObjVector* vector);
+Value mochiVectorGetAt(int index, ObjVector* vector);
+// Returns the slot holding element [index]. Only a vector whose nodes are not shared, such as one
+// just made from values, may be written through it.
+Value* mochiVectorSlot(int index, ObjVector* vector);
+ObjVector* mochiVectorSetAt(MochiVM* vm, int index, Value value, ObjVector* vector);
+ObjVector* mochiVectorSnoc(MochiVM* vm, Value elem, ObjVector* vector);
+ObjVector* mochiVectorConcat(MochiVM* vm, ObjVector* a, ObjVector* b);
+ObjVector* mochiVectorSlice(MochiVM* vm, int start, int length, ObjVector* vector);
+int mochiVectorLength(ObjVector* vector);
+
+// Creates a numeric array of [count] zeroes of [elemType].
+ObjNumArray* mochiNewNumArray(MochiVM* vm, ValueType elemType, int count);
+ObjNumArray* mochiNumArrayFill(MochiVM* vm, ValueType elemType, int count, Value elem);
+Value mochiNumArrayGetAt(MochiVM* vm, int index, ObjNumArray* array);
+void mochiNumArraySetAt(int index, Value value, ObjNumArray* array);
+int mochiNumArrayLength(ObjNumArray* array);
+ObjNumArray* mochiNumArraySlice(MochiVM* vm, int start, int length, ObjNumArray* array);
+// The bulk operations take arrays of the same type and length. Integer arithmetic wraps around,
+// and floating point sums may be added up in any order. Eq and Less return arrays of U8 holding
+// 1 where the comparison of the elements of [a] and [b] holds and 0 elsewhere.
+ObjNumArray* mochiNumArrayAdd(MochiVM* vm, ObjNumArray* a, ObjNumArray* b);
+ObjNumArray* mochiNumArrayMul(MochiVM* vm, ObjNumArray* a, ObjNumArray* b);
+// Returns [a] * [b] + [c], fused where the processor supports it.
+ObjNumArray* mochiNumArrayFma(MochiVM* vm, ObjNumArray* a, ObjNumArray* b, ObjNumArray* c);
+Value mochiNumArraySum(MochiVM* vm, ObjNumArray* array);
+// The minimum and maximum of an empty array, or of floating point numbers including NaN, are
+// undefined.
+Value mochiNumArrayMin(MochiVM* vm, ObjNumArray* array);
+Value mochiNumArrayMax(MochiVM* vm, ObjNumArray* array);
+Value mochiNumArrayDot(MochiVM* vm, ObjNumArray* a, ObjNumArray* b);
+ObjNumArray* mochiNumArrayEq(MochiVM* vm, ObjNumArray* a, ObjNumArray* b);
+ObjNumArray* mochiNumArrayLess(MochiVM* vm, ObjNumArray* a, ObjNumArray* b);
+
+// Returns the interned shape with the [count] sorted [keys], creating it if no record has had it yet.
+RecordShape* mochiInternShape(MochiVM* vm, const TableKey* keys, int count);
+// Returns the slot of the first occurrence of [field] in [shape], or -1 if it has no such field.
+int mochiShapeSlot(RecordShape* shape, TableKey field);
+void mochiFreeShapes(MochiVM* vm);
+
 ObjRecord* mochiNewRecord(MochiVM* vm);
+// Creates a record of [shape] whose values must all be filled in before the next allocation.
+ObjRecord* mochiNewRecordWithShape(MochiVM* vm, RecordShape* shape);
 ObjRecord* mochiRecordExtend(MochiVM* vm, TableKey field, Value value, ObjRecord* rec);
 ObjRecord* mochiRecordRestrict(MochiVM* vm, TableKey field, ObjRecord* rec);
 ObjRecord* mochiRecordUpdate(MochiVM* vm, TableKey field, Value value, ObjRecord* rec);
+// Updates the field at [slot] in the shape of the flat record [rec], for callers that have
+// already found the slot.
+ObjRecord* mochiRecordUpdateAt(MochiVM* vm, int slot, Value value, ObjRecord* rec);
+// Updates [field] of [rec] without copying the record, which is only safe when nothing else
+// refers to [rec]. The nodes of a record stored in a trie may be shared with other records, so
+// the path to the field is still copied.
+void mochiRecordUpdateInPlace(MochiVM* vm, TableKey field, Value value, ObjRecord* rec);
+int mochiRecordCount(ObjRecord* rec);
+// Writes the labels and values of the fields of [rec] in the order a flat record keeps them. Both
+// arrays must have room for [mochiRecordCount] fields.
+void mochiRecordFields(MochiVM* vm, ObjRecord* rec, TableKey* keys, Value* values);
 Value mochiRecordSelect(TableKey field, ObjRecord* rec);
 
 ObjVariant* mochiNewVariant(MochiVM* vm, TableKey label, Value elem);
@@ -100,6 +100,25 @@ OPCODE(JUMP_FALSE)
 OPCODE(OFFSET_TRUE)
 OPCODE(OFFSET_FALSE)
 
+OPCODE(JUMP_INT_EQ)
+OPCODE(JUMP_INT_LESS)
+OPCODE(JUMP_INT_GREATER)
+OPCODE(OFFSET_INT_EQ)
+OPCODE(OFFSET_INT_LESS)
+OPCODE(OFFSET_INT_GREATER)
+OPCODE(JUMP_SINGLE_EQ)
+OPCODE(JUMP_SINGLE_LESS)
+OPCODE(JUMP_SINGLE_GREATER)
+OPCODE(OFFSET_SINGLE_EQ)
+OPCODE(OFFSET_SINGLE_LESS)
+OPCODE(OFFSET_SINGLE_GREATER)
+OPCODE(JUMP_DOUBLE_EQ)
+OPCODE(JUMP_DOUBLE_LESS)
+OPCODE(JUMP_DOUBLE_GREATER)
+OPCODE(OFFSET_DOUBLE_EQ)
+OPCODE(OFFSET_DOUBLE_LESS)
+OPCODE(OFFSET_DOUBLE_GREATER)
+
 OPCODE(CLOSURE)
 OPCODE(RECURSIVE)
 OPCODE(MUTUAL)
@@ -124,6 +143,15 @@ OPCODE(THREAD_YIELD)
 OPCODE(THREAD_JOIN)
 OPCODE(THREAD_EQUAL)
 
+OPCODE(CHANNEL_NEW)
+OPCODE(CHANNEL_SEND)
+OPCODE(CHANNEL_RECV)
+OPCODE(CHANNEL_TRY_RECV)
+OPCODE(CHANNEL_CLOSE)
+OPCODE(CHANNEL_SELECT)
+
+OPCODE(AWAIT)
+
 OPCODE(ZAP)
 OPCODE(DUP)
 OPCODE(SWAP)
@@ -132,6 +160,9 @@ OPCODE(SHUFFLE)
 OPCODE(NEWREF)
 OPCODE(GETREF)
 OPCODE(PUTREF)
+OPCODE(REF_SWAP)
+OPCODE(REF_CAS)
+OPCODE(REF_FETCH_ADD)
 
 OPCODE(CONSTRUCT)
 OPCODE(DESTRUCT)
@@ -144,9 +175,11 @@ OPCODE(RECORD_EXTEND)
 OPCODE(RECORD_SELECT)
 OPCODE(RECORD_RESTRICT)
 OPCODE(RECORD_UPDATE)
+OPCODE(RECORD_UPDATE_REUSE)
 
 OPCODE(VARIANT)
 OPCODE(EMBED)
+OPCODE(EMBED_REUSE)
 OPCODE(IS_CASE)
 OPCODE(JUMP_CASE)
 OPCODE(OFFSET_CASE)
@@ -157,6 +190,7 @@ OPCODE(LIST_HEAD)
 OPCODE(LIST_TAIL)
 OPCODE(LIST_IS_EMPTY)
 OPCODE(LIST_APPEND)
+OPCODE(LIST_APPEND_REUSE)
 
 OPCODE(ARRAY_NIL)
 OPCODE(ARRAY_FILL)
@@ -166,6 +200,9 @@ OPCODE(ARRAY_SET_AT)
 OPCODE(ARRAY_LENGTH)
 OPCODE(ARRAY_COPY)
 OPCODE(ARRAY_CONCAT)
+OPCODE(ARRAY_CONCAT_REUSE)
+OPCODE(ARRAY_PAR_MAP)
+OPCODE(ARRAY_PAR_REDUCE)
 
 OPCODE(ARRAY_SLICE)
 OPCODE(SUBSLICE)
@@ -182,6 +219,7 @@ OPCODE(BYTE_ARRAY_SET_AT)
 OPCODE(BYTE_ARRAY_LENGTH)
 OPCODE(BYTE_ARRAY_COPY)
 OPCODE(BYTE_ARRAY_CONCAT)
+OPCODE(BYTE_ARRAY_CONCAT_REUSE)
 
 OPCODE(BYTE_ARRAY_SLICE)
 OPCODE(BYTE_SUBSLICE)
@@ -190,5 +228,37 @@ OPCODE(BYTE_SLICE_SET_AT)
 OPCODE(BYTE_SLICE_LENGTH)
 OPCODE(BYTE_SLICE_COPY)
 
+OPCODE(BYTES_INDEX_OF)
+OPCODE(BYTES_COUNT)
+OPCODE(BYTES_COMPARE)
+OPCODE(BYTES_EQUAL)
+OPCODE(BYTES_HASH)
+
+OPCODE(VECTOR_NIL)
+OPCODE(VECTOR_SNOC)
+OPCODE(VECTOR_GET_AT)
+OPCODE(VECTOR_SET_AT)
+OPCODE(VECTOR_LENGTH)
+OPCODE(VECTOR_CONCAT)
+OPCODE(VECTOR_SLICE)
+OPCODE(ARRAY_TO_VECTOR)
+OPCODE(VECTOR_TO_ARRAY)
+
+OPCODE(NUM_ARRAY_FILL)
+OPCODE(NUM_ARRAY_GET_AT)
+OPCODE(NUM_ARRAY_SET_AT)
+OPCODE(NUM_ARRAY_LENGTH)
+OPCODE(NUM_ARRAY_SLICE)
+OPCODE(NUM_ARRAY_ADD)
+OPCODE(NUM_ARRAY_MUL)
+OPCODE(NUM_ARRAY_FMA)
+OPCODE(NUM_ARRAY_SUM)
+OPCODE(NUM_ARRAY_MIN)
+OPCODE(NUM_ARRAY_MAX)
+OPCODE(NUM_ARRAY_DOT)
+OPCODE(NUM_ARRAY_EQ)
+OPCODE(NUM_ARRAY_LESS)
+
 OPCODE(STRING_CONCAT)
+OPCODE(STRING_CONCAT_REUSE)
 OPCODE(PRINT)
\ No newline at end of file
@@ -0,0 +1,625 @@
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "vm.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if MOCHIVM_BATTERY_UV
+#include "uv.h"
+#endif
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+// How long an idle worker waits between runs of the event loop while fibers are suspended.
+#define EVENT_POLL_NANOS 1000000
+
+// The worker running on this OS thread. A thread only ever works for one VM, but the VM is
+// checked so that a thread running a VM of its own is not taken for a worker of another.
+static _Thread_local Worker* currentWorker = NULL;
+
+// Deques and queues hold fibers that are already reachable through the VM's fibers, and are
+// touched by workers while a collection runs, so they are allocated outside the collected heap.
+static void* rawReallocate(MochiVM* vm, void* memory, size_t newSize) {
+    return vm->config.reallocateFn(memory, newSize, vm->config.userData);
+}
+
+static int processorCount(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+uint64_t mochiSchedulerNow(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static FiberRing* newRing(MochiVM* vm, int64_t capacity) {
+    FiberRing* ring = rawReallocate(vm, NULL, sizeof(FiberRing) + sizeof(_Atomic(ObjFiber*)) * capacity);
+    PANIC_IF(ring != NULL, "Out of memory while growing a fiber deque.");
+    ring->capacity = capacity;
+    ring->retired = NULL;
+    return ring;
+}
+
+static void dequeInit(MochiVM* vm, FiberDeque* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->ring, newRing(vm, DEQUE_INITIAL_CAPACITY));
+}
+
+static void dequeFree(MochiVM* vm, FiberDeque* deque) {
+    FiberRing* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    while (ring != NULL) {
+        FiberRing* retired = ring->retired;
+        rawReallocate(vm, ring, 0);
+        ring = retired;
+    }
+}
+
+static void dequePush(MochiVM* vm, FiberDeque* deque, ObjFiber* fiber) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    FiberRing* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    if (bottom - top > ring->capacity - 1) {
+        FiberRing* grown = newRing(vm, ring->capacity * 2);
+        for (int64_t i = top; i < bottom; i++) {
+            ObjFiber* moved = atomic_load_explicit(&ring->slots[i & (ring->capacity - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->slots[i & (grown->capacity - 1)], moved, memory_order_relaxed);
+        }
+        grown->retired = ring;
+        atomic_store_explicit(&deque->ring, grown, memory_order_release);
+        ring = grown;
+    }
+    atomic_store_explicit(&ring->slots[bottom & (ring->capacity - 1)], fiber, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static ObjFiber* dequeTake(FiberDeque* deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    FiberRing* ring = atomic_load_explicit(&deque->ring, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    ObjFiber* fiber = atomic_load_explicit(&ring->slots[bottom & (ring->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // The last fiber in the deque, which a thief may be taking at the same time.
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            fiber = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return fiber;
+}
+
+// Returns NULL if the deque is empty, or if another worker took the fiber first.
+static ObjFiber* dequeSteal(FiberDeque* deque) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    FiberRing* ring = atomic_load_explicit(&deque->ring, memory_order_acquire);
+    ObjFiber* fiber = atomic_load_explicit(&ring->slots[top & (ring->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return fiber;
+}
+
+void mochiSchedulerInit(MochiVM* vm) {
+    Scheduler* scheduler = &vm->scheduler;
+    scheduler->workers = NULL;
+    scheduler->workerCount = 0;
+    scheduler->main = NULL;
+    mtx_init(&scheduler->lock, mtx_plain);
+    cnd_init(&scheduler->wake);
+#if MOCHIVM_BATTERY_UV
+    mtx_init(&scheduler->eventLock, mtx_plain);
+#endif
+    scheduler->queue = NULL;
+    scheduler->queueHead = 0;
+    scheduler->queueCount = 0;
+    scheduler->queueCapacity = 0;
+    scheduler->sleepers = NULL;
+    scheduler->sleeperCount = 0;
+    scheduler->sleeperCapacity = 0;
+    atomic_init(&scheduler->readyCount, 0);
+    atomic_init(&scheduler->idleCount, 0);
+    atomic_init(&scheduler->parkedCount, 0);
+    atomic_init(&scheduler->stopping, false);
+}
+
+void mochiSchedulerFree(MochiVM* vm) {
+    Scheduler* scheduler = &vm->scheduler;
+    scheduler->queue = rawReallocate(vm, scheduler->queue, 0);
+    scheduler->sleepers = rawReallocate(vm, scheduler->sleepers, 0);
+#if MOCHIVM_BATTERY_UV
+    mtx_destroy(&scheduler->eventLock);
+#endif
+    cnd_destroy(&scheduler->wake);
+    mtx_destroy(&scheduler->lock);
+}
+
+Worker* mochiWorkerCurrent(MochiVM* vm) {
+    return currentWorker != NULL && currentWorker->vm == vm ? currentWorker : NULL;
+}
+
+void mochiWorkerWaitGc(MochiVM* vm, Worker* worker) {
+    while (vm->collecting) {
+        worker->isPausedForGc = true;
+        thrd_yield();
+    }
+    worker->isPausedForGc = false;
+}
+
+// Marks [worker] as no longer paused before it runs a fiber. The flag is cleared before the
+// collecting flag is checked, and the collector sets its flag before checking the workers, so
+// either the collector waits for this worker or this worker waits for the collection.
+static void leavePause(MochiVM* vm, Worker* worker) {
+    worker->isPausedForGc = false;
+    if (vm->collecting) {
+        mochiWorkerWaitGc(vm, worker);
+    }
+}
+
+static void wakeIdleWorker(Scheduler* scheduler) {
+    if (scheduler->idleCount > 0) {
+        mtx_lock(&scheduler->lock);
+        cnd_signal(&scheduler->wake);
+        mtx_unlock(&scheduler->lock);
+    }
+}
+
+// Appends [fiber] to the shared queue. The scheduler lock must be held.
+static void queuePush(MochiVM* vm, ObjFiber* fiber) {
+    Scheduler* scheduler = &vm->scheduler;
+    if (scheduler->queueCount == scheduler->queueCapacity) {
+        int capacity = scheduler->queueCapacity < 16 ? 16 : scheduler->queueCapacity * 2;
+        ObjFiber** queue = rawReallocate(vm, NULL, sizeof(ObjFiber*) * capacity);
+        PANIC_IF(queue != NULL, "Out of memory while growing the fiber queue.");
+        for (int i = 0; i < scheduler->queueCount; i++) {
+            queue[i] = scheduler->queue[(scheduler->queueHead + i) % scheduler->queueCapacity];
+        }
+        rawReallocate(vm, scheduler->queue, 0);
+        scheduler->queue = queue;
+        scheduler->queueHead = 0;
+        scheduler->queueCapacity = capacity;
+    }
+    scheduler->queue[(scheduler->queueHead + scheduler->queueCount) % scheduler->queueCapacity] = fiber;
+    scheduler->queueCount++;
+}
+
+// Takes the fiber at the front of the shared queue, or NULL if it is empty. The scheduler lock
+// must be held.
+static ObjFiber* queueTake(Scheduler* scheduler) {
+    if (scheduler->queueCount == 0) {
+        return NULL;
+    }
+    ObjFiber* fiber = scheduler->queue[scheduler->queueHead];
+    scheduler->queueHead = (scheduler->queueHead + 1) % scheduler->queueCapacity;
+    scheduler->queueCount--;
+    return fiber;
+}
+
+// Queues [fiber] to run, on the deque of [worker] if there is one and on the shared queue
+// otherwise. The scheduler lock must not be held.
+static void makeReady(MochiVM* vm, Worker* worker, ObjFiber* fiber) {
+    Scheduler* scheduler = &vm->scheduler;
+    fiber->state = FIBER_READY;
+    if (worker != NULL) {
+        dequePush(vm, &worker->deque, fiber);
+    } else {
+        mtx_lock(&scheduler->lock);
+        queuePush(vm, fiber);
+        mtx_unlock(&scheduler->lock);
+    }
+    scheduler->readyCount++;
+    wakeIdleWorker(scheduler);
+}
+
+void mochiSchedulerSpawn(MochiVM* vm, ObjFiber* fiber) {
+    makeReady(vm, mochiWorkerCurrent(vm), fiber);
+}
+
+void mochiSchedulerWake(MochiVM* vm, ObjFiber* fiber) {
+    makeReady(vm, mochiWorkerCurrent(vm), fiber);
+}
+
+void mochiSchedulerResume(MochiVM* vm, ObjFiber* fiber) {
+    Scheduler* scheduler = &vm->scheduler;
+    mtx_lock(&scheduler->lock);
+    fiber->isSuspended = false;
+    // The fiber may not have been parked yet, in which case the worker parking it queues it instead.
+    bool parked = fiber->state == FIBER_PARKED;
+    if (parked) {
+        scheduler->parkedCount--;
+    }
+    mtx_unlock(&scheduler->lock);
+    if (parked) {
+        makeReady(vm, mochiWorkerCurrent(vm), fiber);
+    }
+}
+
+void mochiSchedulerSettle(MochiVM* vm, ObjPromise* promise, Value value) {
+    Scheduler* scheduler = &vm->scheduler;
+    mtx_lock(&scheduler->lock);
+    ASSERT(!promise->isSettled, "Tried to settle a promise that has already settled.");
+    promise->value = value;
+    atomic_store(&promise->isSettled, true);
+    if (promise->prevPending != NULL) {
+        promise->prevPending->nextPending = promise->nextPending;
+    } else {
+        vm->pendingPromises = promise->nextPending;
+    }
+    if (promise->nextPending != NULL) {
+        promise->nextPending->prevPending = promise->prevPending;
+    }
+    promise->prevPending = NULL;
+    promise->nextPending = NULL;
+    ObjFiber* awaiter = promise->awaiters;
+    promise->awaiters = NULL;
+    for (ObjFiber* fiber = awaiter; fiber != NULL; fiber = fiber->nextJoiner) {
+        scheduler->parkedCount--;
+    }
+    mtx_unlock(&scheduler->lock);
+
+    Worker* worker = mochiWorkerCurrent(vm);
+    while (awaiter != NULL) {
+        ObjFiber* next = awaiter->nextJoiner;
+        awaiter->nextJoiner = NULL;
+        makeReady(vm, worker, awaiter);
+        awaiter = next;
+    }
+}
+
+// Moves the sleeping fibers whose wake time has passed to the deque of [worker].
+static void wakeSleepers(MochiVM* vm, Worker* worker) {
+    Scheduler* scheduler = &vm->scheduler;
+    int woken = 0;
+    mtx_lock(&scheduler->lock);
+    uint64_t now = mochiSchedulerNow();
+    for (int i = 0; i < scheduler->sleeperCount;) {
+        Sleeper* sleeper = &scheduler->sleepers[i];
+        if (sleeper->wakeTime > now) {
+            i++;
+            continue;
+        }
+        sleeper->fiber->state = FIBER_READY;
+        dequePush(vm, &worker->deque, sleeper->fiber);
+        *sleeper = scheduler->sleepers[--scheduler->sleeperCount];
+        woken++;
+    }
+    scheduler->parkedCount -= woken;
+    scheduler->readyCount += woken;
+    mtx_unlock(&scheduler->lock);
+    if (woken > 1) {
+        wakeIdleWorker(scheduler);
+    }
+}
+
+#if MOCHIVM_BATTERY_UV
+// Runs the callbacks of finished events, which resume the fibers they suspended. The default loop
+// may only be run by one thread at a time, so this does nothing while another worker is running it.
+static void pumpEvents(MochiVM* vm, Worker* worker) {
+    Scheduler* scheduler = &vm->scheduler;
+    if (mtx_trylock(&scheduler->eventLock) == thrd_success) {
+        // Callbacks push values and frames onto the fibers they resume, which may allocate.
+        bool paused = worker->isPausedForGc;
+        if (paused) {
+            leavePause(vm, worker);
+        }
+        uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+        worker->isPausedForGc = paused;
+        mtx_unlock(&scheduler->eventLock);
+    }
+}
+#endif
+
+bool mochiSchedulerShouldYield(MochiVM* vm, Worker* worker) {
+    Scheduler* scheduler = &vm->scheduler;
+    // Parked fibers are otherwise only woken by workers looking for a fiber to run, so a worker
+    // busy with a long running fiber wakes them itself. It only yields once one is ready.
+    if (scheduler->parkedCount > 0 && worker != NULL) {
+        wakeSleepers(vm, worker);
+#if MOCHIVM_BATTERY_UV
+        pumpEvents(vm, worker);
+#endif
+    }
+    return scheduler->readyCount > 0 || scheduler->stopping;
+}
+
+static uint32_t nextRandom(Worker* worker) {
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= worker->random << 5;
+    return worker->random;
+}
+
+// Finds the next fiber for [worker] to run: from its own deque first, then the shared queue, and
+// then by stealing from the other workers, starting from a random one.
+static ObjFiber* findFiber(MochiVM* vm, Worker* worker) {
+    Scheduler* scheduler = &vm->scheduler;
+    if (scheduler->parkedCount > 0) {
+        wakeSleepers(vm, worker);
+#if MOCHIVM_BATTERY_UV
+        pumpEvents(vm, worker);
+#endif
+    }
+
+    ObjFiber* fiber = dequeTake(&worker->deque);
+    if (fiber == NULL && scheduler->readyCount > 0) {
+        mtx_lock(&scheduler->lock);
+        fiber = queueTake(scheduler);
+        mtx_unlock(&scheduler->lock);
+    }
+    if (fiber == NULL && scheduler->readyCount > 0) {
+        int start = (int)(nextRandom(worker) % (uint32_t)scheduler->workerCount);
+        for (int i = 0; i < scheduler->workerCount && fiber == NULL; i++) {
+            Worker* victim = &scheduler->workers[(start + i) % scheduler->workerCount];
+            if (victim != worker) {
+                fiber = dequeSteal(&victim->deque);
+            }
+        }
+    }
+    if (fiber != NULL) {
+        scheduler->readyCount--;
+    }
+    return fiber;
+}
+
+// Blocks [worker] until a fiber may be ready: one is queued, a sleeping fiber's wake time comes,
+// or the scheduler stops.
+static void waitForFiber(MochiVM* vm, Worker* worker) {
+    Scheduler* scheduler = &vm->scheduler;
+    mtx_lock(&scheduler->lock);
+    scheduler->idleCount++;
+    if (scheduler->readyCount == 0 && !scheduler->stopping) {
+        uint64_t wakeTime = 0;
+        for (int i = 0; i < scheduler->sleeperCount; i++) {
+            if (wakeTime == 0 || scheduler->sleepers[i].wakeTime < wakeTime) {
+                wakeTime = scheduler->sleepers[i].wakeTime;
+            }
+        }
+#if MOCHIVM_BATTERY_UV
+        // Suspended fibers are resumed by the event loop, which has to be run to notice.
+        if (scheduler->parkedCount > scheduler->sleeperCount) {
+            uint64_t poll = mochiSchedulerNow() + EVENT_POLL_NANOS;
+            wakeTime = wakeTime == 0 || poll < wakeTime ? poll : wakeTime;
+        }
+#endif
+        if (wakeTime == 0) {
+            cnd_wait(&scheduler->wake, &scheduler->lock);
+        } else {
+            struct timespec until = { .tv_sec = (time_t)(wakeTime / 1000000000),
+                                      .tv_nsec = (long)(wakeTime % 1000000000) };
+            cnd_timedwait(&scheduler->wake, &scheduler->lock, &until);
+        }
+    }
+    scheduler->idleCount--;
+    mtx_unlock(&scheduler->lock);
+}
+
+// Called once a fiber has finished, to queue the fibers joining it. The main fiber stops the
+// scheduler and is kept in the VM, so its stack can still be read once the run is over. Any other
+// fiber gives its stacks to the fiber pool, since joining it only reads its result.
+static void finishFiber(MochiVM* vm, Worker* worker, ObjFiber* fiber) {
+    Scheduler* scheduler = &vm->scheduler;
+    mtx_lock(&scheduler->lock);
+    ObjFiber* joiner = fiber->joiners;
+    fiber->joiners = NULL;
+    mtx_unlock(&scheduler->lock);
+    while (joiner != NULL) {
+        ObjFiber* next = joiner->nextJoiner;
+        joiner->nextJoiner = NULL;
+        joiner->joining = NULL;
+        makeReady(vm, worker, joiner);
+        joiner = next;
+    }
+
+    if (fiber == scheduler->main) {
+        mtx_lock(&scheduler->lock);
+        scheduler->stopping = true;
+        cnd_broadcast(&scheduler->wake);
+        mtx_unlock(&scheduler->lock);
+    } else {
+        // A part of a parallel array instruction that stops early fails the whole instruction.
+        if (fiber->isParTask && mochiParPartDone(vm, fiber, true)) {
+            mochiSchedulerResume(vm, fiber->caller);
+        }
+        // No collection can run from unregistering the fiber until its stacks are given away, or
+        // it could be swept and reused in between, and those of the fiber reusing it given away.
+        leavePause(vm, worker);
+        mochiRemoveFiber(vm, fiber);
+        mochiFiberRelease(vm, fiber);
+        worker->isPausedForGc = true;
+    }
+}
+
+// Runs [fiber] until it stops, and then queues or parks it according to why it stopped. The
+// worker is paused for collections for all but the run itself and parking on channels. A fiber
+// must not be touched once it is queued or parked, since another worker may already be running it.
+static void runFiber(MochiVM* vm, Worker* worker, ObjFiber* fiber) {
+    Scheduler* scheduler = &vm->scheduler;
+    worker->fiber = fiber;
+    fiber->state = FIBER_RUNNING;
+    leavePause(vm, worker);
+    mochiInterpret(vm, fiber);
+    worker->isPausedForGc = true;
+    worker->fiber = NULL;
+
+    switch (fiber->state) {
+    case FIBER_YIELDED:
+        fiber->state = FIBER_READY;
+        mtx_lock(&scheduler->lock);
+        queuePush(vm, fiber);
+        mtx_unlock(&scheduler->lock);
+        scheduler->readyCount++;
+        wakeIdleWorker(scheduler);
+        break;
+    case FIBER_SLEEPING:
+        mtx_lock(&scheduler->lock);
+        if (scheduler->sleeperCount == scheduler->sleeperCapacity) {
+            int capacity = scheduler->sleeperCapacity < 16 ? 16 : scheduler->sleeperCapacity * 2;
+            scheduler->sleepers = rawReallocate(vm, scheduler->sleepers, sizeof(Sleeper) * capacity);
+            PANIC_IF(scheduler->sleepers != NULL, "Out of memory while parking a sleeping fiber.");
+            scheduler->sleeperCapacity = capacity;
+        }
+        scheduler->sleepers[scheduler->sleeperCount++] = (Sleeper){ .fiber = fiber, .wakeTime = fiber->wakeTime };
+        scheduler->parkedCount++;
+        mtx_unlock(&scheduler->lock);
+        break;
+    case FIBER_JOINING: {
+        ObjFiber* joining = fiber->joining;
+        mtx_lock(&scheduler->lock);
+        bool finished = joining->state == FIBER_DONE;
+        if (!finished) {
+            fiber->nextJoiner = joining->joiners;
+            joining->joiners = fiber;
+        }
+        mtx_unlock(&scheduler->lock);
+        if (finished) {
+            fiber->joining = NULL;
+            makeReady(vm, worker, fiber);
+        }
+        break;
+    }
+    case FIBER_SUSPENDED: {
+        mtx_lock(&scheduler->lock);
+        bool resumed = !fiber->isSuspended;
+        if (!resumed) {
+            fiber->state = FIBER_PARKED;
+            scheduler->parkedCount++;
+        }
+        mtx_unlock(&scheduler->lock);
+        if (resumed) {
+            makeReady(vm, worker, fiber);
+        }
+        break;
+    }
+    case FIBER_AWAITING: {
+        // Awaiting fibers count as parked, so idle workers keep running the event loop that is
+        // likely to settle the promise.
+        ObjPromise* promise = AS_PROMISE(mochiFiberPeekValue(fiber, 1));
+        mtx_lock(&scheduler->lock);
+        bool settled = promise->isSettled;
+        if (!settled) {
+            fiber->state = FIBER_PARKED;
+            fiber->nextJoiner = promise->awaiters;
+            promise->awaiters = fiber;
+            scheduler->parkedCount++;
+        }
+        mtx_unlock(&scheduler->lock);
+        if (settled) {
+            makeReady(vm, worker, fiber);
+        }
+        break;
+    }
+    case FIBER_SENDING:
+    case FIBER_RECEIVING:
+        // Parking reads the channels off the fiber's stack and touches channels other fibers are
+        // using, neither of which a collection may run alongside.
+        leavePause(vm, worker);
+        if (mochiChannelPark(vm, fiber)) {
+            makeReady(vm, worker, fiber);
+        }
+        worker->isPausedForGc = true;
+        break;
+    case FIBER_DONE:
+        finishFiber(vm, worker, fiber);
+        break;
+    default:
+        UNREACHABLE();
+    }
+}
+
+static int workerMain(void* start) {
+    Worker* worker = start;
+    MochiVM* vm = worker->vm;
+    currentWorker = worker;
+    while (!vm->scheduler.stopping) {
+        ObjFiber* fiber = findFiber(vm, worker);
+        if (fiber != NULL) {
+            runFiber(vm, worker, fiber);
+        } else {
+            waitForFiber(vm, worker);
+        }
+    }
+    currentWorker = NULL;
+    return 0;
+}
+
+int mochiSchedulerRun(MochiVM* vm, ObjFiber* main) {
+    Scheduler* scheduler = &vm->scheduler;
+    int count = vm->config.workerCount > 0 ? vm->config.workerCount : processorCount();
+    scheduler->workers = rawReallocate(vm, NULL, sizeof(Worker) * count);
+    thrd_t* threads = rawReallocate(vm, NULL, sizeof(thrd_t) * count);
+    PANIC_IF(scheduler->workers != NULL && threads != NULL, "Out of memory while starting the workers.");
+    for (int i = 0; i < count; i++) {
+        Worker* worker = &scheduler->workers[i];
+        worker->vm = vm;
+        dequeInit(vm, &worker->deque);
+        worker->fiber = NULL;
+        atomic_init(&worker->isPausedForGc, true);
+        worker->random = 2463534242u + (uint32_t)i * 2654435761u;
+    }
+    scheduler->workerCount = count;
+    scheduler->main = main;
+    scheduler->stopping = false;
+    main->state = FIBER_READY;
+    dequePush(vm, &scheduler->workers[0].deque, main);
+    scheduler->readyCount = 1;
+
+    int status = thrd_success;
+    int started = 0;
+    for (; started < count; started++) {
+        status = thrd_create(&threads[started], workerMain, &scheduler->workers[started]);
+        if (status != thrd_success) {
+            printf("Couldn't create worker thread.\n");
+            mtx_lock(&scheduler->lock);
+            scheduler->stopping = true;
+            cnd_broadcast(&scheduler->wake);
+            mtx_unlock(&scheduler->lock);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        thrd_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        dequeFree(vm, &scheduler->workers[i].deque);
+    }
+    scheduler->workers = rawReallocate(vm, scheduler->workers, 0);
+    rawReallocate(vm, threads, 0);
+    scheduler->workerCount = 0;
+    scheduler->main = NULL;
+    scheduler->queueHead = 0;
+    scheduler->queueCount = 0;
+    scheduler->sleeperCount = 0;
+    scheduler->readyCount = 0;
+    scheduler->parkedCount = 0;
+    return status == thrd_success ? main->result : status;
+}
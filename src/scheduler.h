@@ -0,0 +1,124 @@
+#ifndef mochivm_scheduler_h
+#define mochivm_scheduler_h
+
+#include "object.h"
+#include <threads.h>
+
+// Fibers are green threads, run by a fixed pool of worker OS threads rather than one OS thread
+// each. Every worker keeps a deque of ready fibers: it pushes and takes fibers at the bottom of its
+// own deque, and idle workers steal from the top of the others. Fibers run until they finish,
+// yield, sleep, join an unfinished fiber, wait on a channel, await an unsettled promise, are
+// suspended by a foreign function, or use up their slice while other fibers are waiting. Yielded
+// fibers are queued on a shared queue so they go behind the fibers already waiting.
+
+// The number of instructions a fiber runs before it checks whether other fibers are waiting.
+#define MOCHIVM_SCHEDULER_SLICE 1024
+
+// The ring of slots behind a work stealing deque. When a ring fills, its contents are copied to
+// one twice the size, and the old ring is kept on the [retired] list until the scheduler stops,
+// since a thief may still be reading from it.
+typedef struct FiberRing {
+    int64_t capacity;
+    struct FiberRing* retired;
+    _Atomic(ObjFiber*) slots[];
+} FiberRing;
+
+// A Chase-Lev work stealing deque, with the memory orderings of Lê et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models". Only the owning worker pushes and takes, at [bottom].
+typedef struct {
+    _Atomic(int64_t) top;
+    _Atomic(int64_t) bottom;
+    _Atomic(FiberRing*) ring;
+} FiberDeque;
+
+typedef struct Worker {
+    MochiVM* vm;
+    FiberDeque deque;
+    // The fiber the worker is running, or NULL between fibers.
+    ObjFiber* fiber;
+    // Set while the worker is at a point where the collector may run: between fibers, or while
+    // waiting for a collection another worker started.
+    _Atomic(bool) isPausedForGc;
+    // The state of the random number generator used to pick workers to steal from.
+    uint32_t random;
+} Worker;
+
+typedef struct {
+    ObjFiber* fiber;
+    uint64_t wakeTime;
+} Sleeper;
+
+typedef struct {
+    Worker* workers;
+    int workerCount;
+    ObjFiber* main;
+
+    // Guards the shared queue, the sleepers, the joiners of every fiber, and suspended fibers.
+    // Nothing may be allocated from the VM heap while it is held, since a collection would wait
+    // on workers blocked on the lock.
+    mtx_t lock;
+    // Signalled when a fiber is queued while workers are idle, or when the scheduler stops.
+    cnd_t wake;
+#if MOCHIVM_BATTERY_UV
+    // Held by the worker running the event loop, which only one thread may run at a time.
+    mtx_t eventLock;
+#endif
+
+    // A ring of [queueCapacity] fibers, holding [queueCount] from [queueHead].
+    ObjFiber** queue;
+    int queueHead;
+    int queueCount;
+    int queueCapacity;
+
+    Sleeper* sleepers;
+    int sleeperCount;
+    int sleeperCapacity;
+
+    // The number of fibers in the deques and the shared queue, the number of workers waiting for
+    // one, and the number of fibers asleep or suspended. Readable without the lock.
+    _Atomic(int) readyCount;
+    _Atomic(int) idleCount;
+    _Atomic(int) parkedCount;
+
+    // Set once the main fiber finishes, telling the workers to stop.
+    _Atomic(bool) stopping;
+} Scheduler;
+
+void mochiSchedulerInit(MochiVM* vm);
+void mochiSchedulerFree(MochiVM* vm);
+
+// Starts the workers with [main] as the only ready fiber, and waits for them to stop once it has
+// finished. Returns the value [main] aborted with, or the status of a worker that could not be
+// started.
+int mochiSchedulerRun(MochiVM* vm, ObjFiber* main);
+
+// Queues the new fiber [fiber] to run. Called from a worker, the fiber is pushed on that worker's
+// deque, and otherwise on the shared queue.
+void mochiSchedulerSpawn(MochiVM* vm, ObjFiber* fiber);
+
+// Queues [fiber] to run again, once whoever woke it has moved it out of FIBER_CHANNEL_PARKED.
+void mochiSchedulerWake(MochiVM* vm, ObjFiber* fiber);
+
+// Queues [fiber] again once a foreign function that suspended it has set it up to continue.
+void mochiSchedulerResume(MochiVM* vm, ObjFiber* fiber);
+
+// Settles [promise] with [value] and queues every fiber awaiting it. Called from a worker, such as
+// by a foreign function or an event loop callback, and only once for each promise.
+void mochiSchedulerSettle(MochiVM* vm, ObjPromise* promise, Value value);
+
+// Whether a fiber that has used up its slice on [worker] should stop to let other fibers run,
+// which is only when one is ready or the scheduler is stopping. Sleeping fibers that are due and
+// events that have finished are taken care of first, without stopping the fiber.
+bool mochiSchedulerShouldYield(MochiVM* vm, Worker* worker);
+
+// The worker running on the current OS thread, or NULL if it is not one of the VM's workers.
+Worker* mochiWorkerCurrent(MochiVM* vm);
+
+// Spins until a collection another worker started is over, with the current worker marked as
+// paused for it.
+void mochiWorkerWaitGc(MochiVM* vm, Worker* worker);
+
+// Returns the current time in nanoseconds, as used for fiber wake times.
+uint64_t mochiSchedulerNow(void);
+
+#endif
@@ -1,6 +1,13 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2 1
+#else
+#define TABLE_SSE2 0
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -17,8 +24,13 @@
 
 // The maximum percentage of map entries that can be filled before the map is
 // grown. A lower load takes more memory but reduces collisions which makes
-// lookup faster.
-#define TABLE_LOAD_PERCENT 75
+// lookup faster. Since whole groups of control bytes are probed at once, the
+// table stays fast at a higher load than a table probed an entry at a time.
+#define TABLE_LOAD_PERCENT 87
+
+// Control bytes for entries that are not full. Full entries have the high bit clear.
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xFE
 
 const TableKey TABLE_KEY_UNUSED = 0;
 const TableKey TABLE_KEY_TOMBSTONE = 1;
@@ -51,10 +63,12 @@ Table* mochiNewTable(MochiVM* vm) {
 void mochiTableInit(Table* table) {
     table->capacity = 0;
     table->count = 0;
+    table->growthLeft = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
-static inline uint32_t hashBits(uint64_t hash) {
+static inline uint64_t hashBits(uint64_t hash) {
     // From v8's ComputeLongHash() which in turn cites:
     // Thomas Wang, Integer Hash Functions.
     // http://www.concentric.net/~Ttwang/tech/inthash.htm
@@ -64,192 +78,344 @@ static inline uint32_t hashBits(uint64_t hash) {
     hash = hash ^ (hash >> 11);
     hash = hash + (hash << 6);
     hash = hash ^ (hash >> 22);
-    return (uint32_t)(hash & 0x3fffffff);
+    return hash;
 }
 
-// Looks for an entry with [key] in an array of [capacity] [entries].
-//
-// If found, sets [result] to point to it and returns `true`. Otherwise,
-// returns `false` and points [result] to the entry where the key/value pair
-// should be inserted.
-static bool findEntry(TableEntry* entries, uint32_t capacity, TableKey key, TableEntry** result) {
-    // If there is no entry array (an empty map), we definitely won't find it.
-    if (capacity == 0) {
-        return false;
+// The seven bits of a key's hash kept in its control byte. The rest of the hash picks the
+// position its probe starts at.
+static inline uint8_t hashTag(uint64_t hash) {
+    return (uint8_t)(hash & 0x7F);
+}
+
+static inline uint32_t hashPosition(uint64_t hash, uint32_t capacity) {
+    return (uint32_t)(hash >> 7) & (capacity - 1);
+}
+
+static inline int lowestSetBit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
     }
+    return index;
+#endif
+}
 
-    // Figure out where to insert it in the table. Use open addressing and
-    // basic linear probing.
-    uint32_t startIndex = hashBits(key) % capacity;
-    uint32_t index = startIndex;
+static inline int highestSetBit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(bits);
+#else
+    int index = 63;
+    while ((bits & (1ull << 63)) == 0) {
+        bits <<= 1;
+        index--;
+    }
+    return index;
+#endif
+}
 
-    // If we pass a tombstone and don't end up finding the key, its entry will
-    // be re-used for the insert.
-    TableEntry* tombstone = NULL;
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
 
-    // Walk the probe sequence until we've tried every slot.
-    do {
-        TableEntry* entry = &entries[index];
+// A group is scanned into a mask with a set bit for each of its entries whose control byte
+// matches. Masks are walked from the lowest entry up by clearing their lowest set bit.
+#if TABLE_SSE2
 
-        // 0 or 1 signifies an empty slot.
-        if (entry->key < TABLE_KEY_RANGE_START) {
-            // If we found an empty slot, the key is not in the table. If we found a
-            // slot that contains a deleted key, we have to keep looking.
-            if (entry->key == TABLE_KEY_UNUSED) {
-                // We found an empty non-deleted slot, so we've reached the end of the probe
-                // sequence without finding the key.
-                *result = tombstone != NULL ? tombstone : entry;
-                return false;
-            } else {
-                // We found a tombstone. We need to keep looking in case the key is after it.
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
-            }
-        } else if (entry->key == key) {
-            // We found the most recent key.
-            *result = entry;
-            return true;
-        }
+#define TABLE_GROUP_SIZE 16
+#define GROUP_BITS       1
 
-        // Try the next slot.
-        index = (index + 1) % capacity;
-    } while (index != startIndex);
+typedef uint32_t GroupMask;
 
-    // If we get here, the table is full of tombstones. Return the first one we found.
-    ASSERT(tombstone != NULL, "Map should have tombstones or empty entries in findEntry.");
-    *result = tombstone;
-    return false;
+static inline GroupMask groupMatch(const uint8_t* group, uint8_t control) {
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
 }
 
-// Inserts [key] and [value] in the array of [entries] with the given
-// [capacity]. If overwrite is true and the key already has a value in the table,
-// the existing value will be overwritten. If overwrite is false, a new entry
-// with the same key will be added at nesting level 0, and the nesting level of
-// existing entries with the same key will be incremented.
-//
-// Returns `true` if a new entry was set, `false` if an entry was overwritten.
-static bool insertEntry(TableEntry* entries, uint32_t capacity, TableKey key, Value value) {
-    ASSERT(entries != NULL, "Should ensure capacity before inserting.");
+static inline GroupMask groupMatchEmpty(const uint8_t* group) {
+    return groupMatch(group, CONTROL_EMPTY);
+}
 
-    TableEntry* entry;
-    if (findEntry(entries, capacity, key, &entry)) {
-        // Already present, so just replace the value.
-        entry->value = value;
+// Empty and deleted control bytes are the only ones with the high bit set.
+static inline GroupMask groupMatchFree(const uint8_t* group) {
+    return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#else
+
+// Without SSE2, eight control bytes are compared at once as a 64-bit word, with the match for
+// each entry in the high bit of its byte. The word is assembled in little endian order, so the
+// lowest entry is always in the lowest byte.
+#define TABLE_GROUP_SIZE 8
+#define GROUP_BITS       8
+#define GROUP_LOWS       0x0101010101010101ull
+#define GROUP_HIGHS      0x8080808080808080ull
+
+typedef uint64_t GroupMask;
+
+static inline uint64_t loadGroup(const uint8_t* group) {
+    uint64_t word = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+        word |= (uint64_t)group[i] << (i * 8);
+    }
+    return word;
+}
+
+// May also match the entry after a true match, which the key comparison rules out.
+static inline GroupMask groupMatch(const uint8_t* group, uint8_t control) {
+    uint64_t word = loadGroup(group) ^ (GROUP_LOWS * control);
+    return (word - GROUP_LOWS) & ~word & GROUP_HIGHS;
+}
+
+// Of the bytes with the high bit set, only the empty control byte has its second bit clear.
+static inline GroupMask groupMatchEmpty(const uint8_t* group) {
+    uint64_t word = loadGroup(group);
+    return word & ~(word << 6) & GROUP_HIGHS;
+}
+
+static inline GroupMask groupMatchFree(const uint8_t* group) {
+    return loadGroup(group) & GROUP_HIGHS;
+}
+
+#endif
+
+static inline uint32_t groupFirst(GroupMask mask) {
+    return (uint32_t)lowestSetBit(mask) / GROUP_BITS;
+}
+
+static inline uint32_t groupLast(GroupMask mask) {
+    return (uint32_t)highestSetBit(mask) / GROUP_BITS;
+}
+
+// Sets the control byte of entry [index], and of its copy if it is in the first group.
+static inline void setControl(Table* table, uint32_t index, uint8_t control) {
+    table->control[index] = control;
+    if (index < TABLE_GROUP_SIZE) {
+        table->control[table->capacity + index] = control;
+    }
+}
+
+// Looks for an entry with [key] in [table].
+//
+// If found, sets [result] to its index and returns `true`. Otherwise,
+// returns `false`.
+static bool findEntry(const Table* table, TableKey key, uint32_t* result) {
+    // If there is no entry array (an empty map), we definitely won't find it.
+    if (table->capacity == 0) {
         return false;
-    } else {
-        entry->key = key;
-        entry->value = value;
-        return true;
     }
+
+    uint64_t hash = hashBits(key);
+    uint8_t tag = hashTag(hash);
+    uint32_t mask = table->capacity - 1;
+    uint32_t position = hashPosition(hash, table->capacity);
+    // Most keys sit where their probe starts, so start fetching that entry alongside the
+    // control bytes rather than waiting for them to match first.
+    PREFETCH(&table->entries[position]);
+
+    // Each step moves a group further than the last, which visits every group once the
+    // capacity is a power of two. A table always has an empty entry, so this terminates.
+    for (uint32_t step = TABLE_GROUP_SIZE;; step += TABLE_GROUP_SIZE) {
+        const uint8_t* group = table->control + position;
+        for (GroupMask matches = groupMatch(group, tag); matches != 0; matches &= matches - 1) {
+            uint32_t index = (position + groupFirst(matches)) & mask;
+            if (table->entries[index].key == key) {
+                *result = index;
+                return true;
+            }
+        }
+
+        // If the group has an empty entry, the key would have been put there or earlier.
+        if (groupMatchEmpty(group) != 0) {
+            return false;
+        }
+        position = (position + step) & mask;
+    }
+}
+
+// Returns the index of the first empty or deleted entry along the probe sequence of [hash].
+static uint32_t findFreeEntry(const Table* table, uint64_t hash) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t position = hashPosition(hash, table->capacity);
+    for (uint32_t step = TABLE_GROUP_SIZE;; step += TABLE_GROUP_SIZE) {
+        GroupMask free = groupMatchFree(table->control + position);
+        if (free != 0) {
+            return (position + groupFirst(free)) & mask;
+        }
+        position = (position + step) & mask;
+    }
+}
+
+// Fills the entry at [index] with [key] and [value].
+static void fillEntry(Table* table, uint32_t index, uint64_t hash, TableKey key, Value value) {
+    if (table->control[index] == CONTROL_EMPTY) {
+        table->growthLeft--;
+    }
+    setControl(table, index, hashTag(hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+}
+
+static uint32_t maxLoad(uint32_t capacity) {
+    return (uint32_t)((uint64_t)capacity * TABLE_LOAD_PERCENT / 100);
 }
 
 // Updates [table]'s entry array to [capacity].
 static void resizeTable(MochiVM* vm, Table* table, uint32_t capacity) {
     // Create the new empty hash table.
+    uint8_t* control = ALLOCATE_ARRAY(vm, uint8_t, capacity + TABLE_GROUP_SIZE);
     TableEntry* entries = ALLOCATE_ARRAY(vm, TableEntry, capacity);
+    memset(control, CONTROL_EMPTY, capacity + TABLE_GROUP_SIZE);
     for (uint32_t i = 0; i < capacity; i++) {
         entries[i].key = TABLE_KEY_UNUSED;
         entries[i].value = FALSE_VAL;
     }
 
-    // Re-add the existing entries.
-    if (table->capacity > 0) {
-        for (uint32_t i = 0; i < table->capacity; i++) {
-            TableEntry* entry = &table->entries[i];
+    Table resized;
+    resized.capacity = capacity;
+    resized.count = 0;
+    resized.growthLeft = maxLoad(capacity);
+    resized.control = control;
+    resized.entries = entries;
 
-            // Don't copy empty entries or tombstones.
-            if (entry->key < TABLE_KEY_RANGE_START) {
-                continue;
-            }
+    // Re-add the existing entries. Every key is known to be distinct, so each goes straight
+    // into the first free entry of its probe sequence.
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        TableEntry* entry = &table->entries[i];
 
-            insertEntry(entries, capacity, entry->key, entry->value);
+        // Don't copy empty entries or tombstones.
+        if (entry->key < TABLE_KEY_RANGE_START) {
+            continue;
         }
+
+        uint64_t hash = hashBits(entry->key);
+        fillEntry(&resized, findFreeEntry(&resized, hash), hash, entry->key, entry->value);
     }
 
-    // Replace the array.
+    // Replace the arrays.
+    DEALLOCATE(vm, table->control);
     DEALLOCATE(vm, table->entries);
-    table->entries = entries;
-    table->capacity = capacity;
+    *table = resized;
 }
 
 Table* mochiTableClone(MochiVM* vm, Table* table) {
     Table* cloned = ALLOCATE(vm, Table);
     mochiTableInit(cloned);
-    resizeTable(vm, cloned, table->capacity);
-    // TODO: this also copies tombstones, is that desirable?
-    for (uint32_t i = 0; i < table->capacity; i++) {
-        cloned->entries[i] = table->entries[i];
+    if (table->capacity == 0) {
+        return cloned;
     }
+    cloned->control = ALLOCATE_ARRAY(vm, uint8_t, table->capacity + TABLE_GROUP_SIZE);
+    cloned->entries = ALLOCATE_ARRAY(vm, TableEntry, table->capacity);
+    // Deleted entries are copied along with the rest, so the clone probes exactly like the original.
+    memcpy(cloned->control, table->control, table->capacity + TABLE_GROUP_SIZE);
+    memcpy(cloned->entries, table->entries, table->capacity * sizeof(TableEntry));
+    cloned->capacity = table->capacity;
+    cloned->count = table->count;
+    cloned->growthLeft = table->growthLeft;
     return cloned;
 }
 
 bool mochiTableGet(Table* table, TableKey key, Value* out) {
     ASSERT(out != NULL, "Cannot pass null pointer for Value out in mochiTableGet.");
-    TableEntry* entry;
-    bool found = findEntry(table->entries, table->capacity, key, &entry);
-    *out = found ? entry->value : FALSE_VAL;
+    uint32_t index;
+    bool found = findEntry(table, key, &index);
+    *out = found ? table->entries[index].value : FALSE_VAL;
     return found;
 }
 
+// Makes room for one more entry. Tables that are mostly deleted entries are rebuilt at the
+// same capacity, rather than grown.
 static void ensureTableCapacity(MochiVM* vm, Table* table) {
-    // If the table is getting too full, make room first.
-    if (table->count + 1 > table->capacity * TABLE_LOAD_PERCENT / 100) {
-        // Figure out the new hash table size.
-        uint32_t capacity = table->capacity * TABLE_GROW_FACTOR;
-        if (capacity < TABLE_MIN_CAPACITY) {
-            capacity = TABLE_MIN_CAPACITY;
-        }
+    if (table->growthLeft > 0) {
+        return;
+    }
 
-        resizeTable(vm, table, capacity);
+    // Figure out the new hash table size.
+    uint32_t capacity = table->capacity * TABLE_GROW_FACTOR;
+    if (table->count < maxLoad(table->capacity) / 2) {
+        capacity = table->capacity;
     }
+    if (capacity < TABLE_MIN_CAPACITY) {
+        capacity = TABLE_MIN_CAPACITY;
+    }
+
+    resizeTable(vm, table, capacity);
 }
 
 void mochiTableSet(MochiVM* vm, Table* table, TableKey key, Value value) {
-    ensureTableCapacity(vm, table);
+    uint32_t index;
+    if (findEntry(table, key, &index)) {
+        // Already present, so just replace the value.
+        table->entries[index].value = value;
+        return;
+    }
 
-    if (insertEntry(table->entries, table->capacity, key, value)) {
-        // A new key was added.
-        table->count++;
+    // A deleted entry can be reused without touching the growth left, so only make room when
+    // the key would take an empty one.
+    uint64_t hash = hashBits(key);
+    if (table->capacity == 0 ||
+        (table->growthLeft == 0 && table->control[findFreeEntry(table, hash)] == CONTROL_EMPTY)) {
+        ensureTableCapacity(vm, table);
     }
+    fillEntry(table, findFreeEntry(table, hash), hash, key, value);
 }
 
 void mochiTableClear(MochiVM* vm, Table* table) {
+    DEALLOCATE(vm, table->control);
     DEALLOCATE(vm, table->entries);
     mochiTableInit(table);
 }
 
-void shrinkTableCapacity(MochiVM* vm, Table* table) {
+static void shrinkTableCapacity(MochiVM* vm, Table* table) {
     if (table->count == 0) {
         // Removed the last item, so free the array.
         mochiTableClear(vm, table);
     } else if (table->capacity > TABLE_MIN_CAPACITY &&
-               table->count < table->capacity / TABLE_GROW_FACTOR * TABLE_LOAD_PERCENT / 100) {
+               table->count < table->capacity / TABLE_GROW_FACTOR * TABLE_LOAD_PERCENT / 100 / 2) {
         uint32_t capacity = table->capacity / TABLE_GROW_FACTOR;
         if (capacity < TABLE_MIN_CAPACITY) {
             capacity = TABLE_MIN_CAPACITY;
         }
 
-        // The table is getting empty, so shrink the entry array back down.
-        // TODO: Should we do this less aggressively than we grow?
+        // The table is getting empty, so shrink the entry array back down. This waits until
+        // the table is a quarter as full as it may get, so a table that keeps gaining and
+        // losing a few keys does not resize back and forth.
         resizeTable(vm, table, capacity);
     }
 }
 
 bool mochiTableTryRemove(MochiVM* vm, Table* table, TableKey key) {
-    TableEntry* entry;
-    if (!findEntry(table->entries, table->capacity, key, &entry)) {
+    uint32_t index;
+    if (!findEntry(table, key, &index)) {
         return false;
     }
 
-    // Remove the entry from the table. Set this key to 1, which marks it as a
-    // deleted slot. When searching for a key, we will stop on empty slots, but
-    // continue past deleted slots.
-    entry->key = TABLE_KEY_TOMBSTONE;
-    entry->value = FALSE_VAL;
+    // If the run of entries that are not empty around this one is shorter than a group, every
+    // group a probe could have read across it has an empty entry, so no probe ever continued
+    // past it and it can be emptied. Otherwise it must stay in the way as a deleted entry.
+    uint32_t mask = table->capacity - 1;
+    GroupMask emptyBefore = groupMatchEmpty(table->control + ((index - TABLE_GROUP_SIZE) & mask));
+    GroupMask emptyAfter = groupMatchEmpty(table->control + index);
+    bool neverFull = emptyBefore != 0 && emptyAfter != 0 &&
+                     groupFirst(emptyAfter) + (TABLE_GROUP_SIZE - 1 - groupLast(emptyBefore)) < TABLE_GROUP_SIZE;
+    if (neverFull) {
+        setControl(table, index, CONTROL_EMPTY);
+        table->entries[index].key = TABLE_KEY_UNUSED;
+        table->growthLeft++;
+    } else {
+        setControl(table, index, CONTROL_DELETED);
+        table->entries[index].key = TABLE_KEY_TOMBSTONE;
+    }
+    table->entries[index].value = FALSE_VAL;
 
     table->count -= 1;
     shrinkTableCapacity(vm, table);
 
     return true;
-}
\ No newline at end of file
+}
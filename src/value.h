@@ -47,7 +47,16 @@ typedef enum
     OBJ_REF,
     OBJ_STRUCT,
     OBJ_RECORD,
-    OBJ_VARIANT
+    OBJ_VARIANT,
+    OBJ_RECORD_NODE,
+    OBJ_ROPE,
+    OBJ_VECTOR,
+    OBJ_VECTOR_NODE,
+    OBJ_LIST_CHUNK,
+    OBJ_NUM_ARRAY,
+    OBJ_CHANNEL,
+    OBJ_PROMISE,
+    OBJ_STACK_SEGMENT
 } ObjType;
 
 // Base struct for all heap-allocated object types.
@@ -107,33 +116,47 @@ typedef struct {
 
 // A hash table mapping keys to values.
 //
-// We use something very simple: open addressing with linear probing. The hash
-// table is an array of entries. Each entry is a key-value pair. If the key is
-// either 0 or 1, it indicates no value is currently in that slot.
-// Otherwise, it's a valid key, and the value is the value associated with it.
+// This is an open addressing table in the style of Abseil's SwissTable. Alongside the array of
+// entries is an array of one control byte per entry, saying whether the entry is empty, deleted
+// or full. A full control byte holds seven bits of the key's hash, so a lookup scans the control
+// bytes of a whole group of entries at once and only compares the keys whose bits match. Groups
+// are 16 entries wide where SSE2 is available, and 8 entries compared as one 64-bit word
+// elsewhere.
+//
+// The capacity is always a power of two, so positions wrap with a mask instead of a division.
+// Lookups probe group after group, starting where the rest of the key's hash points and moving
+// further on each time, until they find the key or a group holding an empty entry. The first
+// group's worth of control bytes is copied after the last, so a group can be read from any
+// position without wrapping.
 //
 // When entries are added, the array is dynamically scaled by GROW_FACTOR to
 // keep the number of filled slots under MAP_LOAD_PERCENT. Likewise, if the map
 // gets empty enough, it will be resized to a smaller array. When this happens,
 // all existing entries are rehashed and re-added to the new array.
 //
-// When an entry is removed, its slot is replaced with a "tombstone". This is an
-// entry whose key is 1. When probing
-// for a key, we will continue past tombstones, because the desired key may be
-// found after them if the key that was removed was part of a prior collision.
-// When the array gets resized, all tombstones are discarded.
+// When an entry is removed, it is marked deleted rather than empty if some lookup could have
+// probed past it, so lookups continue past it. Deleted entries are only reused by inserts and
+// are dropped whenever the table is rebuilt. The key of an entry that is not full is still set
+// to 0 if empty or 1 if deleted, so the entries can be walked without the control bytes.
 typedef struct {
-    // The number of entries allocated.
+    // The number of entries allocated, either 0 or a power of two.
     uint32_t capacity;
 
     // The number of entries in the map.
     uint32_t count;
 
+    // The number of empty entries that can still be filled before the table must be rebuilt.
+    uint32_t growthLeft;
+
+    // Pointer to a contiguous array of [capacity] control bytes, followed by a copy of the
+    // first group of them.
+    uint8_t* control;
+
     // Pointer to a contiguous array of [capacity] entries.
     TableEntry* entries;
 } Table;
 
-static inline void valueArrayCopy(Value* dest, Value* src, int count) {
+static inline void valueArrayCopy(Value* dest, const Value* src, int count) {
     memcpy(dest, src, sizeof(Value) * count);
 }
 
@@ -0,0 +1,1367 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "vm.h"
+
+// The verifier makes two passes over the code buffer. The first decodes every
+// instruction in order, checking that each opcode exists, that its operands fit in
+// the buffer and that any constant, foreign function and type operands are in
+// range, and records where each instruction begins. The second walks the control
+// flow of each function, tracking the depth of the value stack and the shape of the
+// frames pushed by the function itself, which validates jump and call targets,
+// frame and slot indices and stack balance at join points and returns. Function
+// summaries are combined at call sites to find the deepest stacks any fiber can
+// reach.
+//
+// Some instructions have stack effects that can only be known at runtime, such as
+// calling closures, which parallel array instructions do on other fibers, foreign
+// functions and continuations, the handler instructions, and destructuring
+// structs. Code containing them can still be verified, but the stack depths
+// reachable by that code are left unbounded and fibers fall back to
+// growable stacks, limited by the capacities given in the VM configuration. The walk
+// carries on past them with the value stack depth unknown until a later path brings
+// it back, so the frames and targets of the code after them are still checked.
+// Recursive calls are likewise unbounded, except for a function that tail calls
+// itself with a balanced stack, which is just a loop. The code after a recursive call
+// continues with the depth the function returns with, once a path that returns has
+// been found.
+//
+// Growable stacks are checked by the interpreter rather than on every push: whenever
+// a fiber starts or resumes, calls, returns, jumps backwards or runs an instruction
+// with a dynamic stack effect, it makes sure its stacks have a headroom computed
+// here. The headroom is the most any stretch of code between two such checks can
+// push, found by a single pass over the instructions in reverse, since every stretch
+// only ever moves forwards through the code.
+//
+// The same pass finds the floors of the stacks: the most values and frames any stretch
+// reaches below the depths it started at. A copied fiber shares the bottom of its
+// stacks with its copies and only copies what it reaches into, so at each check it
+// makes sure at least this many are its own.
+
+#define NO_OFFSET    INT_MIN
+#define NO_TARGET    INT_MIN
+#define NO_SHAPE     -1
+
+typedef enum
+{
+    // Continue with the next instruction.
+    FLOW_NEXT,
+    // Either continue at the target or with the next instruction.
+    FLOW_BRANCH,
+    // Always continue at the target.
+    FLOW_JUMP,
+    // Call the function at the target, then continue with the next instruction.
+    FLOW_CALL,
+    // Continue in the function at the target, never coming back to this one.
+    FLOW_TAILCALL,
+    // Return to the caller of the current function.
+    FLOW_RETURN,
+    // Stop the fiber.
+    FLOW_HALT,
+    // Run code only known at runtime, then continue with the next instruction at a
+    // value stack depth only known at runtime.
+    FLOW_DYNAMIC,
+    // Continue in code only known at runtime, which returns to the caller of the current
+    // function.
+    FLOW_DYNAMIC_TAILCALL,
+    // Continue with the next instruction in a new handle context. The context is left at
+    // the target, at a value stack depth only known at runtime.
+    FLOW_HANDLE,
+    // Leave the innermost handle context through its after closure, which comes back at
+    // the target of the instruction that began the context.
+    FLOW_COMPLETE
+} Flow;
+
+typedef struct {
+    int length;
+    // Values popped and pushed by the instruction, in that order.
+    int pops;
+    int pushes;
+    // Values pushed above the starting depth before the pops take effect.
+    int peak;
+    // Frames pushed (1) or forgotten (-1), and the slot count of a pushed frame.
+    int frames;
+    int frameSlots;
+    // Objects temporarily held on the root stack.
+    int roots;
+    Flow flow;
+    int target;
+    // For instructions that spawn a new fiber, the number of values it starts with.
+    int spawnValues;
+    // Whether the instruction runs code only known at runtime on other fibers, whose stack
+    // depths cannot be bounded.
+    bool unbounded;
+} Instruction;
+
+// A frame pushed by the function being walked, linked to the frame beneath it.
+typedef struct {
+    int slotCount;
+    int below;
+    int depth;
+} Shape;
+
+typedef enum
+{
+    SUMMARY_UNVISITED,
+    SUMMARY_IN_PROGRESS,
+    SUMMARY_DONE
+} SummaryState;
+
+// Stack effects of a function, relative to the value stack depth it was entered with
+// and the frames beneath it.
+typedef struct {
+    SummaryState state;
+    bool bounded;
+    bool returns;
+    // The lowest depth the function reaches into its caller's values, never positive.
+    int minValue;
+    int maxValue;
+    // The value depth the function returns with, if it is known.
+    int exitValue;
+    bool exitKnown;
+    int maxFrame;
+    int maxRoot;
+    // The number of caller frames the function reads variables from.
+    int frameReach;
+} Summary;
+
+typedef struct {
+    int entry;
+    int values;
+} Entry;
+
+typedef struct {
+    MochiVM* vm;
+    uint8_t* code;
+    int count;
+
+    bool* starts;
+    Summary* summaries;
+
+    Shape* shapes;
+    int shapeCount;
+    int shapeCapacity;
+
+    Entry* entries;
+    int entryCount;
+    int entryCapacity;
+
+    bool failed;
+} Verifier;
+
+static void* verifierAlloc(Verifier* v, void* memory, size_t size) {
+    return v->vm->config.reallocateFn(memory, size, v->vm->config.userData);
+}
+
+static void fail(Verifier* v, int offset, const char* message) {
+    if (v->failed) {
+        return;
+    }
+    v->failed = true;
+    if (v->vm->config.errorFn != NULL) {
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "Bytecode verification failed at offset %d: %s", offset, message);
+        v->vm->config.errorFn(v->vm, NULL, mochiGetLine(v->vm, offset), buffer);
+    }
+}
+
+static int getShort(uint8_t* buffer, int offset) {
+    return (int16_t)((buffer[offset] << 8) | buffer[offset + 1]);
+}
+
+static int getUShort(uint8_t* buffer, int offset) {
+    return (uint16_t)((buffer[offset] << 8) | buffer[offset + 1]);
+}
+
+static int getInt(uint8_t* buffer, int offset) {
+    return (int32_t)(((uint32_t)buffer[offset] << 24) | (buffer[offset + 1] << 16) | (buffer[offset + 2] << 8) |
+                     buffer[offset + 3]);
+}
+
+static bool isIntType(uint8_t type) {
+    return type >= VAL_I8 && type <= VAL_U64;
+}
+
+static bool isSignedIntType(uint8_t type) {
+    return type == VAL_I8 || type == VAL_I16 || type == VAL_I32 || type == VAL_I64;
+}
+
+static void setEffect(Instruction* inst, int length, int pops, int pushes) {
+    inst->length = length;
+    inst->pops = pops;
+    inst->pushes = pushes;
+}
+
+// Decodes the instruction at [offset], filling in its length and static effects.
+// Returns an error message if the instruction is malformed, or NULL.
+static const char* decode(Verifier* v, int offset, Instruction* inst) {
+    memset(inst, 0, sizeof(Instruction));
+    inst->flow = FLOW_NEXT;
+    inst->target = NO_TARGET;
+    inst->spawnValues = -1;
+
+    uint8_t* code = v->code;
+    int remaining = v->count - offset - 1;
+    int args = offset + 1;
+
+#define NEED(n)                                                                                                        \
+    if (remaining < (n)) {                                                                                             \
+        return "Instruction operands extend past the end of the code.";                                               \
+    }
+#define INT_TYPE_ARG()                                                                                                 \
+    NEED(1);                                                                                                           \
+    if (!isIntType(code[args])) {                                                                                      \
+        return "Invalid integer type operand.";                                                                        \
+    }
+#define SIGNED_TYPE_ARG()                                                                                              \
+    NEED(1);                                                                                                           \
+    if (!isSignedIntType(code[args])) {                                                                                \
+        return "Invalid signed integer type operand.";                                                                 \
+    }
+
+    switch (code[offset]) {
+    case CODE_NOP:
+    case CODE_BREAKPOINT:
+    case CODE_THREAD_YIELD:
+        setEffect(inst, 1, 0, 0);
+        break;
+    case CODE_ABORT:
+        setEffect(inst, 1, 1, 0);
+        inst->flow = FLOW_HALT;
+        break;
+
+    case CODE_PERM_QUERY:
+    case CODE_PERM_REQUEST:
+    case CODE_PERM_REQUEST_ALL:
+        NEED(2);
+        setEffect(inst, 3, 0, 1);
+        break;
+    case CODE_PERM_REVOKE:
+        NEED(2);
+        setEffect(inst, 3, 0, 0);
+        break;
+    case CODE_JUMP_PERMISSION:
+        NEED(6);
+        setEffect(inst, 7, 0, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = getInt(code, args + 2);
+        break;
+    case CODE_OFFSET_PERMISSION:
+        NEED(6);
+        setEffect(inst, 7, 0, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = offset + 7 + getInt(code, args + 2);
+        break;
+
+    case CODE_TRUE:
+    case CODE_FALSE:
+    case CODE_THREAD_CURRENT:
+    case CODE_LIST_NIL:
+    case CODE_RECORD_NIL:
+    case CODE_ARRAY_NIL:
+    case CODE_BYTE_ARRAY_NIL:
+    case CODE_VECTOR_NIL:
+        setEffect(inst, 1, 0, 1);
+        break;
+    case CODE_BOOL_NOT:
+    case CODE_SINGLE_NEG:
+    case CODE_SINGLE_SIGN:
+    case CODE_DOUBLE_NEG:
+    case CODE_DOUBLE_SIGN:
+    case CODE_CLOSURE_ONCE:
+    case CODE_CLOSURE_ONCE_TAIL:
+    case CODE_CLOSURE_MANY:
+    case CODE_THREAD_SLEEP:
+    case CODE_NEWREF:
+    case CODE_GETREF:
+    case CODE_CHANNEL_NEW:
+    case CODE_AWAIT:
+    case CODE_LIST_HEAD:
+    case CODE_LIST_TAIL:
+    case CODE_LIST_IS_EMPTY:
+    case CODE_ARRAY_LENGTH:
+    case CODE_SLICE_LENGTH:
+    case CODE_BYTE_ARRAY_LENGTH:
+    case CODE_BYTE_SLICE_LENGTH:
+    case CODE_VECTOR_LENGTH:
+    case CODE_ARRAY_TO_VECTOR:
+    case CODE_VECTOR_TO_ARRAY:
+    case CODE_NUM_ARRAY_LENGTH:
+    case CODE_NUM_ARRAY_SUM:
+    case CODE_NUM_ARRAY_MIN:
+    case CODE_NUM_ARRAY_MAX:
+    case CODE_BYTES_HASH:
+        setEffect(inst, 1, 1, 1);
+        break;
+    case CODE_BOOL_AND:
+    case CODE_BOOL_OR:
+    case CODE_BOOL_NEQ:
+    case CODE_BOOL_EQ:
+    case CODE_SINGLE_ADD:
+    case CODE_SINGLE_SUB:
+    case CODE_SINGLE_MUL:
+    case CODE_SINGLE_DIV:
+    case CODE_SINGLE_EQ:
+    case CODE_SINGLE_LESS:
+    case CODE_SINGLE_GREATER:
+    case CODE_DOUBLE_ADD:
+    case CODE_DOUBLE_SUB:
+    case CODE_DOUBLE_MUL:
+    case CODE_DOUBLE_DIV:
+    case CODE_DOUBLE_EQ:
+    case CODE_DOUBLE_LESS:
+    case CODE_DOUBLE_GREATER:
+    case CODE_THREAD_EQUAL:
+    case CODE_CHANNEL_SEND:
+    case CODE_LIST_CONS:
+    case CODE_ARRAY_SNOC:
+    case CODE_ARRAY_GET_AT:
+    case CODE_ARRAY_CONCAT:
+    case CODE_SLICE_GET_AT:
+    case CODE_BYTE_ARRAY_SNOC:
+    case CODE_BYTE_ARRAY_GET_AT:
+    case CODE_BYTE_ARRAY_CONCAT:
+    case CODE_BYTE_SLICE_GET_AT:
+    case CODE_VECTOR_SNOC:
+    case CODE_VECTOR_GET_AT:
+    case CODE_VECTOR_CONCAT:
+    case CODE_NUM_ARRAY_GET_AT:
+    case CODE_NUM_ARRAY_ADD:
+    case CODE_NUM_ARRAY_MUL:
+    case CODE_NUM_ARRAY_DOT:
+    case CODE_NUM_ARRAY_EQ:
+    case CODE_NUM_ARRAY_LESS:
+    case CODE_BYTES_INDEX_OF:
+    case CODE_BYTES_COUNT:
+    case CODE_BYTES_COMPARE:
+    case CODE_BYTES_EQUAL:
+    case CODE_LIST_APPEND_REUSE:
+    case CODE_ARRAY_CONCAT_REUSE:
+    case CODE_BYTE_ARRAY_CONCAT_REUSE:
+    case CODE_STRING_CONCAT:
+    case CODE_STRING_CONCAT_REUSE:
+        setEffect(inst, 1, 2, 1);
+        break;
+    case CODE_LIST_APPEND:
+    case CODE_ARRAY_FILL:
+    case CODE_BYTE_ARRAY_FILL:
+        setEffect(inst, 1, 2, 1);
+        inst->roots = 1;
+        break;
+    case CODE_ARRAY_SET_AT:
+    case CODE_ARRAY_SLICE:
+    case CODE_SUBSLICE:
+    case CODE_SLICE_SET_AT:
+    case CODE_BYTE_ARRAY_SET_AT:
+    case CODE_BYTE_ARRAY_SLICE:
+    case CODE_BYTE_SUBSLICE:
+    case CODE_BYTE_SLICE_SET_AT:
+    case CODE_VECTOR_SET_AT:
+    case CODE_VECTOR_SLICE:
+    case CODE_NUM_ARRAY_SET_AT:
+    case CODE_NUM_ARRAY_SLICE:
+    case CODE_NUM_ARRAY_FMA:
+        setEffect(inst, 1, 3, 1);
+        break;
+    case CODE_ARRAY_COPY:
+    case CODE_BYTE_ARRAY_COPY:
+        setEffect(inst, 1, 3, 2);
+        break;
+    case CODE_SLICE_COPY:
+    case CODE_BYTE_SLICE_COPY:
+    case CODE_DUP:
+    case CODE_THREAD_JOIN:
+    case CODE_CHANNEL_RECV:
+    case CODE_CHANNEL_TRY_RECV:
+        setEffect(inst, 1, 1, 2);
+        break;
+    case CODE_CHANNEL_SELECT:
+        NEED(1);
+        if (code[args] == 0) {
+            return "CHANNEL_SELECT needs at least one channel.";
+        }
+        setEffect(inst, 2, code[args], 3);
+        break;
+    case CODE_SWAP:
+        setEffect(inst, 1, 2, 2);
+        break;
+    case CODE_ZAP:
+    case CODE_PRINT:
+    case CODE_CHANNEL_CLOSE:
+        setEffect(inst, 1, 1, 0);
+        break;
+    case CODE_PUTREF:
+        setEffect(inst, 1, 2, 0);
+        break;
+    case CODE_REF_SWAP:
+        setEffect(inst, 1, 2, 1);
+        break;
+    case CODE_REF_CAS:
+        INT_TYPE_ARG();
+        setEffect(inst, 2, 3, 1);
+        break;
+    case CODE_REF_FETCH_ADD:
+        INT_TYPE_ARG();
+        setEffect(inst, 2, 2, 1);
+        break;
+
+    case CODE_CONSTANT:
+        NEED(2);
+        if (getUShort(code, args) >= v->vm->constants.count) {
+            return "Constant index is outside the constant pool.";
+        }
+        setEffect(inst, 3, 0, 1);
+        break;
+
+    case CODE_I8:
+    case CODE_U8:
+        NEED(1);
+        setEffect(inst, 2, 0, 1);
+        break;
+    case CODE_I16:
+    case CODE_U16:
+        NEED(2);
+        setEffect(inst, 3, 0, 1);
+        break;
+    case CODE_I32:
+    case CODE_U32:
+    case CODE_SINGLE:
+        NEED(4);
+        setEffect(inst, 5, 0, 1);
+        break;
+    case CODE_I64:
+    case CODE_U64:
+    case CODE_DOUBLE:
+        NEED(8);
+        setEffect(inst, 9, 0, 1);
+        break;
+
+    case CODE_INT_NEG:
+    case CODE_INT_INC:
+    case CODE_INT_DEC:
+    case CODE_INT_COMP:
+        INT_TYPE_ARG();
+        setEffect(inst, 2, 1, 1);
+        break;
+    case CODE_INT_SIGN:
+        SIGNED_TYPE_ARG();
+        setEffect(inst, 2, 1, 1);
+        break;
+    case CODE_INT_ADD:
+    case CODE_INT_SUB:
+    case CODE_INT_MUL:
+    case CODE_INT_OR:
+    case CODE_INT_AND:
+    case CODE_INT_XOR:
+    case CODE_INT_SHL:
+    case CODE_INT_SHR:
+    case CODE_INT_EQ:
+    case CODE_INT_LESS:
+    case CODE_INT_GREATER:
+        INT_TYPE_ARG();
+        setEffect(inst, 2, 2, 1);
+        break;
+    case CODE_INT_DIV_REM_T:
+        INT_TYPE_ARG();
+        setEffect(inst, 2, 2, 2);
+        break;
+    case CODE_INT_DIV_REM_F:
+    case CODE_INT_DIV_REM_E:
+        SIGNED_TYPE_ARG();
+        setEffect(inst, 2, 2, 2);
+        break;
+
+    case CODE_NUM_ARRAY_FILL:
+        NEED(1);
+        if (code[args] == VAL_BOOL || code[args] > VAL_DOUBLE) {
+            return "Invalid numeric type operand.";
+        }
+        setEffect(inst, 2, 2, 1);
+        break;
+
+    case CODE_VALUE_CONV:
+        NEED(2);
+        if (code[args] > VAL_DOUBLE || code[args + 1] > VAL_DOUBLE) {
+            return "Invalid value type operand.";
+        }
+        setEffect(inst, 3, 1, 1);
+        break;
+
+    case CODE_STORE:
+        NEED(1);
+        setEffect(inst, 2, code[args], 0);
+        inst->frames = 1;
+        inst->frameSlots = code[args];
+        break;
+    case CODE_FIND:
+        NEED(4);
+        setEffect(inst, 5, 0, 1);
+        break;
+    case CODE_OVERWRITE:
+        NEED(4);
+        setEffect(inst, 5, 1, 0);
+        break;
+    case CODE_FORGET:
+        setEffect(inst, 1, 0, 0);
+        inst->frames = -1;
+        break;
+
+    case CODE_CALL_FOREIGN: {
+        NEED(2);
+        int fnIndex = getShort(code, args);
+        if (fnIndex < 0 || fnIndex >= v->vm->foreignFns.count) {
+            return "Foreign function index is outside the foreign function collection.";
+        }
+        setEffect(inst, 3, 0, 0);
+        inst->flow = FLOW_DYNAMIC;
+        break;
+    }
+
+    case CODE_OFFSET:
+        NEED(4);
+        setEffect(inst, 5, 0, 0);
+        inst->flow = FLOW_JUMP;
+        inst->target = offset + 5 + getInt(code, args);
+        break;
+    case CODE_CALL:
+        NEED(4);
+        setEffect(inst, 5, 0, 0);
+        inst->flow = FLOW_CALL;
+        inst->target = getInt(code, args);
+        break;
+    case CODE_TAILCALL:
+        NEED(4);
+        setEffect(inst, 5, 0, 0);
+        inst->flow = FLOW_TAILCALL;
+        inst->target = getInt(code, args);
+        break;
+    case CODE_ARRAY_PAR_MAP:
+        setEffect(inst, 1, 2, 1);
+        inst->roots = 1;
+        inst->unbounded = true;
+        break;
+    case CODE_ARRAY_PAR_REDUCE:
+        setEffect(inst, 1, 3, 1);
+        inst->roots = 1;
+        inst->unbounded = true;
+        break;
+    case CODE_CALL_CLOSURE:
+    case CODE_CALL_CONTINUATION:
+        setEffect(inst, 1, 0, 0);
+        inst->flow = FLOW_DYNAMIC;
+        break;
+    case CODE_TAILCALL_CLOSURE:
+    case CODE_TAILCALL_CONTINUATION:
+        setEffect(inst, 1, 0, 0);
+        inst->flow = FLOW_DYNAMIC_TAILCALL;
+        break;
+    case CODE_COMPLETE:
+        setEffect(inst, 1, 0, 0);
+        inst->flow = FLOW_COMPLETE;
+        break;
+    case CODE_DESTRUCT:
+        setEffect(inst, 1, 1, 0);
+        inst->flow = FLOW_DYNAMIC;
+        break;
+    case CODE_RETURN:
+        setEffect(inst, 1, 0, 0);
+        inst->flow = FLOW_RETURN;
+        break;
+
+    case CODE_JUMP_TRUE:
+    case CODE_JUMP_FALSE:
+        NEED(4);
+        setEffect(inst, 5, 1, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = getInt(code, args);
+        break;
+    case CODE_OFFSET_TRUE:
+    case CODE_OFFSET_FALSE:
+        NEED(4);
+        setEffect(inst, 5, 1, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = offset + 5 + getInt(code, args);
+        break;
+
+    case CODE_JUMP_INT_EQ:
+    case CODE_JUMP_INT_LESS:
+    case CODE_JUMP_INT_GREATER:
+        INT_TYPE_ARG();
+        NEED(5);
+        setEffect(inst, 6, 2, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = getInt(code, args + 1);
+        break;
+    case CODE_OFFSET_INT_EQ:
+    case CODE_OFFSET_INT_LESS:
+    case CODE_OFFSET_INT_GREATER:
+        INT_TYPE_ARG();
+        NEED(5);
+        setEffect(inst, 6, 2, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = offset + 6 + getInt(code, args + 1);
+        break;
+    case CODE_JUMP_SINGLE_EQ:
+    case CODE_JUMP_SINGLE_LESS:
+    case CODE_JUMP_SINGLE_GREATER:
+    case CODE_JUMP_DOUBLE_EQ:
+    case CODE_JUMP_DOUBLE_LESS:
+    case CODE_JUMP_DOUBLE_GREATER:
+        NEED(4);
+        setEffect(inst, 5, 2, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = getInt(code, args);
+        break;
+    case CODE_OFFSET_SINGLE_EQ:
+    case CODE_OFFSET_SINGLE_LESS:
+    case CODE_OFFSET_SINGLE_GREATER:
+    case CODE_OFFSET_DOUBLE_EQ:
+    case CODE_OFFSET_DOUBLE_LESS:
+    case CODE_OFFSET_DOUBLE_GREATER:
+        NEED(4);
+        setEffect(inst, 5, 2, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = offset + 5 + getInt(code, args);
+        break;
+
+    case CODE_CLOSURE:
+    case CODE_RECURSIVE: {
+        NEED(7);
+        int closedCount = getUShort(code, args + 5);
+        NEED(7 + closedCount * 4);
+        if (code[args + 4] + closedCount + (code[offset] == CODE_RECURSIVE ? 1 : 0) > MOCHIVM_MAX_CALL_FRAME_SLOTS) {
+            return "Closure has more parameters and captured values than a call frame can hold.";
+        }
+        setEffect(inst, 8 + closedCount * 4, 0, 1);
+        inst->target = getInt(code, args);
+        break;
+    }
+    case CODE_MUTUAL:
+        NEED(1);
+        setEffect(inst, 2, code[args], code[args]);
+        break;
+
+    case CODE_HANDLE: {
+        NEED(8);
+        uint8_t paramCount = code[args + 6];
+        uint8_t handlerCount = code[args + 7];
+        setEffect(inst, 9, handlerCount + paramCount + 1, 0);
+        inst->frames = 1;
+        inst->frameSlots = paramCount;
+        inst->flow = FLOW_HANDLE;
+        inst->target = offset + 9 + getShort(code, args);
+        break;
+    }
+    case CODE_INJECT:
+    case CODE_EJECT:
+        NEED(4);
+        setEffect(inst, 5, 0, 0);
+        break;
+    case CODE_ESCAPE:
+        NEED(5);
+        setEffect(inst, 6, 0, 0);
+        inst->flow = FLOW_DYNAMIC;
+        break;
+
+    case CODE_THREAD_SPAWN:
+        NEED(4);
+        setEffect(inst, 5, 0, 2);
+        inst->target = getInt(code, args);
+        inst->spawnValues = 0;
+        break;
+    case CODE_THREAD_SPAWN_WITH: {
+        NEED(8);
+        int consumed = getInt(code, args + 4);
+        if (consumed < 0) {
+            return "Spawned fiber cannot consume a negative number of values.";
+        }
+        setEffect(inst, 9, consumed, 2);
+        inst->peak = 1;
+        inst->target = getInt(code, args);
+        inst->spawnValues = consumed;
+        break;
+    }
+    case CODE_THREAD_SPAWN_COPY:
+        setEffect(inst, 1, 0, 2);
+        break;
+
+    case CODE_SHUFFLE: {
+        NEED(2);
+        uint8_t push = code[args + 1];
+        NEED(2 + push);
+        setEffect(inst, 3 + push, code[args], push);
+        inst->peak = push;
+        break;
+    }
+
+    case CODE_CONSTRUCT:
+        NEED(5);
+        setEffect(inst, 6, code[args + 4], 1);
+        break;
+    case CODE_IS_STRUCT:
+    case CODE_RECORD_SELECT:
+    case CODE_RECORD_RESTRICT:
+    case CODE_VARIANT:
+    case CODE_EMBED:
+    case CODE_EMBED_REUSE:
+    case CODE_IS_CASE:
+        NEED(4);
+        setEffect(inst, 5, 1, 1);
+        break;
+    case CODE_RECORD_EXTEND:
+    case CODE_RECORD_UPDATE:
+    case CODE_RECORD_UPDATE_REUSE:
+        NEED(4);
+        setEffect(inst, 5, 2, 1);
+        break;
+    case CODE_JUMP_STRUCT:
+        NEED(8);
+        setEffect(inst, 9, 1, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = getInt(code, args + 4);
+        break;
+    case CODE_OFFSET_STRUCT:
+        NEED(8);
+        setEffect(inst, 9, 1, 0);
+        inst->flow = FLOW_BRANCH;
+        inst->target = offset + 9 + getInt(code, args + 4);
+        break;
+    case CODE_JUMP_CASE:
+        NEED(8);
+        setEffect(inst, 9, 1, 1);
+        inst->flow = FLOW_BRANCH;
+        inst->target = getInt(code, args + 4);
+        break;
+    case CODE_OFFSET_CASE:
+        NEED(8);
+        setEffect(inst, 9, 1, 1);
+        inst->flow = FLOW_BRANCH;
+        inst->target = offset + 9 + getInt(code, args + 4);
+        break;
+
+    default:
+        return "Unknown opcode.";
+    }
+
+#undef NEED
+#undef INT_TYPE_ARG
+#undef SIGNED_TYPE_ARG
+
+    return NULL;
+}
+
+static bool isStart(Verifier* v, int offset) {
+    return offset >= 0 && offset < v->count && v->starts[offset];
+}
+
+static void addEntry(Verifier* v, int entry, int values) {
+    for (int i = 0; i < v->entryCount; i++) {
+        if (v->entries[i].entry == entry && v->entries[i].values == values) {
+            return;
+        }
+    }
+    if (v->entryCount >= v->entryCapacity) {
+        int oldCapacity = v->entryCapacity;
+        v->entryCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+        v->entries = verifierAlloc(v, v->entries, sizeof(Entry) * v->entryCapacity);
+    }
+    v->entries[v->entryCount++] = (Entry){ .entry = entry, .values = values };
+}
+
+// Decode every instruction in order, then check that all static control flow
+// targets land on the start of an instruction. Closure bodies and spawn targets
+// are collected as additional entry points for the flow analysis.
+static void checkStructure(Verifier* v) {
+    Instruction inst;
+    int offset = 0;
+    while (offset < v->count) {
+        const char* error = decode(v, offset, &inst);
+        if (error != NULL) {
+            fail(v, offset, error);
+            return;
+        }
+        v->starts[offset] = true;
+        offset += inst.length;
+    }
+
+    for (offset = 0; offset < v->count; offset += inst.length) {
+        decode(v, offset, &inst);
+        if (inst.target == NO_TARGET) {
+            continue;
+        }
+        if (!isStart(v, inst.target)) {
+            fail(v, offset, "Target is not the start of an instruction.");
+            return;
+        }
+        if (inst.spawnValues >= 0) {
+            addEntry(v, inst.target, inst.spawnValues);
+        } else if (v->code[offset] == CODE_CLOSURE || v->code[offset] == CODE_RECURSIVE) {
+            addEntry(v, inst.target, -1);
+        }
+    }
+}
+
+static int pushShape(Verifier* v, int below, int slotCount) {
+    if (v->shapeCount >= v->shapeCapacity) {
+        int oldCapacity = v->shapeCapacity;
+        v->shapeCapacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+        v->shapes = verifierAlloc(v, v->shapes, sizeof(Shape) * v->shapeCapacity);
+    }
+    int depth = below == NO_SHAPE ? 1 : v->shapes[below].depth + 1;
+    v->shapes[v->shapeCount] = (Shape){ .slotCount = slotCount, .below = below, .depth = depth };
+    return v->shapeCount++;
+}
+
+static int shapeDepth(Verifier* v, int shape) {
+    return shape == NO_SHAPE ? 0 : v->shapes[shape].depth;
+}
+
+static bool shapeEqual(Verifier* v, int a, int b) {
+    while (a != b) {
+        if (a == NO_SHAPE || b == NO_SHAPE || v->shapes[a].slotCount != v->shapes[b].slotCount) {
+            return false;
+        }
+        a = v->shapes[a].below;
+        b = v->shapes[b].below;
+    }
+    return true;
+}
+
+// Checks a frame and slot index pair against the frames pushed by the current
+// function. Frames beneath the function are unknown here, so they are recorded as
+// the function's frame reach and checked wherever the function is entered.
+static void checkVariable(Verifier* v, Summary* sum, int offset, int shape, int frameIdx, int slotIdx) {
+    int s = shape;
+    for (int i = 0; i < frameIdx && s != NO_SHAPE; i++) {
+        s = v->shapes[s].below;
+    }
+    if (s != NO_SHAPE) {
+        if (slotIdx >= v->shapes[s].slotCount) {
+            fail(v, offset, "Slot index is outside the referenced frame.");
+        }
+        return;
+    }
+    int reach = frameIdx + 1 - shapeDepth(v, shape);
+    sum->frameReach = reach > sum->frameReach ? reach : sum->frameReach;
+}
+
+// The depth and frames an instruction is reached with in the function being walked.
+// Once any path reaches it at a depth only known at runtime, the depth is unknown.
+typedef struct {
+    int offset;
+    int depth;
+    bool known;
+    int shape;
+} Visit;
+
+// Visits are kept in an open addressing table sized to the instructions the walk reaches rather
+// than the whole code, so that walking every function stays linear in the size of the code.
+typedef struct {
+    Visit* visits;
+    int visitCount;
+    int visitCapacity;
+    int* work;
+    int workCount;
+    int workCapacity;
+    // Calls back into the function being walked, which continue once it returns.
+    int* recursions;
+    int recursionCount;
+    int recursionCapacity;
+} Walk;
+
+static Visit* findVisit(Walk* walk, int offset) {
+    uint32_t mask = (uint32_t)walk->visitCapacity - 1;
+    uint32_t index = ((uint32_t)offset * 2654435769u) & mask;
+    while (walk->visits[index].offset != NO_OFFSET && walk->visits[index].offset != offset) {
+        index = (index + 1) & mask;
+    }
+    return &walk->visits[index];
+}
+
+static void growVisits(Verifier* v, Walk* walk) {
+    Visit* old = walk->visits;
+    int oldCapacity = walk->visitCapacity;
+    walk->visitCapacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+    walk->visits = verifierAlloc(v, NULL, sizeof(Visit) * walk->visitCapacity);
+    for (int i = 0; i < walk->visitCapacity; i++) {
+        walk->visits[i].offset = NO_OFFSET;
+    }
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].offset != NO_OFFSET) {
+            *findVisit(walk, old[i].offset) = old[i];
+        }
+    }
+    verifierAlloc(v, old, 0);
+}
+
+static void pushOffset(Verifier* v, int** offsets, int* count, int* capacity, int offset) {
+    if (*count >= *capacity) {
+        *capacity = *capacity < 16 ? 16 : *capacity * 2;
+        *offsets = verifierAlloc(v, *offsets, sizeof(int) * *capacity);
+    }
+    (*offsets)[(*count)++] = offset;
+}
+
+static void visit(Verifier* v, Walk* walk, int from, int offset, int depth, bool known, int shape) {
+    if (offset >= v->count) {
+        fail(v, from, "Execution can continue past the end of the code.");
+        return;
+    }
+    if ((walk->visitCount + 1) * 4 > walk->visitCapacity * 3) {
+        growVisits(v, walk);
+    }
+    Visit* seen = findVisit(walk, offset);
+    if (seen->offset == NO_OFFSET) {
+        *seen = (Visit){ .offset = offset, .depth = depth, .known = known, .shape = shape };
+        walk->visitCount++;
+        pushOffset(v, &walk->work, &walk->workCount, &walk->workCapacity, offset);
+    } else if (!shapeEqual(v, seen->shape, shape) || (seen->known && known && seen->depth != depth)) {
+        fail(v, offset, "Stack depth or frames differ between paths reaching this instruction.");
+    } else if (seen->known && !known) {
+        // walk the code from here again, since the depths it was checked with may be wrong
+        seen->known = false;
+        pushOffset(v, &walk->work, &walk->workCount, &walk->workCapacity, offset);
+    }
+}
+
+static void recordExit(Verifier* v, Summary* sum, int offset, int depth, bool known) {
+    if (!sum->returns) {
+        sum->returns = true;
+        sum->exitValue = depth;
+        sum->exitKnown = known;
+    } else if (sum->exitKnown && known && sum->exitValue != depth) {
+        fail(v, offset, "Function returns with differing value stack depths.");
+    } else if (!known) {
+        sum->exitKnown = false;
+    }
+}
+
+static Summary* analyze(Verifier* v, int entry);
+
+// Combine the summary of a called function into the caller's summary, where the
+// callee is entered at [depth], if it is [known], with [frames] of the caller's frames
+// beneath it.
+static void applyCallee(Summary* sum, Summary* callee, int depth, bool known, int frames) {
+    if (!callee->bounded) {
+        sum->bounded = false;
+    }
+    if (known) {
+        int minValue = depth + callee->minValue;
+        int maxValue = depth + callee->maxValue;
+        sum->minValue = minValue < sum->minValue ? minValue : sum->minValue;
+        sum->maxValue = maxValue > sum->maxValue ? maxValue : sum->maxValue;
+    }
+    int maxFrame = frames + callee->maxFrame;
+    int reach = callee->frameReach - frames;
+    sum->maxFrame = maxFrame > sum->maxFrame ? maxFrame : sum->maxFrame;
+    sum->maxRoot = callee->maxRoot > sum->maxRoot ? callee->maxRoot : sum->maxRoot;
+    sum->frameReach = reach > sum->frameReach ? reach : sum->frameReach;
+}
+
+// Checks the instruction at [offset] in the function starting at [entry], and visits the
+// instructions control can reach from it.
+static void walkInstruction(Verifier* v, int entry, Summary* sum, Walk* walk, int offset) {
+    Visit* seen = findVisit(walk, offset);
+    int depth = seen->depth;
+    bool known = seen->known;
+    int shape = seen->shape;
+    int frames = shapeDepth(v, shape);
+
+    Instruction inst;
+    decode(v, offset, &inst);
+    int next = offset + inst.length;
+
+    int low = depth - inst.pops;
+    if (known) {
+        int high = depth + inst.peak > low + inst.pushes ? depth + inst.peak : low + inst.pushes;
+        sum->minValue = low < sum->minValue ? low : sum->minValue;
+        sum->maxValue = high > sum->maxValue ? high : sum->maxValue;
+    }
+    sum->maxRoot = inst.roots > sum->maxRoot ? inst.roots : sum->maxRoot;
+    if (inst.unbounded) {
+        sum->bounded = false;
+    }
+
+    uint8_t* args = v->code + offset + 1;
+    switch (v->code[offset]) {
+    case CODE_FIND:
+    case CODE_OVERWRITE:
+        checkVariable(v, sum, offset, shape, getUShort(args, 0), getUShort(args, 2));
+        break;
+    case CODE_CLOSURE:
+    case CODE_RECURSIVE: {
+        int closedCount = getUShort(args, 5);
+        for (int i = 0; i < closedCount; i++) {
+            checkVariable(v, sum, offset, shape, getUShort(args, 7 + i * 4), getUShort(args, 9 + i * 4));
+        }
+        break;
+    }
+    case CODE_SHUFFLE: {
+        uint8_t push = args[1];
+        for (int i = 0; i < push && known; i++) {
+            int reached = depth + i - args[2 + i] - 1;
+            sum->minValue = reached < sum->minValue ? reached : sum->minValue;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    int nextShape = shape;
+    if (inst.frames > 0) {
+        nextShape = pushShape(v, shape, inst.frameSlots);
+        int pushed = frames + 1;
+        sum->maxFrame = pushed > sum->maxFrame ? pushed : sum->maxFrame;
+    } else if (inst.frames < 0) {
+        if (shape == NO_SHAPE) {
+            fail(v, offset, "FORGET has no stored frame to forget.");
+            return;
+        }
+        nextShape = v->shapes[shape].below;
+    }
+
+    int after = low + inst.pushes;
+    switch (inst.flow) {
+    case FLOW_NEXT:
+        visit(v, walk, offset, next, after, known, nextShape);
+        break;
+    case FLOW_BRANCH:
+        visit(v, walk, offset, inst.target, after, known, nextShape);
+        visit(v, walk, offset, next, after, known, nextShape);
+        break;
+    case FLOW_JUMP:
+        visit(v, walk, offset, inst.target, after, known, nextShape);
+        break;
+    case FLOW_CALL: {
+        if (inst.target == entry) {
+            sum->bounded = false;
+            if (known && after < 0) {
+                fail(v, offset, "Function calls itself below the depth it was entered with.");
+                break;
+            }
+            pushOffset(v, &walk->recursions, &walk->recursionCount, &walk->recursionCapacity, offset);
+            break;
+        }
+        // a function further up the chain of calls being analyzed has an incomplete summary, and
+        // code after calling it continues at an unknown depth until it is known to return
+        Summary* callee = analyze(v, inst.target);
+        bool inProgress = callee->state == SUMMARY_IN_PROGRESS;
+        if (inProgress) {
+            sum->bounded = false;
+        }
+        applyCallee(sum, callee, after, known, frames + 1);
+        if (callee->returns) {
+            visit(v, walk, offset, next, after + callee->exitValue, known && callee->exitKnown, nextShape);
+        } else if (inProgress) {
+            visit(v, walk, offset, next, after, false, nextShape);
+        }
+        break;
+    }
+    case FLOW_TAILCALL: {
+        if (frames > 0) {
+            fail(v, offset, "TAILCALL leaves stored frames on the frame stack.");
+            break;
+        }
+        if (inst.target == entry) {
+            // a balanced tail call back into the same function is a loop
+            if (!known || after != 0) {
+                sum->bounded = false;
+            }
+            break;
+        }
+        Summary* callee = analyze(v, inst.target);
+        if (callee->state == SUMMARY_IN_PROGRESS) {
+            sum->bounded = false;
+        }
+        applyCallee(sum, callee, after, known, frames);
+        if (callee->returns) {
+            recordExit(v, sum, offset, after + callee->exitValue, known && callee->exitKnown);
+        }
+        break;
+    }
+    case FLOW_RETURN:
+        if (frames > 0) {
+            fail(v, offset, "RETURN leaves stored frames on the frame stack.");
+            break;
+        }
+        recordExit(v, sum, offset, after, known);
+        break;
+    case FLOW_HALT:
+        break;
+    case FLOW_DYNAMIC:
+        sum->bounded = false;
+        visit(v, walk, offset, next, after, false, nextShape);
+        break;
+    case FLOW_DYNAMIC_TAILCALL:
+        sum->bounded = false;
+        if (frames > 0) {
+            fail(v, offset, "Tail call leaves stored frames on the frame stack.");
+            break;
+        }
+        recordExit(v, sum, offset, after, false);
+        break;
+    case FLOW_HANDLE:
+        visit(v, walk, offset, next, after, known, nextShape);
+        visit(v, walk, offset, inst.target, after, false, shape);
+        break;
+    case FLOW_COMPLETE:
+        sum->bounded = false;
+        break;
+    }
+}
+
+static void walkFunction(Verifier* v, int entry, Summary* sum, Walk* walk) {
+    visit(v, walk, entry, entry, 0, true, NO_SHAPE);
+
+    int resumedCount = 0;
+    bool resumedKnown = true;
+    while (!v->failed) {
+        while (walk->workCount > 0 && !v->failed) {
+            walkInstruction(v, entry, sum, walk, walk->work[--walk->workCount]);
+        }
+        // calls the function makes to itself come back at the depth it returns with, so they
+        // continue once a path that returns is found, and again if that depth becomes unknown
+        if (!sum->returns || (resumedCount == walk->recursionCount && resumedKnown == sum->exitKnown)) {
+            break;
+        }
+        resumedCount = walk->recursionCount;
+        resumedKnown = sum->exitKnown;
+        for (int i = 0; i < walk->recursionCount; i++) {
+            int offset = walk->recursions[i];
+            Visit call = *findVisit(walk, offset);
+            Instruction inst;
+            decode(v, offset, &inst);
+            visit(v, walk, offset, offset + inst.length, call.depth + sum->exitValue, call.known && sum->exitKnown,
+                  call.shape);
+        }
+    }
+}
+
+static Summary* analyze(Verifier* v, int entry) {
+    Summary* sum = &v->summaries[entry];
+    if (sum->state != SUMMARY_UNVISITED) {
+        return sum;
+    }
+    sum->state = SUMMARY_IN_PROGRESS;
+    sum->bounded = true;
+
+    Walk walk;
+    memset(&walk, 0, sizeof(Walk));
+    walkFunction(v, entry, sum, &walk);
+    verifierAlloc(v, walk.visits, 0);
+    verifierAlloc(v, walk.work, 0);
+    verifierAlloc(v, walk.recursions, 0);
+
+    sum->state = SUMMARY_DONE;
+    return sum;
+}
+
+// Checks a summary for a fiber that starts at [entry] with [values] on its value
+// stack and no frames, and widens the program-wide stack bounds to fit it.
+static void checkFiberEntry(Verifier* v, int entry, int values, bool* bounded, int* maxValue, int* maxFrame,
+                            int* maxRoot) {
+    Summary* sum = analyze(v, entry);
+    if (v->failed) {
+        return;
+    }
+    if (sum->minValue + values < 0) {
+        fail(v, entry, "Fiber starting here can underflow its value stack.");
+    } else if (sum->returns) {
+        fail(v, entry, "Fiber starting here can RETURN without a call frame.");
+    } else if (sum->frameReach > 0) {
+        fail(v, entry, "Fiber starting here references frames it never stored.");
+    }
+
+    *bounded = *bounded && sum->bounded;
+    *maxValue = values + sum->maxValue > *maxValue ? values + sum->maxValue : *maxValue;
+    *maxFrame = sum->maxFrame > *maxFrame ? sum->maxFrame : *maxFrame;
+    *maxRoot = sum->maxRoot > *maxRoot ? sum->maxRoot : *maxRoot;
+}
+
+// Finds how far below the depths it starts at the instruction at [offset] reads, which
+// for most instructions is just the values they pop.
+static void stackReach(Verifier* v, int offset, Instruction* inst, int* values, int* frames) {
+    uint8_t* args = v->code + offset + 1;
+    *values = inst->pops;
+    *frames = inst->frames < 0 ? -inst->frames : 0;
+    switch (v->code[offset]) {
+    case CODE_FIND:
+    case CODE_OVERWRITE:
+        *frames = getUShort(args, 0) + 1;
+        break;
+    case CODE_CLOSURE:
+    case CODE_RECURSIVE: {
+        int closedCount = getUShort(args, 5);
+        for (int i = 0; i < closedCount; i++) {
+            int reach = getUShort(args, 7 + i * 4) + 1;
+            *frames = reach > *frames ? reach : *frames;
+        }
+        break;
+    }
+    case CODE_SHUFFLE: {
+        // each value is read once those before it have been pushed
+        uint8_t push = args[1];
+        for (int i = 0; i < push; i++) {
+            int reach = args[2 + i] + 1 - i;
+            *values = reach > *values ? reach : *values;
+        }
+        break;
+    }
+    case CODE_CALL_CLOSURE:
+    case CODE_TAILCALL_CLOSURE:
+    case CODE_COMPLETE:
+    case CODE_RETURN:
+        *frames = 1;
+        break;
+    default:
+        break;
+    }
+}
+
+// Finds the most values and frames any stretch of code between two stack checks can
+// push, and the most it can reach below the depths it started at. Each stretch
+// continues through forward jumps and the instructions that do not check, so the need
+// at each instruction only depends on instructions after it.
+static void computeHeadroom(Verifier* v, int* valueRoom, int* frameRoom, int* valueFloor, int* frameFloor) {
+    int* valueNeeds = verifierAlloc(v, NULL, sizeof(int) * v->count);
+    int* frameNeeds = verifierAlloc(v, NULL, sizeof(int) * v->count);
+    int* valueReaches = verifierAlloc(v, NULL, sizeof(int) * v->count);
+    int* frameReaches = verifierAlloc(v, NULL, sizeof(int) * v->count);
+    int maxValue = 0;
+    int maxFrame = 0;
+    int maxValueReach = 0;
+    int maxFrameReach = 0;
+
+    Instruction inst;
+    for (int offset = v->count - 1; offset >= 0; offset--) {
+        if (!v->starts[offset]) {
+            continue;
+        }
+        decode(v, offset, &inst);
+
+        int next = offset + inst.length;
+        int valueAfter = 0;
+        int frameAfter = 0;
+        int valueReachAfter = 0;
+        int frameReachAfter = 0;
+        bool followNext = inst.flow == FLOW_NEXT || inst.flow == FLOW_BRANCH || inst.flow == FLOW_HANDLE;
+        bool followTarget = (inst.flow == FLOW_BRANCH || inst.flow == FLOW_JUMP) && inst.target > offset;
+        if (followNext && next < v->count) {
+            valueAfter = valueNeeds[next];
+            frameAfter = frameNeeds[next];
+            valueReachAfter = valueReaches[next];
+            frameReachAfter = frameReaches[next];
+        }
+        if (followTarget) {
+            int target = inst.target;
+            valueAfter = valueNeeds[target] > valueAfter ? valueNeeds[target] : valueAfter;
+            frameAfter = frameNeeds[target] > frameAfter ? frameNeeds[target] : frameAfter;
+            valueReachAfter = valueReaches[target] > valueReachAfter ? valueReaches[target] : valueReachAfter;
+            frameReachAfter = frameReaches[target] > frameReachAfter ? frameReaches[target] : frameReachAfter;
+        }
+
+        int valueGrowth = inst.pushes - inst.pops;
+        int valuePeak = inst.peak > valueGrowth ? inst.peak : valueGrowth;
+        int frameGrowth = inst.frames;
+        int framePeak = frameGrowth > 0 ? frameGrowth : 0;
+        valueNeeds[offset] = valueGrowth + valueAfter > valuePeak ? valueGrowth + valueAfter : valuePeak;
+        frameNeeds[offset] = frameGrowth + frameAfter > framePeak ? frameGrowth + frameAfter : framePeak;
+        maxValue = valueNeeds[offset] > maxValue ? valueNeeds[offset] : maxValue;
+        maxFrame = frameNeeds[offset] > maxFrame ? frameNeeds[offset] : maxFrame;
+
+        // what the rest of the stretch reaches below the depth after this instruction
+        int valueReach;
+        int frameReach;
+        stackReach(v, offset, &inst, &valueReach, &frameReach);
+        valueReaches[offset] = valueReachAfter - valueGrowth > valueReach ? valueReachAfter - valueGrowth : valueReach;
+        frameReaches[offset] = frameReachAfter - frameGrowth > frameReach ? frameReachAfter - frameGrowth : frameReach;
+        maxValueReach = valueReaches[offset] > maxValueReach ? valueReaches[offset] : maxValueReach;
+        maxFrameReach = frameReaches[offset] > maxFrameReach ? frameReaches[offset] : maxFrameReach;
+    }
+
+    verifierAlloc(v, valueNeeds, 0);
+    verifierAlloc(v, frameNeeds, 0);
+    verifierAlloc(v, valueReaches, 0);
+    verifierAlloc(v, frameReaches, 0);
+    *valueRoom = maxValue + MOCHIVM_STACK_RESERVE;
+    *frameRoom = maxFrame + MOCHIVM_STACK_RESERVE;
+    *valueFloor = maxValueReach;
+    *frameFloor = maxFrameReach;
+}
+
+bool mochiVerify(MochiVM* vm) {
+    Verifier v;
+    memset(&v, 0, sizeof(Verifier));
+    v.vm = vm;
+    v.code = vm->code.data;
+    v.count = vm->code.count;
+
+    vm->verified = false;
+    vm->valueStackCapacity = vm->config.valueStackCapacity;
+    vm->frameStackCapacity = vm->config.frameStackCapacity;
+    vm->rootStackCapacity = vm->config.rootStackCapacity;
+    vm->valueStackHeadroom = 0;
+    vm->frameStackHeadroom = 0;
+    vm->valueStackFloor = 0;
+    vm->frameStackFloor = 0;
+
+    if (v.count == 0) {
+        fail(&v, 0, "There is no code to run.");
+        return false;
+    }
+
+    v.starts = verifierAlloc(&v, NULL, sizeof(bool) * v.count);
+    memset(v.starts, 0, sizeof(bool) * v.count);
+    v.summaries = verifierAlloc(&v, NULL, sizeof(Summary) * v.count);
+    memset(v.summaries, 0, sizeof(Summary) * v.count);
+
+    checkStructure(&v);
+
+    bool bounded = true;
+    int maxValue = 0;
+    int maxFrame = 0;
+    int maxRoot = 0;
+    if (!v.failed) {
+        checkFiberEntry(&v, 0, 0, &bounded, &maxValue, &maxFrame, &maxRoot);
+    }
+    for (int i = 0; i < v.entryCount && !v.failed; i++) {
+        if (v.entries[i].values >= 0) {
+            checkFiberEntry(&v, v.entries[i].entry, v.entries[i].values, &bounded, &maxValue, &maxFrame, &maxRoot);
+        } else {
+            // closure bodies are only ever entered dynamically, but still need to be
+            // well formed
+            analyze(&v, v.entries[i].entry);
+        }
+    }
+
+    if (!v.failed) {
+        vm->verified = true;
+        int valueRoom;
+        int frameRoom;
+        computeHeadroom(&v, &valueRoom, &frameRoom, &vm->valueStackFloor, &vm->frameStackFloor);
+        if (bounded) {
+            // always leave room for at least one element so the stacks are real allocations
+            vm->valueStackCapacity = maxValue > 0 ? maxValue : 1;
+            vm->frameStackCapacity = maxFrame > 0 ? maxFrame : 1;
+            vm->rootStackCapacity = maxRoot > 0 ? maxRoot : 1;
+        } else {
+            // start with room for the headroom twice over, so a fiber does not grow its stacks
+            // the first time it calls
+            vm->valueStackHeadroom = valueRoom;
+            vm->frameStackHeadroom = frameRoom;
+            int valueCapacity = vm->valueStackHeadroom * 2;
+            int frameCapacity = vm->frameStackHeadroom * 2;
+            vm->valueStackCapacity = valueCapacity < vm->valueStackCapacity ? valueCapacity : vm->valueStackCapacity;
+            vm->frameStackCapacity = frameCapacity < vm->frameStackCapacity ? frameCapacity : vm->frameStackCapacity;
+        }
+    }
+
+    verifierAlloc(&v, v.starts, 0);
+    verifierAlloc(&v, v.summaries, 0);
+    verifierAlloc(&v, v.shapes, 0);
+    verifierAlloc(&v, v.entries, 0);
+    return vm->verified;
+}
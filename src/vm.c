@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "debug.h"
+#include "kernels.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -20,7 +21,121 @@
 #endif
 
 DEFINE_BUFFER(ForeignFunction, MochiVMForeignMethodFn);
-DEFINE_BUFFER(Fiber, ObjFiber*);
+DEFINE_BUFFER(LineRun, LineRun);
+
+// Finds the chunk of the fiber registry that holds slot [index], and the offset of the slot in
+// it. Chunk k starts at slot MOCHIVM_FIBER_CHUNK_SIZE * (2^k - 1).
+static int fiberChunk(int32_t index, int32_t* offset) {
+    uint32_t scaled = (uint32_t)index / MOCHIVM_FIBER_CHUNK_SIZE + 1;
+#if defined(__GNUC__) || defined(__clang__)
+    int chunk = 31 - __builtin_clz(scaled);
+#else
+    int chunk = 0;
+    while ((scaled >> (chunk + 1)) != 0) {
+        chunk++;
+    }
+#endif
+    *offset = index - MOCHIVM_FIBER_CHUNK_SIZE * ((1 << chunk) - 1);
+    return chunk;
+}
+
+static int32_t fiberChunkSize(int chunk) {
+    return MOCHIVM_FIBER_CHUNK_SIZE << chunk;
+}
+
+static _Atomic(int32_t)* fiberChunkNext(FiberRegistry* fibers, int chunk, _Atomic(ObjFiber*)* slots) {
+    return chunk == 0 ? fibers->firstNext : (_Atomic(int32_t)*)(slots + fiberChunkSize(chunk));
+}
+
+// Returns the slots of [chunk], allocating them if no worker has yet. Registering a fiber happens
+// where a collection must not start, so chunks are allocated outside the heap.
+static _Atomic(ObjFiber*)* fiberChunkSlots(MochiVM* vm, int chunk) {
+    FiberRegistry* fibers = &vm->fibers;
+    _Atomic(ObjFiber*)* slots = atomic_load_explicit(&fibers->chunks[chunk], memory_order_acquire);
+    if (slots != NULL) {
+        return slots;
+    }
+    int32_t size = fiberChunkSize(chunk);
+    _Atomic(ObjFiber*)* fresh = vm->config.reallocateFn(
+        NULL, (sizeof(_Atomic(ObjFiber*)) + sizeof(_Atomic(int32_t))) * size, vm->config.userData);
+    PANIC_IF(fresh != NULL, "Out of memory while registering a fiber.");
+    _Atomic(int32_t)* next = fiberChunkNext(fibers, chunk, fresh);
+    for (int32_t i = 0; i < size; i++) {
+        atomic_init(&fresh[i], NULL);
+        atomic_init(&next[i], 0);
+    }
+    if (atomic_compare_exchange_strong_explicit(&fibers->chunks[chunk], &slots, fresh, memory_order_acq_rel,
+                                                memory_order_acquire)) {
+        return fresh;
+    }
+    vm->config.reallocateFn(fresh, 0, vm->config.userData);
+    return slots;
+}
+
+static void initFibers(FiberRegistry* fibers) {
+    for (int i = 0; i < MOCHIVM_FIBER_CHUNK_SIZE; i++) {
+        atomic_init(&fibers->data[i], NULL);
+        atomic_init(&fibers->firstNext[i], 0);
+    }
+    atomic_init(&fibers->chunks[0], fibers->data);
+    for (int i = 1; i < MOCHIVM_FIBER_CHUNKS; i++) {
+        atomic_init(&fibers->chunks[i], NULL);
+    }
+    atomic_init(&fibers->count, 0);
+    atomic_init(&fibers->liveCount, 0);
+    atomic_init(&fibers->freeTop, 0);
+}
+
+static void freeFibers(MochiVM* vm) {
+    for (int i = 1; i < MOCHIVM_FIBER_CHUNKS; i++) {
+        vm->config.reallocateFn(vm->fibers.chunks[i], 0, vm->config.userData);
+    }
+}
+
+static void initFiberPool(MochiVM* vm) {
+    FiberPool* pool = &vm->fiberPool;
+    mtx_init(&pool->lock, mtx_plain);
+    pool->stacks = NULL;
+    if (vm->config.fiberStackPoolSize > 0) {
+        pool->stacks =
+            vm->config.reallocateFn(NULL, sizeof(FiberStacks) * vm->config.fiberStackPoolSize, vm->config.userData);
+        PANIC_IF(pool->stacks != NULL, "Out of memory while creating the fiber pool.");
+    }
+    pool->stackCount = 0;
+    pool->objects = NULL;
+    pool->objectCount = 0;
+}
+
+static void freeFiberPool(MochiVM* vm) {
+    FiberPool* pool = &vm->fiberPool;
+    for (int i = 0; i < pool->stackCount; i++) {
+        DEALLOCATE(vm, pool->stacks[i].values);
+        DEALLOCATE(vm, pool->stacks[i].frames);
+        DEALLOCATE(vm, pool->stacks[i].roots);
+    }
+    vm->config.reallocateFn(pool->stacks, 0, vm->config.userData);
+    while (pool->objects != NULL) {
+        Obj* next = pool->objects->next;
+        DEALLOCATE(vm, pool->objects);
+        pool->objects = next;
+    }
+    mtx_destroy(&pool->lock);
+}
+
+static void grayFibers(MochiVM* vm) {
+    int32_t count = vm->fibers.count;
+    for (int chunk = 0; chunk < MOCHIVM_FIBER_CHUNKS; chunk++) {
+        int32_t start = MOCHIVM_FIBER_CHUNK_SIZE * ((1 << chunk) - 1);
+        _Atomic(ObjFiber*)* slots = vm->fibers.chunks[chunk];
+        if (start >= count || slots == NULL) {
+            break;
+        }
+        int32_t end = count - start < fiberChunkSize(chunk) ? count - start : fiberChunkSize(chunk);
+        for (int32_t i = 0; i < end; i++) {
+            mochiGrayObj(vm, (Obj*)slots[i]);
+        }
+    }
+}
 
 // The behavior of realloc() when the size is 0 is implementation defined. It
 // may return a non-NULL pointer which must not be dereferenced but nevertheless
@@ -58,9 +173,12 @@ int mochiGetVersionNumber() {
 void mochiInitConfiguration(MochiVMConfiguration* config) {
     config->reallocateFn = defaultReallocate;
     config->errorFn = NULL;
-    config->valueStackCapacity = 128;
-    config->frameStackCapacity = 512;
+    config->valueStackCapacity = 1024 * 64;
+    config->frameStackCapacity = 1024 * 64;
     config->rootStackCapacity = 16;
+    config->fiberStackPoolSize = 256;
+    config->fiberObjectPoolSize = 256;
+    config->workerCount = 0;
     config->initialHeapSize = 1024 * 1024 * 10;
     config->minHeapSize = 1024 * 1024;
     config->heapGrowthPercent = 50;
@@ -95,21 +213,36 @@ MochiVM* mochiNewVM(MochiVMConfiguration* config) {
     vm->gray = (Obj**)reallocate(NULL, vm->grayCapacity * sizeof(Obj*), userData);
     vm->nextGC = vm->config.initialHeapSize;
 
+    vm->verified = false;
+    vm->valueStackCapacity = vm->config.valueStackCapacity;
+    vm->frameStackCapacity = vm->config.frameStackCapacity;
+    vm->rootStackCapacity = vm->config.rootStackCapacity;
+
     mtx_init(&vm->allocLock, mtx_plain);
+    mtx_init(&vm->shapeLock, mtx_plain);
+    mochiSchedulerInit(vm);
 
     mochiByteBufferInit(&vm->code);
-    mochiIntBufferInit(&vm->lines);
+    mochiLineRunBufferInit(&vm->lines);
     mochiValueBufferInit(&vm->constants);
+    mochiByteBufferInit(&vm->constantKinds);
     mochiIntBufferInit(&vm->labelIndices);
     mochiValueBufferInit(&vm->labels);
     mochiForeignFunctionBufferInit(&vm->foreignFns);
-    mochiFiberBufferInit(&vm->fibers);
-    mochiTableInit(&vm->heap);
-    // start at 2 since 0 and 1 are reserved for available/tombstoned slots
-    vm->nextHeapKey = 2;
+    mochiValueBufferInit(&vm->foreignNames);
+    initFibers(&vm->fibers);
+    initFiberPool(vm);
+    mochiValueBufferInit(&vm->snapshotRefs);
+    vm->pendingPromises = NULL;
+    vm->moduleMapping = NULL;
+    vm->moduleMappingSize = 0;
+    vm->emptyShape = mochiInternShape(vm, NULL, 0);
 
 #if MOCHIVM_BATTERY_UV
     uv_replace_allocator(uvmochiMalloc, uvmochiRealloc, uvmochiCalloc, uvmochiFree);
+    // Event loop callbacks are only given their handles, which point to the promises they settle,
+    // so they find the VM through the loop.
+    uv_loop_set_data(uv_default_loop(), vm);
 
     mochiAddForeign(vm, uvmochiNewTimer);
     mochiAddForeign(vm, uvmochiCloseTimer);
@@ -126,26 +259,35 @@ MochiVM* mochiNewVM(MochiVMConfiguration* config) {
 
 void mochiFreeVM(MochiVM* vm) {
 
-    // Free all of the GC objects.
+    // Free all of the GC objects. Fibers may be kept in the pool, which is freed after them.
     Obj* obj = vm->objects;
     while (obj != NULL) {
         Obj* next = obj->next;
         mochiFreeObj(vm, obj);
         obj = next;
     }
+    freeFiberPool(vm);
 
     // Free up the GC gray set.
     vm->gray = (Obj**)vm->config.reallocateFn(vm->gray, 0, vm->config.userData);
 
+    if (vm->moduleMapping != NULL) {
+        mochiReleaseModule(vm, false);
+    }
     mochiByteBufferClear(vm, &vm->code);
-    mochiIntBufferClear(vm, &vm->lines);
+    mochiLineRunBufferClear(vm, &vm->lines);
     mochiValueBufferClear(vm, &vm->constants);
+    mochiByteBufferClear(vm, &vm->constantKinds);
     mochiIntBufferClear(vm, &vm->labelIndices);
     mochiValueBufferClear(vm, &vm->labels);
     mochiForeignFunctionBufferClear(vm, &vm->foreignFns);
-    mochiFiberBufferClear(vm, &vm->fibers);
-    mochiTableClear(vm, &vm->heap);
+    mochiValueBufferClear(vm, &vm->foreignNames);
+    freeFibers(vm);
+    mochiValueBufferClear(vm, &vm->snapshotRefs);
+    mochiFreeShapes(vm);
 
+    mochiSchedulerFree(vm);
+    mtx_destroy(&vm->shapeLock);
     mtx_destroy(&vm->allocLock);
     DEALLOCATE(vm, vm);
 }
@@ -173,9 +315,12 @@ static void waitForThreadSync(MochiVM* vm) {
     bool allThreadsPaused = false;
     while (!allThreadsPaused) {
         allThreadsPaused = true;
-        for (int i = 0; i < vm->fibers.count; i++) {
-            // fibers will set their ready for gc flags when they've reached a safe point
-            allThreadsPaused = allThreadsPaused && vm->fibers.data[i] != NULL && vm->fibers.data[i]->isPausedForGc;
+        for (int i = 0; i < vm->scheduler.workerCount; i++) {
+            // workers will set their ready for gc flags when they've reached a safe point
+            allThreadsPaused = allThreadsPaused && vm->scheduler.workers[i].isPausedForGc;
+        }
+        if (!allThreadsPaused) {
+            thrd_yield();
         }
     }
 }
@@ -231,9 +376,12 @@ void mochiCollectGarbage(MochiVM* vm) {
 
     mochiGrayBuffer(vm, &vm->constants);
     mochiGrayBuffer(vm, &vm->labels);
-    for (int i = 0; i < vm->fibers.count; i++) {
-        mochiGrayObj(vm, (Obj*)vm->fibers.data[i]);
+    mochiGrayBuffer(vm, &vm->foreignNames);
+    mochiGrayBuffer(vm, &vm->snapshotRefs);
+    for (ObjPromise* promise = vm->pendingPromises; promise != NULL; promise = promise->nextPending) {
+        mochiGrayObj(vm, (Obj*)promise);
     }
+    grayFibers(vm);
 
     // Now that we have grayed the roots, do a depth-first search over all of the
     // reachable objects.
@@ -270,11 +418,36 @@ int mochiWriteCodeI8(MochiVM* vm, int8_t val, int line) {
 }
 
 int mochiWriteCodeByte(MochiVM* vm, uint8_t instr, int line) {
+    vm->verified = false;
+    if (vm->moduleMapping != NULL) {
+        mochiReleaseModule(vm, true);
+    }
     mochiByteBufferWrite(vm, &vm->code, instr);
-    mochiIntBufferWrite(vm, &vm->lines, line);
+    if (vm->lines.count == 0 || vm->lines.data[vm->lines.count - 1].line != line) {
+        mochiLineRunBufferWrite(vm, &vm->lines, (LineRun){ .start = vm->code.count - 1, .line = line });
+    }
     return vm->code.count - 1;
 }
 
+int mochiGetLine(MochiVM* vm, int byteIndex) {
+    if (byteIndex < 0 || byteIndex >= vm->code.count || vm->lines.count == 0) {
+        return -1;
+    }
+
+    // find the last run starting at or before the index
+    int low = 0;
+    int high = vm->lines.count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (vm->lines.data[mid].start <= byteIndex) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return vm->lines.data[low].line;
+}
+
 int mochiWriteCodeI16(MochiVM* vm, int16_t val, int line) {
     mochiWriteCodeByte(vm, (val) >> 8, (line));
     mochiWriteCodeByte(vm, (val), (line));
@@ -356,100 +529,131 @@ const char* mochiGetLabel(MochiVM* vm, int byteIndex) {
     return NULL;
 }
 
-static int mochiWriteConstant(MochiVM* vm, Value value) {
+static int mochiWriteConstant(MochiVM* vm, Value value, ConstantKind kind) {
+    mochiByteBufferWrite(vm, &vm->constantKinds, kind);
     mochiValueBufferWrite(vm, &vm->constants, I32_VAL(vm, 0));
     vm->constants.data[vm->constants.count - 1] = value;
     return vm->constants.count - 1;
 }
 
 int mochiWriteI32Const(MochiVM* vm, int32_t val) {
-    return mochiWriteConstant(vm, I32_VAL(vm, val));
+    return mochiWriteConstant(vm, I32_VAL(vm, val), CONST_KIND_I32);
 }
 
 int mochiWriteSingleConst(MochiVM* vm, float val) {
-    return mochiWriteConstant(vm, SINGLE_VAL(vm, val));
+    return mochiWriteConstant(vm, SINGLE_VAL(vm, val), CONST_KIND_SINGLE);
 }
 
 int mochiWriteDoubleConst(MochiVM* vm, double val) {
-    return mochiWriteConstant(vm, DOUBLE_VAL(vm, val));
+    return mochiWriteConstant(vm, DOUBLE_VAL(vm, val), CONST_KIND_DOUBLE);
 }
 
 int mochiWriteStringConst(MochiVM* vm, const char* val) {
-    int ind = mochiWriteConstant(vm, I32_VAL(vm, 0));
+    int ind = mochiWriteConstant(vm, I32_VAL(vm, 0), CONST_KIND_STRING);
     ObjByteArray* str = mochiByteArrayString(vm, val);
     vm->constants.data[ind] = OBJ_VAL(str);
     return ind;
 }
 
 int mochiWriteObjConst(MochiVM* vm, Obj* val) {
-    return mochiWriteConstant(vm, OBJ_VAL(val));
+    return mochiWriteConstant(vm, OBJ_VAL(val), CONST_KIND_OBJ);
 }
 
 int mochiAddForeign(MochiVM* vm, MochiVMForeignMethodFn fn) {
     mochiForeignFunctionBufferWrite(vm, &vm->foreignFns, fn);
+    mochiValueBufferWrite(vm, &vm->foreignNames, OBJ_VAL(NULL));
     return vm->foreignFns.count - 1;
 }
 
-// using this to get around the garbage collector, can allocate one of these
-// and it'll never be garbage collected. But, we have to free it ourselves after
-// the thread has been started.
-struct NewThread {
-    MochiVM* vm;
-    ObjFiber* fiber;
-};
-
-static void addFiberToVM(MochiVM* vm, ObjFiber* fiber) {
-    // find where to place the new fiber
-    int fibIndex = -1;
-    for (int i = 0; i < vm->fibers.count; i++) {
-        if (vm->fibers.data[i] == NULL) {
-            vm->fibers.data[i] = fiber;
-            fibIndex = i;
+int mochiAddNamedForeign(MochiVM* vm, const char* name, MochiVMForeignMethodFn fn) {
+    int ind = mochiAddForeign(vm, fn);
+    ObjByteArray* str = mochiByteArrayString(vm, name);
+    vm->foreignNames.data[ind] = OBJ_VAL(str);
+    return ind;
+}
+
+bool mochiEnsureStack(MochiVM* vm, ObjFiber* fiber, int values, int frames) {
+    return mochiFiberReserve(vm, fiber, values, frames);
+}
+
+void mochiAddFiber(MochiVM* vm, ObjFiber* fiber) {
+    FiberRegistry* fibers = &vm->fibers;
+    int32_t index = -1;
+    int32_t offset;
+    int chunk;
+
+    // Take the most recently freed slot, if there is one.
+    uint64_t top = atomic_load_explicit(&fibers->freeTop, memory_order_acquire);
+    while ((uint32_t)top != 0) {
+        int32_t freed = (int32_t)(uint32_t)top - 1;
+        chunk = fiberChunk(freed, &offset);
+        _Atomic(ObjFiber*)* slots = atomic_load_explicit(&fibers->chunks[chunk], memory_order_acquire);
+        int32_t next = atomic_load_explicit(&fiberChunkNext(fibers, chunk, slots)[offset], memory_order_relaxed);
+        uint64_t taken = (((top >> 32) + 1) << 32) | (uint32_t)next;
+        if (atomic_compare_exchange_weak_explicit(&fibers->freeTop, &top, taken, memory_order_acquire,
+                                                  memory_order_acquire)) {
+            index = freed;
             break;
         }
     }
-    if (fibIndex < 0) {
-        // TODO: this buffer write is not yet thread safe!
-        // need a lock here around writing and getting the index of the new fiber
-        mochiFiberBufferWrite(vm, &vm->fibers, fiber);
-        fibIndex = vm->fibers.count - 1;
+    if (index < 0) {
+        index = atomic_fetch_add_explicit(&fibers->count, 1, memory_order_relaxed);
+        PANIC_IF(index >= 0 && index < MOCHIVM_FIBER_CHUNK_SIZE * ((1 << MOCHIVM_FIBER_CHUNKS) - 1),
+                 "Too many fibers to register another.");
     }
-}
 
-static void removeFiberFromVM(MochiVM* vm, ObjFiber* fiber) {
-    for (int i = 0; i < vm->fibers.count - 1; i++) {
-        if (vm->fibers.data[i] == fiber) {
-            vm->fibers.data[i] = NULL;
-            break;
+    chunk = fiberChunk(index, &offset);
+    _Atomic(ObjFiber*)* slots = fiberChunkSlots(vm, chunk);
+    fiber->registryIndex = index;
+    atomic_store_explicit(&slots[offset], fiber, memory_order_release);
+    atomic_fetch_add_explicit(&fibers->liveCount, 1, memory_order_relaxed);
+}
+
+void mochiRemoveFiber(MochiVM* vm, ObjFiber* fiber) {
+    FiberRegistry* fibers = &vm->fibers;
+    int32_t index = fiber->registryIndex;
+    ASSERT(index >= 0, "Tried to remove a fiber that is not registered.");
+    fiber->registryIndex = -1;
+
+    int32_t offset;
+    int chunk = fiberChunk(index, &offset);
+    _Atomic(ObjFiber*)* slots = atomic_load_explicit(&fibers->chunks[chunk], memory_order_acquire);
+    atomic_store_explicit(&slots[offset], NULL, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&fibers->liveCount, 1, memory_order_relaxed);
+
+    _Atomic(int32_t)* next = &fiberChunkNext(fibers, chunk, slots)[offset];
+    uint64_t top = atomic_load_explicit(&fibers->freeTop, memory_order_relaxed);
+    uint64_t freed;
+    do {
+        atomic_store_explicit(next, (int32_t)(uint32_t)top, memory_order_relaxed);
+        freed = (((top >> 32) + 1) << 32) | (uint32_t)(index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&fibers->freeTop, &top, freed, memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+void mochiResetFibers(MochiVM* vm) {
+    FiberRegistry* fibers = &vm->fibers;
+    for (int32_t index = 0; index < fibers->count; index++) {
+        int32_t offset;
+        int chunk = fiberChunk(index, &offset);
+        ObjFiber* fiber = fibers->chunks[chunk][offset];
+        if (fiber != NULL) {
+            fiber->registryIndex = -1;
+            fibers->chunks[chunk][offset] = NULL;
         }
     }
+    fibers->count = 0;
+    fibers->liveCount = 0;
+    fibers->freeTop = 0;
 }
 
-static int mochiFiberThread(void* resume) {
-    struct NewThread* thread = resume;
-    MochiVM* vm = thread->vm;
-    ObjFiber* fiber = thread->fiber;
-    DEALLOCATE(vm, thread);
-
-    int res = mochiInterpret(vm, fiber);
-    removeFiberFromVM(vm, fiber);
-    return res;
-}
-
-static void startThread(MochiVM* vm, ObjFiber* caller, ObjFiber* new) {
-    addFiberToVM(vm, new);
-    struct NewThread* threadMeta = ALLOCATE(vm, struct NewThread);
-    threadMeta->vm = vm;
-    threadMeta->fiber = new;
-
-    // Now that we're all setup, create the new thread
-    int threadStatus = thrd_create(&new->thread, mochiFiberThread, threadMeta);
-    if (threadStatus != 0) {
-        // Thread creation failed, clean up.
-        removeFiberFromVM(vm, new);
-        DEALLOCATE(vm, threadMeta);
-    }
-    mochiFiberPushValue(caller, I32_VAL(vm, threadStatus));
+// Spawning only allocates the fiber, which is queued on the current worker. The spawn status is
+// kept on the caller's stack for code written against the one thread per fiber model, and is
+// always thrd_success.
+static void startFiber(MochiVM* vm, ObjFiber* caller, ObjFiber* new) {
+    mochiAddFiber(vm, new);
+    mochiSchedulerSpawn(vm, new);
+    mochiFiberPushValue(caller, I32_VAL(vm, thrd_success));
 }
 
 void mochiSpawnCall(MochiVM* vm, ObjFiber* caller, int codeStart) {
@@ -457,54 +661,72 @@ void mochiSpawnCall(MochiVM* vm, ObjFiber* caller, int codeStart) {
     fib->caller = caller;
     mochiFiberPushValue(caller, OBJ_VAL(fib));
 
-    startThread(vm, caller, fib);
+    startFiber(vm, caller, fib);
 }
 
 void mochiSpawnCallWith(MochiVM* vm, ObjFiber* caller, int codeStart, int valueConsume) {
-    ObjFiber* fib = mochiNewFiber(vm, vm->code.data + codeStart, NULL, 0);
+    // the consumed values stay on the calling fiber until they are copied, keeping them alive, and
+    // keep the same order on the new fiber
+    ObjFiber* fib =
+        mochiNewFiber(vm, vm->code.data + codeStart, caller->valueStackTop - valueConsume, valueConsume);
     fib->caller = caller;
-    mochiFiberPushValue(caller, OBJ_VAL(fib));
-
-    // going from valueConsume down ensures the order on the new thread is the same as on the calling thread
-    for (int i = valueConsume; i > 0; i--) {
-        mochiFiberPushValue(fib, mochiFiberPeekValue(caller, i));
-    }
     mochiFiberDropValues(caller, valueConsume);
+    mochiFiberPushValue(caller, OBJ_VAL(fib));
 
-    startThread(vm, caller, fib);
+    startFiber(vm, caller, fib);
 }
 
+// The copy continues after the spawn just as the caller does, so it gets the same two values, with
+// itself in place of the new fiber. Either can tell which it is by comparing that with the current
+// fiber.
 void mochiSpawnCopy(MochiVM* vm, ObjFiber* caller) {
     ObjFiber* fib = mochiFiberClone(vm, caller);
     fib->caller = caller;
+    mochiFiberPushValue(fib, OBJ_VAL(fib));
+    mochiFiberPushValue(fib, I32_VAL(vm, thrd_success));
     mochiFiberPushValue(caller, OBJ_VAL(fib));
 
-    startThread(vm, caller, fib);
+    startFiber(vm, caller, fib);
+}
+
+void mochiSpawnParPart(MochiVM* vm, ObjFiber* caller, Value* values, int valueCount) {
+    ObjFiber* fib = mochiNewFiber(vm, caller->ip, values, valueCount);
+    fib->caller = caller;
+    fib->isParTask = true;
+    mochiAddFiber(vm, fib);
+    mochiSchedulerSpawn(vm, fib);
+}
+
+bool mochiParPartDone(MochiVM* vm, ObjFiber* part, bool failed) {
+    ObjFiber* waiting = part->caller;
+    part->isParTask = false;
+    // The result is written before the count goes down, so the waiting fiber sees it once woken.
+    if (failed && !atomic_exchange(&waiting->parFailed, true)) {
+        waiting->parResult = part->result;
+    }
+    return atomic_fetch_sub(&waiting->parRemaining, 1) == 1;
 }
 
 ObjFiber* mochiThreadCurrent(MochiVM* vm) {
-    thrd_t current = thrd_current();
-    for (int i = 0; i < vm->fibers.count; i++) {
-        if (vm->fibers.data[i] != NULL && thrd_equal(current, vm->fibers.data[i]->thread)) {
-            return vm->fibers.data[i];
-        }
+    Worker* worker = mochiWorkerCurrent(vm);
+    if (worker == NULL || worker->fiber == NULL) {
+        PANIC("Current thread is not a MochiVM thread, but tried to be accessed as one.");
     }
-    PANIC("Current thread is not a MochiVM thread, but tried to be accessed as one.");
-    return NULL;
+    return worker->fiber;
 }
 
 size_t mochiThreadCount(MochiVM* vm) {
-    size_t count = 0;
-    for (int i = 0; i < vm->fibers.count; i++) {
-        count += vm->fibers.data[i] == NULL ? 0 : 1;
-    }
-    return count;
+    return (size_t)atomic_load_explicit(&vm->fibers.liveCount, memory_order_relaxed);
 }
 
 void mochiGrayObj(MochiVM* vm, Obj* obj) {
     if (obj == NULL)
         return;
 
+    // List cells live inside the chunk that holds them, which is what the collector tracks.
+    if (obj->type == OBJ_LIST)
+        obj = (Obj*)LIST_CHUNK((ObjList*)obj);
+
     // Stop if the object is already darkened so we don't get stuck in a cycle.
     if (obj->isMarked)
         return;
@@ -602,6 +824,10 @@ static void markFiber(MochiVM* vm, ObjFiber* fiber) {
         mochiGrayObj(vm, (Obj*)*slot);
     }
 
+    // Values and frames shared with copies of the fiber.
+    mochiGrayObj(vm, (Obj*)fiber->sharedValues);
+    mochiGrayObj(vm, (Obj*)fiber->sharedFrames);
+
     // Root stack.
     for (Obj** slot = fiber->rootStack; slot < fiber->rootStackTop; slot++) {
         mochiGrayObj(vm, *slot);
@@ -611,9 +837,9 @@ static void markFiber(MochiVM* vm, ObjFiber* fiber) {
     mochiGrayObj(vm, (Obj*)fiber->caller);
 
     vm->bytesAllocated += sizeof(ObjFiber);
-    vm->bytesAllocated += vm->config.frameStackCapacity * sizeof(ObjVarFrame*);
-    vm->bytesAllocated += vm->config.valueStackCapacity * sizeof(Value);
-    vm->bytesAllocated += vm->config.rootStackCapacity * sizeof(Obj*);
+    vm->bytesAllocated += (fiber->frameStackEnd - fiber->frameStack) * sizeof(ObjVarFrame*);
+    vm->bytesAllocated += (fiber->valueStackEnd - fiber->valueStack) * sizeof(Value);
+    vm->bytesAllocated += (fiber->rootStackEnd - fiber->rootStack) * sizeof(Obj*);
 }
 
 static void markForeign(MochiVM* vm, ObjForeign* foreign) {
@@ -621,11 +847,14 @@ static void markForeign(MochiVM* vm, ObjForeign* foreign) {
     vm->bytesAllocated += sizeof(uint8_t) * foreign->dataCount;
 }
 
-static void markList(MochiVM* vm, ObjList* list) {
-    mochiGrayValue(vm, list->elem);
-    mochiGrayObj(vm, (Obj*)list->next);
+static void markListChunk(MochiVM* vm, ObjListChunk* chunk) {
+    int used = atomic_load(&chunk->used);
+    for (int i = 0; i < used; i++) {
+        mochiGrayValue(vm, chunk->cells[i].elem);
+    }
+    mochiGrayObj(vm, (Obj*)chunk->next);
 
-    vm->bytesAllocated += sizeof(ObjList);
+    vm->bytesAllocated += sizeof(ObjListChunk) + sizeof(ObjList) * chunk->capacity;
 }
 
 static void markArray(MochiVM* vm, ObjArray* arr) {
@@ -646,16 +875,112 @@ static void markByteSlice(MochiVM* vm, ObjByteSlice* slice) {
     vm->bytesAllocated += sizeof(ObjByteSlice);
 }
 
-static void markRef(MochiVM* vm, ObjRef* ref) {
-    // TODO: investigate iterating over the table itself to gray set values, determine if performance
-    // benefit/degradation
-    Value val;
-    if (mochiTableGet(&vm->heap, ref->ptr, &val)) {
-        mochiGrayValue(vm, val);
-    } else {
-        ASSERT(false, "Ref does not point to a heap slot.");
+static void markStackSegment(MochiVM* vm, ObjStackSegment* segment) {
+    // A fiber may see only part of a segment, but all of it is kept for the fibers that see more.
+    mochiGrayObj(vm, (Obj*)segment->below);
+    for (int i = 0; i < segment->count; i++) {
+        if (segment->holdsFrames) {
+            mochiGrayObj(vm, (Obj*)segment->frames[i]);
+        } else {
+            mochiGrayValue(vm, segment->values[i]);
+        }
+    }
+
+    vm->bytesAllocated += sizeof(ObjStackSegment);
+    vm->bytesAllocated += segment->capacity * (segment->holdsFrames ? sizeof(ObjVarFrame*) : sizeof(Value));
+}
+
+static void markRope(MochiVM* vm, ObjRope* rope) {
+    ObjByteArray* flat = atomic_load_explicit(&rope->flat, memory_order_relaxed);
+    if (flat != NULL) {
+        // Every worker is paused, so no thread is still copying from the halves of a rope
+        // flattened since the last collection, and they can be let go.
+        rope->left = NULL;
+        rope->right = NULL;
     }
+    mochiGrayObj(vm, rope->left);
+    mochiGrayObj(vm, rope->right);
+    mochiGrayObj(vm, (Obj*)flat);
 
+    vm->bytesAllocated += sizeof(ObjRope);
+}
+
+static void markVector(MochiVM* vm, ObjVector* vector) {
+    mochiGrayObj(vm, (Obj*)vector->root);
+
+    vm->bytesAllocated += sizeof(ObjVector);
+}
+
+static void markNumArray(MochiVM* vm, ObjNumArray* array) {
+    mochiGrayObj(vm, (Obj*)array->source);
+
+    vm->bytesAllocated += sizeof(ObjNumArray);
+    if (array->source == NULL) {
+        vm->bytesAllocated += (size_t)array->count * mochiNumElemSize(array->elemType);
+    }
+}
+
+static void markWaiters(MochiVM* vm, ChannelWaiters* waiters) {
+    for (int i = 0; i < waiters->count; i++) {
+        mochiGrayObj(vm, (Obj*)waiters->fibers[i].fiber);
+    }
+}
+
+static void markChannel(MochiVM* vm, ObjChannel* channel) {
+    // Values sent but not yet received.
+    if (channel->capacity > 0) {
+        for (uint64_t position = channel->receivePosition; position < channel->sendPosition; position++) {
+            ChannelSlot* slot = &channel->slots[position % channel->capacity];
+            if (slot->sequence == position + 1) {
+                mochiGrayValue(vm, slot->value);
+            }
+        }
+    }
+    for (ChannelSegment* segment = channel->head; segment != NULL; segment = segment->next) {
+        int64_t end = segment->tail < MOCHIVM_CHANNEL_SEGMENT_SIZE ? segment->tail : MOCHIVM_CHANNEL_SEGMENT_SIZE;
+        for (int64_t i = segment->head; i < end; i++) {
+            if (segment->slots[i].sequence != 0) {
+                mochiGrayValue(vm, segment->slots[i].value);
+            }
+        }
+        vm->bytesAllocated += sizeof(ChannelSegment);
+    }
+
+    // Every fiber is stopped, so none can still be reading a retired segment.
+    ChannelSegment* retired = channel->retired;
+    channel->retired = NULL;
+    while (retired != NULL) {
+        ChannelSegment* next = retired->retired;
+        DEALLOCATE(vm, retired);
+        retired = next;
+    }
+
+    // A fiber may be left listed after being woken through another channel, and after finishing.
+    markWaiters(vm, &channel->senders);
+    markWaiters(vm, &channel->receivers);
+
+    vm->bytesAllocated += sizeof(ObjChannel) + sizeof(ChannelSlot) * channel->capacity;
+}
+
+// The fibers awaiting the promise are all registered, so only its value needs marking.
+static void markPromise(MochiVM* vm, ObjPromise* promise) {
+    mochiGrayValue(vm, promise->value);
+    vm->bytesAllocated += sizeof(ObjPromise);
+}
+
+static void markVectorNode(MochiVM* vm, ObjVectorNode* node) {
+    for (int i = 0; i < node->count; i++) {
+        mochiGrayValue(vm, node->slots[i]);
+    }
+
+    vm->bytesAllocated += sizeof(ObjVectorNode) + sizeof(Value) * node->count;
+    if (node->sizes != NULL) {
+        vm->bytesAllocated += sizeof(int) * node->count;
+    }
+}
+
+static void markRef(MochiVM* vm, ObjRef* ref) {
+    mochiGrayValue(vm, mochiRefGet(ref));
     vm->bytesAllocated += sizeof(ObjRef);
 }
 
@@ -668,12 +993,33 @@ static void markStruct(MochiVM* vm, ObjStruct* stru) {
 }
 
 static void markRecord(MochiVM* vm, ObjRecord* rec) {
-    for (size_t i = 0; i < rec->count; i++) {
-        mochiGrayValue(vm, rec->fields[i].value);
+    if (rec->shape == NULL) {
+        mochiGrayObj(vm, (Obj*)rec->trie);
+        vm->bytesAllocated += sizeof(ObjRecord);
+        return;
+    }
+
+    for (int i = 0; i < rec->shape->count; i++) {
+        mochiGrayValue(vm, rec->values[i]);
     }
 
     vm->bytesAllocated += sizeof(ObjRecord);
-    vm->bytesAllocated += sizeof(TableEntry) * rec->count;
+    vm->bytesAllocated += sizeof(Value) * rec->shape->count;
+}
+
+static void markRecordNode(MochiVM* vm, ObjRecordNode* node) {
+    for (int i = 0; i < node->count; i++) {
+        RecordTrieEntry* entry = &node->entries[i];
+        if (entry->node != NULL) {
+            mochiGrayObj(vm, (Obj*)entry->node);
+        } else {
+            mochiGrayValue(vm, entry->value);
+            mochiGrayObj(vm, (Obj*)entry->shadowed);
+        }
+    }
+
+    vm->bytesAllocated += sizeof(ObjRecordNode);
+    vm->bytesAllocated += sizeof(RecordTrieEntry) * node->count;
 }
 
 static void markVariant(MochiVM* vm, ObjVariant* var) {
@@ -731,7 +1077,10 @@ static void blackenObject(MochiVM* vm, Obj* obj) {
         MARK_SIMPLE(vm, ObjCPointer);
         break;
     case OBJ_LIST:
-        markList(vm, (ObjList*)obj);
+        // Cells are never grayed themselves, only their chunks.
+        break;
+    case OBJ_LIST_CHUNK:
+        markListChunk(vm, (ObjListChunk*)obj);
         break;
     case OBJ_FOREIGN_RESUME:
         markForeignResume(vm, (ForeignResume*)obj);
@@ -760,6 +1109,30 @@ static void blackenObject(MochiVM* vm, Obj* obj) {
     case OBJ_VARIANT:
         markVariant(vm, (ObjVariant*)obj);
         break;
+    case OBJ_RECORD_NODE:
+        markRecordNode(vm, (ObjRecordNode*)obj);
+        break;
+    case OBJ_ROPE:
+        markRope(vm, (ObjRope*)obj);
+        break;
+    case OBJ_VECTOR:
+        markVector(vm, (ObjVector*)obj);
+        break;
+    case OBJ_VECTOR_NODE:
+        markVectorNode(vm, (ObjVectorNode*)obj);
+        break;
+    case OBJ_NUM_ARRAY:
+        markNumArray(vm, (ObjNumArray*)obj);
+        break;
+    case OBJ_CHANNEL:
+        markChannel(vm, (ObjChannel*)obj);
+        break;
+    case OBJ_PROMISE:
+        markPromise(vm, (ObjPromise*)obj);
+        break;
+    case OBJ_STACK_SEGMENT:
+        markStackSegment(vm, (ObjStackSegment*)obj);
+        break;
     }
 }
 
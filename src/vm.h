@@ -2,6 +2,7 @@
 #define mochivm_vm_h
 
 #include "object.h"
+#include "scheduler.h"
 #include <threads.h>
 
 typedef enum
@@ -18,31 +19,137 @@ typedef enum
 #define MOCHIVM_MAX_CALL_FRAME_SLOTS 65535
 #define MOCHIVM_MAX_MARK_FRAME_SLOTS 256
 
+// Source line information is stored as runs rather than per code byte. Each entry
+// marks the code index at which a new run of bytes from a single line begins, and
+// the run extends until the start of the next entry.
+typedef struct {
+    int start;
+    int line;
+} LineRun;
+
+// The kinds of constant the constant pool can hold. Values do not carry their type in
+// every representation, so the kind of each constant is recorded as it is written to
+// allow the pool to be saved in a module.
+typedef enum
+{
+    CONST_KIND_I32,
+    CONST_KIND_SINGLE,
+    CONST_KIND_DOUBLE,
+    CONST_KIND_STRING,
+    CONST_KIND_OBJ
+} ConstantKind;
+
+// The number of inline caches shared by the record instructions. Each instruction uses the
+// cache at its code offset modulo this size.
+#define MOCHIVM_RECORD_CACHE_SIZE 1024
+
+// An inline cache for a record instruction, remembering the slot its field was found at in the
+// last record shape it saw. Instructions that share a cache, or fibers that write the same cache
+// at once, can leave a stale or mismatched entry, so the slot is checked against the shape
+// before it is used.
+typedef struct {
+    RecordShape* shape;
+    int slot;
+} RecordCache;
+
 DECLARE_BUFFER(ForeignFunction, MochiVMForeignMethodFn);
-DECLARE_BUFFER(Fiber, ObjFiber*);
+DECLARE_BUFFER(LineRun, LineRun);
+
+// The slots of the fiber registry come in chunks that never move once allocated, so workers can
+// register and remove fibers without a lock while others do the same. The first chunk holds
+// [MOCHIVM_FIBER_CHUNK_SIZE] slots and each chunk after it twice as many as the one before.
+#define MOCHIVM_FIBER_CHUNK_SIZE 64
+#define MOCHIVM_FIBER_CHUNKS     25
+
+// The room left on the value and frame stacks of a fiber beyond what the verifier computed it needs
+// before the next stack check. It covers the frame a call pushes after its check, and the values
+// and frames a foreign function may push onto the fiber that called it without reserving room.
+#define MOCHIVM_STACK_RESERVE MOCHIVM_FOREIGN_STACK_ROOM
+
+// Parallel array instructions split their elements into parts of at least [MOCHIVM_PAR_MIN_PART]
+// elements, and no more parts than [MOCHIVM_PAR_PARTS_PER_WORKER] for each worker, so a worker
+// that finishes early can steal the part of one that is running behind.
+#define MOCHIVM_PAR_MIN_PART         64
+#define MOCHIVM_PAR_PARTS_PER_WORKER 4
+
+// Every fiber that has not finished, and the main fiber of the last run, which is always in the
+// first slot. Slots freed by finished fibers are kept on a stack, linked through [next], and given
+// to new fibers before any unused slot is handed out. The top of the stack is a slot index plus
+// one in the low half, with a count of changes in the high half so a slot taken and freed again
+// between a worker reading the top and swapping it does not go unnoticed.
+typedef struct {
+    // The first chunk, held inline.
+    _Atomic(ObjFiber*) data[MOCHIVM_FIBER_CHUNK_SIZE];
+    _Atomic(int32_t) firstNext[MOCHIVM_FIBER_CHUNK_SIZE];
+
+    // The slots of each chunk, followed in the same allocation by their links in the free stack.
+    _Atomic(_Atomic(ObjFiber*)*) chunks[MOCHIVM_FIBER_CHUNKS];
+
+    // The number of slots ever handed out, which are all below this index.
+    _Atomic(int32_t) count;
+    _Atomic(int32_t) liveCount;
+    _Atomic(uint64_t) freeTop;
+} FiberRegistry;
+
+typedef struct {
+    Value* values;
+    ObjVarFrame** frames;
+    Obj** roots;
+    int valueCapacity;
+    int frameCapacity;
+    int rootCapacity;
+} FiberStacks;
+
+// Finished fibers give their stacks to the pool, and fiber objects freed by the collector are kept
+// in it, so new fibers can take both rather than allocating them. Holds at most the configured
+// number of each. Pooled objects are linked through [next], and are not on the object list.
+typedef struct {
+    mtx_t lock;
+    FiberStacks* stacks;
+    int stackCount;
+    Obj* objects;
+    int objectCount;
+} FiberPool;
 
 struct MochiVM {
     MochiVMConfiguration config;
 
     // Byte code and other buffers used for operation and disassembly.
     ByteBuffer code;
-    IntBuffer lines;
+    LineRunBuffer lines;
     ValueBuffer constants;
+    ByteBuffer constantKinds;
     IntBuffer labelIndices;
     ValueBuffer labels;
 
-    FiberBuffer fibers;
+    FiberRegistry fibers;
+    FiberPool fiberPool;
+    Scheduler scheduler;
+
+    // Refs restored from a snapshot. Nothing in the new VM refers to them, so they are kept
+    // alive as roots for the life of the VM.
+    ValueBuffer snapshotRefs;
 
-    // Shared mutable state among threads. Operations on the store are done using
-    // reference values, which change the values stored in the table non-immutably.
-    // TODO: rename this, it's more like a stateful value store, maybe just 'store'
-    Table heap;
-    TableKey nextHeapKey;
+    // Promises not yet settled, linked through [nextPending] and kept alive as roots until they
+    // settle. Guarded by the scheduler lock.
+    ObjPromise* pendingPromises;
+
+    // The interned record shapes, in an open addressed table of [shapeCapacity] slots.
+    RecordShape** shapes;
+    int shapeCount;
+    int shapeCapacity;
+    RecordShape* emptyShape;
+    mtx_t shapeLock;
+
+    RecordCache recordCaches[MOCHIVM_RECORD_CACHE_SIZE];
 
     // Memory management data:
 
     // Is the garbage collector currently running? Simple stop the world assumed.
     _Atomic(bool) collecting;
+    // While above zero, allocation does not start a collection. Lets the VM build a structure
+    // from several allocations before any of them is reachable from a root.
+    _Atomic(int) collectionDeferrals;
     // Provide a way to lock allocation so multiple threads don't start a GC pass simultaneously.
     mtx_t allocLock;
 
@@ -52,6 +159,11 @@ struct MochiVM {
     // were freed since the last GC.
     size_t bytesAllocated;
 
+    // The number of new blocks of memory requested since the VM was created. Resizing or freeing
+    // a block does not count. Lets benchmarks and tests see how many allocations a piece of code
+    // makes, independent of how often the collector runs.
+    uint64_t allocations;
+
     // The number of total allocated bytes that will trigger the next GC.
     size_t nextGC;
 
@@ -66,6 +178,34 @@ struct MochiVM {
 
     // The buffer of foreign function pointers the VM knows about.
     ForeignFunctionBuffer foreignFns;
+    // The symbol name of each foreign function, or a NULL object if it was added without one.
+    ValueBuffer foreignNames;
+
+    // The file mapping backing the code buffer when the code was loaded from a module,
+    // or NULL if the code buffer was written by the embedder.
+    void* moduleMapping;
+    size_t moduleMappingSize;
+
+    // Whether the code buffer has passed verification since it was last written to.
+    bool verified;
+    // The stack capacities given to new fibers. These start as the configured
+    // capacities, and are narrowed to the exact depths the verifier computed when
+    // the code has bounded stack usage. Otherwise the value and frame stacks start
+    // small and grow as needed, up to the configured capacities.
+    int valueStackCapacity;
+    int frameStackCapacity;
+    int rootStackCapacity;
+    // The room the interpreter makes sure a fiber has on its value and frame stacks
+    // whenever it enters or returns to a function, jumps backwards, or resumes. The
+    // verifier computes these for code with unbounded stack usage, and they are zero
+    // when the fiber stacks are sized exactly.
+    int valueStackHeadroom;
+    int frameStackHeadroom;
+    // The most values and frames any stretch of code between two stack checks reaches below the
+    // depth it started at. A fiber sharing the bottom of its stacks with fibers it was copied from
+    // or to copies at least this many up from them at each check.
+    int valueStackFloor;
+    int frameStackFloor;
 };
 
 bool mochiHasPermission(MochiVM* vm, int permissionId);
@@ -73,6 +213,26 @@ bool mochiRequestPermission(MochiVM* vm, int permissionId);
 bool mochiRequestAllPermissions(MochiVM* vm, int permissionGroup);
 void mochiRevokePermission(MochiVM* vm, int permissionId);
 
+// Releases the file mapping of a loaded module. If [keepCode] is true, the mapped code is
+// first copied into a code buffer owned by the VM so that it can be written to.
+void mochiReleaseModule(MochiVM* vm, bool keepCode);
+
+// Adds [fiber] to the fibers of the VM, which the collector treats as roots, and removes it once
+// it has finished. Both take constant time, and are safe to call from any number of workers at
+// once.
+void mochiAddFiber(MochiVM* vm, ObjFiber* fiber);
+void mochiRemoveFiber(MochiVM* vm, ObjFiber* fiber);
+
+// Empties the fiber registry, keeping the chunks it has allocated. Only safe while no fiber runs.
+void mochiResetFibers(MochiVM* vm);
+
+// Starts a fiber running one part of the parallel array instruction [caller] is at, with
+// [values] on its stack.
+void mochiSpawnParPart(MochiVM* vm, ObjFiber* caller, Value* values, int valueCount);
+// Records that [part] of a parallel array instruction has finished, or failed and stopped early,
+// returning whether it was the last part still running.
+bool mochiParPartDone(MochiVM* vm, ObjFiber* part, bool failed);
+
 // Mark [obj] as reachable and still in use. This should only be called
 // during the sweep phase of a garbage collection.
 void mochiGrayObj(MochiVM* vm, Obj* obj);
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -24,10 +25,15 @@ static ObjCallFrame* callClosureFrame(MochiVM* vm, ObjFiber* fiber, ObjClosure*
                                       ObjContinuation* cont, uint8_t* after) {
     ASSERT(mochiFiberValueCount(fiber) >= capture->paramCount,
            "Not enough values on the value stack to call the closure.");
+    // The parameters may still be shared with copies of the fiber.
+    mochiFiberReach(vm, fiber, capture->paramCount, 0);
 
     int varCount = (cont != NULL ? 1 : 0) + capture->paramCount + capture->capturedCount +
                    (frameVars != NULL ? frameVars->slotCount : 0);
+    // Both allocations come before the parameters leave the stack, since nothing else keeps them
+    // alive until the frame is pushed.
     Value* vars = ALLOCATE_ARRAY(vm, Value, varCount);
+    ObjCallFrame* frame = newCallFrame(vars, varCount, after, vm);
 
     int offset = 0;
     if (cont != NULL) {
@@ -45,7 +51,7 @@ static ObjCallFrame* callClosureFrame(MochiVM* vm, ObjFiber* fiber, ObjClosure*
         offset += frameVars->slotCount;
     }
     valueArrayCopy(vars + offset, capture->captured, capture->capturedCount);
-    return newCallFrame(vars, varCount, after, vm);
+    return frame;
 }
 
 // Walk the frame stack backwards looking for a handle frame with the given
@@ -98,10 +104,104 @@ static void restoreSaved(MochiVM* vm, ObjFiber* fiber, ObjHandleFrame* handle, O
     fiber->frameStackTop = fiber->frameStackTop + (cont->savedFramesCount - 1);
 }
 
+// Finds the slot of [field] in [shape] through the inline cache of a record instruction,
+// filling the cache from the shape when it was last used with a different one.
+static inline int cachedRecordSlot(RecordCache* cache, RecordShape* shape, TableKey field) {
+    int slot = cache->slot;
+    // The slot must also hold the first occurrence of a label that has been added more than once.
+    if (cache->shape == shape && slot < shape->count && shape->keys[slot] == field &&
+        (slot == 0 || shape->keys[slot - 1] != field)) {
+        return slot;
+    }
+    slot = mochiShapeSlot(shape, field);
+    ASSERT(slot >= 0, "Record does not contain the field.");
+    cache->shape = shape;
+    cache->slot = slot;
+    return slot;
+}
+
+// The number of elements in the array or slice a parallel array instruction runs over.
+static int parLength(Value source) {
+    if (OBJ_TYPE(source) == OBJ_SLICE) {
+        return mochiSliceLength(AS_SLICE(source));
+    }
+    return mochiArrayLength(AS_ARRAY(source));
+}
+
+static Value parElement(Value source, int index) {
+    if (OBJ_TYPE(source) == OBJ_SLICE) {
+        return mochiSliceGetAt(index, AS_SLICE(source));
+    }
+    return mochiArrayGetAt(index, AS_ARRAY(source));
+}
+
+static int parPartCount(MochiVM* vm, int length) {
+    int parts = (length + MOCHIVM_PAR_MIN_PART - 1) / MOCHIVM_PAR_MIN_PART;
+    int most = vm->scheduler.workerCount * MOCHIVM_PAR_PARTS_PER_WORKER;
+    return parts < most ? parts : most;
+}
+
+// Splits the [length] elements of the source at the bottom of [shared] into [parts], starts a
+// fiber at the current instruction for each, and suspends [fiber] until they have all finished.
+// Each part starts with the three [shared] values, its part number and the range of elements it
+// covers, and for a reduction the first of those elements as the value accumulated so far.
+static void startParParts(MochiVM* vm, ObjFiber* fiber, Value* shared, int length, int parts, bool reduce) {
+    fiber->isParWaiting = true;
+    atomic_store(&fiber->parFailed, false);
+    atomic_store(&fiber->parRemaining, parts);
+    // Suspended before any part starts, so the last part to finish cannot resume it too early.
+    fiber->isSuspended = true;
+    for (int part = 0; part < parts; part++) {
+        int start = (int)((int64_t)length * part / parts);
+        int end = (int)((int64_t)length * (part + 1) / parts);
+        Value values[7] = { shared[0], shared[1], shared[2], I32_VAL(vm, part), I32_VAL(vm, start), I32_VAL(vm, end) };
+        if (reduce) {
+            values[4] = I32_VAL(vm, start + 1);
+            values[6] = parElement(shared[0], start);
+        }
+        mochiSpawnParPart(vm, fiber, values, reduce ? 7 : 6);
+    }
+}
+
+// Calls [closure] on the arguments at the top of the stack of a part of a parallel array
+// instruction, returning to the instruction once it is done.
+static void callParClosure(MochiVM* vm, ObjFiber* fiber, ObjClosure* closure) {
+    ObjCallFrame* frame = callClosureFrame(vm, fiber, closure, NULL, NULL, fiber->ip - 1);
+    mochiFiberPushFrame(fiber, (ObjVarFrame*)frame);
+    fiber->ip = closure->funcLocation;
+}
+
+// Finishes a part of a parallel array instruction, resuming the fiber waiting on it if this was
+// the [last] part still running.
+static int finishParPart(MochiVM* vm, ObjFiber* fiber, bool last) {
+    fiber->valueStackTop = fiber->valueStack;
+    fiber->sharedValues = NULL;
+    fiber->sharedValueCount = 0;
+    fiber->result = 0;
+    fiber->state = FIBER_DONE;
+    if (last) {
+        mochiSchedulerResume(vm, fiber->caller);
+    }
+    return 0;
+}
+
+// Reports that [fiber] needs more stack than the VM allows, and finishes it.
+static int stackOverflow(MochiVM* vm, ObjFiber* fiber) {
+    if (vm->config.errorFn != NULL) {
+        int line = mochiGetLine(vm, (int)(fiber->ip - vm->code.data) - 1);
+        vm->config.errorFn(vm, NULL, line, "Fiber stack overflow.");
+    }
+    fiber->result = MOCHIVM_STACK_OVERFLOW;
+    fiber->state = FIBER_DONE;
+    return MOCHIVM_STACK_OVERFLOW;
+}
+
 // Dispatcher function to run a particular fiber in the context of the given
 // vm.
 static int run(MochiVM* vm, register ObjFiber* fiber) {
     register uint8_t* codeStart = vm->code.data;
+    Worker* worker = mochiWorkerCurrent(vm);
+    int sliceLeft = MOCHIVM_SCHEDULER_SLICE;
 
 #define FROM_START(offset) (codeStart + (int)(offset))
 
@@ -109,15 +209,40 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
 #define POP_VAL()        (*(--fiber->valueStackTop))
 #define DROP_VALS(count) (fiber->valueStackTop = fiber->valueStackTop - (count))
 #define PEEK_VAL(index)  (*(fiber->valueStackTop - (index)))
-#define VALUE_COUNT()    (fiber->valueStackTop - fiber->valueStack)
+#define VALUE_COUNT()    ((int)mochiFiberValueCount(fiber))
 
 #define PUSH_FRAME(frame)  (*fiber->frameStackTop++ = (ObjVarFrame*)(frame))
 #define POP_FRAME()        (*(--fiber->frameStackTop))
 #define DROP_FRAMES(count) (fiber->frameStackTop = fiber->frameStackTop - (count))
 #define PEEK_FRAME(index)  (*(fiber->frameStackTop - (index)))
-#define FRAME_COUNT()      (fiber->frameStackTop - fiber->frameStack)
+#define FRAME_COUNT()      ((int)mochiFiberFrameCount(fiber))
 #define FIND_VAL(frame, slot)  ((*(fiber->frameStackTop - 1 - (frame)))->slots[(slot)])
 
+// Pushes are not checked one by one. Instead the stacks are grown to the headroom the verifier
+// computed wherever a new stretch of code starts, along with room for [values] and [frames] that
+// an instruction with a dynamic stack effect is about to push. A fiber sharing the bottom of its
+// stacks also copies up values and frames from there until it has the floors the verifier found.
+#define ENSURE_STACKS(values, frames)                                                                                  \
+    do {                                                                                                               \
+        if (fiber->valueStackEnd - fiber->valueStackTop < vm->valueStackHeadroom + (values) ||                         \
+            fiber->frameStackEnd - fiber->frameStackTop < vm->frameStackHeadroom + (frames) ||                         \
+            (fiber->sharedValues != NULL && fiber->valueStackTop - fiber->valueStack < vm->valueStackFloor) ||         \
+            (fiber->sharedFrames != NULL && fiber->frameStackTop - fiber->frameStack < vm->frameStackFloor)) {         \
+            if (!mochiFiberReserve(vm, fiber, vm->valueStackHeadroom + (values), vm->frameStackHeadroom + (frames))) { \
+                return stackOverflow(vm, fiber);                                                                       \
+            }                                                                                                          \
+        }                                                                                                              \
+    } while (false)
+// Forward jumps stay within the stretch of code the last check covered, but backward ones do not.
+#define JUMP_TO(target)                                                                                                \
+    do {                                                                                                               \
+        uint8_t* jumpTarget = (target);                                                                                \
+        if (jumpTarget < fiber->ip) {                                                                                  \
+            ENSURE_STACKS(0, 0);                                                                                       \
+        }                                                                                                              \
+        fiber->ip = jumpTarget;                                                                                        \
+    } while (false)
+
 #define READ_BYTE()   (*fiber->ip++)
 #define READ_SHORT()  (fiber->ip += 2, (int16_t)((fiber->ip[-2] << 8) | fiber->ip[-1]))
 #define READ_USHORT() (fiber->ip += 2, (uint16_t)((fiber->ip[-2] << 8) | fiber->ip[-1]))
@@ -126,6 +251,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
 #define READ_UINT()                                                                                                    \
     (fiber->ip += 4, (uint32_t)((fiber->ip[-4] << 24) | (fiber->ip[-3] << 16) | (fiber->ip[-2] << 8) | fiber->ip[-1]))
 #define READ_CONSTANT() (vm->constants.data[READ_USHORT()])
+#define RECORD_CACHE()  (&vm->recordCaches[(fiber->ip - codeStart) & (MOCHIVM_RECORD_CACHE_SIZE - 1)])
 #define UNARY_OP(paramType, paramExtract, retConstruct, op)                                                            \
     do {                                                                                                               \
         paramType n = paramExtract(POP_VAL());                                                                         \
@@ -142,6 +268,46 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         paramType a = paramExtract(POP_VAL());                                                                         \
         PUSH_VAL(I8_VAL(vm, (a > 0) - (a < 0)));                                                                       \
     } while (false)
+// Compare-and-branch instructions fuse a comparison with the following conditional
+// jump, so that no intermediate boolean is pushed to and popped from the value stack.
+// The operands are consumed in the same order as the non-branching comparisons.
+#define BRANCH_OP(paramType, paramExtract, op, target)                                                                 \
+    do {                                                                                                               \
+        paramType a = paramExtract(POP_VAL());                                                                         \
+        paramType b = paramExtract(POP_VAL());                                                                         \
+        if (a op b) {                                                                                                  \
+            JUMP_TO(target);                                                                                           \
+        }                                                                                                              \
+    } while (false)
+#define INT_BRANCH_OP(type, op, target)                                                                                \
+    do {                                                                                                               \
+        switch (type) {                                                                                                \
+        case VAL_I8:                                                                                                   \
+            BRANCH_OP(int8_t, AS_I8, op, target);                                                                      \
+            break;                                                                                                     \
+        case VAL_U8:                                                                                                   \
+            BRANCH_OP(uint8_t, AS_U8, op, target);                                                                     \
+            break;                                                                                                     \
+        case VAL_I16:                                                                                                  \
+            BRANCH_OP(int16_t, AS_I16, op, target);                                                                    \
+            break;                                                                                                     \
+        case VAL_U16:                                                                                                  \
+            BRANCH_OP(uint16_t, AS_U16, op, target);                                                                   \
+            break;                                                                                                     \
+        case VAL_I32:                                                                                                  \
+            BRANCH_OP(int32_t, AS_I32, op, target);                                                                    \
+            break;                                                                                                     \
+        case VAL_U32:                                                                                                  \
+            BRANCH_OP(uint32_t, AS_U32, op, target);                                                                   \
+            break;                                                                                                     \
+        case VAL_I64:                                                                                                  \
+            BRANCH_OP(int64_t, AS_I64, op, target);                                                                    \
+            break;                                                                                                     \
+        case VAL_U64:                                                                                                  \
+            BRANCH_OP(uint64_t, AS_U64, op, target);                                                                   \
+            break;                                                                                                     \
+        }                                                                                                              \
+    } while (false)
 // Integer division has several interesting flavors, some of which we
 // implement. For a more in depth overview of these flavors, see
 // https://www.microsoft.com/en-us/research/wp-content/uploads/2016/02/divmodnote-letter.pdf
@@ -180,24 +346,24 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
                 r = r - b;                                                                                             \
             }                                                                                                          \
         }                                                                                                              \
+        PUSH_VAL(retConstruct(vm, q));                                                                                 \
+        PUSH_VAL(retConstruct(vm, r));                                                                                 \
     } while (false)
 
-#if MOCHIVM_BATTERY_UV
-#define UV_EVENT_LOOP()                                                                                                \
-    do {                                                                                                               \
-        uv_run(uv_default_loop(), UV_RUN_NOWAIT);                                                                      \
-    } while (false);
-#else
-#define UV_EVENT_LOOP()                                                                                                \
-    do {                                                                                                               \
-    } while (false)
-#endif
-
 #define WAIT_GC()                                                                                                      \
-    while (vm->collecting) {                                                                                           \
-        fiber->isPausedForGc = true;                                                                                   \
-    }                                                                                                                  \
-    fiber->isPausedForGc = false
+    if (vm->collecting) {                                                                                              \
+        mochiWorkerWaitGc(vm, worker);                                                                                 \
+    }
+
+// Fibers are only stopped between instructions, where everything about them is held in the fiber.
+#define YIELD_SLICE()                                                                                                  \
+    if (--sliceLeft == 0) {                                                                                            \
+        sliceLeft = MOCHIVM_SCHEDULER_SLICE;                                                                           \
+        if (mochiSchedulerShouldYield(vm, worker)) {                                                                   \
+            fiber->state = FIBER_YIELDED;                                                                              \
+            return 0;                                                                                                  \
+        }                                                                                                              \
+    }
 
 #if MOCHIVM_COMPUTED_GOTO
 
@@ -213,10 +379,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
 #define DISPATCH()                                                                                                     \
     do {                                                                                                               \
         WAIT_GC();                                                                                                     \
-        UV_EVENT_LOOP();                                                                                               \
-        if (fiber->isSuspended) {                                                                                      \
-            goto CASE_CODE(NOP);                                                                                       \
-        }                                                                                                              \
+        YIELD_SLICE();                                                                                                 \
         debugTraceValueStack(vm, fiber);                                                                               \
         debugTraceFrameStack(vm, fiber);                                                                               \
         debugTraceRootStack(vm, fiber);                                                                                \
@@ -229,10 +392,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
 #define INTERPRET_LOOP                                                                                                 \
     loop:                                                                                                              \
     WAIT_GC();                                                                                                         \
-    UV_EVENT_LOOP();                                                                                                   \
-    if (fiber->isSuspended) {                                                                                          \
-        goto loop;                                                                                                     \
-    }                                                                                                                  \
+    YIELD_SLICE();                                                                                                     \
     debugTraceValueStack(vm, fiber);                                                                                   \
     debugTraceFrameStack(vm, fiber);                                                                                   \
     debugTraceRootStack(vm, fiber);                                                                                    \
@@ -244,6 +404,9 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
 
 #endif
 
+    // The fiber may be new, or resuming after foreign code pushed onto it.
+    ENSURE_STACKS(0, 0);
+
     Code instruction = CODE_NOP;
     INTERPRET_LOOP {
         CASE_CODE(NOP) : {
@@ -257,6 +420,12 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         }
         CASE_CODE(ABORT) : {
             int32_t ret = AS_I32(POP_VAL());
+            // The stack of the main fiber is still read once the run is over.
+            if (fiber == vm->scheduler.main) {
+                mochiFiberUnshare(vm, fiber);
+            }
+            fiber->result = ret;
+            fiber->state = FIBER_DONE;
             return ret;
         }
         CASE_CODE(CONSTANT) : {
@@ -293,7 +462,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             int permId = READ_USHORT();
             uint8_t* newLoc = FROM_START(READ_UINT());
             if (mochiHasPermission(vm, permId)) {
-                fiber->ip = newLoc;
+                JUMP_TO(newLoc);
             }
             DISPATCH();
         }
@@ -301,7 +470,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             int permId = READ_USHORT();
             int offset = READ_INT();
             if (mochiHasPermission(vm, permId)) {
-                fiber->ip += offset;
+                JUMP_TO(fiber->ip + offset);
             }
             DISPATCH();
         }
@@ -1287,10 +1456,19 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             ASSERT(vm->foreignFns.count > fnIndex, "CALL_FOREIGN attempted to address a method outside the bounds of "
                                                    "the foreign function collection.");
             MochiVMForeignMethodFn fn = vm->foreignFns.data[fnIndex];
+            // Foreign functions work on the stacks directly, and may pop any number of values.
+            mochiFiberUnshare(vm, fiber);
+            ENSURE_STACKS(0, 0);
             fn(vm, fiber);
+            if (fiber->isSuspended) {
+                fiber->state = FIBER_SUSPENDED;
+                return 0;
+            }
+            ENSURE_STACKS(0, 0);
             DISPATCH();
         }
         CASE_CODE(CALL) : {
+            ENSURE_STACKS(0, 0);
             uint8_t* callPtr = FROM_START(READ_UINT());
             ObjCallFrame* frame = newCallFrame(NULL, 0, fiber->ip, vm);
             PUSH_FRAME((ObjVarFrame*)frame);
@@ -1298,10 +1476,12 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
         CASE_CODE(TAILCALL) : {
+            ENSURE_STACKS(0, 0);
             fiber->ip = FROM_START(READ_UINT());
             DISPATCH();
         }
         CASE_CODE(CALL_CLOSURE) : {
+            ENSURE_STACKS(0, 0);
             ASSERT(FRAME_COUNT() > 0, "CALL_CLOSURE requires at least one frame on the frame stack.");
             ASSERT(VALUE_COUNT() > 0, "CALL_CLOSURE requires at least one value on the value stack.");
 
@@ -1315,12 +1495,15 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             ObjCallFrame* frame = callClosureFrame(vm, fiber, closure, NULL, NULL, fiber->ip);
             mochiFiberPopRoot(fiber);
 
-            // jump to the closure body and push the frame
+            // jump to the closure body and push the frame, which may need to reach further into
+            // shared values now that the parameters are gone
             fiber->ip = next;
             PUSH_FRAME(frame);
+            ENSURE_STACKS(0, 0);
             DISPATCH();
         }
         CASE_CODE(TAILCALL_CLOSURE) : {
+            ENSURE_STACKS(0, 0);
             ASSERT(FRAME_COUNT() > 0, "TAILCALL_CLOSURE requires at least one frame on the frame stack.");
             ASSERT(VALUE_COUNT() > 0, "TAILCALL_CLOSURE requires at least one value on the value stack.");
 
@@ -1338,11 +1521,12 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             fiber->ip = next;
             DROP_FRAMES(1);
             PUSH_FRAME(frame);
+            ENSURE_STACKS(0, 0);
             DISPATCH();
         }
         CASE_CODE(OFFSET) : {
             int offset = READ_INT();
-            fiber->ip = fiber->ip + offset;
+            JUMP_TO(fiber->ip + offset);
             DISPATCH();
         }
         CASE_CODE(RETURN) : {
@@ -1350,6 +1534,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             ObjCallFrame* frame = (ObjCallFrame*)POP_FRAME();
             ASSERT_OBJ_TYPE(frame, OBJ_CALL_FRAME, "RETURN expects a frame of type 'call frame' on the frame stack.");
             fiber->ip = frame->afterLocation;
+            ENSURE_STACKS(0, 0);
             DISPATCH();
         }
 
@@ -1358,7 +1543,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             uint8_t* newLoc = FROM_START(READ_UINT());
             bool val = AS_BOOL(POP_VAL());
             if (val) {
-                fiber->ip = newLoc;
+                JUMP_TO(newLoc);
             }
             DISPATCH();
         }
@@ -1367,7 +1552,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             uint8_t* newLoc = FROM_START(READ_UINT());
             bool val = AS_BOOL(POP_VAL());
             if (!val) {
-                fiber->ip = newLoc;
+                JUMP_TO(newLoc);
             }
             DISPATCH();
         }
@@ -1376,7 +1561,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             int offset = READ_INT();
             bool val = AS_BOOL(POP_VAL());
             if (val) {
-                fiber->ip += offset;
+                JUMP_TO(fiber->ip + offset);
             }
             DISPATCH();
         }
@@ -1385,11 +1570,126 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             int offset = READ_INT();
             bool val = AS_BOOL(POP_VAL());
             if (!val) {
-                fiber->ip += offset;
+                JUMP_TO(fiber->ip + offset);
             }
             DISPATCH();
         }
 
+        CASE_CODE(JUMP_INT_EQ) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_INT_EQ expects at least two integers on the value stack.");
+            uint8_t type = READ_BYTE();
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            INT_BRANCH_OP(type, ==, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_INT_LESS) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_INT_LESS expects at least two integers on the value stack.");
+            uint8_t type = READ_BYTE();
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            INT_BRANCH_OP(type, <, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_INT_GREATER) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_INT_GREATER expects at least two integers on the value stack.");
+            uint8_t type = READ_BYTE();
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            INT_BRANCH_OP(type, >, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_INT_EQ) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_INT_EQ expects at least two integers on the value stack.");
+            uint8_t type = READ_BYTE();
+            int offset = READ_INT();
+            INT_BRANCH_OP(type, ==, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_INT_LESS) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_INT_LESS expects at least two integers on the value stack.");
+            uint8_t type = READ_BYTE();
+            int offset = READ_INT();
+            INT_BRANCH_OP(type, <, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_INT_GREATER) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_INT_GREATER expects at least two integers on the value stack.");
+            uint8_t type = READ_BYTE();
+            int offset = READ_INT();
+            INT_BRANCH_OP(type, >, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_SINGLE_EQ) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_SINGLE_EQ expects at least two floats on the value stack.");
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            BRANCH_OP(float, AS_SINGLE, ==, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_SINGLE_LESS) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_SINGLE_LESS expects at least two floats on the value stack.");
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            BRANCH_OP(float, AS_SINGLE, <, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_SINGLE_GREATER) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_SINGLE_GREATER expects at least two floats on the value stack.");
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            BRANCH_OP(float, AS_SINGLE, >, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_SINGLE_EQ) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_SINGLE_EQ expects at least two floats on the value stack.");
+            int offset = READ_INT();
+            BRANCH_OP(float, AS_SINGLE, ==, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_SINGLE_LESS) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_SINGLE_LESS expects at least two floats on the value stack.");
+            int offset = READ_INT();
+            BRANCH_OP(float, AS_SINGLE, <, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_SINGLE_GREATER) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_SINGLE_GREATER expects at least two floats on the value stack.");
+            int offset = READ_INT();
+            BRANCH_OP(float, AS_SINGLE, >, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_DOUBLE_EQ) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_DOUBLE_EQ expects at least two doubles on the value stack.");
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            BRANCH_OP(double, AS_DOUBLE, ==, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_DOUBLE_LESS) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_DOUBLE_LESS expects at least two doubles on the value stack.");
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            BRANCH_OP(double, AS_DOUBLE, <, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(JUMP_DOUBLE_GREATER) : {
+            ASSERT(VALUE_COUNT() > 1, "JUMP_DOUBLE_GREATER expects at least two doubles on the value stack.");
+            uint8_t* newLoc = FROM_START(READ_UINT());
+            BRANCH_OP(double, AS_DOUBLE, >, newLoc);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_DOUBLE_EQ) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_DOUBLE_EQ expects at least two doubles on the value stack.");
+            int offset = READ_INT();
+            BRANCH_OP(double, AS_DOUBLE, ==, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_DOUBLE_LESS) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_DOUBLE_LESS expects at least two doubles on the value stack.");
+            int offset = READ_INT();
+            BRANCH_OP(double, AS_DOUBLE, <, fiber->ip + offset);
+            DISPATCH();
+        }
+        CASE_CODE(OFFSET_DOUBLE_GREATER) : {
+            ASSERT(VALUE_COUNT() > 1, "OFFSET_DOUBLE_GREATER expects at least two doubles on the value stack.");
+            int offset = READ_INT();
+            BRANCH_OP(double, AS_DOUBLE, >, fiber->ip + offset);
+            DISPATCH();
+        }
+
         CASE_CODE(CLOSURE) : {
             uint8_t* bodyLocation = FROM_START(READ_UINT());
             uint8_t paramCount = READ_BYTE();
@@ -1514,6 +1814,9 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         }
         CASE_CODE(INJECT) : {
             int handleId = READ_UINT();
+            // Every frame may be looked at, so none can stay shared.
+            mochiFiberReach(vm, fiber, 0, INT_MAX);
+            ENSURE_STACKS(0, 0);
 
             for (int i = 0; i < fiber->frameStackTop - fiber->frameStack; i++) {
                 ObjVarFrame* frame = *(fiber->frameStackTop - i - 1);
@@ -1533,6 +1836,9 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         }
         CASE_CODE(EJECT) : {
             int handleId = READ_UINT();
+            // Every frame may be looked at, so none can stay shared.
+            mochiFiberReach(vm, fiber, 0, INT_MAX);
+            ENSURE_STACKS(0, 0);
 
             for (int i = 0; i < fiber->frameStackTop - fiber->frameStack; i++) {
                 ObjVarFrame* frame = *(fiber->frameStackTop - i - 1);
@@ -1552,6 +1858,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
         CASE_CODE(COMPLETE) : {
+            ENSURE_STACKS(0, 0);
             ASSERT(FRAME_COUNT() > 0, "COMPLETE expects at least one handle frame on the frame stack.");
 
             ObjHandleFrame* frame = (ObjHandleFrame*)PEEK_FRAME(1);
@@ -1562,9 +1869,13 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DROP_FRAMES(1);
             PUSH_FRAME(newFrame);
             fiber->ip = frame->afterClosure->funcLocation;
+            ENSURE_STACKS(0, 0);
             DISPATCH();
         }
         CASE_CODE(ESCAPE) : {
+            // The whole stacks are saved or dropped, so none of them can stay shared.
+            mochiFiberUnshare(vm, fiber);
+            ENSURE_STACKS(0, 0);
             ASSERT(FRAME_COUNT() > 0, "ESCAPE expects at least one handle frame on the frame stack.");
 
             int handleId = READ_UINT();
@@ -1617,6 +1928,9 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
                                       "top of the value stack.");
             ObjContinuation* cont = AS_CONTINUATION(POP_VAL());
             mochiFiberPushRoot(fiber, (Obj*)cont);
+            // The saved values go under the whole value stack, so none of it can stay shared.
+            mochiFiberUnshare(vm, fiber);
+            ENSURE_STACKS(cont->savedStackCount, cont->savedFramesCount);
 
             // the last frame in the saved frame stack is always the handle frame
             // action reacted on
@@ -1641,6 +1955,9 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
                                       "call frame at the top of the frame stack.");
             ObjContinuation* cont = AS_CONTINUATION(POP_VAL());
             mochiFiberPushRoot(fiber, (Obj*)cont);
+            // The saved values go under the whole value stack, so none of it can stay shared.
+            mochiFiberUnshare(vm, fiber);
+            ENSURE_STACKS(cont->savedStackCount, cont->savedFramesCount);
 
             uint8_t* after = ((ObjCallFrame*)POP_FRAME())->afterLocation;
 
@@ -1673,7 +1990,9 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
         CASE_CODE(THREAD_SPAWN_COPY) : {
+            // Both fibers go on with their stacks shared, so this one copies back what it reaches.
             mochiSpawnCopy(vm, fiber);
+            ENSURE_STACKS(0, 0);
             DISPATCH();
         }
         CASE_CODE(THREAD_CURRENT) : {
@@ -1682,23 +2001,33 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         }
         CASE_CODE(THREAD_SLEEP) : {
             uint32_t millis = AS_U32(POP_VAL());
-            time_t secs = millis / 1000;
-            long int nanos = (millis % 1000) * 1000000;
-            int32_t res = thrd_sleep(&(struct timespec){.tv_sec = secs, .tv_nsec = nanos}, NULL);
-            PUSH_VAL(I32_VAL(vm, res));
-            DISPATCH();
+            PUSH_VAL(I32_VAL(vm, thrd_success));
+            fiber->wakeTime = mochiSchedulerNow() + (uint64_t)millis * 1000000;
+            fiber->state = millis == 0 ? FIBER_YIELDED : FIBER_SLEEPING;
+            return 0;
         }
         CASE_CODE(THREAD_YIELD) : {
-            thrd_yield();
-            DISPATCH();
+            fiber->state = FIBER_YIELDED;
+            return 0;
         }
         CASE_CODE(THREAD_JOIN) : {
             ObjFiber* toJoin = AS_FIBER(PEEK_VAL(1));
-            int threadRes = 0;
-            int32_t res = thrd_join(toJoin->thread, &threadRes);
+            if (toJoin == fiber) {
+                DROP_VALS(1);
+                PUSH_VAL(I32_VAL(vm, 0));
+                PUSH_VAL(I32_VAL(vm, thrd_error));
+                DISPATCH();
+            }
+            if (toJoin->state != FIBER_DONE) {
+                // Park until the fiber finishes, and then run the join again.
+                fiber->ip--;
+                fiber->joining = toJoin;
+                fiber->state = FIBER_JOINING;
+                return 0;
+            }
             DROP_VALS(1);
-            PUSH_VAL(I32_VAL(vm, threadRes));
-            PUSH_VAL(I32_VAL(vm, res));
+            PUSH_VAL(I32_VAL(vm, toJoin->result));
+            PUSH_VAL(I32_VAL(vm, thrd_success));
             DISPATCH();
         }
         CASE_CODE(THREAD_EQUAL) : {
@@ -1710,6 +2039,85 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
 
+        CASE_CODE(CHANNEL_NEW) : {
+            ObjChannel* channel = mochiNewChannel(vm, AS_U32(PEEK_VAL(1)));
+            PEEK_VAL(1) = OBJ_VAL(channel);
+            DISPATCH();
+        }
+        CASE_CODE(CHANNEL_SEND) : {
+            // The value stays on the stack until it is sent, since sending may allocate.
+            ChannelStatus status = mochiChannelSend(vm, AS_CHANNEL(PEEK_VAL(2)), PEEK_VAL(1));
+            if (status == CHANNEL_BLOCKED) {
+                // Park until the channel has room, and then run the send again.
+                fiber->ip--;
+                fiber->state = FIBER_SENDING;
+                return 0;
+            }
+            DROP_VALS(2);
+            PUSH_VAL(BOOL_VAL(vm, status == CHANNEL_OK));
+            DISPATCH();
+        }
+        CASE_CODE(CHANNEL_RECV) : {
+            Value value = FALSE_VAL;
+            ChannelStatus status = mochiChannelReceive(vm, AS_CHANNEL(PEEK_VAL(1)), &value);
+            if (status == CHANNEL_BLOCKED) {
+                // Park until the channel has a value or is closed, and then run the receive again.
+                fiber->ip--;
+                fiber->waitCount = 1;
+                fiber->state = FIBER_RECEIVING;
+                return 0;
+            }
+            PEEK_VAL(1) = value;
+            PUSH_VAL(BOOL_VAL(vm, status == CHANNEL_OK));
+            DISPATCH();
+        }
+        CASE_CODE(CHANNEL_TRY_RECV) : {
+            Value value = FALSE_VAL;
+            ChannelStatus status = mochiChannelReceive(vm, AS_CHANNEL(PEEK_VAL(1)), &value);
+            PEEK_VAL(1) = value;
+            PUSH_VAL(BOOL_VAL(vm, status == CHANNEL_OK));
+            DISPATCH();
+        }
+        CASE_CODE(CHANNEL_CLOSE) : {
+            mochiChannelClose(vm, AS_CHANNEL(POP_VAL()));
+            DISPATCH();
+        }
+        CASE_CODE(CHANNEL_SELECT) : {
+            uint8_t count = READ_BYTE();
+            // Start from a different channel each time, so a busy one cannot starve the others.
+            int start = sliceLeft % count;
+            int index = 0;
+            Value value = FALSE_VAL;
+            ChannelStatus status = CHANNEL_BLOCKED;
+            for (int i = 0; i < count && status == CHANNEL_BLOCKED; i++) {
+                index = (start + i) % count;
+                status = mochiChannelReceive(vm, AS_CHANNEL(PEEK_VAL(count - index)), &value);
+            }
+            if (status == CHANNEL_BLOCKED) {
+                fiber->ip -= 2;
+                fiber->waitCount = count;
+                fiber->state = FIBER_RECEIVING;
+                return 0;
+            }
+            DROP_VALS(count);
+            PUSH_VAL(value);
+            PUSH_VAL(U32_VAL(vm, index));
+            PUSH_VAL(BOOL_VAL(vm, status == CHANNEL_OK));
+            DISPATCH();
+        }
+
+        CASE_CODE(AWAIT) : {
+            ObjPromise* promise = AS_PROMISE(PEEK_VAL(1));
+            if (!atomic_load(&promise->isSettled)) {
+                // Park until the promise settles, and then run the await again.
+                fiber->ip--;
+                fiber->state = FIBER_AWAITING;
+                return 0;
+            }
+            PEEK_VAL(1) = promise->value;
+            DISPATCH();
+        }
+
         CASE_CODE(ZAP) : {
             ASSERT(VALUE_COUNT() >= 1, "ZAP expects at least one value on the value stack.");
             DROP_VALS(1);
@@ -1775,7 +2183,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             // standard library exception mechanism
             ASSERT(list != NULL, "LIST_HEAD cannot operate on an empty list.");
             ASSERT_OBJ_TYPE(list, OBJ_LIST, "LIST_HEAD can only operate on objects of list type.");
-            PUSH_VAL(OBJ_VAL(list->next));
+            PUSH_VAL(OBJ_VAL(mochiListTail(list)));
             DISPATCH();
         }
         CASE_CODE(LIST_IS_EMPTY) : {
@@ -1789,54 +2197,57 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             ObjList* prefix = AS_LIST(PEEK_VAL(1));
             ObjList* suffix = AS_LIST(PEEK_VAL(2));
 
-            if (suffix == NULL) {
-                DROP_VALS(2);
-                PUSH_VAL(OBJ_VAL(prefix));
-            } else if (prefix == NULL) {
-                DROP_VALS(1);
-            } else {
-                ObjList* start = mochiListCons(vm, prefix->elem, NULL);
-                ObjList* iter = start;
-                prefix = prefix->next;
-
-                mochiFiberPushRoot(fiber, (Obj*)start);
-                while (prefix != NULL) {
-                    iter->next = mochiListCons(vm, prefix->elem, NULL);
-                    iter = iter->next;
-                    prefix = prefix->next;
-                }
-                iter->next = suffix;
-                mochiFiberPopRoot(fiber);
+            ObjList* appended = mochiListAppend(vm, prefix, suffix);
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(appended));
+            DISPATCH();
+        }
+        CASE_CODE(LIST_APPEND_REUSE) : {
+            ASSERT(VALUE_COUNT() >= 2, "LIST_APPEND_REUSE expects at least two list values on the stack.");
+            ObjList* prefix = AS_LIST(PEEK_VAL(1));
+            ObjList* suffix = AS_LIST(PEEK_VAL(2));
 
-                DROP_VALS(2);
-                PUSH_VAL(OBJ_VAL(start));
-            }
+            // Every cell of the prefix must be unshared, since the last one is relinked to the suffix.
+            PEEK_VAL(2) = OBJ_VAL(mochiListAppendInPlace(prefix, suffix));
+            DROP_VALS(1);
             DISPATCH();
         }
 
         CASE_CODE(NEWREF) : {
-            Value refInit = POP_VAL();
-            // TODO: make this into a function: TableKey nextKey(vm)
-            // TODO: make these two lines atomic/thread safe
-            uint64_t key = vm->nextHeapKey;
-            vm->nextHeapKey += 1;
-
-            mochiTableSet(vm, &vm->heap, (TableKey)key, refInit);
-            PUSH_VAL(OBJ_VAL(mochiNewRef(vm, key)));
+            // The initial value stays on the stack until the ref has been allocated.
+            ObjRef* ref = mochiNewRef(vm, PEEK_VAL(1));
+            PEEK_VAL(1) = OBJ_VAL(ref);
             DISPATCH();
         }
         CASE_CODE(GETREF) : {
-            ObjRef* ref = AS_REF(POP_VAL());
-            Value val;
-            mochiTableGet(&vm->heap, ref->ptr, &val);
-            PUSH_VAL(val);
+            PEEK_VAL(1) = mochiRefGet(AS_REF(PEEK_VAL(1)));
             DISPATCH();
         }
         CASE_CODE(PUTREF) : {
-            Value val = PEEK_VAL(1);
-            ObjRef* ref = AS_REF(PEEK_VAL(2));
-            mochiTableSet(vm, &vm->heap, ref->ptr, val);
+            mochiRefPut(AS_REF(PEEK_VAL(2)), PEEK_VAL(1));
+            DROP_VALS(2);
+            DISPATCH();
+        }
+        CASE_CODE(REF_SWAP) : {
+            PEEK_VAL(2) = mochiRefSwap(AS_REF(PEEK_VAL(2)), PEEK_VAL(1));
+            DROP_VALS(1);
+            DISPATCH();
+        }
+        CASE_CODE(REF_CAS) : {
+            ValueType type = READ_BYTE();
+            bool swapped = mochiRefCompareSwap(AS_REF(PEEK_VAL(3)), type, PEEK_VAL(2), PEEK_VAL(1));
             DROP_VALS(2);
+            PEEK_VAL(1) = BOOL_VAL(vm, swapped);
+            DISPATCH();
+        }
+        CASE_CODE(REF_FETCH_ADD) : {
+            ValueType type = READ_BYTE();
+            // The delta is no longer needed once read, so its slot holds the old value while the
+            // new one is allocated.
+            Value delta = PEEK_VAL(1);
+            Value old = mochiRefFetchAdd(vm, AS_REF(PEEK_VAL(2)), type, delta, &PEEK_VAL(1));
+            DROP_VALS(1);
+            PEEK_VAL(1) = old;
             DISPATCH();
         }
 
@@ -1857,7 +2268,10 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
         CASE_CODE(DESTRUCT) : {
-            ObjStruct* stru = AS_STRUCT(POP_VAL());
+            // the struct stays on the stack while it grows, so a collection keeps it alive
+            ObjStruct* stru = AS_STRUCT(PEEK_VAL(1));
+            ENSURE_STACKS(stru->count, 0);
+            DROP_VALS(1);
             // NOTE: see note in CONSTRUCT instruction for a potential conceptual
             // pitfall.
             valueArrayCopy(fiber->valueStackTop, stru->elems, stru->count);
@@ -1875,7 +2289,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             uint8_t* newLoc = FROM_START(READ_UINT());
             ObjStruct* stru = AS_STRUCT(POP_VAL());
             if (stru->id == structId) {
-                fiber->ip = newLoc;
+                JUMP_TO(newLoc);
             }
             DISPATCH();
         }
@@ -1884,7 +2298,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             int offset = READ_INT();
             ObjStruct* stru = AS_STRUCT(POP_VAL());
             if (stru->id == structId) {
-                fiber->ip += offset;
+                JUMP_TO(fiber->ip + offset);
             }
             DISPATCH();
         }
@@ -1901,25 +2315,47 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
         CASE_CODE(RECORD_SELECT) : {
+            RecordCache* cache = RECORD_CACHE();
             TableKey field = READ_UINT();
-            Value v = mochiRecordSelect(field, AS_RECORD(POP_VAL()));
-            PUSH_VAL(v);
+            ObjRecord* rec = AS_RECORD(PEEK_VAL(1));
+            if (rec->shape != NULL) {
+                PEEK_VAL(1) = rec->values[cachedRecordSlot(cache, rec->shape, field)];
+            } else {
+                PEEK_VAL(1) = mochiRecordSelect(field, rec);
+            }
             DISPATCH();
         }
         CASE_CODE(RECORD_RESTRICT) : {
             TableKey field = READ_UINT();
             ObjRecord* restr = mochiRecordRestrict(vm, field, AS_RECORD(PEEK_VAL(1)));
-            PUSH_VAL(OBJ_VAL(restr));
-            DROP_VALS(1);
+            PEEK_VAL(1) = OBJ_VAL(restr);
             DISPATCH();
         }
         CASE_CODE(RECORD_UPDATE) : {
+            RecordCache* cache = RECORD_CACHE();
             TableKey field = READ_UINT();
-            ObjRecord* rec = mochiRecordUpdate(vm, field, PEEK_VAL(1), AS_RECORD(PEEK_VAL(2)));
+            ObjRecord* old = AS_RECORD(PEEK_VAL(2));
+            ObjRecord* rec = old->shape != NULL
+                                 ? mochiRecordUpdateAt(vm, cachedRecordSlot(cache, old->shape, field), PEEK_VAL(1), old)
+                                 : mochiRecordUpdate(vm, field, PEEK_VAL(1), old);
             DROP_VALS(2);
             PUSH_VAL(OBJ_VAL(rec));
             DISPATCH();
         }
+        // The _REUSE variants of instructions are emitted by a compiler that has proven the input they
+        // consume is referenced from nowhere else, so it can be changed in place rather than copied.
+        CASE_CODE(RECORD_UPDATE_REUSE) : {
+            RecordCache* cache = RECORD_CACHE();
+            TableKey field = READ_UINT();
+            ObjRecord* rec = AS_RECORD(PEEK_VAL(2));
+            if (rec->shape != NULL) {
+                rec->values[cachedRecordSlot(cache, rec->shape, field)] = PEEK_VAL(1);
+            } else {
+                mochiRecordUpdateInPlace(vm, field, PEEK_VAL(1), rec);
+            }
+            DROP_VALS(1);
+            DISPATCH();
+        }
 
         CASE_CODE(VARIANT) : {
             ObjVariant* var = mochiNewVariant(vm, READ_UINT(), POP_VAL());
@@ -1932,6 +2368,14 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             PUSH_VAL(OBJ_VAL(var));
             DISPATCH();
         }
+        CASE_CODE(EMBED_REUSE) : {
+            TableKey label = READ_UINT();
+            ObjVariant* var = AS_VARIANT(PEEK_VAL(1));
+            if (var->label == label) {
+                var->nesting += 1;
+            }
+            DISPATCH();
+        }
         CASE_CODE(IS_CASE) : {
             TableKey label = READ_UINT();
             ObjVariant* var = AS_VARIANT(POP_VAL());
@@ -1944,7 +2388,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             ObjVariant* var = AS_VARIANT(POP_VAL());
             if (var->label == label) {
                 PUSH_VAL(var->elem);
-                fiber->ip = newLoc;
+                JUMP_TO(newLoc);
             } else {
                 PUSH_VAL(OBJ_VAL(var));
             }
@@ -1956,7 +2400,7 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             ObjVariant* var = AS_VARIANT(POP_VAL());
             if (var->label == label) {
                 PUSH_VAL(var->elem);
-                fiber->ip += offset;
+                JUMP_TO(fiber->ip + offset);
             } else {
                 PUSH_VAL(OBJ_VAL(var));
             }
@@ -2014,18 +2458,150 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         CASE_CODE(ARRAY_CONCAT) : {
             ObjArray* b = AS_ARRAY(PEEK_VAL(1));
             ObjArray* a = AS_ARRAY(PEEK_VAL(2));
-
-            ObjArray* cat = mochiArrayNil(vm);
-            for (int i = 0; i < a->elems.count; i++) {
-                mochiArraySnoc(vm, a->elems.data[i], cat);
-            }
-            for (int i = 0; i < b->elems.count; i++) {
-                mochiArraySnoc(vm, b->elems.data[i], cat);
-            }
+            ObjArray* cat = mochiArrayConcat(vm, a, b);
             DROP_VALS(2);
             PUSH_VAL(OBJ_VAL(cat));
             DISPATCH();
         }
+        CASE_CODE(ARRAY_CONCAT_REUSE) : {
+            ObjArray* b = AS_ARRAY(PEEK_VAL(1));
+            ObjArray* a = AS_ARRAY(PEEK_VAL(2));
+            mochiArrayAppend(vm, a, b);
+            DROP_VALS(1);
+            DISPATCH();
+        }
+
+        // A parallel array instruction runs in three ways. The fiber that reaches it splits the
+        // elements into parts, pushes the array the parts write their results into, and suspends
+        // at the instruction. Each part runs on its own fiber starting at the instruction, which
+        // calls the closure for the next element each time it returns to the bottom of the
+        // stack. Once every part is done, the waiting fiber runs the instruction again to take
+        // the result, or finishes with the result of a part that failed.
+        CASE_CODE(ARRAY_PAR_MAP) : {
+            if (fiber->isParTask && FRAME_COUNT() == 0) {
+                // [source, result, closure, part, next, end], then the last element's result
+                mochiFiberUnshare(vm, fiber);
+                ENSURE_STACKS(1, 1);
+                Value* base = fiber->valueStack;
+                int next = AS_I32(base[4]);
+                if (VALUE_COUNT() == 7) {
+                    mochiArraySetAt(next - 1, POP_VAL(), AS_ARRAY(base[1]));
+                }
+                if (next == AS_I32(base[5])) {
+                    return finishParPart(vm, fiber, mochiParPartDone(vm, fiber, false));
+                }
+                base[4] = I32_VAL(vm, next + 1);
+                PUSH_VAL(parElement(base[0], next));
+                callParClosure(vm, fiber, AS_CLOSURE(base[2]));
+                DISPATCH();
+            }
+            if (fiber->isParWaiting) {
+                fiber->isParWaiting = false;
+                if (atomic_load(&fiber->parFailed)) {
+                    fiber->result = fiber->parResult;
+                    fiber->state = FIBER_DONE;
+                    return fiber->result;
+                }
+                Value result = POP_VAL();
+                DROP_VALS(2);
+                PUSH_VAL(result);
+                DISPATCH();
+            }
+
+            ENSURE_STACKS(1, 0);
+            ASSERT(AS_CLOSURE(PEEK_VAL(1))->paramCount == 1, "ARRAY_PAR_MAP expects a closure of one parameter.");
+            int length = parLength(PEEK_VAL(2));
+            ObjArray* result = mochiArrayNil(vm);
+            mochiFiberPushRoot(fiber, (Obj*)result);
+            result = mochiArrayFill(vm, length, FALSE_VAL, result);
+            mochiFiberPopRoot(fiber);
+            if (length == 0) {
+                DROP_VALS(2);
+                PUSH_VAL(OBJ_VAL(result));
+                DISPATCH();
+            }
+            PUSH_VAL(OBJ_VAL(result));
+            Value shared[3] = { PEEK_VAL(3), PEEK_VAL(1), PEEK_VAL(2) };
+            fiber->ip--;
+            startParParts(vm, fiber, shared, length, parPartCount(vm, length), false);
+            fiber->state = FIBER_SUSPENDED;
+            return 0;
+        }
+        CASE_CODE(ARRAY_PAR_REDUCE) : {
+            if (fiber->isParTask && FRAME_COUNT() == 0) {
+                // [source, partials, closure, part, next, end, accumulated]
+                mochiFiberUnshare(vm, fiber);
+                ENSURE_STACKS(1, 1);
+                Value* base = fiber->valueStack;
+                int next = AS_I32(base[4]);
+                if (next < AS_I32(base[5])) {
+                    base[4] = I32_VAL(vm, next + 1);
+                    PUSH_VAL(parElement(base[0], next));
+                    callParClosure(vm, fiber, AS_CLOSURE(base[2]));
+                    DISPATCH();
+                }
+
+                // The partials hold the result of each part, followed by the initial value.
+                ObjArray* partials = AS_ARRAY(base[1]);
+                int parts = mochiArrayLength(partials) - 1;
+                int part = AS_I32(base[3]);
+                if (part < 0) {
+                    mochiArraySetAt(parts, base[6], partials);
+                    return finishParPart(vm, fiber, mochiParPartDone(vm, fiber, false));
+                }
+                mochiArraySetAt(part, base[6], partials);
+                // The last part to finish goes on to combine the results of every part in order,
+                // starting from the initial value, as a part of its own.
+                ObjFiber* waiting = fiber->caller;
+                bool last = mochiParPartDone(vm, fiber, false);
+                if (last && !atomic_load(&waiting->parFailed)) {
+                    fiber->isParTask = true;
+                    atomic_store(&waiting->parRemaining, 1);
+                    base[0] = OBJ_VAL(partials);
+                    base[3] = I32_VAL(vm, -1);
+                    base[4] = I32_VAL(vm, 0);
+                    base[5] = I32_VAL(vm, parts);
+                    base[6] = mochiArrayGetAt(parts, partials);
+                    fiber->ip--;
+                    DISPATCH();
+                }
+                return finishParPart(vm, fiber, last);
+            }
+            if (fiber->isParWaiting) {
+                fiber->isParWaiting = false;
+                if (atomic_load(&fiber->parFailed)) {
+                    fiber->result = fiber->parResult;
+                    fiber->state = FIBER_DONE;
+                    return fiber->result;
+                }
+                ObjArray* partials = AS_ARRAY(POP_VAL());
+                Value result = mochiArrayGetAt(mochiArrayLength(partials) - 1, partials);
+                DROP_VALS(3);
+                PUSH_VAL(result);
+                DISPATCH();
+            }
+
+            ENSURE_STACKS(1, 0);
+            ASSERT(AS_CLOSURE(PEEK_VAL(1))->paramCount == 2, "ARRAY_PAR_REDUCE expects a closure of two parameters.");
+            int length = parLength(PEEK_VAL(3));
+            if (length == 0) {
+                Value initial = PEEK_VAL(2);
+                DROP_VALS(3);
+                PUSH_VAL(initial);
+                DISPATCH();
+            }
+            int parts = parPartCount(vm, length);
+            ObjArray* partials = mochiArrayNil(vm);
+            mochiFiberPushRoot(fiber, (Obj*)partials);
+            partials = mochiArrayFill(vm, parts + 1, PEEK_VAL(2), partials);
+            mochiFiberPopRoot(fiber);
+            PUSH_VAL(OBJ_VAL(partials));
+            Value shared[3] = { PEEK_VAL(4), PEEK_VAL(1), PEEK_VAL(2) };
+            fiber->ip--;
+            startParParts(vm, fiber, shared, length, parts, true);
+            fiber->state = FIBER_SUSPENDED;
+            return 0;
+        }
 
         CASE_CODE(ARRAY_SLICE) : {
             int start = (int)AS_U32(POP_VAL());
@@ -2086,55 +2662,59 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
         }
         CASE_CODE(BYTE_ARRAY_SNOC) : {
             uint8_t v = AS_U8(POP_VAL());
-            ObjByteArray* arr = AS_BYTE_ARRAY(PEEK_VAL(1));
+            ObjByteArray* arr = mochiDetachString(vm, &PEEK_VAL(1));
             mochiByteArraySnoc(vm, v, arr);
             DISPATCH();
         }
         CASE_CODE(BYTE_ARRAY_GET_AT) : {
             int idx = (int)AS_U32(POP_VAL());
-            ObjByteArray* arr = AS_BYTE_ARRAY(POP_VAL());
+            ObjByteArray* arr = mochiFlattenString(vm, PEEK_VAL(1));
+            DROP_VALS(1);
             PUSH_VAL(U8_VAL(vm, mochiByteArrayGetAt(idx, arr)));
             DISPATCH();
         }
         CASE_CODE(BYTE_ARRAY_SET_AT) : {
             int idx = (int)AS_U32(POP_VAL());
             uint8_t val = AS_U8(POP_VAL());
-            ObjByteArray* arr = AS_BYTE_ARRAY(PEEK_VAL(1));
+            ObjByteArray* arr = mochiDetachString(vm, &PEEK_VAL(1));
             mochiByteArraySetAt(idx, val, arr);
             DISPATCH();
         }
         CASE_CODE(BYTE_ARRAY_LENGTH) : {
-            ObjByteArray* arr = AS_BYTE_ARRAY(POP_VAL());
-            PUSH_VAL(U32_VAL(vm, mochiByteArrayLength(arr)));
+            // The length of a rope is known without flattening it, but leaves out the terminator.
+            Obj* arr = AS_OBJ(POP_VAL());
+            int length = arr->type == OBJ_ROPE ? mochiStringLength(arr) + 1 : mochiByteArrayLength((ObjByteArray*)arr);
+            PUSH_VAL(U32_VAL(vm, length));
             DISPATCH();
         }
         CASE_CODE(BYTE_ARRAY_COPY) : {
             int start = (int)AS_U32(POP_VAL());
             int length = (int)AS_U32(POP_VAL());
-            ObjByteArray* arr = AS_BYTE_ARRAY(PEEK_VAL(1));
+            ObjByteArray* arr = mochiFlattenString(vm, PEEK_VAL(1));
             PUSH_VAL(OBJ_VAL(mochiByteArrayCopy(vm, start, length, arr)));
             DISPATCH();
         }
         CASE_CODE(BYTE_ARRAY_CONCAT) : {
-            ObjByteArray* b = AS_BYTE_ARRAY(PEEK_VAL(1));
-            ObjByteArray* a = AS_BYTE_ARRAY(PEEK_VAL(2));
-
-            ObjByteArray* cat = mochiByteArrayNil(vm);
-            for (int i = 0; i < a->elems.count; i++) {
-                mochiByteArraySnoc(vm, a->elems.data[i], cat);
-            }
-            for (int i = 0; i < b->elems.count; i++) {
-                mochiByteArraySnoc(vm, b->elems.data[i], cat);
-            }
+            ObjByteArray* b = mochiFlattenString(vm, PEEK_VAL(1));
+            ObjByteArray* a = mochiFlattenString(vm, PEEK_VAL(2));
+            ObjByteArray* cat = mochiByteArrayConcat(vm, a, b);
             DROP_VALS(2);
             PUSH_VAL(OBJ_VAL(cat));
             DISPATCH();
         }
+        CASE_CODE(BYTE_ARRAY_CONCAT_REUSE) : {
+            ObjByteArray* a = mochiDetachString(vm, &PEEK_VAL(2));
+            ObjByteArray* b = mochiFlattenString(vm, PEEK_VAL(1));
+            mochiByteArrayAppend(vm, a, b);
+            DROP_VALS(1);
+            DISPATCH();
+        }
 
         CASE_CODE(BYTE_ARRAY_SLICE) : {
             int start = (int)AS_U32(POP_VAL());
             int length = (int)AS_U32(POP_VAL());
-            ObjByteArray* arr = AS_BYTE_ARRAY(PEEK_VAL(1));
+            // Byte slices can change their source, so a rope is sliced through a copy of its bytes.
+            ObjByteArray* arr = mochiDetachString(vm, &PEEK_VAL(1));
             ObjByteSlice* slice = mochiByteArraySlice(vm, start, length, arr);
             DROP_VALS(1);
             PUSH_VAL(OBJ_VAL(slice));
@@ -2173,26 +2753,212 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
             DISPATCH();
         }
 
-        CASE_CODE(STRING_CONCAT) : {
-            ObjByteArray* b = AS_BYTE_ARRAY(PEEK_VAL(1));
-            ObjByteArray* a = AS_BYTE_ARRAY(PEEK_VAL(2));
+        CASE_CODE(VECTOR_NIL) : {
+            PUSH_VAL(OBJ_VAL(mochiNewVector(vm)));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_SNOC) : {
+            Value v = PEEK_VAL(1);
+            ObjVector* vec = AS_VECTOR(PEEK_VAL(2));
+            ObjVector* longer = mochiVectorSnoc(vm, v, vec);
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(longer));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_GET_AT) : {
+            int idx = (int)AS_U32(POP_VAL());
+            ObjVector* vec = AS_VECTOR(POP_VAL());
+            PUSH_VAL(mochiVectorGetAt(idx, vec));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_SET_AT) : {
+            int idx = (int)AS_U32(POP_VAL());
+            Value val = PEEK_VAL(1);
+            ObjVector* vec = AS_VECTOR(PEEK_VAL(2));
+            ObjVector* upd = mochiVectorSetAt(vm, idx, val, vec);
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(upd));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_LENGTH) : {
+            ObjVector* vec = AS_VECTOR(POP_VAL());
+            PUSH_VAL(U32_VAL(vm, mochiVectorLength(vec)));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_CONCAT) : {
+            ObjVector* b = AS_VECTOR(PEEK_VAL(1));
+            ObjVector* a = AS_VECTOR(PEEK_VAL(2));
+            ObjVector* cat = mochiVectorConcat(vm, a, b);
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(cat));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_SLICE) : {
+            int start = (int)AS_U32(POP_VAL());
+            int length = (int)AS_U32(POP_VAL());
+            ObjVector* vec = AS_VECTOR(PEEK_VAL(1));
+            ObjVector* slice = mochiVectorSlice(vm, start, length, vec);
+            DROP_VALS(1);
+            PUSH_VAL(OBJ_VAL(slice));
+            DISPATCH();
+        }
+        CASE_CODE(ARRAY_TO_VECTOR) : {
+            ObjVector* vec = mochiVectorFromArray(vm, AS_ARRAY(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(OBJ_VAL(vec));
+            DISPATCH();
+        }
+        CASE_CODE(VECTOR_TO_ARRAY) : {
+            ObjArray* arr = mochiVectorToArray(vm, AS_VECTOR(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(OBJ_VAL(arr));
+            DISPATCH();
+        }
 
-            ObjByteArray* cat = mochiByteArrayNil(vm);
-            mochiFiberPushRoot(fiber, (Obj*)cat);
-            // count - 1 to remove the null-terminator character from the first string
-            for (int i = 0; i < a->elems.count - 1; i++) {
-                mochiByteArraySnoc(vm, a->elems.data[i], cat);
-            }
-            for (int i = 0; i < b->elems.count; i++) {
-                mochiByteArraySnoc(vm, b->elems.data[i], cat);
-            }
-            mochiFiberPopRoot(fiber);
+        CASE_CODE(NUM_ARRAY_FILL) : {
+            ValueType type = (ValueType)READ_BYTE();
+            int count = (int)AS_U32(PEEK_VAL(2));
+            ObjNumArray* arr = mochiNumArrayFill(vm, type, count, PEEK_VAL(1));
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(arr));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_GET_AT) : {
+            int idx = (int)AS_U32(POP_VAL());
+            // Getting a 64-bit number may box it, so the array stays on the stack until then.
+            Value elem = mochiNumArrayGetAt(vm, idx, AS_NUM_ARRAY(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(elem);
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_SET_AT) : {
+            int idx = (int)AS_U32(POP_VAL());
+            Value val = POP_VAL();
+            mochiNumArraySetAt(idx, val, AS_NUM_ARRAY(PEEK_VAL(1)));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_LENGTH) : {
+            ObjNumArray* arr = AS_NUM_ARRAY(POP_VAL());
+            PUSH_VAL(U32_VAL(vm, mochiNumArrayLength(arr)));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_SLICE) : {
+            int start = (int)AS_U32(POP_VAL());
+            int length = (int)AS_U32(POP_VAL());
+            ObjNumArray* slice = mochiNumArraySlice(vm, start, length, AS_NUM_ARRAY(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(OBJ_VAL(slice));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_ADD) : {
+            ObjNumArray* sum = mochiNumArrayAdd(vm, AS_NUM_ARRAY(PEEK_VAL(1)), AS_NUM_ARRAY(PEEK_VAL(2)));
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(sum));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_MUL) : {
+            ObjNumArray* product = mochiNumArrayMul(vm, AS_NUM_ARRAY(PEEK_VAL(1)), AS_NUM_ARRAY(PEEK_VAL(2)));
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(product));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_FMA) : {
+            ObjNumArray* result = mochiNumArrayFma(vm, AS_NUM_ARRAY(PEEK_VAL(1)), AS_NUM_ARRAY(PEEK_VAL(2)),
+                                                   AS_NUM_ARRAY(PEEK_VAL(3)));
+            DROP_VALS(3);
+            PUSH_VAL(OBJ_VAL(result));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_SUM) : {
+            Value sum = mochiNumArraySum(vm, AS_NUM_ARRAY(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(sum);
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_MIN) : {
+            Value min = mochiNumArrayMin(vm, AS_NUM_ARRAY(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(min);
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_MAX) : {
+            Value max = mochiNumArrayMax(vm, AS_NUM_ARRAY(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(max);
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_DOT) : {
+            Value dot = mochiNumArrayDot(vm, AS_NUM_ARRAY(PEEK_VAL(1)), AS_NUM_ARRAY(PEEK_VAL(2)));
+            DROP_VALS(2);
+            PUSH_VAL(dot);
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_EQ) : {
+            ObjNumArray* mask = mochiNumArrayEq(vm, AS_NUM_ARRAY(PEEK_VAL(1)), AS_NUM_ARRAY(PEEK_VAL(2)));
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(mask));
+            DISPATCH();
+        }
+        CASE_CODE(NUM_ARRAY_LESS) : {
+            ObjNumArray* mask = mochiNumArrayLess(vm, AS_NUM_ARRAY(PEEK_VAL(1)), AS_NUM_ARRAY(PEEK_VAL(2)));
+            DROP_VALS(2);
+            PUSH_VAL(OBJ_VAL(mask));
+            DISPATCH();
+        }
+
+        CASE_CODE(BYTES_INDEX_OF) : {
+            int index = mochiBytesIndexOf(vm, AS_OBJ(PEEK_VAL(2)), AS_OBJ(PEEK_VAL(1)));
+            DROP_VALS(2);
+            PUSH_VAL(I32_VAL(vm, index));
+            DISPATCH();
+        }
+        CASE_CODE(BYTES_COUNT) : {
+            uint8_t byte = AS_U8(POP_VAL());
+            int count = mochiBytesCount(vm, byte, AS_OBJ(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(U32_VAL(vm, count));
+            DISPATCH();
+        }
+        CASE_CODE(BYTES_COMPARE) : {
+            int order = mochiBytesCompare(vm, AS_OBJ(PEEK_VAL(2)), AS_OBJ(PEEK_VAL(1)));
+            DROP_VALS(2);
+            PUSH_VAL(I32_VAL(vm, order));
+            DISPATCH();
+        }
+        CASE_CODE(BYTES_EQUAL) : {
+            bool equal = mochiBytesEqual(vm, AS_OBJ(PEEK_VAL(2)), AS_OBJ(PEEK_VAL(1)));
+            DROP_VALS(2);
+            PUSH_VAL(BOOL_VAL(vm, equal));
+            DISPATCH();
+        }
+        CASE_CODE(BYTES_HASH) : {
+            uint64_t hash = mochiBytesHash(vm, AS_OBJ(PEEK_VAL(1)));
+            DROP_VALS(1);
+            PUSH_VAL(U64_VAL(vm, hash));
+            DISPATCH();
+        }
+
+        CASE_CODE(STRING_CONCAT) : {
+            Obj* cat = mochiRopeConcat(vm, AS_OBJ(PEEK_VAL(2)), AS_OBJ(PEEK_VAL(1)));
             DROP_VALS(2);
             PUSH_VAL(OBJ_VAL(cat));
             DISPATCH();
         }
+        CASE_CODE(STRING_CONCAT_REUSE) : {
+            Obj* b = AS_OBJ(PEEK_VAL(1));
+            Obj* a = AS_OBJ(PEEK_VAL(2));
+            if (a->type == OBJ_BYTE_ARRAY && b->type == OBJ_BYTE_ARRAY) {
+                mochiStringAppend(vm, (ObjByteArray*)a, (ObjByteArray*)b);
+                DROP_VALS(1);
+            } else {
+                Obj* cat = mochiRopeConcat(vm, a, b);
+                DROP_VALS(2);
+                PUSH_VAL(OBJ_VAL(cat));
+            }
+            DISPATCH();
+        }
         CASE_CODE(PRINT): {
-            printf("%s", AS_CSTRING(PEEK_VAL(1)));
+            printf("%s", (char*)mochiFlattenString(vm, PEEK_VAL(1))->elems.data);
             DROP_VALS(1);
             DISPATCH();
         }
@@ -2207,26 +2973,26 @@ static int run(MochiVM* vm, register ObjFiber* fiber) {
 #undef READ_INT
 #undef READ_UINT
 #undef READ_CONSTANT
+#undef RECORD_CACHE
 }
 
 int mochiInterpret(MochiVM* vm, ObjFiber* fiber) {
     return run(vm, fiber);
 }
 
-int mochiInterpretFirst(void* vmStart) {
-    MochiVM* vm = vmStart;
-    return run(vm, vm->fibers.data[0]);
-}
-
 int mochiRun(MochiVM* vm, int argc, const char* argv[]) {
 #if MOCHIVM_DEBUG_DUMP_BYTECODE
     disassembleChunk(vm, "VM BYTECODE");
 #endif
 
-    mochiFiberBufferClear(vm, &vm->fibers);
-    mochiFiberBufferWrite(vm, &vm->fibers, NULL);
+    if (!vm->verified && !mochiVerify(vm)) {
+        printf("Bytecode failed verification.\n");
+        return -1;
+    }
+
+    mochiResetFibers(vm);
     ObjFiber* fib = mochiNewFiber(vm, vm->code.data, NULL, 0);
-    vm->fibers.data[0] = fib;
+    mochiAddFiber(vm, fib);
 
     /*ObjArray* args = mochiArrayNil(vm);
     mochiFiberPushValue(fib, OBJ_VAL(args));
@@ -2237,19 +3003,7 @@ int mochiRun(MochiVM* vm, int argc, const char* argv[]) {
         mochiFiberPopRoot(fib);
     }*/
 
-    int threadStatus = thrd_create(&fib->thread, mochiInterpretFirst, vm);
-    if (threadStatus != thrd_success) {
-        printf("Couldn't create main thread.\n");
-        return threadStatus;
-    }
-
-    // only wait for the main thread to finish
-    int mainResult;
-    int joinStatus = thrd_join(fib->thread, &mainResult);
-    if (joinStatus != thrd_success) {
-        printf("Couldn't join main thread with runner.\n");
-        return joinStatus;
-    }
+    int mainResult = mochiSchedulerRun(vm, fib);
 #if MOCHIVM_BATTERY_UV
     uv_run(uv_default_loop(), UV_RUN_DEFAULT);
 #endif
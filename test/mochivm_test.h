@@ -22,4 +22,29 @@ void vm_setup() {
 
 void vm_teardown() {
     mochiFreeVM(vm);
-}
\ No newline at end of file
+}
+
+// Replaces the VM with one running on [count] workers.
+void useWorkers(int count) {
+    mochiFreeVM(vm);
+    MochiVMConfiguration config;
+    mochiInitConfiguration(&config);
+    config.workerCount = count;
+    vm = mochiNewVM(&config);
+}
+
+// Writes an OFFSET over the fiber bodies that follow, returning where to patch it.
+int writeSkip(void) {
+    WRITE_INST(OFFSET, 1);
+    int skip = vm->code.count;
+    WRITE_INT(0, 1);
+    return skip;
+}
+
+// Points the OFFSET written by writeSkip at the code written next.
+void patchSkip(int skip) {
+    int target = vm->code.count;
+    for (int i = 0; i < 4; i++) {
+        vm->code.data[skip + i] = (uint8_t)((target - skip - 4) >> (24 - 8 * i));
+    }
+}